@@ -0,0 +1,405 @@
+#include "config.h"
+#include "equirect-blur-annotations.h"
+#include "equirect-blur-manifest.h"
+#include "equirect-blur-pipeline.h"
+#include "equirect-blur-shared.h"
+#include "equirect-blur-sidecar.h"
+#include "equirect-blur-stats.h"
+#include "synthetic.h"
+
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <opencv2/opencv.hpp>
+#include <sstream>
+
+/* Run equirect-blur-image under a named configuration over a dataset with its
+ * faces annotated on the sphere, and report how many of the faces it found
+ * (recall), how many of its detections were faces (precision), how much of the
+ * sphere it blurred that wasn't a face, and how fast it went, as JSON. Runs of
+ * different configurations over the same dataset show what a speed up costs in
+ * missed faces. Without a dataset it makes a small synthetic one */
+
+/* The equirect rects an annotated face's box covers, split at the frame's left
+ * and right edges */
+static std::vector<cv::Rect> annotation_rects(const AnnotatedFace& face, const cv::Size& size)
+{
+    const double half_width = face.width / 2 / MAX(cos(face.latitude * M_PI / 180), 0.01);
+    int x0 = static_cast<int>(floor((face.longitude - half_width + 180) / 360 * size.width));
+    int x1 = static_cast<int>(ceil((face.longitude + half_width + 180) / 360 * size.width));
+    int y0 = static_cast<int>(floor((90 - face.latitude - face.height / 2) / 180 * size.height));
+    int y1 = static_cast<int>(ceil((90 - face.latitude + face.height / 2) / 180 * size.height));
+    y0 = CLAMP(y0, 0, size.height);
+    y1 = CLAMP(y1, 0, size.height);
+
+    if (x1 - x0 >= size.width)
+        return { cv::Rect(0, y0, size.width, y1 - y0) };
+
+    const int shift = static_cast<int>(floor(static_cast<double>(x0) / size.width)) * size.width;
+    x0 -= shift;
+    x1 -= shift;
+    if (x1 <= size.width)
+        return { cv::Rect(x0, y0, x1 - x0, y1 - y0) };
+    return { cv::Rect(x0, y0, size.width - x0, y1 - y0), cv::Rect(0, y0, x1 - size.width, y1 - y0) };
+}
+
+/* Solid angle in steradians of the rects an image's run obscured (into
+ * blurred), and of the part of them outside every annotated face's box */
+static double over_blurred_area(const DirtyRegions& regions, const std::vector<AnnotatedFace>& faces, double& blurred)
+{
+    const cv::Rect frame(cv::Point(0, 0), regions.size);
+    cv::Mat mask = cv::Mat::zeros(regions.size, CV_8UC1);
+    for (const cv::Rect& rect : regions.rects)
+        mask(rect & frame).setTo(1);
+    cv::Mat outside = mask.clone();
+    for (const AnnotatedFace& face : faces) {
+        for (const cv::Rect& rect : annotation_rects(face, regions.size))
+            outside(rect & frame).setTo(0);
+    }
+
+    /* Each pixel covers less of the sphere the further it is from the equator */
+    const double pixel = (2 * M_PI / regions.size.width) * (M_PI / regions.size.height);
+    double over = 0;
+    blurred = 0;
+    for (int y = 0; y < regions.size.height; y++) {
+        const double weight = pixel * cos((0.5 - (y + 0.5) / regions.size.height) * M_PI);
+        blurred += cv::countNonZero(mask.row(y)) * weight;
+        over += cv::countNonZero(outside.row(y)) * weight;
+    }
+    return over;
+}
+
+/* Write count synthetic frames with faces planted around them into dir, and
+ * their annotations into annotations.jsonl alongside. Every run makes the same
+ * frames */
+static bool write_synthetic_set(
+    const std::filesystem::path& dir,
+    const cv::Size& size,
+    const int count,
+    const int faces_per_image,
+    const std::vector<cv::Mat>& faces)
+{
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    std::ofstream annotations(dir / "annotations.jsonl", std::ios::out | std::ios::trunc);
+
+    cv::RNG rng(0x0bad5eed);
+    for (int i = 0; i < count; i++) {
+        cv::setRNGSeed(i + 1);
+        cv::Mat frame = synthetic_frame(size);
+        const std::string file = cv::format("synthetic-%03d.jpg", i);
+
+        /* Spread out in longitude so that no two faces overlap, kept off the
+         * poles where the projections hardly see them */
+        std::string json = "{\"file\":\"" + file + "\",\"faces\":[";
+        for (int j = 0; j < faces_per_image; j++) {
+            const PlantedFace planted {
+                rng.uniform(-60.0, 60.0),
+                -180 + 360 * (j + rng.uniform(0.2, 0.8)) / faces_per_image,
+                rng.uniform(MAX(size.height / 60, 16), MAX(size.height / 20, 17)),
+            };
+            plant_face(frame, planted, faces.empty() ? cv::Mat() : faces[(i * faces_per_image + j) % faces.size()]);
+
+            /* The same stretch as plant_face(), which makes the face about as
+             * wide on the sphere as it is high */
+            const double cos_lat = cos(planted.latitude * M_PI / 180);
+            const int width = static_cast<int>(planted.size / MAX(cos_lat, 0.1));
+            json += cv::format(
+                "%s{\"longitude\":%.4f,\"latitude\":%.4f,\"width\":%.4f,\"height\":%.4f}",
+                j > 0 ? "," : "",
+                planted.longitude,
+                planted.latitude,
+                width * 360.0 / size.width * cos_lat,
+                planted.size * 180.0 / size.height);
+        }
+        annotations << json << "]}" << std::endl;
+
+        if (!cv::imwrite((dir / file).u8string(), frame)) {
+            std::cerr << "Can't write " << (dir / file).u8string() << std::endl;
+            return false;
+        }
+    }
+
+    if (!annotations) {
+        std::cerr << "Can't write " << (dir / "annotations.jsonl").u8string() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/* The configuration a baseline line is for, and the recall measured for it */
+static bool parse_baseline(const std::string& line, std::string& config, double& recall, std::string& error)
+{
+    try {
+        const cv::FileStorage fs(line, cv::FileStorage::READ | cv::FileStorage::MEMORY | cv::FileStorage::FORMAT_JSON);
+        if (!fs.isOpened() || fs["config"].empty() || fs["recall"].empty())
+            return false;
+        config = static_cast<std::string>(fs["config"]);
+        recall = static_cast<double>(fs["recall"]);
+        return true;
+    }
+    catch (const cv::Exception& e) {
+        error = e.what();
+        return false;
+    }
+}
+
+/* Reads a baseline file of JSON lines like {"config":"default","recall":0.9167},
+ * each the recall a configuration was measured to have, into lines (a missing
+ * file has none), setting recall and found if it lists configuration name */
+static bool read_baseline(
+    const std::string& path, const std::string& name, std::vector<std::string>& lines, double& recall, bool& found)
+{
+    found = false;
+    lines.clear();
+    if (!std::filesystem::exists(path))
+        return true;
+    std::ifstream in(path);
+    if (!in.is_open()) {
+        std::cerr << "Can't open baseline file " << path << std::endl;
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(in, line)) {
+        lines.push_back(line);
+        if (line.empty())
+            continue;
+        std::string config, error;
+        double line_recall;
+        if (!parse_baseline(line, config, line_recall, error)) {
+            std::cerr << "Invalid baseline at " << path << ":" << lines.size() << (error.empty() ? "" : ": ") << error
+                      << std::endl;
+            return false;
+        }
+        if (config == name) {
+            recall = line_recall;
+            found = true;
+        }
+    }
+    return true;
+}
+
+/* Writes recall as configuration name's measured recall in the baseline file,
+ * in place of the one it had */
+static bool record_baseline(const std::string& path, const std::string& name, double recall)
+{
+    std::vector<std::string> lines;
+    double old_recall;
+    bool found;
+    if (!read_baseline(path, name, lines, old_recall, found))
+        return false;
+
+    const std::string record
+        = cv::format("{\"config\":\"%s\",\"recall\":%.4f}", json_escape(name).c_str(), recall);
+    std::ofstream out(path, std::ios::out | std::ios::trunc);
+    for (const std::string& line : lines) {
+        std::string config, error;
+        double line_recall;
+        if (line.empty() || !parse_baseline(line, config, line_recall, error) || config != name)
+            out << line << std::endl;
+        else
+            out << record << std::endl;
+    }
+    if (!found)
+        out << record << std::endl;
+    if (!out) {
+        std::cerr << "Failed to write " << path << std::endl;
+        return false;
+    }
+    std::cout << name << ": recorded recall " << cv::format("%.4f", recall) << " in " << path << std::endl;
+    return true;
+}
+
+int main(int argc, const char** argv)
+{
+    cv::CommandLineParser parser(
+        argc,
+        argv,
+        "{help h||}"
+        "{name|default|Name of the configuration, reported with the results and used for its output directory}"
+        "{args||equirect-blur-image options for the configuration, separated by spaces (e.g. \"--detect-scale=0.5\")}"
+        "{models-dir m||Path to PCN models}"
+        "{dataset||Directory of annotated .jpg images (a synthetic set is made in --work-dir if not given)}"
+        "{annotations||Annotations for --dataset (default: annotations.jsonl in it)}"
+        "{work-dir|accuracy|Directory for the synthetic set and each configuration's output}"
+        "{images|4|Images in the synthetic set}"
+        "{faces|6|Faces planted in each synthetic image}"
+        "{size|3840x1920|Size of the synthetic images, WIDTHxHEIGHT}"
+        "{face|" BENCHMARK_FACES_DIR "|Image of a face to plant in the synthetic set, or a directory of them (a drawn "
+        "one if empty)}"
+        "{baseline||Fail if recall is more than --tolerance below the configuration's measured recall in this file "
+        "(JSON lines)}"
+        "{tolerance|0.05|How much lower than the baseline's recall a run's may be (0.05 lets the default synthetic "
+        "set's 24 faces lose one)}"
+        "{record-baseline||Record this run's recall as the configuration's baseline, instead of comparing with it}"
+        "{json||Also append the results to this file (JSON lines)}");
+    parser.about("\nReports recall, precision, over-blurred area and frames per second of equirect-blur-image\n"
+                 "under a configuration, on a dataset annotated with the faces in it\n");
+
+    if (parser.get<bool>("help")) {
+        parser.printMessage();
+        return 0;
+    }
+
+    const std::string name = parser.get<cv::String>("name");
+    const std::filesystem::path work_dir(parser.get<cv::String>("work-dir"));
+    std::filesystem::path dataset(parser.get<cv::String>("dataset"));
+    std::filesystem::path annotations_path(parser.get<cv::String>("annotations"));
+
+    if (dataset.empty()) {
+        int width, height;
+        if (sscanf(parser.get<cv::String>("size").c_str(), "%dx%d", &width, &height) != 2 || width < 1
+            || height < 1) {
+            std::cerr << "--size must be WIDTHxHEIGHT" << std::endl;
+            return 1;
+        }
+
+        std::vector<cv::Mat> faces;
+        if (!load_faces(parser.get<cv::String>("face"), faces))
+            return 1;
+
+        dataset = work_dir / "synthetic";
+        if (!write_synthetic_set(
+                dataset,
+                cv::Size(width, height),
+                MAX(parser.get<int>("images"), 1),
+                MAX(parser.get<int>("faces"), 1),
+                faces))
+            return 1;
+    }
+    if (annotations_path.empty())
+        annotations_path = dataset / "annotations.jsonl";
+
+    AnnotationReader annotations;
+    if (!annotations.load(annotations_path.u8string()))
+        return 1;
+    const std::vector<AnnotatedImage>& annotated = annotations.images();
+
+    /* Each configuration gets a fresh output directory, so that every image is
+     * processed rather than skipped for having an output already */
+    const std::filesystem::path out_dir = work_dir / name;
+    std::filesystem::remove_all(out_dir);
+    std::filesystem::create_directories(out_dir / "images");
+    const std::string detections_path = (out_dir / "detections.jsonl").u8string();
+    const std::string manifest_path = (out_dir / "manifest.jsonl").u8string();
+
+    std::vector<std::string> args { "equirect-blur-image" };
+    std::stringstream config_args(parser.get<cv::String>("args"));
+    std::string arg;
+    while (config_args >> arg)
+        args.push_back(arg);
+    if (parser.has("models-dir"))
+        args.push_back("--models-dir=" + parser.get<cv::String>("models-dir"));
+    args.push_back("--save-detections=" + detections_path);
+    args.push_back("--dirty-manifest=" + manifest_path);
+    args.push_back("--output-dir=" + (out_dir / "images").u8string());
+    args.push_back(dataset.u8string());
+
+    std::vector<const char*> image_argv;
+    for (const std::string& a : args)
+        image_argv.push_back(a.c_str());
+    const cv::CommandLineParser image_parser
+        = equirect_blur_image_parser(static_cast<int>(image_argv.size()), image_argv.data());
+    ImageRunOptions options;
+    std::string error;
+    if (!equirect_blur_image_options(image_parser, options, error)) {
+        std::cerr << name << ": " << error << std::endl;
+        return 1;
+    }
+    const double projection_cache_mb = image_parser.get<double>("projection-cache");
+    if (projection_cache_mb > 0)
+        equirect_blur_set_projection_cache_limit(static_cast<size_t>(projection_cache_mb * 1024 * 1024));
+
+    BlurStats stats;
+    ImageResources resources;
+    resources.stats = &stats;
+    ImageRunResult result;
+    const auto start = std::chrono::steady_clock::now();
+    if (!equirect_blur_run_images(options, resources, result))
+        return 1;
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    SidecarReader detections;
+    ManifestReader manifest;
+    if (!detections.load(detections_path) || !manifest.load(manifest_path))
+        return 1;
+
+    size_t faces = 0, detected = 0, matched = 0;
+    double over_blurred = 0, blurred = 0;
+    for (const AnnotatedImage& image : annotated) {
+        const SidecarFrame* frame = detections.find_file(image.file);
+        const DirtyRegions* regions = manifest.find_file(image.file);
+        if (frame == nullptr || regions == nullptr) {
+            std::cerr << name << ": no results for " << image.file << std::endl;
+            return 1;
+        }
+
+        double image_blurred;
+        faces += image.faces.size();
+        detected += frame->faces.size();
+        matched += equirect_blur_match_faces(image.faces, frame->faces, regions->size);
+        over_blurred += over_blurred_area(*regions, image.faces, image_blurred);
+        blurred += image_blurred;
+    }
+
+    const double recall = faces > 0 ? static_cast<double>(matched) / static_cast<double>(faces) : 1.0;
+
+    /* Areas are given as the share of each image's sphere, averaged over the images */
+    const double sphere = 4 * M_PI * static_cast<double>(MAX(annotated.size(), static_cast<size_t>(1)));
+    const std::string json = cv::format(
+        "{\"config\":\"%s\",\"args\":\"%s\",\"images\":%zu,\"faces\":%zu,\"detections\":%zu,\"matched\":%zu,"
+        "\"recall\":%.4f,\"precision\":%.4f,\"blurred_percent\":%.4f,\"over_blurred_percent\":%.4f,"
+        "\"seconds\":%.3f,\"fps\":%.3f,\"stats\":",
+        json_escape(name).c_str(),
+        json_escape(parser.get<cv::String>("args")).c_str(),
+        annotated.size(),
+        faces,
+        detected,
+        matched,
+        recall,
+        detected > 0 ? static_cast<double>(matched) / static_cast<double>(detected) : 1.0,
+        100 * blurred / sphere,
+        100 * over_blurred / sphere,
+        elapsed.count(),
+        elapsed.count() > 0 ? static_cast<double>(result.processed) / elapsed.count() : 0.0)
+        + equirect_blur_stats_json(stats.snapshot()) + "}";
+
+    std::cout << json << std::endl;
+    if (parser.has("json")) {
+        std::ofstream out(parser.get<cv::String>("json"), std::ios::out | std::ios::app);
+        out << json << std::endl;
+        if (!out) {
+            std::cerr << "Failed to write " << parser.get<cv::String>("json") << std::endl;
+            return 1;
+        }
+    }
+
+    if (parser.has("baseline")) {
+        const std::string baseline = parser.get<cv::String>("baseline");
+        if (parser.get<bool>("record-baseline"))
+            return record_baseline(baseline, name, recall) ? 0 : 1;
+
+        std::vector<std::string> lines;
+        double baseline_recall;
+        bool found;
+        if (!read_baseline(baseline, name, lines, baseline_recall, found))
+            return 1;
+        if (!found) {
+            /* Skipped rather than passed: there is nothing measured to compare with */
+            std::cerr << name << ": " << baseline << " has no measured recall for this configuration; run with "
+                      << "--record-baseline to record this run's" << std::endl;
+            return 77;
+        }
+        const double min_recall = baseline_recall - MAX(parser.get<double>("tolerance"), 0.0);
+        if (recall < min_recall) {
+            std::cerr << name << ": recall " << recall << " is below the baseline's " << baseline_recall
+                      << " less the tolerance" << std::endl;
+            return 1;
+        }
+    }
+
+    return 0;
+}
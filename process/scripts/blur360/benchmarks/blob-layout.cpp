@@ -0,0 +1,120 @@
+#include "config.h"
+#include "PCN.h"
+#include "synthetic.h"
+
+#include <iostream>
+#include <opencv2/opencv.hpp>
+
+/* Checks that ImageToBlob() gives the networks what they were given before it
+ * replaced converting each crop to float, subtracting the mean and calling
+ * blobFromImage(): the blobs must be identical on sample crops, and with the
+ * models, each network's outputs for them must be too */
+
+/* The blob PCN made before ImageToBlob() */
+static cv::Mat reference_blob(const cv::Mat& img)
+{
+    cv::Mat imgF;
+    img.convertTo(imgF, CV_32FC3);
+    const cv::Mat mean(img.size(), CV_32FC3, PCN_MEAN);
+    return cv::dnn::blobFromImage(imgF - mean, 1.0, cv::Size(), cv::Scalar(), false, false);
+}
+
+static cv::Mat image_blob(const cv::Mat& img)
+{
+    const int sizes[] = { 1, 3, img.rows, img.cols };
+    cv::Mat blob(4, sizes, CV_32F);
+    ImageToBlob(img, PCN_MEAN, blob);
+    return blob;
+}
+
+/* Largest difference between the outputs of net for each blob */
+static double output_difference(cv::dnn::Net& net, const cv::Mat& a, const cv::Mat& b)
+{
+    const std::vector<cv::String> names = net.getUnconnectedOutLayersNames();
+    std::vector<cv::Mat> outputs[2];
+    net.setInput(a);
+    net.forward(outputs[0], names);
+    for (cv::Mat& output : outputs[0])
+        output = output.clone();
+    net.setInput(b);
+    net.forward(outputs[1], names);
+
+    double difference = 0;
+    for (size_t i = 0; i < outputs[0].size(); i++)
+        difference = MAX(difference, cv::norm(outputs[0][i], outputs[1][i], cv::NORM_INF));
+    return difference;
+}
+
+int main(int argc, const char** argv)
+{
+    cv::CommandLineParser parser(
+        argc,
+        argv,
+        "{help h||}"
+        "{face|" BENCHMARK_FACES_DIR "|Image of a face to crop, or a directory of them}"
+        "{models-dir m||Path to PCN models, to compare the networks' outputs too}");
+    parser.about("\nChecks that ImageToBlob() makes the blobs blobFromImage() made\n");
+
+    if (parser.get<bool>("help")) {
+        parser.printMessage();
+        return 0;
+    }
+
+    /* The face crops at each network's input size, and noise at odd sizes */
+    std::vector<cv::Mat> faces;
+    if (!load_faces(parser.get<cv::String>("face"), faces))
+        return 1;
+    std::vector<cv::Mat> crops;
+    for (const cv::Mat& face : faces) {
+        for (const int dim : { 24, 48, 96 }) {
+            cv::Mat crop;
+            resize(face, crop, cv::Size(dim, dim));
+            crops.push_back(crop);
+        }
+    }
+    cv::RNG rng(1);
+    for (const cv::Size& size : { cv::Size(24, 24), cv::Size(48, 48), cv::Size(96, 96), cv::Size(117, 61) }) {
+        cv::Mat noise(size, CV_8UC3);
+        rng.fill(noise, cv::RNG::UNIFORM, 0, 256);
+        crops.push_back(noise);
+    }
+
+    int status = 0;
+    for (size_t i = 0; i < crops.size(); i++) {
+        const double difference = cv::norm(reference_blob(crops[i]), image_blob(crops[i]), cv::NORM_INF);
+        if (difference != 0) {
+            std::cerr << "Crop " << i << " (" << crops[i].cols << "x" << crops[i].rows
+                      << "): blobs differ by up to " << difference << std::endl;
+            status = 1;
+        }
+    }
+
+    if (parser.has("models-dir")) {
+        const std::string models = parser.get<cv::String>("models-dir") + "/";
+        const std::pair<const char*, const char*> networks[] = {
+            { "PCN-1.prototxt", "PCN.caffemodel" },
+            { "PCN-2.prototxt", "PCN.caffemodel" },
+            { "PCN-3.prototxt", "PCN.caffemodel" },
+            { "PCN-Tracking.prototxt", "PCN-Tracking.caffemodel" },
+        };
+        const int input_sizes[] = { 0, 24, 48, 96 }; /* The first network takes any size */
+        for (size_t n = 0; n < 4; n++) {
+            cv::dnn::Net net = cv::dnn::readNetFromCaffe(models + networks[n].first, models + networks[n].second);
+            for (const cv::Mat& crop : crops) {
+                if (input_sizes[n] != 0 && crop.size() != cv::Size(input_sizes[n], input_sizes[n]))
+                    continue;
+                const double difference = output_difference(net, reference_blob(crop), image_blob(crop));
+                if (difference != 0) {
+                    std::cerr << networks[n].first << " outputs for a " << crop.cols << "x" << crop.rows
+                              << " crop differ by up to " << difference << std::endl;
+                    status = 1;
+                }
+            }
+        }
+    }
+
+    if (status == 0)
+        std::cout << crops.size() << " crops made the same blobs" << (parser.has("models-dir") ? " and outputs" : "")
+                  << std::endl;
+    return status;
+}
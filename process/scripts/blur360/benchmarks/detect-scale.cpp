@@ -0,0 +1,157 @@
+#include "equirect-blur-common.h"
+#include "equirect-blur-shared.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <opencv2/opencv.hpp>
+#include <sstream>
+
+/* Compare face detection on reduced resolution proxies (equirect-blur-image's
+ * --detect-scale) against full resolution: time taken, and how many of the
+ * faces found at full resolution are still found */
+
+/* Detect faces in image at scale, in full resolution coordinates */
+static std::vector<FaceDetection> detect_at_scale(
+    const cv::Mat& image, const double scale, PCN* detector, FrameScratch& scratch)
+{
+    cv::Mat proxy = image;
+    if (scale < 1)
+        cv::resize(image, proxy, cv::Size(), scale, scale, cv::INTER_AREA);
+
+    std::vector<Projection> projections = equirect_blur_shared_projections(proxy.size());
+    for (Projection& p : projections)
+        p.detector = detector;
+
+    std::vector<FaceDetection> detections;
+    equirect_blur_detect_frame(proxy, projections, detections, &scratch);
+    equirect_blur_scale_detections(detections, static_cast<double>(image.cols) / proxy.cols);
+
+    return detections;
+}
+
+/* True if any of the face's rects overlaps one of the candidates' by at least
+ * a third of the smaller rect */
+static bool found_in(const FaceDetection& face, const std::vector<FaceDetection>& candidates)
+{
+    for (const FaceDetection& candidate : candidates) {
+        for (const cv::Rect& a : face.equ_rects) {
+            for (const cv::Rect& b : candidate.equ_rects) {
+                const int overlap = (a & b).area();
+                if (overlap > 0 && 3 * overlap >= std::min(a.area(), b.area()))
+                    return true;
+            }
+        }
+    }
+    return false;
+}
+
+int main(int argc, const char** argv)
+{
+    cv::CommandLineParser parser(
+        argc,
+        argv,
+        "{help h||}"
+        "{models-dir m||Path to PCN models}"
+        "{thresh t|0.9175|Threshold value}"
+        "{scales|1,0.75,0.5,0.375,0.25|Detection scales to compare (1 is the reference)}"
+        "{@input||Image, or directory of .jpg images, with faces in}");
+    parser.about("\nMeasures detection time and recall on reduced resolution proxies\n");
+
+    if (parser.get<bool>("help") || parser.get<cv::String>("@input").empty()) {
+        parser.printMessage();
+        return 0;
+    }
+
+    std::vector<double> scales;
+    std::stringstream scales_arg(parser.get<cv::String>("scales"));
+    for (std::string scale; std::getline(scales_arg, scale, ',');)
+        scales.push_back(std::stod(scale));
+    if (std::find(scales.begin(), scales.end(), 1.0) == scales.end())
+        scales.insert(scales.begin(), 1.0);
+    const size_t reference = std::find(scales.begin(), scales.end(), 1.0) - scales.begin();
+
+    const std::filesystem::path input(parser.get<cv::String>("@input"));
+    std::vector<std::string> files;
+    if (std::filesystem::is_directory(input)) {
+        for (const auto& file : std::filesystem::directory_iterator(input)) {
+            std::string ext = file.path().extension().u8string();
+            std::transform(ext.begin(), ext.end(), ext.begin(), [](const unsigned char c) { return std::tolower(c); });
+            if (ext == ".jpg")
+                files.push_back(file.path().u8string());
+        }
+        std::sort(files.begin(), files.end());
+    }
+    else {
+        files.push_back(input.u8string());
+    }
+
+    /* The same settings as equirect-blur-image, with the threshold given */
+    DetectorSettings settings;
+    const float thresh = parser.get<float>("thresh");
+    settings.thresh[0] = settings.thresh[1] = settings.thresh[2] = thresh;
+    PCN* detector = equirect_blur_create_detector(parser.get<cv::String>("models-dir"), settings, false);
+
+    struct Result {
+        std::chrono::steady_clock::duration time {};
+        int faces = 0;
+        int recalled = 0;
+    };
+    std::vector<Result> results(scales.size());
+    int reference_faces = 0;
+    FrameScratch scratch;
+
+    for (const std::string& file : files) {
+        const cv::Mat image = cv::imread(file);
+        if (image.empty()) {
+            std::cerr << "Can't open image file " << file << std::endl;
+            return 1;
+        }
+        std::cout << "Detecting in " << file << std::endl;
+
+        /* Build the maps outside the timed detections */
+        for (const double scale : scales) {
+            cv::Mat proxy;
+            cv::resize(image, proxy, cv::Size(), scale, scale, cv::INTER_AREA);
+            equirect_blur_shared_projections(proxy.size());
+        }
+
+        std::vector<std::vector<FaceDetection>> found(scales.size());
+        for (size_t s = 0; s < scales.size(); s++) {
+            const auto start = std::chrono::steady_clock::now();
+            found[s] = detect_at_scale(image, scales[s], detector, scratch);
+            results[s].time += std::chrono::steady_clock::now() - start;
+            results[s].faces += static_cast<int>(found[s].size());
+        }
+
+        reference_faces += static_cast<int>(found[reference].size());
+        for (size_t s = 0; s < scales.size(); s++) {
+            for (const FaceDetection& face : found[reference])
+                results[s].recalled += found_in(face, found[s]) ? 1 : 0;
+        }
+    }
+
+    const std::chrono::duration<double> full_time = results[reference].time;
+
+    std::cout << std::endl
+              << files.size() << " images, " << reference_faces << " faces at full resolution" << std::endl;
+    std::cout << cv::format("%-8s %10s %8s %8s %8s", "scale", "time (s)", "speedup", "faces", "recall") << std::endl;
+    for (size_t s = 0; s < scales.size(); s++) {
+        const std::chrono::duration<double> time = results[s].time;
+        const double recall = reference_faces > 0 ? 100.0 * results[s].recalled / reference_faces : 100.0;
+        std::cout << cv::format(
+            "%-8.3g %10.2f %7.2fx %8d %7.1f%%",
+            scales[s],
+            time.count(),
+            time.count() > 0 ? full_time.count() / time.count() : 0.0,
+            results[s].faces,
+            recall)
+                  << std::endl;
+    }
+
+    delete detector;
+
+    return 0;
+}
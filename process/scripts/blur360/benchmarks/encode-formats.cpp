@@ -0,0 +1,122 @@
+#include "equirect-blur-output.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <opencv2/opencv.hpp>
+
+/* Encode one image in each output format and report the encode time against
+ * the resulting size */
+
+/* Stand-in for a panorama when no image is given: smooth gradients with noise,
+ * which compresses more like a photo than flat colour or pure noise would */
+static cv::Mat synthetic_image(const cv::Size& size)
+{
+    cv::Mat image(size, CV_8UC3);
+    for (int y = 0; y < size.height; y++) {
+        auto* row = image.ptr<cv::Vec3b>(y);
+        for (int x = 0; x < size.width; x++) {
+            row[x] = cv::Vec3b(
+                static_cast<uchar>(255 * x / size.width),
+                static_cast<uchar>(255 * y / size.height),
+                static_cast<uchar>((x + y) & 0xff));
+        }
+    }
+
+    /* Centred on 128 so the noise can go both ways before saturating */
+    cv::Mat noise(size, CV_8UC3);
+    cv::randn(noise, cv::Scalar::all(128), cv::Scalar::all(8));
+    cv::addWeighted(image, 1.0, noise, 1.0, -128.0, image);
+
+    return image;
+}
+
+int main(int argc, const char** argv)
+{
+    cv::CommandLineParser parser(
+        argc,
+        argv,
+        "{help h||}"
+        "{iterations n|5|Encodes per format (the median time is reported)}"
+        "{width|5760|Width of the synthetic image used when no input is given}"
+        "{height|2880|Height of the synthetic image used when no input is given}"
+        "{@input||Image to encode}");
+    parser.about("\nMeasures how long each equirect-blur-image output format takes to encode an image\n");
+
+    if (parser.get<bool>("help")) {
+        parser.printMessage();
+        return 0;
+    }
+
+    const int iterations = MAX(parser.get<int>("iterations"), 1);
+    const auto input = parser.get<cv::String>("@input");
+
+    cv::Mat image;
+    if (!input.empty()) {
+        image = cv::imread(input);
+        if (image.empty()) {
+            std::cerr << "Can't open image file " << input << std::endl;
+            return 1;
+        }
+    }
+    else {
+        image = synthetic_image(cv::Size(parser.get<int>("width"), parser.get<int>("height")));
+    }
+
+    struct Case {
+        const char* name;
+        int quality;
+        int png_compression;
+    };
+    const Case cases[] = {
+        { "png", 0, -1 },
+        { "png", 0, 6 },
+        { "fast-png", 0, -1 },
+        { "jpeg", 95, -1 },
+        { "jpeg", 85, -1 },
+        { "webp", 0, -1 },
+    };
+
+    const double raw_mb = static_cast<double>(image.total() * image.elemSize()) / (1024 * 1024);
+    std::cout << "Encoding " << image.cols << " x " << image.rows << " image (" << cv::format("%.1f", raw_mb)
+              << " MB raw), " << iterations << " iterations" << std::endl;
+    std::cout << cv::format("%-10s %-18s %10s %10s %8s", "format", "settings", "time (ms)", "size (MB)", "ratio")
+              << std::endl;
+
+    for (const Case& c : cases) {
+        OutputFormat format;
+        if (!equirect_blur_output_format(c.name, c.quality, c.png_compression, format))
+            return 1;
+
+        std::vector<uchar> encoded;
+        std::vector<double> times;
+        for (int i = 0; i < iterations; i++) {
+            const auto start = std::chrono::steady_clock::now();
+            if (!cv::imencode(format.extension, image, encoded, format.params)) {
+                std::cerr << "Encoding " << c.name << " failed" << std::endl;
+                return 1;
+            }
+            const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            times.push_back(elapsed.count());
+        }
+        std::sort(times.begin(), times.end());
+
+        std::string settings;
+        if (format.name == "jpeg")
+            settings = cv::format("quality %d", c.quality);
+        else if (format.name == "png")
+            settings = c.png_compression >= 0 ? cv::format("level %d", c.png_compression) : "opencv default";
+        else if (format.name == "fast-png")
+            settings = "huffman only";
+        else
+            settings = "lossless";
+
+        const double size_mb = static_cast<double>(encoded.size()) / (1024 * 1024);
+        const double median_ms = times[times.size() / 2];
+        std::cout << cv::format(
+            "%-10s %-18s %10.1f %10.2f %8.2f", c.name, settings.c_str(), median_ms, size_mb, raw_mb / size_mb)
+                  << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,319 @@
+#include "config.h"
+#include "equirect-blur-common.h"
+#include "equirect-blur-config.h"
+#include "equirect-blur-shared.h"
+#include "synthetic.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <iostream>
+#include <unistd.h>
+
+/* Checks that processing a frame like the ones before it doesn't allocate: once
+ * two frames have sized a FrameScratch, the detector's working lists and the
+ * projections' face lists, frames through them must make no heap allocations
+ * of their own. malloc() and its relatives are replaced with ones that count
+ * the allocations made while counting is on (operator new goes through
+ * malloc()), and each allocation's call stack decides whose it is:
+ *
+ *  - Allocations made by blur360's own code (its vectors, Mats and arena
+ *    blocks, and heap Mats frame_arena_mat() falls back to) are ours
+ *  - So are Mats that an OpenCV function called from blur360's code creates
+ *    for its output, which it does when the output it is given doesn't match
+ *  - Anything under cv::dnn is counted on its own. Net::setInput() and
+ *    Net::forward() allocate on every call (the pins they look the outputs up
+ *    by, and the 4 dimensional headers they hand back), whatever they are
+ *    given, so these can't be brought to zero from outside the network. They
+ *    must stay the same from frame to frame, so they can't grow with the run
+ *  - OpenCV's other internal allocations (its temporaries and thread pools)
+ *    aren't counted
+ *
+ * Recording detections allocates each face's equirect rects, so frames that
+ * record them must allocate exactly once a face */
+
+/* Frames processed before counting, to size the buffers */
+#define WARM_UP_FRAMES 2
+
+#define MAX_FRAMES 64
+/* Frames of each call stack in note_allocation() and the replacement calling it */
+#define HOOK_FRAMES 2
+/* Call stacks printed for allocations that count */
+#define MAX_REPORTS 10
+
+static std::atomic<bool> counting { false };
+static std::atomic<uint64_t> allocations { 0 }; /* Ours */
+static std::atomic<uint64_t> dnn_allocations { 0 };
+static std::atomic<int> reports { 0 };
+static thread_local bool in_hook = false;
+static const void* program_base = nullptr; /* Where this program is loaded */
+
+enum class FrameKind { OURS, RUNTIME, MAT_CREATE, DNN, OTHER };
+
+static bool starts_with(const char* s, const char* prefix)
+{
+    return s != nullptr && strncmp(s, prefix, strlen(prefix)) == 0;
+}
+
+static FrameKind frame_kind(void* address)
+{
+    Dl_info info;
+    if (dladdr(address, &info) == 0 || info.dli_fname == nullptr)
+        return FrameKind::OTHER;
+    if (info.dli_fbase == program_base)
+        return FrameKind::OURS;
+
+    const char* symbol = info.dli_sname;
+    if (strstr(info.dli_fname, "libopencv_dnn") != nullptr || starts_with(symbol, "_ZN2cv3dnn")
+        || starts_with(symbol, "_ZNK2cv3dnn"))
+        return FrameKind::DNN;
+    if (starts_with(symbol, "_ZN2cv3Mat6create") || starts_with(symbol, "_ZN2cv3MatC")
+        || starts_with(symbol, "_ZNK2cv12_OutputArray6create") || starts_with(symbol, "_ZN2cv10fastMalloc")
+        || starts_with(symbol, "_ZNK2cv15StdMatAllocator"))
+        return FrameKind::MAT_CREATE;
+
+    static const char* const runtime[] = { "/libc.so", "/libc-", "/libstdc++", "/libm.so", "/libm-",
+                                           "/libgcc_s", "/libpthread", "/ld-linux" };
+    for (const char* library : runtime) {
+        if (strstr(info.dli_fname, library) != nullptr)
+            return FrameKind::RUNTIME;
+    }
+    return FrameKind::OTHER;
+}
+
+enum class Owner { NONE, OURS, DNN };
+
+/* Whose an allocation with this call stack is */
+static Owner allocation_owner(void* const* frames, const int depth)
+{
+    FrameKind kinds[MAX_FRAMES];
+    for (int i = HOOK_FRAMES; i < depth; i++) {
+        kinds[i] = frame_kind(frames[i]);
+        if (kinds[i] == FrameKind::DNN)
+            return Owner::DNN;
+    }
+
+    /* Past the allocator, to whoever wanted the memory */
+    int i = HOOK_FRAMES;
+    bool mat = false;
+    for (; i < depth && (kinds[i] == FrameKind::RUNTIME || kinds[i] == FrameKind::MAT_CREATE); i++)
+        mat = mat || kinds[i] == FrameKind::MAT_CREATE;
+    if (i == depth)
+        return Owner::NONE;
+
+    if (kinds[i] == FrameKind::OURS || (mat && i + 1 < depth && kinds[i + 1] == FrameKind::OURS))
+        return Owner::OURS;
+    return Owner::NONE;
+}
+
+static __attribute__((noinline)) void note_allocation()
+{
+    if (!counting.load(std::memory_order_relaxed) || in_hook)
+        return;
+
+    in_hook = true;
+    void* frames[MAX_FRAMES];
+    const int depth = backtrace(frames, MAX_FRAMES);
+    const Owner owner = allocation_owner(frames, depth);
+    if (owner == Owner::DNN)
+        dnn_allocations++;
+    if (owner == Owner::OURS) {
+        allocations++;
+        if (reports++ < MAX_REPORTS) {
+            fputs("Allocation while processing a frame:\n", stderr);
+            backtrace_symbols_fd(frames + HOOK_FRAMES, depth - HOOK_FRAMES, STDERR_FILENO);
+        }
+    }
+    in_hook = false;
+}
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void* ptr);
+
+__attribute__((noinline)) void* malloc(size_t size) noexcept
+{
+    note_allocation();
+    return __libc_malloc(size);
+}
+
+__attribute__((noinline)) void* calloc(size_t count, size_t size) noexcept
+{
+    note_allocation();
+    return __libc_calloc(count, size);
+}
+
+__attribute__((noinline)) void* realloc(void* ptr, size_t size) noexcept
+{
+    note_allocation();
+    return __libc_realloc(ptr, size);
+}
+
+__attribute__((noinline)) void* memalign(size_t alignment, size_t size) noexcept
+{
+    note_allocation();
+    return __libc_memalign(alignment, size);
+}
+
+__attribute__((noinline)) void* aligned_alloc(size_t alignment, size_t size) noexcept
+{
+    note_allocation();
+    return __libc_memalign(alignment, size);
+}
+
+__attribute__((noinline)) int posix_memalign(void** ptr, size_t alignment, size_t size) noexcept
+{
+    if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+    note_allocation();
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr != nullptr ? 0 : ENOMEM;
+}
+
+void free(void* ptr) noexcept
+{
+    __libc_free(ptr);
+}
+}
+
+int main(int argc, const char** argv)
+{
+    cv::CommandLineParser parser(
+        argc,
+        argv,
+        "{help h||}"
+        "{size|1920x960|Frame size, WIDTHxHEIGHT}"
+        "{frames n|3|Frames to count allocations over, after the first two}"
+        "{face-size|64|Height of the planted faces, in pixels}"
+        "{face|" BENCHMARK_FACES_DIR "|Image of a face to plant, or a directory of them (a drawn one if empty)}"
+        "{models-dir m||Path to PCN models}");
+    parser.about("\nChecks that frames like the ones before them don't allocate while they are processed\n");
+
+    if (parser.get<bool>("help")) {
+        parser.printMessage();
+        return 0;
+    }
+
+    int width, height;
+    if (sscanf(parser.get<cv::String>("size").c_str(), "%dx%d", &width, &height) != 2 || width < 1 || height < 1) {
+        std::cerr << "--size must be WIDTHxHEIGHT" << std::endl;
+        return 1;
+    }
+    if (!parser.has("models-dir")) {
+        std::cerr << "--models-dir is needed" << std::endl;
+        return 1;
+    }
+    const cv::Size size(width, height);
+    const int frames = MAX(parser.get<int>("frames"), 1);
+    const int face_size = MAX(parser.get<int>("face-size"), 8);
+
+    /* Know this program's frames, and load backtrace()'s unwinder before counting */
+    Dl_info self;
+    if (dladdr(reinterpret_cast<void*>(&note_allocation), &self) == 0) {
+        std::cerr << "Can't find where the program is loaded" << std::endl;
+        return 1;
+    }
+    program_base = self.dli_fbase;
+    void* stack[MAX_FRAMES];
+    backtrace(stack, MAX_FRAMES);
+
+    std::vector<cv::Mat> faces;
+    if (!load_faces(parser.get<cv::String>("face"), faces))
+        return 1;
+    cv::Mat frame = synthetic_frame(size);
+    const double latitudes[] = { 0, 30, -30, 60 };
+    for (size_t i = 0; i < sizeof(latitudes) / sizeof(latitudes[0]); i++) {
+        plant_face(
+            frame,
+            { latitudes[i], -135.0 + 90.0 * static_cast<double>(i), face_size },
+            faces.empty() ? cv::Mat() : faces[i % faces.size()]);
+    }
+
+    PCN* detector = equirect_blur_create_detector(
+        parser.get<cv::String>("models-dir"), equirect_blur_image_defaults().detector, false);
+    if (detector == nullptr)
+        return 1;
+    std::vector<Projection> sweep = equirect_blur_shared_projections(size);
+    for (Projection& p : sweep)
+        p.detector = detector;
+
+    const ObscureOptions obscure;
+    FrameScratch scratch;
+    std::vector<FaceDetection> detections;
+    cv::Mat work;
+    for (int i = 0; i < WARM_UP_FRAMES; i++) {
+        frame.copyTo(work);
+        detections.clear();
+        equirect_blur_process_frame(work, sweep, obscure, &detections, &scratch);
+    }
+    const uint64_t warm_blocks = scratch.arena.heap_allocations();
+    const uint64_t warm_fallbacks = frame_arena_fallbacks();
+
+    /* Detecting and obscuring */
+    uint64_t start = allocations;
+    std::vector<uint64_t> dnn_frame_allocations(frames);
+    for (int i = 0; i < frames; i++) {
+        frame.copyTo(work);
+        const uint64_t dnn_start = dnn_allocations;
+        counting = true;
+        equirect_blur_process_frame(work, sweep, obscure, nullptr, &scratch);
+        counting = false;
+        dnn_frame_allocations[i] = dnn_allocations - dnn_start;
+    }
+    const uint64_t frame_allocations = allocations - start;
+
+    /* And recording the faces found */
+    size_t recorded = 0;
+    start = allocations;
+    for (int i = 0; i < frames; i++) {
+        frame.copyTo(work);
+        detections.clear();
+        counting = true;
+        equirect_blur_process_frame(work, sweep, obscure, &detections, &scratch);
+        counting = false;
+        recorded += detections.size();
+    }
+    const uint64_t recording_allocations = allocations - start;
+    delete detector;
+
+    int status = 0;
+    if (recorded == 0) {
+        std::cerr << "No faces were found, so obscuring wasn't covered" << std::endl;
+        status = 1;
+    }
+    if (frame_allocations != 0) {
+        std::cerr << frames << " frames made " << frame_allocations << " allocations" << std::endl;
+        status = 1;
+    }
+    for (int i = 1; i < frames; i++) {
+        if (dnn_frame_allocations[i] != dnn_frame_allocations[0]) {
+            std::cerr << "cv::dnn made " << dnn_frame_allocations[0] << " allocations in the first frame but "
+                      << dnn_frame_allocations[i] << " in frame " << i + 1 << std::endl;
+            status = 1;
+        }
+    }
+    if (recording_allocations != recorded) {
+        std::cerr << frames << " frames recording " << recorded << " faces made " << recording_allocations
+                  << " allocations" << std::endl;
+        status = 1;
+    }
+    if (scratch.arena.heap_allocations() != warm_blocks || frame_arena_fallbacks() != warm_fallbacks) {
+        std::cerr << "The frames took " << scratch.arena.heap_allocations() - warm_blocks << " arena blocks and "
+                  << frame_arena_fallbacks() - warm_fallbacks << " images outside the arena from the heap"
+                  << std::endl;
+        status = 1;
+    }
+    if (status == 0) {
+        std::cout << frames << " frames of " << size.width << "x" << size.height << " with "
+                  << recorded / frames << " faces each made no allocations of their own, and "
+                  << dnn_frame_allocations[0] << " in cv::dnn" << std::endl;
+    }
+
+    return status;
+}
@@ -0,0 +1,112 @@
+#include "equirect-blur-filters.h"
+#include "equirect-blur-sphere.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <opencv2/opencv.hpp>
+#include <sstream>
+
+/* Time each obscuring filter on faces of several sizes: on the padded face
+ * square blur_face() filters, and as a spherical cap in an equirect frame */
+
+static double median_us(const int iterations, const std::function<void()>& run)
+{
+    std::vector<double> times;
+    for (int i = 0; i < iterations; i++) {
+        const auto start = std::chrono::steady_clock::now();
+        run();
+        const std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+        times.push_back(elapsed.count());
+    }
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+static std::vector<int> parse_widths(const std::string& list)
+{
+    std::vector<int> widths;
+    std::stringstream in(list);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        const int width = atoi(item.c_str());
+        if (width > 0)
+            widths.push_back(width);
+    }
+    return widths;
+}
+
+int main(int argc, const char** argv)
+{
+    cv::CommandLineParser parser(
+        argc,
+        argv,
+        "{help h||}"
+        "{iterations n|50|Runs of each filter (the median time is reported)}"
+        "{face-widths|20,40,80,160,320|Face widths to test, in pixels}"
+        "{radius|0.25|Filter radius in face widths}"
+        "{width|5760|Width of the equirect frame for the spherical cap tests}"
+        "{latitude|45|Latitude of the spherical caps, in degrees}");
+    parser.about("\nMeasures how long each face obscuring filter takes for faces of different sizes\n");
+
+    if (parser.get<bool>("help")) {
+        parser.printMessage();
+        return 0;
+    }
+
+    const int iterations = MAX(parser.get<int>("iterations"), 1);
+    const std::vector<int> face_widths = parse_widths(parser.get<cv::String>("face-widths"));
+    const double radius = parser.get<double>("radius");
+    const int frame_width = parser.get<int>("width");
+    const double latitude = parser.get<double>("latitude");
+
+    const ObscureFilter filters[]
+        = { ObscureFilter::GAUSSIAN, ObscureFilter::BOX, ObscureFilter::STACK, ObscureFilter::PIXELATE };
+
+    cv::Mat frame(frame_width / 2, frame_width, CV_8UC3);
+    cv::randu(frame, cv::Scalar::all(0), cv::Scalar::all(255));
+
+    std::cout << "Filter radius " << radius << " face widths, " << iterations << " iterations" << std::endl;
+    std::cout << cv::format("%-10s %6s %12s %12s", "filter", "face", "square (us)", "cap (us)") << std::endl;
+
+    for (const int face_width : face_widths) {
+        /* blur_face() pads faces by a quarter of their width each side */
+        const int size = face_width * 3 / 2;
+        cv::Mat square(size, size, CV_8UC3);
+        cv::randu(square, cv::Scalar::all(0), cv::Scalar::all(255));
+        const int radius_pixels = MAX(cvRound(radius * face_width), 1);
+
+        /* The original fixed kernel, for comparison */
+        const double fixed_us = median_us(iterations, [&] {
+            cv::Mat work = square.clone();
+            GaussianBlur(work, work, cv::Size(31, 31), 10);
+        });
+        std::cout << cv::format("%-10s %6d %12.1f %12s", "fixed-31", face_width, fixed_us, "-") << std::endl;
+
+        for (const ObscureFilter filter : filters) {
+            const double square_us = median_us(iterations, [&] {
+                cv::Mat work = square.clone();
+                equirect_obscure_filter(work, filter, radius_pixels);
+            });
+
+            SphericalCap cap {};
+            cap.longitude = M_PI;
+            cap.colatitude = (90 - latitude) * M_PI / 180;
+            cap.radius = 0.75 * face_width * 2 * M_PI / frame_width;
+
+            ObscureOptions obscure;
+            obscure.direct = true;
+            obscure.filter = filter;
+            obscure.radius = radius;
+            cv::Mat work = frame.clone();
+            const double cap_us = median_us(iterations, [&] { equirect_obscure_cap(work, cap, obscure); });
+
+            std::cout << cv::format(
+                "%-10s %6d %12.1f %12.1f", equirect_blur_filter_name(filter), face_width, square_us, cap_us)
+                      << std::endl;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,102 @@
+#include "equirect-blur-queue.h"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <opencv2/core.hpp>
+#include <thread>
+#include <vector>
+
+/* How sequence mode's detection throughput scales with the number of detection
+ * threads, for a fixed number of decode threads. Decoding and detecting are
+ * simulated with fixed delays, so this measures how the runs are scheduled
+ * across the threads rather than the detector */
+
+/* Images per second through RunQueues with the given threads */
+static double images_per_second(
+    const int images,
+    const int run_length,
+    const int queue_depth,
+    const int decode_threads,
+    const int detect_threads,
+    const std::chrono::milliseconds decode_time,
+    const std::chrono::milliseconds detect_time)
+{
+    RunQueues<int> runs(images, run_length, queue_depth, detect_threads + decode_threads);
+    std::atomic<bool> in_order { true };
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < decode_threads; i++) {
+        threads.emplace_back([&] {
+            size_t run, index;
+            while (runs.next(run, index)) {
+                std::this_thread::sleep_for(decode_time);
+                runs.push(run, static_cast<int>(index));
+            }
+        });
+    }
+    for (int i = 0; i < detect_threads; i++) {
+        threads.emplace_back([&] {
+            size_t run;
+            while (runs.take_run(run)) {
+                int image, expected = static_cast<int>(run) * run_length;
+                while (runs.pop(run, image)) {
+                    if (image != expected++)
+                        in_order = false;
+                    std::this_thread::sleep_for(detect_time);
+                }
+            }
+        });
+    }
+    for (std::thread& t : threads)
+        t.join();
+
+    if (!in_order)
+        std::cerr << "Images of a run were detected out of order" << std::endl;
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return images / elapsed.count();
+}
+
+int main(int argc, const char** argv)
+{
+    cv::CommandLineParser parser(
+        argc,
+        argv,
+        "{help h||}"
+        "{images|160|Images in the sequence}"
+        "{full-sweep-interval|10|Images in each run}"
+        "{queue-depth|4|Images each run's queue holds}"
+        "{decode-threads|1|Number of decode threads}"
+        "{max-detect-threads|8|Largest number of detection threads to try}"
+        "{decode-ms|10|Time to decode an image}"
+        "{detect-ms|100|Time to detect and obscure an image}");
+    parser.about("\nMeasures how sequence mode's throughput scales with detection threads\n");
+
+    if (parser.get<bool>("help")) {
+        parser.printMessage();
+        return 0;
+    }
+
+    const int images = MAX(parser.get<int>("images"), 1);
+    const int run_length = MAX(parser.get<int>("full-sweep-interval"), 1);
+    const int queue_depth = MAX(parser.get<int>("queue-depth"), 1);
+    const int decode_threads = MAX(parser.get<int>("decode-threads"), 1);
+    const std::chrono::milliseconds decode_time(parser.get<int>("decode-ms"));
+    const std::chrono::milliseconds detect_time(parser.get<int>("detect-ms"));
+
+    std::cout << images << " images in runs of " << run_length << ", " << decode_threads << " decode threads"
+              << std::endl;
+    std::cout << cv::format("%-14s %10s %8s", "detect threads", "images/s", "speedup") << std::endl;
+
+    double single = 0;
+    for (int threads = 1; threads <= parser.get<int>("max-detect-threads"); threads *= 2) {
+        const double rate = images_per_second(
+            images, run_length, queue_depth, decode_threads, threads, decode_time, detect_time);
+        if (threads == 1)
+            single = rate;
+        std::cout << cv::format("%-14d %10.1f %7.2fx", threads, rate, rate / single) << std::endl;
+    }
+
+    return 0;
+}
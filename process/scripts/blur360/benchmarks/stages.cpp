@@ -0,0 +1,305 @@
+#include "config.h"
+#include "equirect-blur-common.h"
+#include "equirect-blur-shared.h"
+#include "synthetic.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <opencv2/opencv.hpp>
+#include <sstream>
+
+/* Time each stage of processing a frame on its own, on a synthetic equirect
+ * frame with faces planted at known latitudes, through projections tilted to
+ * each of a list of latitudes, and report the results as JSON so runs can be
+ * compared between commits */
+
+struct StageResult {
+    std::string name;
+    double phi; /* Latitude the stage's projection faces, in degrees */
+    std::vector<double> ms;
+    size_t count = 0; /* Windows, faces or rects the stage handled, on its last run */
+
+    StageResult(std::string name_, const double phi_)
+        : name(std::move(name_))
+        , phi(phi_)
+    {
+    }
+};
+
+static void time_stage(StageResult& result, const int iterations, const std::function<size_t()>& run)
+{
+    for (int i = 0; i < iterations; i++) {
+        const auto start = std::chrono::steady_clock::now();
+        result.count = run();
+        const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        result.ms.push_back(elapsed.count());
+    }
+}
+
+static std::vector<double> parse_list(const std::string& list)
+{
+    std::vector<double> values;
+    std::stringstream in(list);
+    std::string item;
+    while (std::getline(in, item, ','))
+        values.push_back(atof(item.c_str()));
+    return values;
+}
+
+/* Where a point of the equirect frame appears in a projection's cropped view:
+ * the cropped pixel that maps closest to it, and how far from it that is */
+static cv::Point find_in_projection(const Projection& p, const cv::Point2f& target, float& distance)
+{
+    cv::Point best(-1, -1);
+    distance = FLT_MAX;
+    for (int y = 0; y < p.e2pMap.rows; y++) {
+        for (int x = 0; x < p.e2pMap.cols; x++) {
+            const cv::Vec2f equ = p.e2pMap(y, x);
+            float dx = fabsf(equ[0] - target.x);
+            dx = MIN(dx, static_cast<float>(p.equ_size.width) - dx);
+            const float d = dx * dx + (equ[1] - target.y) * (equ[1] - target.y);
+            if (d < distance) {
+                distance = d;
+                best = cv::Point(x, y);
+            }
+        }
+    }
+    distance = sqrtf(distance);
+    return best;
+}
+
+static std::string format_results(const cv::Size& size, const int iterations, const std::vector<StageResult>& results)
+{
+    std::string json = cv::format(
+        "{\"benchmark\":\"stages\",\"width\":%d,\"height\":%d,\"iterations\":%d,\"results\":[",
+        size.width,
+        size.height,
+        iterations);
+    for (size_t i = 0; i < results.size(); i++) {
+        std::vector<double> ms = results[i].ms;
+        std::sort(ms.begin(), ms.end());
+        double total = 0;
+        for (const double t : ms)
+            total += t;
+        json += cv::format(
+            "%s{\"stage\":\"%s\",\"phi\":%g,\"median_ms\":%.3f,\"min_ms\":%.3f,\"max_ms\":%.3f,\"mean_ms\":%.3f,"
+            "\"count\":%zu}",
+            i > 0 ? "," : "",
+            results[i].name.c_str(),
+            results[i].phi,
+            ms[ms.size() / 2],
+            ms.front(),
+            ms.back(),
+            total / static_cast<double>(ms.size()),
+            results[i].count);
+    }
+    return json + "]}";
+}
+
+int main(int argc, const char** argv)
+{
+    cv::CommandLineParser parser(
+        argc,
+        argv,
+        "{help h||}"
+        "{size|5760x2880|Frame size, WIDTHxHEIGHT}"
+        "{iterations n|5|Runs of each stage}"
+        "{latitudes|0,20,40,60,75,-30,-60|Latitudes to plant faces at, in degrees}"
+        "{phis|0,60,90|Latitudes to tilt the timed projections to, in degrees}"
+        "{face-size|64|Height of the planted faces, in pixels}"
+        "{face|" BENCHMARK_FACES_DIR "|Image of a face to plant, or a directory of them (a drawn one if empty)}"
+        "{models-dir m||Path to PCN models (the detector stages are skipped without them)}"
+        "{json||Also write the results to this file}");
+    parser.about("\nTimes each stage of processing a synthetic equirect frame, reporting JSON\n");
+
+    if (parser.get<bool>("help")) {
+        parser.printMessage();
+        return 0;
+    }
+
+    int width, height;
+    if (sscanf(parser.get<cv::String>("size").c_str(), "%dx%d", &width, &height) != 2 || width < 1 || height < 1) {
+        std::cerr << "--size must be WIDTHxHEIGHT" << std::endl;
+        return 1;
+    }
+    const cv::Size size(width, height);
+    const int iterations = MAX(parser.get<int>("iterations"), 1);
+    const int face_size = MAX(parser.get<int>("face-size"), 8);
+
+    std::vector<cv::Mat> faces;
+    if (!load_faces(parser.get<cv::String>("face"), faces))
+        return 1;
+
+    /* Spread the faces around, away from the projections' seams */
+    cv::Mat frame = synthetic_frame(size);
+    std::vector<PlantedFace> planted;
+    const std::vector<double> latitudes = parse_list(parser.get<cv::String>("latitudes"));
+    for (size_t i = 0; i < latitudes.size(); i++)
+        planted.push_back({ latitudes[i], -150.0 + 300.0 * static_cast<double>(i) / latitudes.size(), face_size });
+    for (size_t i = 0; i < planted.size(); i++)
+        plant_face(frame, planted[i], faces.empty() ? cv::Mat() : faces[i % faces.size()]);
+
+    PCN* detector = nullptr;
+    if (parser.has("models-dir")) {
+        detector = equirect_blur_create_detector(
+            parser.get<cv::String>("models-dir"), equirect_blur_image_defaults().detector, false);
+    }
+
+    std::vector<StageResult> results;
+    const float apertures[2] = { X_APERTURE, Y_APERTURE };
+    const ObscureOptions obscure;
+
+    for (const double phi_degrees : parse_list(parser.get<cv::String>("phis"))) {
+        const auto phi = static_cast<float>(phi_degrees * M_PI / 180);
+
+        /* The projection facing the face planted nearest its latitude */
+        const PlantedFace* nearest = nullptr;
+        for (const PlantedFace& p : planted) {
+            if (nearest == nullptr || fabs(p.latitude - phi_degrees) < fabs(nearest->latitude - phi_degrees))
+                nearest = &p;
+        }
+        const float lambda = static_cast<float>((nearest == nullptr ? 0.0 : nearest->longitude + 180) * M_PI / 180);
+
+        results.emplace_back("create_subregion_map", phi_degrees);
+        std::vector<Projection> projections;
+        time_stage(results.back(), iterations, [&] {
+            projections.clear();
+            projections.emplace_back(size, apertures, phi, lambda, nullptr);
+            return static_cast<size_t>(projections[0].e2pMap.total());
+        });
+        Projection& p = projections[0];
+
+        cv::Mat cropped;
+        results.emplace_back("extract_subregion", phi_degrees);
+        time_stage(results.back(), iterations, [&] {
+            equirect_blur_extract_subregion(p, frame, cropped);
+            return static_cast<size_t>(1);
+        });
+
+        /* The same remap from the fixed point maps --map-precision=fixed uses */
+        const Projection fixed(size, apertures, phi, lambda, nullptr, MapPrecision::FIXED);
+        cv::Mat fixed_cropped;
+        results.emplace_back("extract_subregion_fixed", phi_degrees);
+        time_stage(results.back(), iterations, [&] {
+            equirect_blur_extract_subregion(fixed, frame, fixed_cropped);
+            return static_cast<size_t>(1);
+        });
+
+        if (detector != nullptr) {
+            std::vector<std::vector<PCNStageTiming>> runs;
+            for (int i = 0; i < iterations; i++)
+                runs.push_back(detector->DetectStages(cropped));
+
+            /* The NMS passes are reported together as well as on their own */
+            for (const PCNStageTiming& stage : runs[0]) {
+                results.emplace_back(stage.name, phi_degrees);
+                for (const auto& run : runs) {
+                    for (const PCNStageTiming& s : run) {
+                        if (s.name == stage.name) {
+                            results.back().ms.push_back(s.seconds * 1000);
+                            results.back().count = s.windows;
+                        }
+                    }
+                }
+            }
+            results.emplace_back("nms", phi_degrees);
+            for (const auto& run : runs) {
+                double ms = 0;
+                for (const PCNStageTiming& s : run)
+                    ms += s.name.compare(0, 3, "nms") == 0 ? s.seconds * 1000 : 0;
+                results.back().ms.push_back(ms);
+            }
+        }
+
+        /* Windows for the planted faces this projection sees well */
+        std::vector<Window> windows;
+        for (const PlantedFace& planted_face : planted) {
+            const cv::Point2f target(
+                static_cast<float>((planted_face.longitude + 180) / 360 * width),
+                static_cast<float>((90 - planted_face.latitude) / 180 * height));
+            float distance;
+            const cv::Point at = find_in_projection(p, target, distance);
+            if (distance < 2 && at.x >= face_size && at.x < p.e2pMap.cols - face_size && at.y >= face_size
+                && at.y < p.e2pMap.rows - face_size)
+                windows.emplace_back(
+                    at.x - face_size / 2, at.y - face_size / 2, face_size, 0, 1.0f, std::vector<cv::Point>());
+        }
+
+        std::vector<cv::Rect> face_rects;
+        results.emplace_back("blur_face", phi_degrees);
+        for (int i = 0; i < iterations; i++) {
+            cv::Mat work = cropped.clone();
+            time_stage(results.back(), 1, [&] {
+                face_rects.clear();
+                for (const Window& window : windows)
+                    face_rects.push_back(equirect_blur_face(work, window, obscure));
+                return windows.size();
+            });
+        }
+
+        cv::Mat blurred = cropped.clone();
+        for (const Window& window : windows)
+            equirect_blur_face(blurred, window, obscure);
+        p.faces = face_rects;
+
+        results.emplace_back("project_faces_to_full_frame", phi_degrees);
+        for (int i = 0; i < iterations; i++) {
+            cv::Mat work = frame.clone();
+            std::vector<cv::Rect> written;
+            time_stage(results.back(), 1, [&] {
+                equirect_blur_project_faces(p, work, blurred, &written);
+                return written.size();
+            });
+        }
+    }
+
+    if (detector != nullptr) {
+        /* Whole frames through one worker's scratch, over the default sweep.
+         * Once the first two have sized its arena, frames like them mustn't
+         * take any more memory from the heap for their working images */
+        std::vector<Projection> sweep = equirect_blur_shared_projections(size);
+        for (Projection& sp : sweep)
+            sp.detector = detector;
+        FrameScratch scratch;
+        cv::Mat work;
+        for (int i = 0; i < 2; i++) {
+            frame.copyTo(work);
+            equirect_blur_process_frame(work, sweep, ObscureOptions(), nullptr, &scratch);
+        }
+        const uint64_t warm_allocations = scratch.arena.heap_allocations();
+        const uint64_t warm_fallbacks = frame_arena_fallbacks();
+        results.emplace_back("process_frame", 0.0);
+        for (int i = 0; i < iterations; i++) {
+            frame.copyTo(work);
+            time_stage(results.back(), 1, [&] {
+                equirect_blur_process_frame(work, sweep, ObscureOptions(), nullptr, &scratch);
+                return static_cast<size_t>(scratch.arena.heap_allocations() - warm_allocations);
+            });
+        }
+        delete detector;
+
+        if (scratch.arena.heap_allocations() != warm_allocations || frame_arena_fallbacks() != warm_fallbacks) {
+            std::cerr << "Steady state frames took " << scratch.arena.heap_allocations() - warm_allocations
+                      << " blocks and " << frame_arena_fallbacks() - warm_fallbacks
+                      << " images outside the arena from the heap for their working images" << std::endl;
+            return 1;
+        }
+    }
+
+    const std::string json = format_results(size, iterations, results);
+    std::cout << json << std::endl;
+    if (parser.has("json")) {
+        std::ofstream out(parser.get<cv::String>("json"));
+        out << json << std::endl;
+        if (!out) {
+            std::cerr << "Failed to write " << parser.get<cv::String>("json") << std::endl;
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,96 @@
+#include "synthetic.h"
+#include "equirect-blur-common.h"
+
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <iostream>
+#include <opencv2/opencv.hpp>
+
+/* Paste face (or a drawn one if it's empty) into image, stretched across the
+ * way equirect frames stretch things away from the equator */
+void plant_face(cv::Mat& image, const PlantedFace& planted, const cv::Mat& face)
+{
+    const double stretch = 1.0 / MAX(cos(planted.latitude * M_PI / 180), 0.1);
+    const cv::Size size(static_cast<int>(planted.size * stretch), planted.size);
+    const cv::Point centre(
+        static_cast<int>((planted.longitude + 180) / 360 * image.cols),
+        static_cast<int>((90 - planted.latitude) / 180 * image.rows));
+    const cv::Rect rect = cv::Rect(centre - cv::Point(size.width / 2, size.height / 2), size)
+        & cv::Rect(0, 0, image.cols, image.rows);
+
+    cv::Mat patch(size, image.type());
+    if (!face.empty()) {
+        cv::resize(face, patch, size, 0, 0, cv::INTER_AREA);
+    }
+    else {
+        /* A plain cartoon face: not something the detector is likely to find,
+         * but it gives the obscuring stages real edges to work on */
+        const cv::Point c(size.width / 2, size.height / 2);
+        const cv::Scalar skin(120, 160, 210), eye(40, 30, 30);
+        const int eye_size = MAX(size.height / 16, 1);
+        patch.setTo(cv::Scalar(90, 90, 90));
+        cv::ellipse(patch, c, cv::Size(size.width * 2 / 5, size.height * 9 / 20), 0, 0, 360, skin, -1);
+        cv::circle(patch, c + cv::Point(-size.width / 6, -size.height / 8), eye_size, eye, -1);
+        cv::circle(patch, c + cv::Point(size.width / 6, -size.height / 8), eye_size, eye, -1);
+        cv::ellipse(patch, c + cv::Point(0, size.height / 6), cv::Size(size.width / 6, size.height / 16), 0, 0, 180,
+                    cv::Scalar(60, 40, 150), MAX(size.height / 32, 1));
+    }
+
+    patch(cv::Rect(rect.tl() - (centre - cv::Point(size.width / 2, size.height / 2)), rect.size())).copyTo(image(rect));
+}
+
+bool load_faces(const std::string& path, std::vector<cv::Mat>& faces)
+{
+    faces.clear();
+    if (path.empty())
+        return true;
+
+    std::vector<std::filesystem::path> files;
+    std::error_code error;
+    if (std::filesystem::is_directory(path, error)) {
+        for (const auto& entry : std::filesystem::directory_iterator(path, error)) {
+            if (entry.is_regular_file() && cv::haveImageReader(entry.path().u8string()))
+                files.push_back(entry.path());
+        }
+        std::sort(files.begin(), files.end());
+    }
+    else {
+        files.emplace_back(path);
+    }
+
+    for (const std::filesystem::path& file : files) {
+        cv::Mat face = cv::imread(file.u8string());
+        if (face.empty()) {
+            std::cerr << "Can't open image file " << file.u8string() << std::endl;
+            return false;
+        }
+        faces.push_back(face);
+    }
+    if (faces.empty()) {
+        std::cerr << "No face images in " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/* Stand-in for a panorama: smooth gradients with noise */
+cv::Mat synthetic_frame(const cv::Size& size)
+{
+    cv::Mat image(size, CV_8UC3);
+    for (int y = 0; y < size.height; y++) {
+        auto* row = image.ptr<cv::Vec3b>(y);
+        for (int x = 0; x < size.width; x++) {
+            row[x] = cv::Vec3b(
+                static_cast<uchar>(255 * x / size.width),
+                static_cast<uchar>(255 * y / size.height),
+                static_cast<uchar>((x + y) & 0xff));
+        }
+    }
+
+    cv::Mat noise(size, CV_8UC3);
+    cv::randn(noise, cv::Scalar::all(128), cv::Scalar::all(8));
+    cv::addWeighted(image, 1.0, noise, 1.0, -128.0, image);
+
+    return image;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+#include <string>
+#include <vector>
+
+/* Synthetic equirect frames with faces planted at known places, for the
+ * benchmarks that need frames to run on without a dataset */
+
+/* A face planted in the frame, at a latitude and longitude in degrees */
+struct PlantedFace {
+    double latitude;
+    double longitude;
+    int size; /* Height in pixels */
+};
+
+/* Stand-in for a panorama: smooth gradients with noise */
+cv::Mat synthetic_frame(const cv::Size& size);
+
+/* Paste face (or a drawn one if it's empty) into image, stretched across the
+ * way equirect frames stretch things away from the equator */
+void plant_face(cv::Mat& image, const PlantedFace& planted, const cv::Mat& face);
+
+/* The face images at path: the image itself, or the images in it if it's a
+ * directory, in name order. An empty path gives none, for drawn faces */
+bool load_faces(const std::string& path, std::vector<cv::Mat>& faces);
@@ -1,4 +1,9 @@
 #include "PCN.h"
+#include "equirect-blur-arena.h"
+#include "equirect-blur-memory.h"
+#include "equirect-blur-trace.h"
+
+#include <chrono>
 
 struct Window2 {
     int x, y, w, h;
@@ -35,28 +40,37 @@ public:
         const std::string& net3,
         const std::string& modelTrack,
         const std::string& netTrack);
-    static cv::Mat ResizeImg(const cv::Mat& img, float scale);
+    [[nodiscard]] cv::Mat ResizeImg(const cv::Mat& img, float scale) const;
     static bool CompareWin(const Window2& w1, const Window2& w2);
     static bool Legal(int x, int y, const cv::Mat& img);
     static bool Inside(int x, int y, const Window2& rect);
     static float SmoothAngle(float a, float b);
     std::vector<Window2> SmoothWindow(std::vector<Window2> winList);
     static float IoU(const Window2& w1, const Window2& w2);
-    static std::vector<Window2> NMS(std::vector<Window2>& winList, bool local, float threshold);
-    static std::vector<Window2> DeleteFP(std::vector<Window2>& winList);
-    [[nodiscard]] cv::Mat PreProcessImg(const cv::Mat& img) const;
-    [[nodiscard]] cv::Mat PreProcessImg(const cv::Mat& img, int dim) const;
+    static void NMS(std::vector<Window2>& winList, bool local, float threshold, std::vector<bool>& flag);
+    static void DeleteFP(std::vector<Window2>& winList, std::vector<bool>& flag);
+    [[nodiscard]] cv::Mat CropImg(const cv::Mat& img, int dim) const;
+    cv::Mat& NewBlob(int rows, int cols);
+    cv::Mat& BlobOver(uchar* data, int rows, int cols);
     [[nodiscard]] cv::Mat PadImg(const cv::Mat& img) const;
-    static std::vector<Window> TransWindow(const cv::Mat& img, const cv::Mat& imgPad, std::vector<Window2>& winList);
-    std::vector<Window2> Stage1(const cv::Mat& img, const cv::Mat& imgPad, cv::dnn::Net& net, float thres) const;
-    std::vector<Window2> Stage2(
+    static void TransWindow(
+        const cv::Mat& img, const cv::Mat& imgPad, std::vector<Window2>& winList, std::vector<Window>& ret);
+    void Stage1(
+        const cv::Mat& img,
+        const cv::Mat& imgPad,
+        cv::dnn::Net& net,
+        float thres,
+        int* levels,
+        std::vector<Window2>& ret);
+    void Stage2(
         const cv::Mat& img,
         const cv::Mat& img180,
         cv::dnn::Net& net,
         float thres,
         int dim,
-        std::vector<Window2>& winList) const;
-    std::vector<Window2> Stage3(
+        const std::vector<Window2>& winList,
+        std::vector<Window2>& ret);
+    void Stage3(
         const cv::Mat& img,
         const cv::Mat& img180,
         const cv::Mat& img90,
@@ -64,10 +78,18 @@ public:
         cv::dnn::Net& net,
         float thres,
         int dim,
-        std::vector<Window2>& winList) const;
-    std::vector<Window2> Detect(const cv::Mat& img, const cv::Mat& imgPad);
-    std::vector<Window2> Track(
-        const cv::Mat& img, cv::dnn::Net& net, float thres, int dim, std::vector<Window2>& winList) const;
+        const std::vector<Window2>& winList,
+        std::vector<Window2>& ret);
+    std::vector<Window2>& Detect(const cv::Mat& img, const cv::Mat& imgPad);
+    void Track(
+        const cv::Mat& img,
+        cv::dnn::Net& net,
+        float thres,
+        int dim,
+        const std::vector<Window2>& winList,
+        std::vector<Window2>& ret);
+    void RecordStage(const char* name, size_t windows, std::chrono::steady_clock::time_point& start) const;
+    size_t ScratchBytes(const cv::Mat& img, const cv::Mat& imgPad);
 
     cv::dnn::Net net_[4];
     int minFace_ {};
@@ -86,6 +108,26 @@ public:
     int m_trackDetectFlag {};
     std::vector<Window2> m_trackPreList;
     std::vector<Window2> m_smoothPreList;
+
+    PCNStats* stats_ = nullptr;
+    FrameArena* arena_ = nullptr; /* Where the working images come from, if set */
+
+    /* Detect()'s working lists, kept between calls so that once they have
+     * grown to a stream's frames they aren't allocated again */
+    std::vector<Window2> winList_; /* Candidates left after the latest stage */
+    std::vector<Window2> stageList_; /* The next stage's candidates, swapped into winList_ */
+    std::vector<bool> nmsFlags_;
+    std::vector<Window> trackWindows_;
+    std::vector<cv::Mat> dataList_; /* Window crops, from the arena */
+    std::vector<cv::Mat> outputBlobs_;
+    cv::Mat blobMemory_; /* NewBlob()'s memory */
+    cv::Mat blob_; /* The 1 x 3 x rows x cols header over it that the networks are given */
+
+    MemoryCharge models_ { MemoryUse::MODELS }; /* The networks' weights */
+    size_t scratchBytes_ {}; /* Detect()'s working images, for scratchSize_ and scratchMinFace_ */
+    size_t scratchNetBytes_ {}; /* And the first stage's activations */
+    cv::Size scratchSize_;
+    int scratchMinFace_ {};
 };
 
 PCN::PCN(
@@ -102,6 +144,11 @@ PCN::PCN(
     p->LoadModel(modelDetect, net1, net2, net3, modelTrack, netTrack);
 }
 
+PCN::~PCN()
+{
+    delete static_cast<Impl*>(impl_);
+}
+
 // ReSharper disable once CppMemberFunctionMayBeConst
 void PCN::SetVideoSmooth(const bool smooth)
 {
@@ -129,7 +176,7 @@ void PCN::SetDetectionThresh(const float thresh1, const float thresh2, const flo
     p->stride_ = 8;
     p->angleRange_ = 45;
     p->augScale_ = 0.15f;
-    p->mean_ = cv::Scalar(104, 117, 123);
+    p->mean_ = PCN_MEAN;
 }
 
 // ReSharper disable once CppMemberFunctionMayBeConst
@@ -153,20 +200,63 @@ void PCN::SetTrackingThresh(const float thresh)
     p->trackThreshold_ = thresh;
 }
 
-// ReSharper disable once CppMemberFunctionMayBeConst
 std::vector<Window> PCN::Detect(const cv::Mat& img)
+{
+    std::vector<Window> faces;
+    Detect(img, faces);
+    return faces;
+}
+
+// ReSharper disable once CppMemberFunctionMayBeConst
+void PCN::Detect(const cv::Mat& img, std::vector<Window>& faces)
 {
     const auto p = static_cast<Impl*>(impl_);
+    const FrameArena::Scope scope(p->arena_);
     const cv::Mat imgPad = p->PadImg(img);
-    std::vector<Window2> winList = p->Detect(img, imgPad);
+    Impl::TransWindow(img, imgPad, p->Detect(img, imgPad), faces);
+}
 
-    return Impl::TransWindow(img, imgPad, winList);
+// ReSharper disable once CppMemberFunctionMayBeConst
+void PCN::SetStats(PCNStats* stats)
+{
+    const auto p = static_cast<Impl*>(impl_);
+    p->stats_ = stats;
+}
+
+// ReSharper disable once CppMemberFunctionMayBeConst
+void PCN::SetArena(FrameArena* arena)
+{
+    const auto p = static_cast<Impl*>(impl_);
+    p->arena_ = arena;
+}
+
+// ReSharper disable once CppMemberFunctionMayBeConst
+std::vector<PCNStageTiming> PCN::DetectStages(const cv::Mat& img)
+{
+    const auto p = static_cast<Impl*>(impl_);
+    PCNStats* const saved = p->stats_;
+    PCNStats stats;
+    p->stats_ = &stats;
+    const FrameArena::Scope scope(p->arena_);
+
+    const cv::Mat imgPad = p->PadImg(img);
+    const std::vector<Window2> winList = p->Detect(img, imgPad);
+
+    /* As DetectTrack() */
+    auto start = std::chrono::steady_clock::now();
+    std::vector<Window2> tracked;
+    p->Track(imgPad, p->net_[3], p->trackThreshold_, 96, winList, tracked);
+    p->RecordStage("track", tracked.size(), start);
+
+    p->stats_ = saved;
+    return stats.stages;
 }
 
 // ReSharper disable once CppMemberFunctionMayBeConst
 std::vector<Window> PCN::DetectTrack(const cv::Mat& img)
 {
     const auto p = static_cast<Impl*>(impl_);
+    const FrameArena::Scope scope(p->arena_);
     const cv::Mat imgPad = p->PadImg(img);
 
     p->m_trackDetectFlag = p->period_;
@@ -174,15 +264,17 @@ std::vector<Window> PCN::DetectTrack(const cv::Mat& img)
     std::vector<Window2> winList = p->m_trackPreList;
 
     if (p->m_trackDetectFlag == p->period_) {
-        const std::vector<Window2> tmpList = p->Detect(img, imgPad);
+        const std::vector<Window2>& tmpList = p->Detect(img, imgPad);
         for (const Window2& window : tmpList) {
             winList.push_back(window);
         }
     }
-    winList = Impl::NMS(winList, false, p->nmsThreshold_[2]);
-    winList = p->Track(imgPad, p->net_[3], p->trackThreshold_, 96, winList);
-    winList = Impl::NMS(winList, false, p->nmsThreshold_[2]);
-    winList = Impl::DeleteFP(winList);
+    Impl::NMS(winList, false, p->nmsThreshold_[2], p->nmsFlags_);
+    std::vector<Window2> tracked;
+    p->Track(imgPad, p->net_[3], p->trackThreshold_, 96, winList, tracked);
+    winList = std::move(tracked);
+    Impl::NMS(winList, false, p->nmsThreshold_[2], p->nmsFlags_);
+    Impl::DeleteFP(winList, p->nmsFlags_);
     if (p->stable_) {
         winList = p->SmoothWindow(winList);
     }
@@ -190,7 +282,10 @@ std::vector<Window> PCN::DetectTrack(const cv::Mat& img)
     p->m_trackDetectFlag--;
     if (p->m_trackDetectFlag == 0)
         p->m_trackDetectFlag = p->period_;
-    return Impl::TransWindow(img, imgPad, winList);
+
+    std::vector<Window> faces;
+    Impl::TransWindow(img, imgPad, winList, faces);
+    return faces;
 }
 
 void Impl::LoadModel(
@@ -206,6 +301,14 @@ void Impl::LoadModel(
     net_[2] = cv::dnn::readNetFromCaffe(net3, modelDetect);
     net_[3] = cv::dnn::readNetFromCaffe(netTrack, modelTrack);
 
+    size_t weights = 0;
+    for (int i = 0; i < 4; i++) {
+        size_t netWeights, blobs;
+        net_[i].getMemoryConsumption(cv::dnn::MatShape { 1, 3, 24, 24 }, netWeights, blobs);
+        weights += netWeights;
+    }
+    models_.set(weights);
+
 #if 0
     for (int i = 0; i < 4; i++) {
         net_[i].setPreferableBackend(cv::dnn::DNN_BACKEND_INFERENCE_ENGINE);
@@ -214,33 +317,52 @@ void Impl::LoadModel(
 #endif
 }
 
-cv::Mat Impl::PreProcessImg(const cv::Mat& img) const
+/// a window resized to the network's input
+cv::Mat Impl::CropImg(const cv::Mat& img, const int dim) const
+{
+    cv::Mat ret = frame_arena_mat(arena_, dim, dim, img.type());
+    resize(img, ret, ret.size());
+    return ret;
+}
+
+/// a 1 x 3 x rows x cols float blob, for ImageToBlob(). It is blob_, so is
+/// only valid until the next call
+cv::Mat& Impl::NewBlob(const int rows, const int cols)
 {
-    const cv::Mat mean(img.size(), CV_32FC3, mean_);
-    cv::Mat imgF;
-    img.convertTo(imgF, CV_32FC3);
-    return imgF - mean;
+    blobMemory_ = frame_arena_mat(arena_, 1, 3 * rows * cols, CV_32F);
+    return BlobOver(blobMemory_.data, rows, cols);
 }
 
-cv::Mat Impl::PreProcessImg(const cv::Mat& img, const int dim) const
+/// blob_, shaped 1 x 3 x rows x cols over data. Making a 4 dimensional Mat
+/// allocates its size and step arrays, so the header is made once and then
+/// reshaped in place
+cv::Mat& Impl::BlobOver(uchar* data, const int rows, const int cols)
 {
-    cv::Mat imgNew;
-    resize(img, imgNew, cv::Size(dim, dim));
-    const cv::Mat mean(imgNew.size(), CV_32FC3, mean_);
-    cv::Mat imgF;
-    imgNew.convertTo(imgF, CV_32FC3);
-    return imgF - mean;
+    if (blob_.dims != 4) {
+        const int sizes[] = { 1, 3, rows, cols };
+        blob_ = cv::Mat(4, sizes, CV_32F, data);
+        return blob_;
+    }
+    const size_t plane = static_cast<size_t>(rows) * static_cast<size_t>(cols) * sizeof(float);
+    blob_.size.p[2] = rows;
+    blob_.size.p[3] = cols;
+    blob_.step.p[0] = 3 * plane;
+    blob_.step.p[1] = plane;
+    blob_.step.p[2] = static_cast<size_t>(cols) * sizeof(float);
+    blob_.data = data;
+    blob_.datastart = data;
+    blob_.dataend = blob_.datalimit = data + 3 * plane;
+    return blob_;
 }
 
-cv::Mat Impl::ResizeImg(const cv::Mat& img, const float scale)
+cv::Mat Impl::ResizeImg(const cv::Mat& img, const float scale) const
 {
-    cv::Mat ret;
-    resize(
-        img,
-        ret,
-        cv::Size(
-            static_cast<int>(static_cast<float>(img.cols) / scale),
-            static_cast<int>(static_cast<float>(img.rows) / scale)));
+    cv::Mat ret = frame_arena_mat(
+        arena_,
+        static_cast<int>(static_cast<float>(img.rows) / scale),
+        static_cast<int>(static_cast<float>(img.cols) / scale),
+        img.type());
+    resize(img, ret, ret.size());
     return ret;
 }
 
@@ -284,13 +406,14 @@ float Impl::IoU(const Window2& w1, const Window2& w2)
     return static_cast<float>(intersection) / unio;
 }
 
-std::vector<Window2> Impl::NMS(std::vector<Window2>& winList, const bool local, const float threshold)
+/// keep the windows not suppressed, in place, with flag as its working space
+void Impl::NMS(std::vector<Window2>& winList, const bool local, const float threshold, std::vector<bool>& flag)
 {
     if (winList.empty())
-        return winList;
+        return;
     std::sort(winList.begin(), winList.end(), CompareWin);
 
-    std::vector flag(winList.size(), false);
+    flag.assign(winList.size(), false);
 
     for (size_t i = 0; i < winList.size(); i++) {
         if (flag[i])
@@ -303,21 +426,21 @@ std::vector<Window2> Impl::NMS(std::vector<Window2>& winList, const bool local,
                 flag[j] = true;
         }
     }
-    std::vector<Window2> ret;
+    size_t kept = 0;
     for (size_t i = 0; i < winList.size(); i++) {
         if (!flag[i])
-            ret.push_back(winList[i]);
+            winList[kept++] = std::move(winList[i]);
     }
-    return ret;
+    winList.erase(winList.begin() + static_cast<std::ptrdiff_t>(kept), winList.end());
 }
 
-/// to delete some false positives
-std::vector<Window2> Impl::DeleteFP(std::vector<Window2>& winList)
+/// to delete some false positives, in place as NMS()
+void Impl::DeleteFP(std::vector<Window2>& winList, std::vector<bool>& flag)
 {
     if (winList.empty())
-        return winList;
+        return;
     std::sort(winList.begin(), winList.end(), CompareWin);
-    std::vector flag(winList.size(), false);
+    flag.assign(winList.size(), false);
     for (size_t i = 0; i < winList.size(); i++) {
         if (flag[i])
             continue;
@@ -327,12 +450,12 @@ std::vector<Window2> Impl::DeleteFP(std::vector<Window2>& winList)
                 flag[j] = true;
         }
     }
-    std::vector<Window2> ret;
+    size_t kept = 0;
     for (size_t i = 0; i < winList.size(); i++) {
         if (!flag[i])
-            ret.push_back(winList[i]);
+            winList[kept++] = std::move(winList[i]);
     }
-    return ret;
+    winList.erase(winList.begin() + static_cast<std::ptrdiff_t>(kept), winList.end());
 }
 
 /// to detect faces on the boundary
@@ -340,29 +463,41 @@ cv::Mat Impl::PadImg(const cv::Mat& img) const
 {
     const int row = std::min(static_cast<int>(img.rows * 0.2), 100);
     const int col = std::min(static_cast<int>(img.cols * 0.2), 100);
-    cv::Mat ret;
+    cv::Mat ret = frame_arena_mat(arena_, img.rows + 2 * row, img.cols + 2 * col, img.type());
     copyMakeBorder(img, ret, row, row, col, col, cv::BORDER_CONSTANT, mean_);
     return ret;
 }
 
-std::vector<Window2> Impl::Stage1(const cv::Mat& img, const cv::Mat& imgPad, cv::dnn::Net& net, float thres) const
+void Impl::Stage1(
+    const cv::Mat& img,
+    const cv::Mat& imgPad,
+    cv::dnn::Net& net,
+    float thres,
+    int* levels,
+    std::vector<Window2>& winList)
 {
-    std::vector<cv::String> outputBlobNames = { "bbox_reg_1", "cls_prob", "rotate_cls_prob" };
+    static const std::vector<cv::String> outputBlobNames = { "bbox_reg_1", "cls_prob", "rotate_cls_prob" };
+    std::vector<cv::Mat>& outputBlobs = outputBlobs_;
 
     int row = (imgPad.rows - img.rows) / 2;
     int col = (imgPad.cols - img.cols) / 2;
-    std::vector<Window2> winList;
+    winList.clear();
     constexpr int netSize = 24;
     float curScale;
     curScale = static_cast<float>(minFace_) / static_cast<float>(netSize);
     cv::Mat imgResized = ResizeImg(img, curScale);
+    /* Each level's blob fits in the first's memory */
+    uchar* const blobMemory = NewBlob(imgResized.rows, imgResized.cols).data;
     while (std::min(imgResized.rows, imgResized.cols) >= netSize) {
-        cv::Mat preProcessed = PreProcessImg(imgResized);
-        cv::Mat inputBlob = cv::dnn::blobFromImage(preProcessed, 1.0, cv::Size(), cv::Scalar(), false, false);
-        std::vector<cv::Mat> outputBlobs;
+        cv::Mat& inputBlob = BlobOver(blobMemory, imgResized.rows, imgResized.cols);
+        ImageToBlob(imgResized, mean_, inputBlob);
 
-        net.setInput(inputBlob);
-        net.forward(outputBlobs, outputBlobNames);
+        {
+            BlurTraceSpan span("dnn", "forward-stage1");
+            span.arg("scale", curScale);
+            net.setInput(inputBlob);
+            net.forward(outputBlobs, outputBlobNames);
+        }
 
         cv::Mat regression[3] = {
             cv::Mat(outputBlobs[0].size[2], outputBlobs[0].size[3], CV_32F, outputBlobs[0].ptr<float>(0, 0)),
@@ -401,36 +536,42 @@ std::vector<Window2> Impl::Stage1(const cv::Mat& img, const cv::Mat& imgPad, cv:
         }
         imgResized = ResizeImg(imgResized, scale_);
         curScale = static_cast<float>(img.rows) / static_cast<float>(imgResized.rows);
+        if (levels != nullptr)
+            (*levels)++;
     }
-    return winList;
 }
 
-std::vector<Window2> Impl::Stage2(
-    const cv::Mat& img, const cv::Mat& img180, cv::dnn::Net& net, float thres, int dim, std::vector<Window2>& winList)
-    const
+void Impl::Stage2(
+    const cv::Mat& img,
+    const cv::Mat& img180,
+    cv::dnn::Net& net,
+    float thres,
+    int dim,
+    const std::vector<Window2>& winList,
+    std::vector<Window2>& ret)
 {
+    ret.clear();
     if (winList.empty())
-        return winList;
-    std::vector<cv::Mat> dataList;
-    dataList.reserve(winList.size());
+        return;
+    std::vector<cv::Mat>& dataList = dataList_;
+    dataList.clear();
 
     int height = img.rows;
     for (const Window2& window : winList) {
         if (abs(window.angle) < EPS)
-            dataList.push_back(PreProcessImg(img(cv::Rect(window.x, window.y, window.w, window.h)), dim));
+            dataList.push_back(CropImg(img(cv::Rect(window.x, window.y, window.w, window.h)), dim));
         else {
             int y2 = window.y + window.h - 1;
-            dataList.push_back(PreProcessImg(img180(cv::Rect(window.x, height - 1 - y2, window.w, window.h)), dim));
+            dataList.push_back(CropImg(img180(cv::Rect(window.x, height - 1 - y2, window.w, window.h)), dim));
         }
     }
 
-    std::vector<cv::String> outputBlobNames = { "bbox_reg_2", "cls_prob", "rotate_cls_prob" };
-    std::vector<cv::Mat> outputBlobs;
-    std::vector<Window2> ret;
+    static const std::vector<cv::String> outputBlobNames = { "bbox_reg_2", "cls_prob", "rotate_cls_prob" };
+    std::vector<cv::Mat>& outputBlobs = outputBlobs_;
 
 #if 0
     /* FIXME: Figure out how the reports from multiple images work so all images can be submitted at once */
-    cv::Mat inputBlob = cv::dnn::blobFromImages(dataList, 1.0, cv::Size(), cv::Scalar(), false, false);
+    cv::Mat inputBlob = cv::dnn::blobFromImages(dataList, 1.0, cv::Size(), mean_, false, false);
     net.setInput(inputBlob);
     net.forward(outputBlobs, outputBlobNames);
 
@@ -508,10 +649,14 @@ std::vector<Window2> Impl::Stage2(
         }
     }
 #else
+    cv::Mat& inputBlob = NewBlob(dim, dim);
     for (size_t i = 0; i < winList.size(); i++) {
-        cv::Mat inputBlob = cv::dnn::blobFromImage(dataList[i], 1.0, cv::Size(), cv::Scalar(), false, false);
-        net.setInput(inputBlob);
-        net.forward(outputBlobs, outputBlobNames);
+        ImageToBlob(dataList[i], mean_, inputBlob);
+        {
+            BlurTraceSpan span("dnn", "forward-stage2");
+            net.setInput(inputBlob);
+            net.forward(outputBlobs, outputBlobNames);
+        }
 
         auto regression
             = cv::Mat(outputBlobs[0].size[1], outputBlobs[0].size[0], CV_32F, outputBlobs[0].ptr<float>(0, 0));
@@ -568,10 +713,9 @@ std::vector<Window2> Impl::Stage2(
         }
     }
 #endif
-    return ret;
 }
 
-std::vector<Window2> Impl::Stage3(
+void Impl::Stage3(
     const cv::Mat& img,
     const cv::Mat& img180,
     const cv::Mat& img90,
@@ -579,38 +723,44 @@ std::vector<Window2> Impl::Stage3(
     cv::dnn::Net& net,
     float thres,
     int dim,
-    std::vector<Window2>& winList) const
+    const std::vector<Window2>& winList,
+    std::vector<Window2>& ret)
 {
+    ret.clear();
     if (winList.empty())
-        return winList;
-    std::vector<cv::Mat> dataList;
+        return;
+    std::vector<cv::Mat>& dataList = dataList_;
+    dataList.clear();
     int height = img.rows;
     int width = img.cols;
     for (const Window2& window : winList) {
         if (abs(window.angle) < EPS)
-            dataList.push_back(PreProcessImg(img(cv::Rect(window.x, window.y, window.w, window.h)), dim));
+            dataList.push_back(CropImg(img(cv::Rect(window.x, window.y, window.w, window.h)), dim));
         else if (abs(window.angle - 90) < EPS) {
-            dataList.push_back(PreProcessImg(img90(cv::Rect(window.y, window.x, window.h, window.w)), dim));
+            dataList.push_back(CropImg(img90(cv::Rect(window.y, window.x, window.h, window.w)), dim));
         }
         else if (abs(window.angle + 90) < EPS) {
             int x = window.y;
             int y = width - 1 - (window.x + window.w - 1);
-            dataList.push_back(PreProcessImg(imgNeg90(cv::Rect(x, y, window.w, window.h)), dim));
+            dataList.push_back(CropImg(imgNeg90(cv::Rect(x, y, window.w, window.h)), dim));
         }
         else {
             int y2 = window.y + window.h - 1;
-            dataList.push_back(PreProcessImg(img180(cv::Rect(window.x, height - 1 - y2, window.w, window.h)), dim));
+            dataList.push_back(CropImg(img180(cv::Rect(window.x, height - 1 - y2, window.w, window.h)), dim));
         }
     }
 
-    std::vector<cv::String> outputBlobNames = { "bbox_reg_3", "cls_prob", "rotate_reg_3" };
-    std::vector<cv::Mat> outputBlobs;
-    std::vector<Window2> ret;
+    static const std::vector<cv::String> outputBlobNames = { "bbox_reg_3", "cls_prob", "rotate_reg_3" };
+    std::vector<cv::Mat>& outputBlobs = outputBlobs_;
 
+    cv::Mat& inputBlob = NewBlob(dim, dim);
     for (size_t i = 0; i < winList.size(); i++) {
-        cv::Mat inputBlob = cv::dnn::blobFromImage(dataList[i], 1.0, cv::Size(), cv::Scalar(), false, false);
-        net.setInput(inputBlob);
-        net.forward(outputBlobs, outputBlobNames);
+        ImageToBlob(dataList[i], mean_, inputBlob);
+        {
+            BlurTraceSpan span("dnn", "forward-stage3");
+            net.setInput(inputBlob);
+            net.forward(outputBlobs, outputBlobNames);
+        }
 
         auto regression
             = cv::Mat(outputBlobs[0].size[1], outputBlobs[0].size[0], CV_32F, outputBlobs[0].ptr<float>(0, 0));
@@ -664,16 +814,15 @@ std::vector<Window2> Impl::Stage3(
             }
         }
     }
-
-    return ret;
 }
 
-std::vector<Window> Impl::TransWindow(const cv::Mat& img, const cv::Mat& imgPad, std::vector<Window2>& winList)
+void Impl::TransWindow(
+    const cv::Mat& img, const cv::Mat& imgPad, std::vector<Window2>& winList, std::vector<Window>& ret)
 {
     const int row = (imgPad.rows - img.rows) / 2;
     const int col = (imgPad.cols - img.cols) / 2;
 
-    std::vector<Window> ret;
+    ret.clear();
     for (Window2& window : winList) {
         if (window.w > 0 && window.h > 0) {
             for (cv::Point& point : window.points14) {
@@ -689,7 +838,6 @@ std::vector<Window> Impl::TransWindow(const cv::Mat& img, const cv::Mat& imgPad,
                 window.points14);
         }
     }
-    return ret;
 }
 
 std::vector<Window2> Impl::SmoothWindow(std::vector<Window2> winList)
@@ -735,58 +883,126 @@ std::vector<Window2> Impl::SmoothWindow(std::vector<Window2> winList)
     return winList;
 }
 
-std::vector<Window2> Impl::Detect(const cv::Mat& img, const cv::Mat& imgPad)
+/// add the time since start to stats_ (if set) and the trace (if on) as a stage, and restart the clock
+void Impl::RecordStage(const char* name, const size_t windows, std::chrono::steady_clock::time_point& start) const
 {
-    cv::Mat img180, img90, imgNeg90;
+    if (stats_ == nullptr && !equirect_blur_trace_enabled())
+        return;
+    const auto now = std::chrono::steady_clock::now();
+    equirect_blur_trace_span("pcn", name, start, now, "\"windows\":" + std::to_string(windows));
+    if (stats_ != nullptr) {
+        const std::chrono::duration<double> elapsed = now - start;
+        stats_->stages.push_back({ name, elapsed.count(), windows });
+    }
+    start = now;
+}
+
+/* Estimate the memory Detect() works in for an image: the padded image and its
+ * three rotations, and the largest pyramid level and its input blob, with the
+ * first stage's activations for it. Smaller levels reuse the same memory as
+ * they go. While an arena is set it charges the images itself, so only the
+ * activations are counted here */
+size_t Impl::ScratchBytes(const cv::Mat& img, const cv::Mat& imgPad)
+{
+    if (imgPad.size() != scratchSize_ || minFace_ != scratchMinFace_) {
+        scratchSize_ = imgPad.size();
+        scratchMinFace_ = minFace_;
+
+        const float curScale = static_cast<float>(minFace_) / 24;
+        const int rows = static_cast<int>(static_cast<float>(img.rows) / curScale);
+        const int cols = static_cast<int>(static_cast<float>(img.cols) / curScale);
+        size_t weights = 0;
+        scratchNetBytes_ = 0;
+        if (MIN(rows, cols) >= 24)
+            net_[0].getMemoryConsumption(cv::dnn::MatShape { 1, 3, rows, cols }, weights, scratchNetBytes_);
+
+        const size_t levelPixels = static_cast<size_t>(rows) * static_cast<size_t>(cols);
+        scratchBytes_ = 4 * imgPad.total() * imgPad.elemSize() + levelPixels * (3 + 3 * sizeof(float));
+    }
+    return scratchNetBytes_ + (arena_ != nullptr ? 0 : scratchBytes_);
+}
+
+std::vector<Window2>& Impl::Detect(const cv::Mat& img, const cv::Mat& imgPad)
+{
+    auto start = std::chrono::steady_clock::now();
+    const MemoryCharge scratch(MemoryUse::SCRATCH, ScratchBytes(img, imgPad));
+
+    cv::Mat img180 = frame_arena_mat(arena_, imgPad.rows, imgPad.cols, imgPad.type());
+    cv::Mat img90 = frame_arena_mat(arena_, imgPad.cols, imgPad.rows, imgPad.type());
+    cv::Mat imgNeg90 = frame_arena_mat(arena_, imgPad.cols, imgPad.rows, imgPad.type());
     flip(imgPad, img180, 0);
     transpose(imgPad, img90);
     flip(img90, imgNeg90, 0);
+    RecordStage("prepare", 0, start);
 
-    std::vector<Window2> winList = Stage1(img, imgPad, net_[0], classThreshold_[0]);
-    winList = NMS(winList, true, nmsThreshold_[0]);
-
-    winList = Stage2(imgPad, img180, net_[1], classThreshold_[1], 24, winList);
-    winList = NMS(winList, true, nmsThreshold_[1]);
-
-    winList = Stage3(imgPad, img180, img90, imgNeg90, net_[2], classThreshold_[2], 48, winList);
-    winList = NMS(winList, false, nmsThreshold_[2]);
-    winList = DeleteFP(winList);
-    return winList;
+    Stage1(
+        img,
+        imgPad,
+        net_[0],
+        classThreshold_[0],
+        stats_ != nullptr ? &stats_->pyramid_levels : nullptr,
+        winList_);
+    RecordStage("stage1", winList_.size(), start);
+    NMS(winList_, true, nmsThreshold_[0], nmsFlags_);
+    RecordStage("nms1", winList_.size(), start);
+
+    Stage2(imgPad, img180, net_[1], classThreshold_[1], 24, winList_, stageList_);
+    std::swap(winList_, stageList_);
+    RecordStage("stage2", winList_.size(), start);
+    NMS(winList_, true, nmsThreshold_[1], nmsFlags_);
+    RecordStage("nms2", winList_.size(), start);
+
+    Stage3(imgPad, img180, img90, imgNeg90, net_[2], classThreshold_[2], 48, winList_, stageList_);
+    std::swap(winList_, stageList_);
+    RecordStage("stage3", winList_.size(), start);
+    NMS(winList_, false, nmsThreshold_[2], nmsFlags_);
+    DeleteFP(winList_, nmsFlags_);
+    RecordStage("nms3", winList_.size(), start);
+    return winList_;
 }
 
-std::vector<Window2> Impl::Track(
-    const cv::Mat& img, cv::dnn::Net& net, float thres, int dim, std::vector<Window2>& winList) const
+void Impl::Track(
+    const cv::Mat& img,
+    cv::dnn::Net& net,
+    float thres,
+    int dim,
+    const std::vector<Window2>& winList,
+    std::vector<Window2>& ret)
 {
-    std::vector<cv::String> outputBlobNames = { "bbox_reg", "cls_prob", "points_reg", "rotate_reg" };
+    static const std::vector<cv::String> outputBlobNames = { "bbox_reg", "cls_prob", "points_reg", "rotate_reg" };
 
+    ret.clear();
     if (winList.empty())
-        return winList;
-    std::vector<Window> tmpWinList;
+        return;
+    std::vector<Window>& tmpWinList = trackWindows_;
+    tmpWinList.clear();
     for (const Window2& window : winList) {
-        Window win(
+        tmpWinList.emplace_back(
             static_cast<int>(floor(static_cast<float>(window.x) - augScale_ * static_cast<float>(window.w))),
             static_cast<int>(floor(static_cast<float>(window.y) - augScale_ * static_cast<float>(window.w))),
             static_cast<int>(ceil(static_cast<float>(window.w) + 2 * augScale_ * static_cast<float>(window.w))),
             static_cast<int>(round(window.angle)),
             window.conf,
             window.points14);
-        tmpWinList.push_back(win);
     }
-    std::vector<cv::Mat> dataList;
-    dataList.reserve(tmpWinList.size());
+    std::vector<cv::Mat>& dataList = dataList_;
+    dataList.clear();
     for (Window& tmp : tmpWinList) {
-        dataList.push_back(PreProcessImg(CropFace(img, tmp, dim), dim));
+        dataList.push_back(frame_arena_mat(arena_, dim, dim, img.type()));
+        CropFace(img, tmp, dim, dataList.back());
     }
 
-    std::vector<cv::Mat> outputBlobs;
-
-    std::vector<Window2> ret;
+    std::vector<cv::Mat>& outputBlobs = outputBlobs_;
 
+    cv::Mat& inputBlob = NewBlob(dim, dim);
     for (size_t i = 0; i < tmpWinList.size(); i++) {
-        cv::Mat inputBlob = cv::dnn::blobFromImage(dataList[i], 1.0, cv::Size(), cv::Scalar(), false, false);
+        ImageToBlob(dataList[i], mean_, inputBlob);
 
-        net.setInput(inputBlob);
-        net.forward(outputBlobs, outputBlobNames);
+        {
+            BlurTraceSpan span("dnn", "forward-track");
+            net.setInput(inputBlob);
+            net.forward(outputBlobs, outputBlobNames);
+        }
 
         auto regression
             = cv::Mat(outputBlobs[0].size[1], outputBlobs[0].size[0], CV_32F, outputBlobs[0].ptr<float>(0, 0));
@@ -859,7 +1075,6 @@ std::vector<Window2> Impl::Track(
             }
         }
     }
-    return ret;
 }
 
 cv::Point RotatePoint(float x, float y, const float centerX, const float centerY, const float angle)
@@ -872,6 +1087,33 @@ cv::Point RotatePoint(float x, float y, const float centerX, const float centerY
     return { rx, ry };
 }
 
+void ImageToBlob(const cv::Mat& img, const cv::Scalar& mean, cv::Mat& blob)
+{
+    CV_Assert(img.type() == CV_8UC3 && blob.isContinuous());
+    const size_t plane = img.total();
+    const auto cols = static_cast<size_t>(img.cols);
+    const float pixelMean[3] = { static_cast<float>(mean[0]), static_cast<float>(mean[1]), static_cast<float>(mean[2]) };
+    auto* out = blob.ptr<float>();
+    for (int y = 0; y < img.rows; y++) {
+        const auto* row = img.ptr<cv::Vec3b>(y);
+        float* dst = out + static_cast<size_t>(y) * cols;
+        for (size_t x = 0; x < cols; x++) {
+            for (size_t c = 0; c < 3; c++)
+                dst[c * plane + x] = static_cast<float>(row[x][static_cast<int>(c)]) - pixelMean[c];
+        }
+    }
+}
+
+cv::Matx23d AffineTransform(const cv::Point2f src[], const cv::Point2f dst[])
+{
+    const cv::Matx33d inverse
+        = cv::Matx33d(src[0].x, src[0].y, 1, src[1].x, src[1].y, 1, src[2].x, src[2].y, 1).inv(cv::DECOMP_LU);
+    const cv::Vec3d x = inverse * cv::Vec3d(dst[0].x, dst[1].x, dst[2].x);
+    const cv::Vec3d y = inverse * cv::Vec3d(dst[0].y, dst[1].y, dst[2].y);
+
+    return { x[0], x[1], x[2], y[0], y[1], y[2] };
+}
+
 void DrawLine(cv::Mat img, const std::vector<cv::Point>& pointList)
 {
     constexpr int width = 2;
@@ -918,6 +1160,13 @@ void DrawPoints(cv::Mat img, const Window& face)
 }
 
 cv::Mat CropFace(const cv::Mat& img, const Window& face, const int cropSize)
+{
+    cv::Mat ret;
+    CropFace(img, face, cropSize, ret);
+    return ret;
+}
+
+void CropFace(const cv::Mat& img, const Window& face, const int cropSize, cv::Mat& crop)
 {
     const auto x1 = static_cast<float>(face.x);
     const auto y1 = static_cast<float>(face.y);
@@ -933,8 +1182,5 @@ cv::Mat CropFace(const cv::Mat& img, const Window& face, const int cropSize)
     dstTriangle[0] = cv::Point(0, 0);
     dstTriangle[1] = cv::Point(0, cropSize - 1);
     dstTriangle[2] = cv::Point(cropSize - 1, cropSize - 1);
-    const cv::Mat rotMat = getAffineTransform(srcTriangle, dstTriangle);
-    cv::Mat ret;
-    warpAffine(img, ret, rotMat, cv::Size(cropSize, cropSize));
-    return ret;
+    warpAffine(img, crop, AffineTransform(srcTriangle, dstTriangle), cv::Size(cropSize, cropSize));
 }
@@ -28,6 +28,8 @@
 #define RED CV_RGB(255, 0, 0)
 #define PURPLE CV_RGB(139, 0, 255)
 
+class FrameArena;
+
 struct Window {
     int x, y, width, angle;
     float score;
@@ -44,10 +46,35 @@ struct Window {
 };
 
 cv::Point RotatePoint(float x, float y, float centerX, float centerY, float angle);
+/// the mean the networks' inputs have taken off each pixel, in BGR order
+#define PCN_MEAN cv::Scalar(104, 117, 123)
+/// img (8 bit BGR) less mean, written into blob (a continuous 1 x 3 x rows x cols
+/// float blob) as its planes: what blobFromImage() makes of img converted to
+/// float with mean subtracted, without the intermediate images
+void ImageToBlob(const cv::Mat& img, const cv::Scalar& mean, cv::Mat& blob);
+/// the affine transform taking src[0..2] to dst[0..2], as getAffineTransform()
+/// finds it, but without allocating a Mat for it
+cv::Matx23d AffineTransform(const cv::Point2f src[], const cv::Point2f dst[]);
 void DrawLine(cv::Mat img, const std::vector<cv::Point>&& pointList);
 void DrawFace(const cv::Mat& img, const Window& face);
 void DrawPoints(cv::Mat img, const Window& face);
 cv::Mat CropFace(const cv::Mat& img, const Window& face, int cropSize);
+/// as CropFace(), into crop (which is written in place if it is already cropSize square)
+void CropFace(const cv::Mat& img, const Window& face, int cropSize, cv::Mat& crop);
+
+/* Time taken by one stage of detection, and the candidate windows left after it */
+struct PCNStageTiming {
+    std::string name;
+    double seconds;
+    size_t windows;
+};
+
+/* Filled in by Detect() while set with PCN::SetStats(): the stages it ran, and
+ * how many levels of the image pyramid Stage1 searched */
+struct PCNStats {
+    std::vector<PCNStageTiming> stages;
+    int pyramid_levels = 0;
+};
 
 class PCN {
 public:
@@ -57,16 +84,34 @@ public:
         const std::string& net3,
         const std::string& modelTrack,
         const std::string& netTrack);
+    ~PCN();
+    PCN(const PCN&) = delete;
+    PCN& operator=(const PCN&) = delete;
+    /// memory: the weights are charged to MemoryUse::MODELS while it lives, and
+    /// Detect()'s working images and activations to MemoryUse::SCRATCH while it runs
     /// detection
     void SetMinFaceSize(int minFace);
     void SetDetectionThresh(float thresh1, float thresh2, float thresh3);
     void SetImagePyramidScaleFactor(float factor);
     [[nodiscard]] std::vector<Window> Detect(const cv::Mat& img);
+    /// as Detect(), into faces, reusing its storage and the detector's working
+    /// lists so that a stream of similar frames doesn't allocate
+    void Detect(const cv::Mat& img, std::vector<Window>& faces);
     /// tracking
     void SetTrackingPeriod(int period);
     void SetTrackingThresh(float thresh);
     void SetVideoSmooth(bool smooth);
     [[nodiscard]] std::vector<Window> DetectTrack(const cv::Mat& img);
+    /// instrumentation: Detect() adds its stages to stats while it is set (nullptr to stop)
+    void SetStats(PCNStats* stats);
+    /// working memory: Detect() takes its padded image, rotations, pyramid, blobs and
+    /// window crops from arena while it is set (nullptr for the heap), and gives them
+    /// back as it returns
+    void SetArena(FrameArena* arena);
+    /// benchmarking: run Detect(), timing each of its stages (prepare, stage1,
+    /// nms1, stage2, nms2, stage3, nms3), then a tracking pass over the faces
+    /// found (track)
+    [[nodiscard]] std::vector<PCNStageTiming> DetectStages(const cv::Mat& img);
 
 private:
     void* impl_;
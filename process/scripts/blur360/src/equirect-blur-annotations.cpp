@@ -0,0 +1,139 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <tuple>
+
+#include "equirect-blur-annotations.h"
+
+static bool parse_image(const std::string& line, AnnotatedImage& image)
+{
+    try {
+        const cv::FileStorage fs(line, cv::FileStorage::READ | cv::FileStorage::MEMORY | cv::FileStorage::FORMAT_JSON);
+        if (!fs.isOpened() || fs["file"].empty())
+            return false;
+
+        image.file = static_cast<std::string>(fs["file"]);
+        for (const cv::FileNode& node : fs["faces"]) {
+            image.faces.push_back({
+                static_cast<double>(node["longitude"]),
+                static_cast<double>(node["latitude"]),
+                static_cast<double>(node["width"]),
+                static_cast<double>(node["height"]),
+            });
+        }
+    }
+    catch (const cv::Exception& e) {
+        std::cerr << "Failed to parse annotations: " << e.what() << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool AnnotationReader::load(const std::string& path)
+{
+    std::ifstream in(path);
+    if (!in.is_open()) {
+        std::cerr << "Can't open annotations file " << path << std::endl;
+        return false;
+    }
+
+    std::string line;
+    int line_no = 0;
+    while (std::getline(in, line)) {
+        line_no++;
+        if (line.empty())
+            continue;
+
+        AnnotatedImage image;
+        if (!parse_image(line, image)) {
+            std::cerr << "Invalid annotations at " << path << ":" << line_no << std::endl;
+            return false;
+        }
+
+        by_file_[image.file] = images_.size();
+        images_.push_back(std::move(image));
+    }
+
+    return true;
+}
+
+const std::vector<AnnotatedImage>& AnnotationReader::images() const
+{
+    return images_;
+}
+
+const AnnotatedImage* AnnotationReader::find_file(const std::string& file) const
+{
+    const auto it = by_file_.find(file);
+    return it != by_file_.end() ? &images_[it->second] : nullptr;
+}
+
+/* Unit vector towards a longitude and latitude in degrees */
+static cv::Vec3d direction(const double longitude, const double latitude)
+{
+    const double lon = longitude * M_PI / 180, lat = latitude * M_PI / 180;
+    return { cos(lat) * cos(lon), cos(lat) * sin(lon), sin(lat) };
+}
+
+/* Angle between two unit vectors, in degrees */
+static double angle_between(const cv::Vec3d& a, const cv::Vec3d& b)
+{
+    return acos(CLAMP(a.dot(b), -1.0, 1.0)) * 180 / M_PI;
+}
+
+/* Where a detection is on the sphere: the mean direction of its equirect rects'
+ * centres weighted by their areas, so a face split across the frame's left and
+ * right edges lands where it is rather than in the middle of the frame */
+static cv::Vec3d detection_centre(const FaceDetection& face, const cv::Size& size)
+{
+    cv::Vec3d sum(0, 0, 0);
+    for (const cv::Rect& rect : face.equ_rects) {
+        const double x = rect.x + rect.width / 2.0, y = rect.y + rect.height / 2.0;
+        sum += direction(x / size.width * 360 - 180, 90 - y / size.height * 180) * static_cast<double>(rect.area());
+    }
+    const double length = cv::norm(sum);
+    return length > 0 ? sum / length : sum;
+}
+
+AnnotatedFace equirect_blur_annotate_detection(const FaceDetection& face, const cv::Size& size)
+{
+    const cv::Vec3d centre = detection_centre(face, size);
+    int height = 0;
+    for (const cv::Rect& rect : face.equ_rects)
+        height = MAX(height, rect.height);
+    const double angular_height = height * 180.0 / size.height;
+
+    return {
+        atan2(centre[1], centre[0]) * 180 / M_PI,
+        asin(CLAMP(centre[2], -1.0, 1.0)) * 180 / M_PI,
+        angular_height,
+        angular_height,
+    };
+}
+
+size_t equirect_blur_match_faces(
+    const std::vector<AnnotatedFace>& annotated, const std::vector<FaceDetection>& detected, const cv::Size& size)
+{
+    std::vector<std::tuple<double, size_t, size_t>> pairs; /* Angle, annotated face, detection */
+    for (size_t d = 0; d < detected.size(); d++) {
+        const cv::Vec3d centre = detection_centre(detected[d], size);
+        for (size_t a = 0; a < annotated.size(); a++) {
+            const double angle = angle_between(centre, direction(annotated[a].longitude, annotated[a].latitude));
+            if (angle <= MAX(annotated[a].width, annotated[a].height) / 2)
+                pairs.emplace_back(angle, a, d);
+        }
+    }
+    std::sort(pairs.begin(), pairs.end());
+
+    std::vector<bool> annotated_used(annotated.size()), detected_used(detected.size());
+    size_t matched = 0;
+    for (const auto& [angle, a, d] : pairs) {
+        if (annotated_used[a] || detected_used[d])
+            continue;
+        annotated_used[a] = detected_used[d] = true;
+        matched++;
+    }
+    return matched;
+}
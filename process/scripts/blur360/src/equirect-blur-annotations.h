@@ -0,0 +1,47 @@
+#pragma once
+
+#include "equirect-blur-common.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+/* A face annotated on the sphere: the centre of its box, and the box's angular
+ * width and height, in degrees */
+struct AnnotatedFace {
+    double longitude; /* -180 to 180, left to right across the equirect frame */
+    double latitude;
+    double width;
+    double height;
+};
+
+/* The faces in one image. Annotation files store one image per line as a JSON
+ * object:
+ *
+ * {"file":"IMG_0012.jpg","faces":[{"longitude":-31.5,"latitude":4.25,"width":2.5,"height":3}]} */
+struct AnnotatedImage {
+    std::string file;
+    std::vector<AnnotatedFace> faces;
+};
+
+class AnnotationReader {
+public:
+    bool load(const std::string& path);
+
+    [[nodiscard]] const std::vector<AnnotatedImage>& images() const;
+    [[nodiscard]] const AnnotatedImage* find_file(const std::string& file) const;
+
+private:
+    std::vector<AnnotatedImage> images_;
+    std::map<std::string, size_t> by_file_;
+};
+
+/* A detection in a frame of size as an annotation: where it is on the sphere,
+ * and the angular height of its equirect rects for both width and height */
+AnnotatedFace equirect_blur_annotate_detection(const FaceDetection& face, const cv::Size& size);
+
+/* Pair detections in a frame of size with annotated faces one to one, nearest
+ * first, where the detection's centre is within half the annotated box's larger
+ * side of the box's centre. Returns the number of pairs */
+size_t equirect_blur_match_faces(
+    const std::vector<AnnotatedFace>& annotated, const std::vector<FaceDetection>& detected, const cv::Size& size);
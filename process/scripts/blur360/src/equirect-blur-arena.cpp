@@ -0,0 +1,122 @@
+#include "equirect-blur-arena.h"
+
+#include <atomic>
+
+/* Allocations are aligned as cv::fastMalloc() aligns them, for the SIMD loops */
+#define ARENA_ALIGNMENT 64
+
+/* Smallest block taken from the heap */
+#define ARENA_MIN_BLOCK (1 << 20)
+
+static std::atomic<uint64_t> arena_fallbacks { 0 };
+
+static size_t align_up(const size_t bytes)
+{
+    return (bytes + ARENA_ALIGNMENT - 1) & ~static_cast<size_t>(ARENA_ALIGNMENT - 1);
+}
+
+void* FrameArena::allocate(size_t bytes)
+{
+    bytes = align_up(MAX(bytes, static_cast<size_t>(1)));
+
+    /* Move on to the next block with room, past any too small */
+    while (block_ < blocks_.size() && used_ + bytes > blocks_[block_].size) {
+        block_++;
+        used_ = 0;
+    }
+    if (block_ == blocks_.size()) {
+        /* At least double the arena, so a frame that outgrows it takes few blocks */
+        add_block(MAX(MAX(bytes, capacity()), static_cast<size_t>(ARENA_MIN_BLOCK)));
+    }
+
+    uint8_t* base = blocks_[block_].data.get();
+    base += (ARENA_ALIGNMENT - reinterpret_cast<uintptr_t>(base) % ARENA_ALIGNMENT) % ARENA_ALIGNMENT;
+    void* memory = base + used_;
+    used_ += bytes;
+    return memory;
+}
+
+cv::Mat FrameArena::mat(const int rows, const int cols, const int type)
+{
+    const size_t bytes = static_cast<size_t>(MAX(rows, 0)) * static_cast<size_t>(MAX(cols, 0)) * CV_ELEM_SIZE(type);
+    return { rows, cols, type, allocate(bytes) };
+}
+
+cv::Mat FrameArena::mat(const int dims, const int* sizes, const int type)
+{
+    size_t bytes = CV_ELEM_SIZE(type);
+    for (int i = 0; i < dims; i++)
+        bytes *= static_cast<size_t>(MAX(sizes[i], 0));
+    return { dims, sizes, type, allocate(bytes) };
+}
+
+void FrameArena::reset()
+{
+    block_ = 0;
+    used_ = 0;
+
+    /* One block holding what the last frames needed keeps the next ones in it */
+    if (blocks_.size() > 1) {
+        const size_t size = capacity();
+        blocks_.clear();
+        add_block(size);
+    }
+}
+
+void FrameArena::add_block(const size_t size)
+{
+    blocks_.push_back({ std::unique_ptr<uint8_t[]>(new uint8_t[size + ARENA_ALIGNMENT]), size });
+    heap_allocations_++;
+    charge_.set(capacity());
+}
+
+size_t FrameArena::capacity() const
+{
+    size_t bytes = 0;
+    for (const Block& block : blocks_)
+        bytes += block.size;
+    return bytes;
+}
+
+uint64_t FrameArena::heap_allocations() const
+{
+    return heap_allocations_;
+}
+
+FrameArena::Scope::Scope(FrameArena* arena)
+    : arena_(arena)
+{
+    if (arena_ != nullptr) {
+        block_ = arena_->block_;
+        used_ = arena_->used_;
+    }
+}
+
+FrameArena::Scope::~Scope()
+{
+    if (arena_ != nullptr) {
+        arena_->block_ = block_;
+        arena_->used_ = used_;
+    }
+}
+
+cv::Mat frame_arena_mat(FrameArena* arena, const int rows, const int cols, const int type)
+{
+    if (arena != nullptr)
+        return arena->mat(rows, cols, type);
+    arena_fallbacks++;
+    return { rows, cols, type };
+}
+
+cv::Mat frame_arena_mat(FrameArena* arena, const int dims, const int* sizes, const int type)
+{
+    if (arena != nullptr)
+        return arena->mat(dims, sizes, type);
+    arena_fallbacks++;
+    return { dims, sizes, type };
+}
+
+uint64_t frame_arena_fallbacks()
+{
+    return arena_fallbacks;
+}
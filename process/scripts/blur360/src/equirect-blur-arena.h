@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "equirect-blur-memory.h"
+
+/* Memory for the working images of one frame (the detector's padded image,
+ * rotations, pyramid levels, blobs and window crops, and the obscuring's face
+ * images and write back maps), handed out as cv::Mat headers over blocks the
+ * arena keeps between frames. Each worker owns one, and isn't shared between
+ * threads.
+ *
+ * Mats from the arena don't own their pixels: they are only valid until the
+ * Scope they were made in ends, or the arena is reset. OpenCV functions given
+ * one as their output write into it as long as its size and type are what they
+ * would create.
+ *
+ * When a frame needs more than the arena holds it takes another block from the
+ * heap, and reset() then replaces the blocks with one that holds them all, so
+ * once frames stop growing the arena stops allocating */
+class FrameArena {
+public:
+    FrameArena() = default;
+    FrameArena(const FrameArena&) = delete;
+    FrameArena& operator=(const FrameArena&) = delete;
+
+    /* Uninitialised memory, until the enclosing Scope ends */
+    void* allocate(size_t bytes);
+    [[nodiscard]] cv::Mat mat(int rows, int cols, int type);
+    [[nodiscard]] cv::Mat mat(int dims, const int* sizes, int type);
+
+    /* Release everything, at the start of a frame */
+    void reset();
+
+    /* Bytes held, and the number of blocks taken from the heap since the arena was made */
+    [[nodiscard]] size_t capacity() const;
+    [[nodiscard]] uint64_t heap_allocations() const;
+
+    /* Memory allocated from the arena while a Scope lives is released when it
+     * ends. A null arena makes it do nothing */
+    class Scope {
+    public:
+        explicit Scope(FrameArena* arena);
+        ~Scope();
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        FrameArena* arena_;
+        size_t block_ = 0;
+        size_t used_ = 0;
+    };
+
+private:
+    struct Block {
+        std::unique_ptr<uint8_t[]> data;
+        size_t size;
+    };
+
+    void add_block(size_t size);
+
+    std::vector<Block> blocks_;
+    size_t block_ = 0; /* Block being allocated from */
+    size_t used_ = 0; /* Bytes of it in use */
+    uint64_t heap_allocations_ = 0;
+    MemoryCharge charge_ { MemoryUse::SCRATCH };
+};
+
+/* A Mat from arena, or an ordinary one if arena is null */
+cv::Mat frame_arena_mat(FrameArena* arena, int rows, int cols, int type);
+cv::Mat frame_arena_mat(FrameArena* arena, int dims, const int* sizes, int type);
+
+/* Mats frame_arena_mat() has taken from the heap for want of an arena, across
+ * all threads since the program started. Frame functions given a FrameScratch
+ * should never add to it */
+uint64_t frame_arena_fallbacks();
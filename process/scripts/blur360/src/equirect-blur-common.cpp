@@ -1,7 +1,13 @@
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 
 #include "equirect-blur-common.h"
+#include "equirect-blur-shared.h"
+#include "equirect-blur-sphere.h"
+#include "equirect-blur-stats.h"
+#include "equirect-blur-trace.h"
 
 #define DEG2RAD(d) ((d) * M_PI / 180.0f)
 #define RAD2DEG(r) (180.0f * (r) / M_PI)
@@ -19,7 +25,7 @@ cv::Mat Projection::eulerYZrotation(const double lambda, const double phi)
     return R_y * R_z;
 }
 
-static cv::Vec2f calculate_source_uv(const double u, const double v, const cv::Mat& rot_mat)
+static cv::Vec2f calculate_source_uv(const double u, const double v, const cv::Matx33d& rot_mat)
 {
     /* Convert to cartesian for rotation */
     cv::Vec3d target_xyz;
@@ -27,11 +33,11 @@ static cv::Vec2f calculate_source_uv(const double u, const double v, const cv::M
     target_xyz[1] = sin(u) * sin(v);
     target_xyz[2] = cos(u);
 
-    cv::Mat source_xyz = rot_mat * target_xyz;
+    const cv::Vec3d source_xyz = rot_mat * target_xyz;
 
     cv::Vec2d source_uv;
-    source_uv[0] = atan2(source_xyz.at<double>(1), -source_xyz.at<double>(0));
-    source_uv[1] = acos(source_xyz.at<double>(2));
+    source_uv[0] = atan2(source_xyz[1], -source_xyz[0]);
+    source_uv[1] = acos(source_xyz[2]);
 
     if (source_uv[0] < 0)
         source_uv[0] += 2 * M_PI;
@@ -44,7 +50,7 @@ static cv::Vec2f calculate_source_uv(const double u, const double v, const cv::M
 static cv::Vec2f calculate_source_xy(
     const double u,
     const double v,
-    const cv::Mat& rot_mat,
+    const cv::Matx33d& rot_mat,
     const int x_offset,
     const int y_offset,
     const int in_width,
@@ -62,16 +68,18 @@ static cv::Vec2f calculate_source_xy(
     return src_pixel;
 }
 
-void Projection::create_subregion_map()
+void Projection::create_subregion_map(const MapPrecision precision)
 {
     int in_width = this->equ_size.width;
     int in_height = this->equ_size.height;
-    int tmp_width = static_cast<int>(round(static_cast<float>(in_width) * this->cropped_aperture[0] / (2 * M_PI)));
-    int tmp_height = static_cast<int>(round(static_cast<float>(in_height) * this->cropped_aperture[1] / M_PI));
+    const cv::Size tmp_size = view_size_for(this->equ_size, this->cropped_aperture);
+    int tmp_width = tmp_size.width;
+    int tmp_height = tmp_size.height;
 
     double u, v;
 
     this->e2pMap = cv::Mat(tmp_height, tmp_width, CV_32FC2);
+    const cv::Matx33d rot = this->p2eRot;
 
 #if 0
     cout << "Creating map phi=" << projection.phi << " lambda=" << projection.lambda << endl;
@@ -89,59 +97,205 @@ void Projection::create_subregion_map()
             v = x_h * this->cropped_aperture[0] + M_PI;
             u = y_h * this->cropped_aperture[1] + M_PI / 2;
 
-            this->e2pMap.at<cv::Vec2f>(y, x) = calculate_source_xy(u, v, this->p2eRot, 0, 0, in_width, in_height);
+            this->e2pMap.at<cv::Vec2f>(y, x) = calculate_source_xy(u, v, rot, 0, 0, in_width, in_height);
         }
     }
+
+    if (precision == MapPrecision::FIXED) {
+        cv::convertMaps(this->e2pMap, cv::noArray(), this->e2pFixed[0], this->e2pFixed[1], CV_16SC2);
+        this->e2pMap.release();
+    }
 }
 
-/* Given an ROI on the full source image, in image coordinates,
- * calculate a map from the cropped projection into the full image */
-static cv::Mat create_roi_map_to_equ(
-    const Projection& projection, const cv::Mat& image, const cv::Mat& tmp_image, cv::Rect& roi)
+cv::Size Projection::view_size_for(const cv::Size& im_size, const float cropped_aperture[2])
 {
-    const int in_width = image.cols;
-    const int in_height = image.rows;
-    const int tmp_width = tmp_image.cols;
-    const int tmp_height = tmp_image.rows;
+    return {
+        static_cast<int>(round(static_cast<float>(im_size.width) * cropped_aperture[0] / (2 * M_PI))),
+        static_cast<int>(round(static_cast<float>(im_size.height) * cropped_aperture[1] / M_PI)),
+    };
+}
 
-    auto ret = cv::Mat(roi.height, roi.width, CV_32FC2);
-    const cv::Mat e2pRot = projection.p2eRot.t();
+void Projection::remap_view(const cv::Mat& image, cv::Mat& out, const cv::Rect& area) const
+{
+    const cv::Rect view = area.empty() ? cv::Rect(cv::Point(0, 0), this->view_size()) : area;
+    if (!this->e2pMap.empty())
+        remap(image, out, this->e2pMap(view), cv::noArray(), cv::INTER_LINEAR, cv::BORDER_WRAP);
+    else
+        remap(image, out, this->e2pFixed[0](view), this->e2pFixed[1](view), cv::INTER_LINEAR, cv::BORDER_WRAP);
+}
 
-    /* Offset for cropped image x/y */
-    const int x_offset = -(in_width - tmp_width) / 2;
-    const int y_offset = -(in_height - tmp_height) / 2;
+size_t Projection::map_bytes() const
+{
+    return this->e2pMap.total() * this->e2pMap.elemSize() + this->e2pFixed[0].total() * this->e2pFixed[0].elemSize()
+        + this->e2pFixed[1].total() * this->e2pFixed[1].elemSize();
+}
 
-    for (int y = 0; y < roi.height; y++) {
-        for (int x = 0; x < roi.width; x++) {
-            /* Calculate the U/V lat/long of the ROI pixel in the source frame */
-            const float x_h = static_cast<float>(x + roi.x) / static_cast<float>(in_width - 1) - 0.5f;
-            const float y_h = static_cast<float>(y + roi.y) / static_cast<float>(in_height - 1) - 0.5f;
+cv::Mat2f equirect_cube_face_map(const cv::Size& equ_size, const CubeFace face, const int face_size)
+{
+    const cv::Matx33d identity = cv::Matx33d::eye();
+    cv::Mat2f map(face_size, face_size);
+
+#pragma omp parallel for // NOLINT(*-use-default-none)
+    for (int y = 0; y < face_size; y++) {
+        for (int x = 0; x < face_size; x++) {
+            /* Position on the face, -1 to 1 rightwards and upwards */
+            const double a = 2.0 * (x + 0.5) / face_size - 1.0;
+            const double b = 1.0 - 2.0 * (y + 0.5) / face_size;
+
+            /* View direction as right/up/forward, where forward is the centre of the equirect */
+            cv::Vec3d dir;
+            switch (face) {
+            case CubeFace::FRONT:
+                dir = { a, b, 1 };
+                break;
+            case CubeFace::BACK:
+                dir = { -a, b, -1 };
+                break;
+            case CubeFace::UP:
+                dir = { a, 1, -b };
+                break;
+            case CubeFace::DOWN:
+                dir = { a, -1, b };
+                break;
+            case CubeFace::LEFT:
+                dir = { -1, b, a };
+                break;
+            case CubeFace::RIGHT:
+                dir = { 1, b, -a };
+                break;
+            }
+            dir /= cv::norm(dir);
 
-            /* Convert to radians */
-            double v = x_h * 2 * M_PI + M_PI;
-            double u = y_h * M_PI + M_PI / 2;
+            /* Convert to the U/V angles used by the projections, which have
+             * forward along +x, right along -y and up along +z */
+            const double u = acos(dir[1]);
+            const double v = atan2(-dir[0], -dir[2]);
 
-            // Rotated UV in cropped image
-            cv::Vec2f target = calculate_source_xy(u, v, e2pRot, x_offset, y_offset, in_width, in_height);
-            ret.at<cv::Vec2f>(y, x) = target;
+            map(y, x) = calculate_source_xy(u, v, identity, 0, 0, equ_size.width, equ_size.height);
+        }
+    }
 
-#if 0
-          cout << "x " << x + roi.x << ", y " << y + roi.y <<
-              " U = " << u << " (" << RAD2DEG(u) << ") V = " << v << " (" << RAD2DEG(v) << ") -> x " <<
-              target[0] << " y " << target[1] << endl;
-#endif
+    return map;
+}
+
+std::string equirect_blur_obscure_name(const ObscureOptions& obscure)
+{
+    std::string name;
+    if (obscure.draw_over_faces)
+        name = "rect";
+    else if (obscure.filter == ObscureFilter::GAUSSIAN && obscure.radius <= 0 && !obscure.direct)
+        name = "blur";
+    else
+        name = cv::format(
+            "%s-%g",
+            equirect_blur_filter_name(obscure.filter),
+            obscure.radius > 0 ? obscure.radius : DEFAULT_FILTER_RADIUS);
+
+    return name + (obscure.direct ? "-direct" : "");
+}
+
+/* Merge rects in the equirect frame (already split where they cross its edges)
+ * into spans that cover each pixel in them once, in row order */
+static void rects_to_spans(const std::vector<cv::Rect>& rects, const cv::Size& size, std::vector<RowSpan>& spans)
+{
+    spans.clear();
+    for (const cv::Rect& rect : rects) {
+        const cv::Rect clipped = rect & cv::Rect(0, 0, size.width, size.height);
+        for (int y = clipped.y; y < clipped.y + clipped.height; y++)
+            spans.push_back({ y, clipped.x, clipped.x + clipped.width });
+    }
+    std::sort(spans.begin(), spans.end(), [](const RowSpan& a, const RowSpan& b) {
+        return a.y != b.y ? a.y < b.y : a.x0 < b.x0;
+    });
+
+    size_t merged = 0;
+    for (size_t i = 0; i < spans.size(); i++) {
+        if (merged > 0 && spans[merged - 1].y == spans[i].y && spans[i].x0 <= spans[merged - 1].x1)
+            spans[merged - 1].x1 = MAX(spans[merged - 1].x1, spans[i].x1);
+        else
+            spans[merged++] = spans[i];
+    }
+    spans.resize(merged);
+}
+
+/* Remapped pixels are laid out this many to a row, within cv::remap()'s size limits */
+#define WRITE_BACK_COLUMNS 4096
+
+/* Copy the spans of the equirect frame back from a projection's cropped view.
+ * The spans' pixels are packed one after another into a buffer, so a single
+ * map and a single remap() cover them all however they are spread over the
+ * frame. Pixels that map outside the cropped view are left alone */
+static void write_back_spans(
+    const Projection& projection,
+    cv::Mat& equ_image,
+    const cv::Mat& cropped_image,
+    const std::vector<RowSpan>& spans,
+    std::vector<size_t>& offsets,
+    FrameArena* arena)
+{
+    offsets.assign(spans.size() + 1, 0);
+    for (size_t i = 0; i < spans.size(); i++)
+        offsets[i + 1] = offsets[i] + (spans[i].x1 - spans[i].x0);
+    const size_t total = offsets.back();
+    if (total == 0)
+        return;
+
+    const int cols = static_cast<int>(MIN(total, static_cast<size_t>(WRITE_BACK_COLUMNS)));
+    const int rows = static_cast<int>((total + cols - 1) / cols);
+    const FrameArena::Scope scope(arena);
+    cv::Mat map = frame_arena_mat(arena, rows, cols, CV_32FC2);
+    map.setTo(cv::Scalar(-1, -1));
+    cv::Mat pixels = frame_arena_mat(arena, rows, cols, equ_image.type());
+
+    const int in_width = equ_image.cols;
+    const int in_height = equ_image.rows;
+    const cv::Matx33d p2eRot = projection.p2eRot;
+    const cv::Matx33d e2pRot = p2eRot.t();
+
+    /* Offset for cropped image x/y */
+    const int x_offset = -(in_width - cropped_image.cols) / 2;
+    const int y_offset = -(in_height - cropped_image.rows) / 2;
+
+    const size_t pixel_size = equ_image.elemSize();
+    auto* map_data = map.ptr<cv::Vec2f>();
+
+#pragma omp parallel for // NOLINT(*-use-default-none)
+    for (int i = 0; i < static_cast<int>(spans.size()); i++) {
+        const RowSpan& span = spans[i];
+
+        /* Calculate the U/V lat/long of each pixel in the source frame, rotated into the cropped view */
+        const float y_h = static_cast<float>(span.y) / static_cast<float>(in_height - 1) - 0.5f;
+        const double u = y_h * M_PI + M_PI / 2;
+        for (int x = span.x0; x < span.x1; x++) {
+            const float x_h = static_cast<float>(x) / static_cast<float>(in_width - 1) - 0.5f;
+            const double v = x_h * 2 * M_PI + M_PI;
+            map_data[offsets[i] + (x - span.x0)]
+                = calculate_source_xy(u, v, e2pRot, x_offset, y_offset, in_width, in_height);
         }
+
+        /* Start from the frame's pixels, for any that map outside the cropped view */
+        memcpy(pixels.data + offsets[i] * pixel_size,
+               equ_image.ptr(span.y) + span.x0 * pixel_size,
+               (span.x1 - span.x0) * pixel_size);
     }
 
-    return ret;
+    remap(cropped_image, pixels, map, cv::noArray(), cv::INTER_LINEAR, cv::BORDER_TRANSPARENT);
+
+    for (size_t i = 0; i < spans.size(); i++) {
+        const RowSpan& span = spans[i];
+        memcpy(equ_image.ptr(span.y) + span.x0 * pixel_size,
+               pixels.data + offsets[i] * pixel_size,
+               (span.x1 - span.x0) * pixel_size);
+    }
 }
+
 static void extract_subregion(const Projection& projection, const cv::Mat& image, cv::Mat& tmp_image)
 {
     // cout << "subregion size " << tmp_image.cols << " x " << tmp_image.rows << endl;
-    remap(image, tmp_image, projection.e2pMap, cv::noArray(), cv::INTER_LINEAR, cv::BORDER_WRAP);
+    projection.remap_view(image, tmp_image);
 }
 
-static cv::Rect blur_face(const cv::Mat& img, const Window& face, const bool draw_over_faces)
+static cv::Rect blur_face(const cv::Mat& img, const Window& face, const ObscureOptions& obscure, FrameArena* arena)
 {
     /* Calculate and extract a bounding rectangle around the
      * (rotated) face and extract it as a ROI from the cropped
@@ -216,8 +370,9 @@ static cv::Rect blur_face(const cv::Mat& img, const Window& face, const bool dra
 
     // cout << "ROI x " << roi.x << " y < " << roi.y << " w " << roi.width << " h " << roi.height << endl;
 
-    const cv::Mat rotMat = getAffineTransform(srcTriangle, dstTriangle);
+    const cv::Matx23d rotMat = AffineTransform(srcTriangle, dstTriangle);
     cv::Mat crop_roi = img(roi);
+    const FrameArena::Scope scope(arena);
     cv::Mat face_img;
 
 #if 0
@@ -230,17 +385,25 @@ static cv::Rect blur_face(const cv::Mat& img, const Window& face, const bool dra
     cv::line(face_img, dstTriangle[2], dstTriangle[3], GREEN, 3);
     cv::line(face_img, dstTriangle[3], dstTriangle[0], CYAN, 3);
 #elif 1
-    if (draw_over_faces) {
+    if (obscure.draw_over_faces) {
         /* Draw grey rectangle to obscure the face */
-        face_img = cv::Mat(dst_size_pixels, dst_size_pixels, img.type());
+        face_img = frame_arena_mat(arena, dst_size_pixels, dst_size_pixels, img.type());
         rectangle(
             face_img, cv::Point(0, 0), cv::Point(dst_size_pixels - 1, dst_size_pixels - 1), cv::Scalar(64, 64, 64), -1);
     }
     else {
         /* blur the face */
         if (crop_roi.rows != 0 && crop_roi.cols != 0) {
+            face_img = frame_arena_mat(arena, dst_size_pixels, dst_size_pixels, img.type());
             warpAffine(crop_roi, face_img, rotMat, cv::Size(dst_size_pixels, dst_size_pixels));
-            GaussianBlur(face_img, face_img, cv::Size(31, 31), 10);
+            if (obscure.filter == ObscureFilter::GAUSSIAN && obscure.radius <= 0) {
+                GaussianBlur(face_img, face_img, cv::Size(31, 31), 10);
+            }
+            else {
+                /* The padded face, 1.5 face widths across, fills face_img */
+                const double radius = obscure.radius > 0 ? obscure.radius : DEFAULT_FILTER_RADIUS;
+                equirect_obscure_filter(face_img, obscure.filter, cvRound(radius * dst_size / 1.5f));
+            }
         }
     }
 #elif 0
@@ -253,7 +416,7 @@ static cv::Rect blur_face(const cv::Mat& img, const Window& face, const bool dra
             face_img,
             crop_roi,
             rotMat,
-            cv::Size(crop_roi.rows, crop_roi.cols),
+            crop_roi.size(),
             cv::WARP_INVERSE_MAP | cv::INTER_LINEAR,
             cv::BORDER_TRANSPARENT);
     }
@@ -266,72 +429,116 @@ static cv::Rect blur_face(const cv::Mat& img, const Window& face, const bool dra
     return roi;
 }
 
-// We have faces to project back to the full frame
-// For each face, calculate bounding rectangles in the
-// equirect frame and generate a map back from the face ROI
-// to it. The reprojection may cross the edges of the image
-// and gets complicated
-static void project_faces_to_full_frame(Projection& projection, cv::Mat& equ_image, const cv::Mat& cropped_image)
-{
-    std::vector<cv::Rect> rects; /* ROI rects in the source frame */
-
-    for (size_t f = 0; f < projection.faces.size(); f++) {
-        cv::Rect roi = projection.faces[f];
-        cv::Point2f srcQuad[4];
-        cv::Point2f dstQuad[4];
-        srcQuad[0] = cv::Point(roi.x, roi.y);
-        srcQuad[1] = cv::Point(roi.x, roi.y + roi.height);
-        srcQuad[2] = cv::Point(roi.x + roi.width, roi.y + roi.height);
-        srcQuad[3] = cv::Point(roi.x + roi.width, roi.y);
-
-        // cout << "Face quad: " << endl;
-        for (int i = 0; i < 4; i++) {
-            int y = static_cast<int>(round(srcQuad[i].y));
-            int x = static_cast<int>(round(srcQuad[i].x));
-
-            auto p = projection.e2pMap.at<cv::Vec2f>(y, x);
-            dstQuad[i] = cv::Point2f(p[0], p[1]);
-            // cout << "  vertex " << i << " from " << x << ", " << y << " src image " << p[0] << ", " << p[1] << endl;
+/* Calculate the bounding rect(s) in the equirect frame of an ROI in the cropped
+ * projection. The reprojection may cross the edges of the image and need
+ * splitting into up to 4 rects */
+static void crop_roi_to_equ_rects(
+    const Projection& projection, const cv::Rect& roi, const cv::Size& equ_size, std::vector<cv::Rect>& rects)
+{
+    cv::Point2f srcQuad[4];
+    cv::Point2f dstQuad[4];
+    srcQuad[0] = cv::Point(roi.x, roi.y);
+    srcQuad[1] = cv::Point(roi.x, roi.y + roi.height);
+    srcQuad[2] = cv::Point(roi.x + roi.width, roi.y + roi.height);
+    srcQuad[3] = cv::Point(roi.x + roi.width, roi.y);
+
+    // cout << "Face quad: " << endl;
+    for (int i = 0; i < 4; i++) {
+        int y = static_cast<int>(round(srcQuad[i].y));
+        int x = static_cast<int>(round(srcQuad[i].x));
+
+        auto p = projection.source_point(x, y);
+        dstQuad[i] = cv::Point2f(p[0], p[1]);
+        // cout << "  vertex " << i << " from " << x << ", " << y << " src image " << p[0] << ", " << p[1] << endl;
+    }
+
+    const int min_x = static_cast<int>(floor(MIN(dstQuad[0].x, dstQuad[1].x)));
+    const int max_x = static_cast<int>(ceil(MAX(dstQuad[2].x, dstQuad[3].x)));
+
+    const int min_y = static_cast<int>(floor(MIN(dstQuad[0].y, dstQuad[3].y)));
+    const int max_y = static_cast<int>(ceil(MAX(dstQuad[1].y, dstQuad[2].y)));
+
+    /* The destination quad may cross edges and need to be split into up to 4 sub-quads and
+     * remapped */
+    if (min_x > max_x) {
+        if (min_y > max_y) {
+            /* Crossed both right and bottom edges - 4 quads */
+            rects.emplace_back(min_x, min_y, equ_size.width - 1 - min_x, equ_size.height - 1 - min_y);
+            rects.emplace_back(0, min_y, max_x, equ_size.height - 1 - min_y);
+            rects.emplace_back(min_x, 0, equ_size.width - 1 - min_x, max_y);
+            rects.emplace_back(0, 0, max_x, max_y);
+        }
+        else {
+            /* Crossed right edge */
+            rects.emplace_back(min_x, min_y, equ_size.width - 1 - min_x, max_y - min_y);
+            rects.emplace_back(0, min_y, max_x, max_y - min_y);
         }
+    }
+    else if (min_y > max_y) {
+        /* Crossed bottom edge */
+        rects.emplace_back(min_x, min_y, max_x - min_x, equ_size.height - 1 - min_y);
+        rects.emplace_back(min_x, 0, max_x - min_x, max_y);
+    }
+    else {
+        /* Just one quad */
+        rects.emplace_back(min_x, min_y, max_x - min_x, max_y - min_y);
+    }
+}
 
-        const int min_x = static_cast<int>(floor(MIN(dstQuad[0].x, dstQuad[1].x)));
-        const int max_x = static_cast<int>(ceil(MAX(dstQuad[2].x, dstQuad[3].x)));
+/* Axis-aligned bounding rect of a (rotated) face window, clipped to the image */
+static cv::Rect face_bounding_rect(const Window& face, const cv::Size& size)
+{
+    const auto x1 = static_cast<float>(face.x);
+    const auto y1 = static_cast<float>(face.y);
+    const auto x2 = static_cast<float>(face.x + face.width - 1);
+    const auto y2 = static_cast<float>(face.y + face.width - 1);
+    const float centerX = (x1 + x2) / 2;
+    const float centerY = (y1 + y2) / 2;
 
-        const int min_y = static_cast<int>(floor(MIN(dstQuad[0].y, dstQuad[3].y)));
-        const int max_y = static_cast<int>(ceil(MAX(dstQuad[1].y, dstQuad[2].y)));
+    const cv::Point corners[4] = {
+        RotatePoint(x1, y1, centerX, centerY, static_cast<float>(face.angle)),
+        RotatePoint(x1, y2, centerX, centerY, static_cast<float>(face.angle)),
+        RotatePoint(x2, y2, centerX, centerY, static_cast<float>(face.angle)),
+        RotatePoint(x2, y1, centerX, centerY, static_cast<float>(face.angle)),
+    };
+
+    int min_x = corners[0].x, max_x = corners[0].x;
+    int min_y = corners[0].y, max_y = corners[0].y;
+    for (const cv::Point& p : corners) {
+        min_x = MIN(min_x, p.x);
+        max_x = MAX(max_x, p.x);
+        min_y = MIN(min_y, p.y);
+        max_y = MAX(max_y, p.y);
+    }
 
-#if 0
-        cv::line(equ_image, dstQuad[0], dstQuad[1], RED, 3);
-        cv::line(equ_image, dstQuad[1], dstQuad[2], BLUE, 3);
-        cv::line(equ_image, dstQuad[2], dstQuad[3], GREEN, 3);
-        cv::line(equ_image, dstQuad[3], dstQuad[0], CYAN, 3);
-#endif
+    min_x = CLAMP(min_x, 0, size.width - 1);
+    max_x = CLAMP(max_x, 0, size.width - 1);
+    min_y = CLAMP(min_y, 0, size.height - 1);
+    max_y = CLAMP(max_y, 0, size.height - 1);
 
-        /* The destination quad may cross edges and need to be split into up to 4 sub-quads and
-         * remapped */
-        if (min_x > max_x) {
-            if (min_y > max_y) {
-                /* Crossed both right and bottom edges - 4 quads */
-                rects.emplace_back(min_x, min_y, equ_image.cols - 1 - min_x, equ_image.rows - 1 - min_y);
-                rects.emplace_back(0, min_y, max_x, equ_image.rows - 1 - min_y);
-                rects.emplace_back(min_x, 0, equ_image.cols - 1 - min_x, max_y);
-                rects.emplace_back(0, 0, max_x, max_y);
-            }
-            else {
-                /* Crossed right edge */
-                rects.emplace_back(min_x, min_y, equ_image.cols - 1 - min_x, max_y - min_y);
-                rects.emplace_back(0, min_y, max_x, max_y - min_y);
-            }
-        }
-        else if (min_y > max_y) {
-            /* Crossed bottom edge */
-            rects.emplace_back(min_x, min_y, max_x - min_x, equ_image.rows - 1 - min_y);
-            rects.emplace_back(min_x, 0, max_x - min_x, max_y);
-        }
-        else {
-            /* Just one quad */
-            rects.emplace_back(min_x, min_y, max_x - min_x, max_y - min_y);
-        }
+    return { min_x, min_y, max_x - min_x, max_y - min_y };
+}
+
+// We have faces to project back to the full frame
+// For each face, calculate bounding rectangles in the
+// equirect frame. The reprojection may cross the edges
+// of the image and gets complicated, so the rects are
+// split there. All the faces' rects are merged into
+// spans and written back together, so overlapping or
+// nearby faces are only resampled once. The rects
+// written are appended to written_rects if it is set
+static void project_faces_to_full_frame(
+    Projection& projection,
+    cv::Mat& equ_image,
+    const cv::Mat& cropped_image,
+    std::vector<cv::Rect>* written_rects,
+    FrameScratch& scratch)
+{
+    std::vector<cv::Rect>& rects = scratch.rects; /* ROI rects in the source frame */
+    rects.clear();
+
+    for (const cv::Rect& roi : projection.faces) {
+        crop_roi_to_equ_rects(projection, roi, equ_image.size(), rects);
     }
 #if 0
     for (int i = 0; i < rects.size(); i++) {
@@ -340,56 +547,195 @@ static void project_faces_to_full_frame(Projection& projection, cv::Mat& equ_ima
     }
 #endif
 
-    for (cv::Rect& rect : rects) {
-        if (rect.width <= 0 || rect.height <= 0)
-            continue;
-        cv::Mat map = create_roi_map_to_equ(projection, equ_image, cropped_image, rect);
-        cv::Mat image_roi = equ_image(rect);
-        remap(cropped_image, image_roi, map, cv::noArray(), cv::INTER_LINEAR, cv::BORDER_TRANSPARENT);
+    rects.erase(std::remove_if(rects.begin(),
+                               rects.end(),
+                               [](const cv::Rect& rect) { return rect.width <= 0 || rect.height <= 0; }),
+                rects.end());
+
+    BlurTraceSpan span("obscure", "write_back");
+    rects_to_spans(rects, equ_image.size(), scratch.spans);
+    write_back_spans(projection, equ_image, cropped_image, scratch.spans, scratch.offsets, &scratch.arena);
+    span.arg("rows", static_cast<double>(scratch.spans.size()));
+
+    if (written_rects != nullptr)
+        written_rects->insert(written_rects->end(), rects.begin(), rects.end());
+}
+
+/* Blur or cover faces in the cropped image and project them back to the full
+ * frame, or obscure them in the full frame directly. The cropped image isn't
+ * used when obscuring directly */
+static void obscure_faces(
+    Projection& projection,
+    cv::Mat& equ_image,
+    cv::Mat& cropped_image,
+    const std::vector<Window>& faces,
+    const ObscureOptions& obscure,
+    std::vector<cv::Rect>* written_rects,
+    FrameScratch& scratch)
+{
+    projection.faces.clear();
+
+    if (obscure.direct) {
+        for (const Window& face : faces) {
+            BlurTraceSpan span("obscure", "obscure_cap");
+            span.arg("width", face.width);
+            equirect_obscure_cap(equ_image, equirect_face_cap(projection, face), obscure, written_rects);
+        }
+        return;
+    }
+
+    for (const Window& face : faces) {
+        BlurTraceSpan span("obscure", "blur_face");
+        span.arg("width", face.width);
+        projection.faces.push_back(blur_face(cropped_image, face, obscure, &scratch.arena));
+        // DrawFace(tmp_image, faces[j]);
+        // drawpoints(tmp_image, faces[j]);
     }
+
+    // Project blurred areas back to the full frame
+    project_faces_to_full_frame(projection, equ_image, cropped_image, written_rects, scratch);
+}
+
+/* Run the projection's detector (or one borrowed from its pool) on its cropped
+ * view in the scratch arena, into the scratch faces, adding its stages and the
+ * faces found to stats if it is set */
+static std::vector<Window>& detect_faces(
+    const Projection& p, const cv::Mat& cropped_image, FrameScratch& scratch, BlurStats* stats)
+{
+    PCN* detector = p.detector != nullptr ? p.detector : p.pool->acquire();
+
+    PCNStats detection;
+    BlurStatsTimer timer(stats, "detect");
+    if (stats != nullptr)
+        detector->SetStats(&detection);
+    detector->SetArena(&scratch.arena);
+    std::vector<Window>& faces = scratch.faces;
+    detector->Detect(cropped_image, faces);
+    detector->SetArena(nullptr);
+    detector->SetStats(nullptr);
+    timer.stop();
+
+    if (p.detector == nullptr)
+        p.pool->release(detector);
+
+    if (stats != nullptr) {
+        stats->add_detection(detection);
+        stats->add_count("projections");
+        stats->add_faces(p.phi, p.lambda, faces.size());
+    }
+    return faces;
 }
 
-bool equirect_blur_process_frame(cv::Mat& image, std::vector<Projection>& projections, const bool draw_over_faces)
+/* Append the faces found in a projection to detections, with their equirect
+ * rects. Built in place, so each face takes one allocation (for its rects) once
+ * detections has grown to hold a frame's faces */
+static void record_detections(
+    const Projection& p,
+    const std::vector<Window>& faces,
+    const cv::Size& cropped_size,
+    const cv::Size& equ_size,
+    std::vector<FaceDetection>& detections)
+{
+    for (const Window& face : faces) {
+        detections.push_back({ p.phi, p.lambda, face, {} });
+        FaceDetection& detection = detections.back();
+        detection.equ_rects.reserve(4);
+        crop_roi_to_equ_rects(p, face_bounding_rect(face, cropped_size), equ_size, detection.equ_rects);
+    }
+}
+
+/* Tag a trace span with the projection it covers */
+static void trace_projection(BlurTraceSpan& span, const Projection& p)
+{
+    span.arg("phi", RAD2DEG(p.phi));
+    span.arg("lambda", RAD2DEG(p.lambda));
+}
+
+/* Charge a caller's scratch buffers to MemoryUse::SCRATCH at their current size */
+static void charge_scratch(FrameScratch* scratch)
+{
+    if (scratch != nullptr) {
+        scratch->charge.set(
+            scratch->cropped.total() * scratch->cropped.elemSize()
+            + scratch->region.total() * scratch->region.elemSize());
+    }
+}
+
+/* Start a frame in the scratch arena, adding the blocks it has taken from the
+ * heap since its last reset to stats */
+static void reset_arena(FrameScratch& scratch, BlurStats* stats)
+{
+    scratch.arena.reset();
+    if (stats != nullptr)
+        stats->add_count("arena_allocations", scratch.arena.heap_allocations() - scratch.arena_allocations);
+    scratch.arena_allocations = scratch.arena.heap_allocations();
+}
+
+/* Size of the cropped view of each of projections, which share one aperture */
+static cv::Size projection_view_size(const std::vector<Projection>& projections)
+{
+    return projections.empty() ? cv::Size() : projections[0].view_size();
+}
+
+static bool check_projection_size(const Projection& p, const cv::Mat& image)
+{
+    if (p.equ_size.width != image.cols || p.equ_size.height != image.rows) {
+        std::cerr << "Input image size mismatch (expected " << p.equ_size.height << " x " << p.equ_size.width
+                  << " got " << image.rows << " x " << image.cols << ")" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool equirect_blur_process_frame(
+    cv::Mat& image,
+    std::vector<Projection>& projections,
+    const ObscureOptions& obscure,
+    std::vector<FaceDetection>* detections,
+    FrameScratch* scratch,
+    std::vector<cv::Rect>* written_rects,
+    BlurStats* stats)
 {
     /*
      * Sweep the sphere in steps, calculating a centre
      * λ and φ and extract sub-images that should allow face
      * recognition to work at latitudes away from the equator
      */
-    const int in_width = image.cols;
-    const int in_height = image.rows;
-
-    /* Calculate a temporary image size that matches the target aperture */
-    const int tmp_width = static_cast<int>(round(static_cast<float>(in_width) * X_APERTURE / (2 * M_PI)));
-    const int tmp_height = static_cast<int>(round(static_cast<float>(in_height) * Y_APERTURE / M_PI));
-
-    cv::Mat tmp_image(tmp_height, tmp_width, image.type());
+    FrameScratch local_scratch;
+    FrameScratch& frame_scratch = scratch != nullptr ? *scratch : local_scratch;
+    cv::Mat& tmp_image = frame_scratch.cropped;
+    tmp_image.create(projection_view_size(projections), image.type());
+    charge_scratch(scratch);
+    reset_arena(frame_scratch, stats);
     for (Projection& p : projections) {
         // cout << "Region phi=" << p.phi << " lambda=" << p.lambda << endl;
         //
-        if (p.equ_size.width != image.cols || p.equ_size.height != image.rows) {
-            std::cerr << "Input image size mismatch (expected " << p.equ_size.height << " x " << p.equ_size.width
-                      << " got " << image.rows << " x " << image.cols << ")" << std::endl;
+        if (!check_projection_size(p, image))
             return false;
-        }
 
+        BlurTraceSpan projection_span("projection", "projection");
+        trace_projection(projection_span, p);
+
+        BlurStatsTimer remap_timer(stats, "remap");
         extract_subregion(p, image, tmp_image);
+        remap_timer.stop();
 #if 0
       imshow("Cropped frame", tmp_image);
       waitKey(0);
 #endif
 
         // Detect faces in this sub-image
+        const std::vector<Window>& faces = detect_faces(p, tmp_image, frame_scratch, stats);
+
         // Extract faces and blur into the cropped image
-        if (std::vector<Window> faces = p.detector->Detect(tmp_image); !faces.empty()) {
+        if (!faces.empty()) {
             // cout << "Detected " << faces.size() << " faces" << endl;
-            p.faces.clear();
+            if (detections != nullptr)
+                record_detections(p, faces, tmp_image.size(), image.size(), *detections);
 
-            for (const Window& face : faces) {
-                p.faces.push_back(blur_face(tmp_image, face, draw_over_faces));
-                // DrawFace(tmp_image, faces[j]);
-                // drawpoints(tmp_image, faces[j]);
-            }
+            BlurStatsTimer obscure_timer(stats, "obscure");
+            obscure_faces(p, image, tmp_image, faces, obscure, written_rects, frame_scratch);
+            obscure_timer.stop();
 
 #if 0
           //imshow("Region", tmp_image);
@@ -398,9 +744,6 @@ bool equirect_blur_process_frame(cv::Mat& image, std::vector<Projection>& projec
           imwrite(fname.str().c_str(), tmp_image);
           //waitKey(0);
 #endif
-
-            // Project blurred areas back to the full frame
-            project_faces_to_full_frame(p, image, tmp_image);
         }
     }
 
@@ -411,3 +754,213 @@ bool equirect_blur_process_frame(cv::Mat& image, std::vector<Projection>& projec
 
     return true;
 }
+
+bool equirect_blur_detect_frame(
+    const cv::Mat& image,
+    std::vector<Projection>& projections,
+    std::vector<FaceDetection>& detections,
+    FrameScratch* scratch,
+    BlurStats* stats)
+{
+    FrameScratch local_scratch;
+    FrameScratch& frame_scratch = scratch != nullptr ? *scratch : local_scratch;
+    cv::Mat& tmp_image = frame_scratch.cropped;
+    tmp_image.create(projection_view_size(projections), image.type());
+    charge_scratch(scratch);
+    reset_arena(frame_scratch, stats);
+    for (const Projection& p : projections) {
+        if (!check_projection_size(p, image))
+            return false;
+
+        BlurTraceSpan projection_span("projection", "projection");
+        trace_projection(projection_span, p);
+
+        BlurStatsTimer remap_timer(stats, "remap");
+        extract_subregion(p, image, tmp_image);
+        remap_timer.stop();
+        record_detections(
+            p, detect_faces(p, tmp_image, frame_scratch, stats), tmp_image.size(), image.size(), detections);
+    }
+
+    return true;
+}
+
+/* Smallest side of the area searched around a seed, so small faces that come
+ * closer are still found */
+#define MIN_SEED_SEARCH 96
+
+static bool same_projection(const FaceDetection& detection, const Projection& p)
+{
+    return ABS(detection.phi - p.phi) < 1e-4f && ABS(detection.lambda - p.lambda) < 1e-4f;
+}
+
+/* The areas of a projection to search for its seeds, with overlapping areas merged */
+static std::vector<cv::Rect> seed_search_areas(
+    const Projection& p, const std::vector<FaceDetection>& seeds, const double search_scale)
+{
+    const cv::Rect cropped(cv::Point(0, 0), p.view_size());
+    std::vector<cv::Rect> areas;
+
+    for (const FaceDetection& seed : seeds) {
+        if (!same_projection(seed, p))
+            continue;
+
+        const int side = MAX(static_cast<int>(std::lround(seed.window.width * search_scale)), MIN_SEED_SEARCH);
+        const cv::Point centre(seed.window.x + seed.window.width / 2, seed.window.y + seed.window.width / 2);
+        cv::Rect area = cv::Rect(centre.x - side / 2, centre.y - side / 2, side, side) & cropped;
+        if (area.empty())
+            continue;
+
+        /* Grow the area over any it overlaps, until it overlaps none */
+        for (size_t a = 0; a < areas.size();) {
+            if ((area & areas[a]).empty()) {
+                a++;
+                continue;
+            }
+            area |= areas[a];
+            areas.erase(areas.begin() + static_cast<std::ptrdiff_t>(a));
+            a = 0;
+        }
+        areas.push_back(area);
+    }
+
+    return areas;
+}
+
+bool equirect_blur_detect_near(
+    const cv::Mat& image,
+    std::vector<Projection>& projections,
+    const std::vector<FaceDetection>& seeds,
+    const double search_scale,
+    std::vector<FaceDetection>& detections,
+    FrameScratch* scratch,
+    BlurStats* stats)
+{
+    FrameScratch local_scratch;
+    FrameScratch& frame_scratch = scratch != nullptr ? *scratch : local_scratch;
+    cv::Mat& region = frame_scratch.region;
+    reset_arena(frame_scratch, stats);
+
+    for (const Projection& p : projections) {
+        if (!check_projection_size(p, image))
+            return false;
+
+        BlurTraceSpan projection_span("projection", "projection");
+        trace_projection(projection_span, p);
+
+        for (const cv::Rect& area : seed_search_areas(p, seeds, search_scale)) {
+            BlurStatsTimer remap_timer(stats, "remap");
+            p.remap_view(image, region, area);
+            remap_timer.stop();
+
+            std::vector<Window>& faces = detect_faces(p, region, frame_scratch, stats);
+            for (Window& face : faces) {
+                face.x += area.x;
+                face.y += area.y;
+                for (cv::Point& point : face.points14)
+                    point += area.tl();
+            }
+            record_detections(p, faces, p.view_size(), image.size(), detections);
+        }
+    }
+    charge_scratch(scratch);
+
+    return true;
+}
+
+void equirect_blur_merge_detections(std::vector<FaceDetection>& detections, const std::vector<FaceDetection>& extra)
+{
+    const size_t existing = detections.size();
+
+    for (const FaceDetection& face : extra) {
+        bool found = false;
+        for (size_t d = 0; d < existing && !found; d++) {
+            for (const cv::Rect& a : face.equ_rects) {
+                for (const cv::Rect& b : detections[d].equ_rects) {
+                    const int overlap = (a & b).area();
+                    if (overlap > 0 && 3 * overlap >= MIN(a.area(), b.area()))
+                        found = true;
+                }
+            }
+        }
+        if (!found)
+            detections.push_back(face);
+    }
+}
+
+void equirect_blur_scale_detections(std::vector<FaceDetection>& detections, const double scale)
+{
+    const auto scaled = [scale](const int v) { return static_cast<int>(std::lround(v * scale)); };
+
+    for (FaceDetection& detection : detections) {
+        detection.window.x = scaled(detection.window.x);
+        detection.window.y = scaled(detection.window.y);
+        detection.window.width = scaled(detection.window.width);
+        for (cv::Point& p : detection.window.points14)
+            p = cv::Point(scaled(p.x), scaled(p.y));
+
+        for (cv::Rect& rect : detection.equ_rects)
+            rect = cv::Rect(scaled(rect.x), scaled(rect.y), scaled(rect.width), scaled(rect.height));
+    }
+}
+
+bool equirect_blur_render_frame(
+    cv::Mat& image,
+    std::vector<Projection>& projections,
+    const std::vector<FaceDetection>& detections,
+    const ObscureOptions& obscure,
+    FrameScratch* scratch,
+    std::vector<cv::Rect>* written_rects,
+    BlurStats* stats)
+{
+    FrameScratch local_scratch;
+    FrameScratch& frame_scratch = scratch != nullptr ? *scratch : local_scratch;
+    cv::Mat& tmp_image = frame_scratch.cropped;
+    if (!obscure.direct)
+        tmp_image.create(projection_view_size(projections), image.type());
+    charge_scratch(scratch);
+    reset_arena(frame_scratch, stats);
+    for (Projection& p : projections) {
+        if (!check_projection_size(p, image))
+            return false;
+
+        /* Only projections that had faces need extracting */
+        std::vector<Window>& faces = frame_scratch.faces;
+        faces.clear();
+        for (const FaceDetection& detection : detections) {
+            if (same_projection(detection, p))
+                faces.push_back(detection.window);
+        }
+        if (faces.empty())
+            continue;
+
+        BlurTraceSpan projection_span("projection", "projection");
+        trace_projection(projection_span, p);
+
+        if (!obscure.direct) {
+            BlurStatsTimer remap_timer(stats, "remap");
+            extract_subregion(p, image, tmp_image);
+        }
+        BlurStatsTimer obscure_timer(stats, "obscure");
+        obscure_faces(p, image, tmp_image, faces, obscure, written_rects, frame_scratch);
+    }
+
+    return true;
+}
+
+void equirect_blur_extract_subregion(const Projection& p, const cv::Mat& image, cv::Mat& cropped)
+{
+    extract_subregion(p, image, cropped);
+}
+
+cv::Rect equirect_blur_face(cv::Mat& cropped, const Window& face, const ObscureOptions& obscure)
+{
+    return blur_face(cropped, face, obscure, nullptr);
+}
+
+void equirect_blur_project_faces(
+    Projection& p, cv::Mat& image, const cv::Mat& cropped, std::vector<cv::Rect>* written_rects)
+{
+    FrameScratch scratch;
+    project_faces_to_full_frame(p, image, cropped, written_rects, scratch);
+}
@@ -1,16 +1,30 @@
 #pragma once
 
 #include "PCN.h"
+#include "equirect-blur-arena.h"
+#include "equirect-blur-filters.h"
+#include "equirect-blur-memory.h"
 #include <opencv2/opencv.hpp>
 
 /* Step around the sphere in overlapping ranges. Bands of 90deg vert (45deg at a time),
- * 360deg horizontal (180deg at a time) */
+ * 360deg horizontal (180deg at a time). These are the default ProjectionLayout,
+ * which a config file can change */
 #define X_APERTURE ((float)(2.0f * M_PI))
 #define Y_APERTURE ((float)(2.0 * M_PI / 3.0f))
 
 #define X_STEP ((float)(X_APERTURE / 2.0f))
 #define Y_STEP ((float)(Y_APERTURE / 2.0f))
 
+class BlurStats;
+class DetectorPool;
+
+/* How a projection's remap table is stored: 32-bit float source coordinates
+ * (8 bytes a pixel), or OpenCV's fixed point form from cv::convertMaps(), with
+ * 16-bit integer coordinates and an index into its interpolation table (6 bytes
+ * a pixel). Fixed point maps remap faster, with source positions rounded to
+ * 1/32 of a pixel */
+enum class MapPrecision { FLOAT, FIXED };
+
 struct Projection {
     cv::Size equ_size;
     /* cropped X/Y aperture */
@@ -20,14 +34,21 @@ struct Projection {
     float phi;
     float lambda;
     cv::Mat p2eRot; /* Rotation matrix from cropped view to the source equirectangular projection */
-    cv::Mat2f e2pMap; /* Mapping from equirectangular view to this cropping */
+    cv::Mat2f e2pMap; /* Mapping from equirectangular view to this cropping, if it has FLOAT precision */
+    cv::Mat e2pFixed[2]; /* The same mapping in fixed point (CV_16SC2 and CV_16UC1), if it has FIXED precision */
 
     std::vector<cv::Rect> faces; /* ROI rects in the cropped view */
 
     PCN* detector;
+    DetectorPool* pool = nullptr; /* Detectors are borrowed from here if there is no detector */
 
     Projection(
-        const cv::Size& im_size, const float cropped_aperture[2], const float phi, const float lambda, PCN* detector)
+        const cv::Size& im_size,
+        const float cropped_aperture[2],
+        const float phi,
+        const float lambda,
+        PCN* detector,
+        const MapPrecision precision = MapPrecision::FLOAT)
     {
         this->equ_size = im_size;
         this->cropped_aperture[0] = cropped_aperture[0];
@@ -39,13 +60,167 @@ struct Projection {
 
         this->detector = detector;
 
-        this->create_subregion_map();
+        this->create_subregion_map(precision);
+    }
+
+    /* Size of the cropped view, and of the view of an im_size frame through cropped_aperture */
+    [[nodiscard]] cv::Size view_size() const
+    {
+        return this->e2pMap.empty() ? this->e2pFixed[0].size() : this->e2pMap.size();
+    }
+    static cv::Size view_size_for(const cv::Size& im_size, const float cropped_aperture[2]);
+
+    /* Position in the equirect frame that a pixel of the cropped view comes from */
+    [[nodiscard]] cv::Vec2f source_point(const int x, const int y) const
+    {
+        if (!this->e2pMap.empty())
+            return this->e2pMap(y, x);
+
+        /* The integer position, plus the fraction in 1/INTER_TAB_SIZE steps packed into the table index */
+        const cv::Vec2s whole = this->e2pFixed[0].at<cv::Vec2s>(y, x);
+        const int fraction = this->e2pFixed[1].at<ushort>(y, x);
+        return {
+            static_cast<float>(whole[0]) + static_cast<float>(fraction % cv::INTER_TAB_SIZE) / cv::INTER_TAB_SIZE,
+            static_cast<float>(whole[1]) + static_cast<float>(fraction / cv::INTER_TAB_SIZE) / cv::INTER_TAB_SIZE,
+        };
     }
 
+    /* Remap area of the cropped view (all of it if empty) from image into out */
+    void remap_view(const cv::Mat& image, cv::Mat& out, const cv::Rect& area = cv::Rect()) const;
+    /* Memory taken by the remap table */
+    [[nodiscard]] size_t map_bytes() const;
+
 private:
-    void create_subregion_map();
+    void create_subregion_map(MapPrecision precision);
 
     static cv::Mat eulerYZrotation(double lambda, double phi);
 };
 
-bool equirect_blur_process_frame(cv::Mat& image, std::vector<Projection>& projections, bool draw_over_faces);
+/* Faces of a cube map, in the order and orientation Pannellum and Hugin use */
+enum class CubeFace { FRONT, BACK, UP, DOWN, LEFT, RIGHT };
+
+/* Mapping from an equirectangular frame to one face_size x face_size cube face,
+ * for cv::remap() like Projection::e2pMap */
+cv::Mat2f equirect_cube_face_map(const cv::Size& equ_size, CubeFace face, int face_size);
+
+/* A face found in one of the projections */
+struct FaceDetection {
+    /* phi/lambda of the projection the face was found in */
+    float phi;
+    float lambda;
+    Window window; /* Face window in the projection's cropped view */
+
+    std::vector<cv::Rect> equ_rects; /* Bounding rects in the equirect frame, split where they cross the frame edges */
+};
+
+/* Pixels of one row of the equirect frame, from x0 up to (not including) x1 */
+struct RowSpan {
+    int y;
+    int x0;
+    int x1;
+};
+
+/* Working buffers for processing frames. Callers that process many frames can
+ * keep one per thread to avoid reallocating them for every frame. The frame
+ * functions reset the arena as they start, and add the blocks it took from the
+ * heap to the arena_allocations counter of their stats. The lists keep their
+ * capacity between frames, so frames like the ones before don't allocate */
+struct FrameScratch {
+    cv::Mat cropped; /* The frame remapped into one projection */
+    cv::Mat region; /* Part of one projection, for searching around seeds */
+    FrameArena arena; /* The detectors' and obscuring's working images */
+    uint64_t arena_allocations = 0; /* The arena's heap allocations, as of its last reset */
+    MemoryCharge charge { MemoryUse::SCRATCH }; /* The buffers' size, as of the last frame */
+
+    std::vector<Window> faces; /* Faces found in, or to obscure in, one projection */
+    std::vector<cv::Rect> rects; /* Their rects in the equirect frame, to write back */
+    std::vector<RowSpan> spans; /* The rects merged into rows */
+    std::vector<size_t> offsets; /* Where each span's pixels start in the write back buffer */
+};
+
+/* Filter radius used when none is given, in face widths */
+#define DEFAULT_FILTER_RADIUS 0.25
+
+/* How faces are obscured */
+struct ObscureOptions {
+    bool draw_over_faces = false; /* Cover faces with grey instead of blurring them */
+    /* Obscure a spherical region of the equirect frame around each face, instead
+     * of obscuring it in its projection and remapping that back */
+    bool direct = false;
+
+    ObscureFilter filter = ObscureFilter::GAUSSIAN;
+    /* Filter radius (pixelate block size) in face widths, so faces of every size
+     * are obscured alike. 0 for DEFAULT_FILTER_RADIUS, except that the Gaussian
+     * filter in projections keeps its original fixed 31x31 kernel */
+    double radius = 0;
+};
+
+/* Short name for how faces are obscured, e.g. for manifests: rect, blur (the
+ * fixed Gaussian) or filter-radius like box-0.25, with -direct appended for
+ * direct obscuring */
+std::string equirect_blur_obscure_name(const ObscureOptions& obscure);
+
+/* Detect and obscure faces in image. If written_rects is set, the rects of the
+ * equirect frame that were actually overwritten are appended to it. They can
+ * overlap, and together cover every pixel that was changed. If stats is set,
+ * the time taken by each stage (remap, detect and the detector's own stages,
+ * obscure) and the faces found in each projection are added to it, here and
+ * in the functions below */
+bool equirect_blur_process_frame(
+    cv::Mat& image,
+    std::vector<Projection>& projections,
+    const ObscureOptions& obscure,
+    std::vector<FaceDetection>* detections = nullptr,
+    FrameScratch* scratch = nullptr,
+    std::vector<cv::Rect>* written_rects = nullptr,
+    BlurStats* stats = nullptr);
+
+/* Find the faces in image without obscuring them, appending them to detections */
+bool equirect_blur_detect_frame(
+    const cv::Mat& image,
+    std::vector<Projection>& projections,
+    std::vector<FaceDetection>& detections,
+    FrameScratch* scratch = nullptr,
+    BlurStats* stats = nullptr);
+
+/* Look for faces around seeds (e.g. the previous image's faces in a sequence,
+ * for a frame of this size), appending them to detections. Each seed's
+ * projection is searched at full resolution in a square search_scale times
+ * the seed's width, so only those areas are remapped and run through the
+ * detectors. Faces that move into another projection aren't followed */
+bool equirect_blur_detect_near(
+    const cv::Mat& image,
+    std::vector<Projection>& projections,
+    const std::vector<FaceDetection>& seeds,
+    double search_scale,
+    std::vector<FaceDetection>& detections,
+    FrameScratch* scratch = nullptr,
+    BlurStats* stats = nullptr);
+
+/* Append the faces in extra that don't overlap one already in detections by a
+ * third or more, e.g. to combine different searches of the same frame */
+void equirect_blur_merge_detections(std::vector<FaceDetection>& detections, const std::vector<FaceDetection>& extra);
+
+/* Scale detections made on a resized copy of a frame (e.g. a reduced resolution
+ * proxy) to a frame scale times its size, ready for equirect_blur_render_frame().
+ * The projections' cropped views scale with the frame, so only the window and
+ * rect coordinates change */
+void equirect_blur_scale_detections(std::vector<FaceDetection>& detections, double scale);
+
+/* Obscure previously detected faces without running the detectors */
+bool equirect_blur_render_frame(
+    cv::Mat& image,
+    std::vector<Projection>& projections,
+    const std::vector<FaceDetection>& detections,
+    const ObscureOptions& obscure,
+    FrameScratch* scratch = nullptr,
+    std::vector<cv::Rect>* written_rects = nullptr,
+    BlurStats* stats = nullptr);
+
+/* The steps of obscuring faces in one projection, for benchmarks: remap the
+ * frame into the projection's cropped view, obscure a face there (returning
+ * the cropped rect changed), and write the rects in p.faces back to the frame */
+void equirect_blur_extract_subregion(const Projection& p, const cv::Mat& image, cv::Mat& cropped);
+cv::Rect equirect_blur_face(cv::Mat& cropped, const Window& face, const ObscureOptions& obscure);
+void equirect_blur_project_faces(
+    Projection& p, cv::Mat& image, const cv::Mat& cropped, std::vector<cv::Rect>* written_rects = nullptr);
@@ -0,0 +1,183 @@
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <tuple>
+
+#include "equirect-blur-config.h"
+
+bool ProjectionLayout::operator<(const ProjectionLayout& other) const
+{
+    return std::tie(aperture[0], aperture[1], step[0], step[1])
+        < std::tie(other.aperture[0], other.aperture[1], other.step[0], other.step[1]);
+}
+
+BlurConfig equirect_blur_image_defaults()
+{
+    return {};
+}
+
+BlurConfig equirect_blur_video_defaults()
+{
+    BlurConfig config;
+    config.detector.min_face_size = 32;
+    config.detector.pyramid_scale = 1.5f;
+    // 0.37, 0.43, 0.85 is PCN's default, and 0.28, 0.32, 0.64 blurs more
+    config.detector.thresh[0] = 0.56f;
+    config.detector.thresh[1] = 0.65f;
+    config.detector.thresh[2] = 1.274f;
+    return config;
+}
+
+static float degrees_to_radians(const double degrees)
+{
+    return static_cast<float>(degrees * M_PI / 180);
+}
+
+/* Read a pair (or for thresholds, three) of numbers into values, if node is set */
+static bool read_numbers(const cv::FileNode& node, float* values, const size_t count, const bool angles)
+{
+    if (node.empty())
+        return true;
+    if (!node.isSeq() || node.size() != count)
+        return false;
+
+    for (size_t i = 0; i < count; i++) {
+        const auto value = static_cast<double>(node[static_cast<int>(i)]);
+        values[i] = angles ? degrees_to_radians(value) : static_cast<float>(value);
+    }
+    return true;
+}
+
+bool equirect_blur_load_config(const std::string& path, BlurConfig& config, std::string& error)
+{
+    BlurConfig loaded = config;
+    try {
+        const cv::FileStorage fs(path, cv::FileStorage::READ | cv::FileStorage::FORMAT_JSON);
+        if (!fs.isOpened()) {
+            error = "Can't open config file " + path;
+            return false;
+        }
+
+        if (!fs["min_face_size"].empty())
+            loaded.detector.min_face_size = static_cast<int>(fs["min_face_size"]);
+        if (!fs["pyramid_scale"].empty())
+            loaded.detector.pyramid_scale = static_cast<float>(fs["pyramid_scale"]);
+        if (!read_numbers(fs["thresholds"], loaded.detector.thresh, 3, false)
+            || !read_numbers(fs["aperture"], loaded.layout.aperture, 2, true)
+            || !read_numbers(fs["step"], loaded.layout.step, 2, true)) {
+            error = "In " + path + ": thresholds must have 3 values, and aperture and step 2";
+            return false;
+        }
+    }
+    catch (const cv::Exception& e) {
+        error = "Can't parse config file " + path + ": " + e.what();
+        return false;
+    }
+
+    if (loaded.detector.min_face_size < 1 || loaded.detector.pyramid_scale <= 1) {
+        error = "In " + path + ": min_face_size must be at least 1 and pyramid_scale more than 1";
+        return false;
+    }
+    for (const float thresh : loaded.detector.thresh) {
+        if (!std::isfinite(thresh) || thresh < 0) {
+            error = "In " + path + ": thresholds can't be negative";
+            return false;
+        }
+    }
+
+    /* Steps longer than the aperture would leave gaps between the projections */
+    const ProjectionLayout& layout = loaded.layout;
+    if (layout.aperture[0] <= 0 || layout.aperture[0] > X_APERTURE || layout.aperture[1] <= 0
+        || layout.aperture[1] > static_cast<float>(M_PI) || layout.step[0] <= 0
+        || layout.step[0] > layout.aperture[0] || layout.step[1] <= 0 || layout.step[1] > layout.aperture[1]) {
+        error = "In " + path + ": aperture must be up to 360 x 180, and step more than 0 and up to the aperture";
+        return false;
+    }
+
+    config = loaded;
+    return true;
+}
+
+std::string equirect_blur_config_json(const BlurConfig& config)
+{
+    const DetectorSettings& d = config.detector;
+    const ProjectionLayout& l = config.layout;
+    return cv::format(
+        "{\"min_face_size\":%d,\"pyramid_scale\":%.6g,\"thresholds\":[%.6g,%.6g,%.6g],"
+        "\"aperture\":[%.6g,%.6g],\"step\":[%.6g,%.6g]}",
+        d.min_face_size,
+        d.pyramid_scale,
+        d.thresh[0],
+        d.thresh[1],
+        d.thresh[2],
+        l.aperture[0] * 180 / M_PI,
+        l.aperture[1] * 180 / M_PI,
+        l.step[0] * 180 / M_PI,
+        l.step[1] * 180 / M_PI);
+}
+
+bool equirect_blur_save_config(const std::string& path, const BlurConfig& config)
+{
+    std::ofstream out(path, std::ios::out | std::ios::trunc);
+    out << equirect_blur_config_json(config) << std::endl;
+    if (!out) {
+        std::cerr << "Can't write config file " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void equirect_blur_apply_detector_settings(PCN& detector, const DetectorSettings& settings)
+{
+    detector.SetMinFaceSize(settings.min_face_size);
+    detector.SetImagePyramidScaleFactor(settings.pyramid_scale);
+    detector.SetDetectionThresh(settings.thresh[0], settings.thresh[1], settings.thresh[2]);
+}
+
+static const char* model_files[] = {
+    "PCN.caffemodel",
+    "PCN-1.prototxt",
+    "PCN-2.prototxt",
+    "PCN-3.prototxt",
+    "PCN-Tracking.caffemodel",
+    "PCN-Tracking.prototxt",
+};
+
+PCN* equirect_blur_create_detector(const std::string& models_dir, const DetectorSettings& settings, const bool tracking)
+{
+    const auto detector = new PCN(
+        models_dir + "/" + model_files[0],
+        models_dir + "/" + model_files[1],
+        models_dir + "/" + model_files[2],
+        models_dir + "/" + model_files[3],
+        models_dir + "/" + model_files[4],
+        models_dir + "/" + model_files[5]);
+
+    /// detection
+    equirect_blur_apply_detector_settings(*detector, settings);
+    /// tracking
+    if (tracking) {
+        detector->SetTrackingPeriod(30);
+        detector->SetTrackingThresh(0.9f);
+        detector->SetVideoSmooth(true);
+    }
+    else {
+        detector->SetTrackingPeriod(0);
+        detector->SetTrackingThresh(9999.9f);
+        detector->SetVideoSmooth(false);
+    }
+
+    return detector;
+}
+
+size_t equirect_blur_model_bytes(const std::string& models_dir)
+{
+    size_t bytes = 0;
+    for (const char* file : model_files) {
+        std::error_code ec;
+        const uintmax_t size = std::filesystem::file_size(std::filesystem::path(models_dir) / file, ec);
+        bytes += ec ? 0 : static_cast<size_t>(size);
+    }
+    return bytes;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "equirect-blur-common.h"
+
+#include <string>
+
+/* Detector settings that trade the cost of detection against the faces found */
+struct DetectorSettings {
+    int min_face_size = 20; /* Smallest face searched for, in projection pixels */
+    float pyramid_scale = 1.25f; /* Scale between the levels of the image pyramid */
+    float thresh[3] = { 0.9175f, 0.9175f, 0.9175f }; /* Score a window needs to pass each detector stage */
+};
+
+/* How the sphere is swept: each projection views aperture (width and height,
+ * in radians) and they are step apart in longitude and latitude */
+struct ProjectionLayout {
+    float aperture[2] = { X_APERTURE, Y_APERTURE };
+    float step[2] = { X_STEP, Y_STEP };
+
+    bool operator<(const ProjectionLayout& other) const;
+};
+
+/* A configuration for the detection cost knobs, as written by equirect-blur-tune.
+ * Config files hold a JSON object with any of these members (angles in degrees):
+ *
+ * {"min_face_size":24,"pyramid_scale":1.4,"thresholds":[0.9,0.9,0.95],"aperture":[360,120],"step":[180,60]}
+ *
+ * Members left out keep the tool's defaults */
+struct BlurConfig {
+    DetectorSettings detector;
+    ProjectionLayout layout;
+};
+
+/* The defaults of equirect-blur-image, and of the equirect_blur element (which
+ * searches for larger faces with per stage thresholds) */
+BlurConfig equirect_blur_image_defaults();
+BlurConfig equirect_blur_video_defaults();
+
+/* Read a config file over config. Returns false with a message in error if it
+ * can't be read or its values are out of range */
+bool equirect_blur_load_config(const std::string& path, BlurConfig& config, std::string& error);
+bool equirect_blur_save_config(const std::string& path, const BlurConfig& config);
+
+/* The config file contents, on one line */
+std::string equirect_blur_config_json(const BlurConfig& config);
+
+/* Apply the detection settings to a detector, leaving its tracking settings */
+void equirect_blur_apply_detector_settings(PCN& detector, const DetectorSettings& settings);
+
+/* A detector loaded from the models in models_dir, with settings applied. With
+ * tracking it follows faces from frame to frame (as the video element does),
+ * otherwise it detects every image afresh */
+PCN* equirect_blur_create_detector(const std::string& models_dir, const DetectorSettings& settings, bool tracking);
+
+/* Total size of the model files in models_dir, as an estimate of a detector's
+ * memory */
+size_t equirect_blur_model_bytes(const std::string& models_dir);
@@ -0,0 +1,252 @@
+#include <algorithm>
+#include <cmath>
+#include <opencv2/imgproc.hpp>
+
+#include "equirect-blur-filters.h"
+
+struct FilterName {
+    ObscureFilter filter;
+    const char* name;
+};
+
+static const FilterName filter_names[] = {
+    { ObscureFilter::GAUSSIAN, "gaussian" },
+    { ObscureFilter::BOX, "box" },
+    { ObscureFilter::STACK, "stack" },
+    { ObscureFilter::PIXELATE, "pixelate" },
+};
+
+bool equirect_blur_parse_filter(const std::string& name, ObscureFilter& filter)
+{
+    for (const FilterName& f : filter_names) {
+        if (name == f.name) {
+            filter = f.filter;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* equirect_blur_filter_name(const ObscureFilter filter)
+{
+    for (const FilterName& f : filter_names) {
+        if (filter == f.filter)
+            return f.name;
+    }
+    return "unknown";
+}
+
+int equirect_blur_filter_reach(const ObscureFilter filter, const int radius)
+{
+    switch (filter) {
+    case ObscureFilter::GAUSSIAN:
+        /* 3 sigma */
+        return (3 * radius + 1) / 2;
+    case ObscureFilter::BOX:
+        return radius;
+    case ObscureFilter::STACK:
+        return radius;
+    case ObscureFilter::PIXELATE:
+        return 0;
+    }
+    return radius;
+}
+
+/* Copy one channel of a row into buf, with pad copies of the end pixels each side */
+static void load_row(const uchar* row, const int length, const int channels, const int pad, std::vector<int>& buf)
+{
+    buf.resize(length + 2 * pad);
+    for (int i = 0; i < length; i++)
+        buf[pad + i] = row[i * channels];
+    std::fill(buf.begin(), buf.begin() + pad, buf[pad]);
+    std::fill(buf.begin() + pad + length, buf.end(), buf[pad + length - 1]);
+}
+
+void equirect_box_blur_row(uchar* row, const int length, const int channels, const int radius, std::vector<int>& buf)
+{
+    if (radius < 1 || length < 1)
+        return;
+
+    const int window = 2 * radius + 1;
+    for (int c = 0; c < channels; c++) {
+        load_row(row + c, length, channels, radius, buf);
+
+        /* buf[i .. i + window - 1] is the window around pixel i */
+        int sum = 0;
+        for (int i = 0; i < window; i++)
+            sum += buf[i];
+        for (int i = 0; i < length; i++) {
+            row[i * channels + c] = static_cast<uchar>((sum + window / 2) / window);
+            if (i + 1 < length)
+                sum += buf[i + window] - buf[i];
+        }
+    }
+}
+
+void equirect_stack_blur_row(uchar* row, const int length, const int channels, const int radius, std::vector<int>& buf)
+{
+    if (radius < 1 || length < 1)
+        return;
+
+    const int pad = radius + 1;
+    const int divisor = (radius + 1) * (radius + 1);
+    for (int c = 0; c < channels; c++) {
+        load_row(row + c, length, channels, pad, buf);
+
+        /* For the pixel at p, sum is its weighted window. rising holds the
+         * radius + 1 pixels after p, whose weights go up by one on the step to
+         * p + 1, and falling the pixels from p - radius to p, whose weights go
+         * down by one */
+        int sum = 0, rising = 0, falling = 0;
+        for (int k = -radius; k <= radius; k++)
+            sum += (radius + 1 - std::abs(k)) * buf[pad + k];
+        for (int k = 1; k <= radius + 1; k++)
+            rising += buf[pad + k];
+        for (int k = -radius; k <= 0; k++)
+            falling += buf[pad + k];
+
+        for (int i = 0; i < length; i++) {
+            const int p = pad + i;
+            row[i * channels + c] = static_cast<uchar>((sum + divisor / 2) / divisor);
+
+            if (i + 1 == length)
+                break;
+            sum += rising - falling;
+            rising += buf[p + radius + 2] - buf[p + 1];
+            falling += buf[p + 1] - buf[p - radius];
+        }
+    }
+}
+
+void equirect_box_blur_columns(cv::Mat& image, const int radius)
+{
+    CV_Assert(image.depth() == CV_8U);
+    if (radius < 1 || image.empty())
+        return;
+
+    const int n = image.cols * image.channels();
+    const int window = 2 * radius + 1;
+    const cv::Mat src = image.clone();
+    auto src_row = [&](const int y) { return src.ptr<uchar>(std::clamp(y, 0, src.rows - 1)); };
+
+    std::vector<int> sums(n, 0);
+    for (int k = -radius; k <= radius; k++) {
+        const uchar* s = src_row(k);
+        for (int j = 0; j < n; j++)
+            sums[j] += s[j];
+    }
+
+    for (int y = 0; y < image.rows; y++) {
+        uchar* out = image.ptr<uchar>(y);
+        for (int j = 0; j < n; j++)
+            out[j] = static_cast<uchar>((sums[j] + window / 2) / window);
+
+        const uchar* add = src_row(y + radius + 1);
+        const uchar* sub = src_row(y - radius);
+        for (int j = 0; j < n; j++)
+            sums[j] += add[j] - sub[j];
+    }
+}
+
+void equirect_stack_blur_columns(cv::Mat& image, const int radius)
+{
+    CV_Assert(image.depth() == CV_8U);
+    if (radius < 1 || image.empty())
+        return;
+
+    const int n = image.cols * image.channels();
+    const int divisor = (radius + 1) * (radius + 1);
+    const cv::Mat src = image.clone();
+    auto src_row = [&](const int y) { return src.ptr<uchar>(std::clamp(y, 0, src.rows - 1)); };
+
+    std::vector<int> sums(n, 0), rising(n, 0), falling(n, 0);
+    for (int k = -radius; k <= radius; k++) {
+        const uchar* s = src_row(k);
+        const int weight = radius + 1 - std::abs(k);
+        for (int j = 0; j < n; j++)
+            sums[j] += weight * s[j];
+    }
+    for (int k = 1; k <= radius + 1; k++) {
+        const uchar* s = src_row(k);
+        for (int j = 0; j < n; j++)
+            rising[j] += s[j];
+    }
+    for (int k = -radius; k <= 0; k++) {
+        const uchar* s = src_row(k);
+        for (int j = 0; j < n; j++)
+            falling[j] += s[j];
+    }
+
+    for (int y = 0; y < image.rows; y++) {
+        uchar* out = image.ptr<uchar>(y);
+        for (int j = 0; j < n; j++)
+            out[j] = static_cast<uchar>((sums[j] + divisor / 2) / divisor);
+
+        const uchar* next = src_row(y + 1);
+        const uchar* enter = src_row(y + radius + 2);
+        const uchar* leave = src_row(y - radius);
+        for (int j = 0; j < n; j++) {
+            sums[j] += rising[j] - falling[j];
+            rising[j] += enter[j] - next[j];
+            falling[j] += next[j] - leave[j];
+        }
+    }
+}
+
+void equirect_box_blur(cv::Mat& image, const int radius)
+{
+    CV_Assert(image.depth() == CV_8U);
+    if (radius < 1 || image.empty())
+        return;
+
+    std::vector<int> buf;
+    for (int y = 0; y < image.rows; y++)
+        equirect_box_blur_row(image.ptr<uchar>(y), image.cols, image.channels(), radius, buf);
+    equirect_box_blur_columns(image, radius);
+}
+
+void equirect_stack_blur(cv::Mat& image, const int radius)
+{
+    CV_Assert(image.depth() == CV_8U);
+    if (radius < 1 || image.empty())
+        return;
+
+    std::vector<int> buf;
+    for (int y = 0; y < image.rows; y++)
+        equirect_stack_blur_row(image.ptr<uchar>(y), image.cols, image.channels(), radius, buf);
+    equirect_stack_blur_columns(image, radius);
+}
+
+void equirect_pixelate(cv::Mat& image, const int block)
+{
+    if (block < 2)
+        return;
+
+    for (int y = 0; y < image.rows; y += block) {
+        for (int x = 0; x < image.cols; x += block) {
+            cv::Mat cell = image(cv::Rect(x, y, std::min(block, image.cols - x), std::min(block, image.rows - y)));
+            cell.setTo(cv::mean(cell));
+        }
+    }
+}
+
+void equirect_obscure_filter(cv::Mat& image, const ObscureFilter filter, const int radius)
+{
+    switch (filter) {
+    case ObscureFilter::GAUSSIAN: {
+        const double sigma = std::max(radius / 2.0, 0.5);
+        const int kernel = 2 * static_cast<int>(ceil(3 * sigma)) + 1;
+        GaussianBlur(image, image, cv::Size(kernel, kernel), sigma);
+        break;
+    }
+    case ObscureFilter::BOX:
+        equirect_box_blur(image, radius);
+        break;
+    case ObscureFilter::STACK:
+        equirect_stack_blur(image, radius);
+        break;
+    case ObscureFilter::PIXELATE:
+        equirect_pixelate(image, radius);
+        break;
+    }
+}
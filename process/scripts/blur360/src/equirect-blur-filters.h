@@ -0,0 +1,41 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+#include <string>
+#include <vector>
+
+/* Filters for blurring faces */
+enum class ObscureFilter { GAUSSIAN, BOX, STACK, PIXELATE };
+
+/* Look up a filter by name: gaussian, box, stack or pixelate */
+bool equirect_blur_parse_filter(const std::string& name, ObscureFilter& filter);
+const char* equirect_blur_filter_name(ObscureFilter filter);
+
+/* How far each filter reaches from a pixel for a given radius, so callers know
+ * how much context to give it */
+int equirect_blur_filter_reach(ObscureFilter filter, int radius);
+
+/* Blur a row of length interleaved 8-bit pixels in place, treating the pixels
+ * past each end as copies of the end pixels. buf is working space. Both cost
+ * the same per pixel whatever the radius:
+ *  - box averages the 2 * radius + 1 pixels around each one, with a running sum
+ *  - stack weights them by radius + 1 - distance (a triangle, close to a
+ *    Gaussian), with running sums of the rising and falling halves */
+void equirect_box_blur_row(uchar* row, int length, int channels, int radius, std::vector<int>& buf);
+void equirect_stack_blur_row(uchar* row, int length, int channels, int radius, std::vector<int>& buf);
+
+/* The same filters down the columns of an 8-bit image. Columns are filtered a
+ * whole row at a time, to stay in cache */
+void equirect_box_blur_columns(cv::Mat& image, int radius);
+void equirect_stack_blur_columns(cv::Mat& image, int radius);
+
+/* Separable 2D versions: each row, then the columns */
+void equirect_box_blur(cv::Mat& image, int radius);
+void equirect_stack_blur(cv::Mat& image, int radius);
+
+/* Replace each block x block square (from the top left) with its average colour */
+void equirect_pixelate(cv::Mat& image, int block);
+
+/* Apply filter with radius in pixels. The Gaussian's sigma is half the radius,
+ * and pixelate's blocks are radius pixels across */
+void equirect_obscure_filter(cv::Mat& image, ObscureFilter filter, int radius);
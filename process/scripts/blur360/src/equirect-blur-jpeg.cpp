@@ -0,0 +1,329 @@
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <opencv2/imgproc.hpp>
+
+#include "config.h"
+#include "equirect-blur-jpeg.h"
+
+#ifdef HAVE_LIBJPEG
+#include <csetjmp>
+#include <cstring>
+#include <jpeglib.h>
+
+struct JpegErrorManager {
+    jpeg_error_mgr pub;
+    jmp_buf setjmp_buffer;
+};
+
+/* libjpeg reports fatal errors by calling error_exit, which must not return */
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+    char message[JMSG_LENGTH_MAX];
+
+    (*cinfo->err->format_message)(cinfo, message);
+    std::cerr << "libjpeg: " << message << std::endl;
+    longjmp(reinterpret_cast<JpegErrorManager*>(cinfo->err)->setjmp_buffer, 1);
+}
+
+/* Everything used while libjpeg may longjmp out, kept together so it can all be
+ * released from the error path */
+struct SelectiveJpeg {
+    JpegErrorManager err {};
+    jpeg_decompress_struct src {}; /* The source file, read as coefficients */
+    jpeg_compress_struct band {}; /* Encodes the rows of MCUs that changed */
+    jpeg_decompress_struct band_coefs {}; /* Reads them back as coefficients */
+    jpeg_compress_struct dst {};
+    bool src_created = false, band_created = false, band_coefs_created = false, dst_created = false;
+    unsigned char* band_buffer = nullptr;
+    unsigned long band_size = 0;
+    FILE* out = nullptr;
+
+    std::vector<uchar> changed; /* One entry per MCU, non-zero if any pixel in it changed */
+    cv::Mat diff;
+    cv::Mat band_pixels;
+};
+
+static void release_selective(SelectiveJpeg& s)
+{
+    if (s.dst_created)
+        jpeg_destroy_compress(&s.dst);
+    if (s.band_coefs_created)
+        jpeg_destroy_decompress(&s.band_coefs);
+    if (s.band_created)
+        jpeg_destroy_compress(&s.band);
+    if (s.src_created)
+        jpeg_destroy_decompress(&s.src);
+    s.dst_created = s.band_coefs_created = s.band_created = s.src_created = false;
+
+    free(s.band_buffer);
+    s.band_buffer = nullptr;
+
+    if (s.out != nullptr)
+        fclose(s.out);
+    s.out = nullptr;
+}
+
+static void find_changed_mcus(
+    SelectiveJpeg& s, const cv::Mat& original, const cv::Mat& processed, const cv::Size& mcu, int mcus_x, int mcus_y)
+{
+    /* Compare as single channel images so each MCU is one countNonZero() */
+    cv::compare(original.reshape(1), processed.reshape(1), s.diff, cv::CMP_NE);
+    const cv::Rect bounds(0, 0, s.diff.cols, s.diff.rows);
+
+    s.changed.assign(static_cast<size_t>(mcus_x) * mcus_y, 0);
+    for (int my = 0; my < mcus_y; my++) {
+        for (int mx = 0; mx < mcus_x; mx++) {
+            const cv::Rect roi = cv::Rect(mx * mcu.width * 3, my * mcu.height, mcu.width * 3, mcu.height) & bounds;
+            s.changed[static_cast<size_t>(my) * mcus_x + mx] = cv::countNonZero(s.diff(roi)) > 0;
+        }
+    }
+}
+
+static bool row_changed(const SelectiveJpeg& s, int mcu_row, int mcus_x)
+{
+    const auto row = s.changed.begin() + static_cast<ptrdiff_t>(mcu_row) * mcus_x;
+    return std::find(row, row + mcus_x, 1) != row + mcus_x;
+}
+
+/* Encode s.band_pixels (whole rows of MCUs, starting on an MCU boundary) into
+ * s.band_buffer with the source's quantisation tables and sampling factors. Blocks
+ * only depend on the pixels they cover, so each one comes out exactly as it would
+ * in a full encode of the image */
+static void encode_band(SelectiveJpeg& s)
+{
+    jpeg_compress_struct* band = &s.band;
+
+    free(s.band_buffer);
+    s.band_buffer = nullptr;
+    s.band_size = 0;
+    jpeg_mem_dest(band, &s.band_buffer, &s.band_size);
+
+    band->image_width = s.src.image_width;
+    band->image_height = static_cast<JDIMENSION>(s.band_pixels.rows);
+    band->input_components = 3;
+#ifdef JCS_EXTENSIONS
+    band->in_color_space = JCS_EXT_BGR;
+#else
+    band->in_color_space = JCS_RGB;
+#endif
+    jpeg_set_defaults(band);
+    jpeg_set_colorspace(band, JCS_YCbCr);
+
+    for (int t = 0; t < NUM_QUANT_TBLS; t++) {
+        if (s.src.quant_tbl_ptrs[t] == nullptr)
+            continue;
+        if (band->quant_tbl_ptrs[t] == nullptr)
+            band->quant_tbl_ptrs[t] = jpeg_alloc_quant_table(reinterpret_cast<j_common_ptr>(band));
+        memcpy(band->quant_tbl_ptrs[t]->quantval,
+               s.src.quant_tbl_ptrs[t]->quantval,
+               sizeof(band->quant_tbl_ptrs[t]->quantval));
+    }
+    for (int c = 0; c < band->num_components; c++) {
+        band->comp_info[c].h_samp_factor = s.src.comp_info[c].h_samp_factor;
+        band->comp_info[c].v_samp_factor = s.src.comp_info[c].v_samp_factor;
+        band->comp_info[c].quant_tbl_no = s.src.comp_info[c].quant_tbl_no;
+    }
+
+    jpeg_start_compress(band, TRUE);
+    while (band->next_scanline < band->image_height) {
+        JSAMPROW row = s.band_pixels.ptr<JSAMPLE>(static_cast<int>(band->next_scanline));
+        jpeg_write_scanlines(band, &row, 1);
+    }
+    jpeg_finish_compress(band);
+}
+
+/* Copy the blocks of every changed MCU in the band starting at MCU row mcu_row0
+ * over the source's coefficients */
+static void copy_changed_blocks(
+    SelectiveJpeg& s, jvirt_barray_ptr* src_coefs, jvirt_barray_ptr* band_coefs, int mcus_x, int mcu_row0, int mcu_rows)
+{
+    for (int c = 0; c < s.src.num_components; c++) {
+        const jpeg_component_info* src_comp = &s.src.comp_info[c];
+        const jpeg_component_info* band_comp = &s.band_coefs.comp_info[c];
+        const int h_blocks = src_comp->h_samp_factor;
+        const int v_blocks = src_comp->v_samp_factor;
+
+        for (int row = 0; row < mcu_rows * v_blocks; row++) {
+            const auto src_row = static_cast<JDIMENSION>(mcu_row0 * v_blocks + row);
+            if (src_row >= src_comp->height_in_blocks || static_cast<JDIMENSION>(row) >= band_comp->height_in_blocks)
+                break;
+
+            JBLOCKARRAY dst_blocks = (*s.src.mem->access_virt_barray)(
+                reinterpret_cast<j_common_ptr>(&s.src), src_coefs[c], src_row, 1, TRUE);
+            JBLOCKARRAY new_blocks = (*s.band_coefs.mem->access_virt_barray)(
+                reinterpret_cast<j_common_ptr>(&s.band_coefs), band_coefs[c], static_cast<JDIMENSION>(row), 1, FALSE);
+
+            const uchar* changed = &s.changed[static_cast<size_t>(mcu_row0 + row / v_blocks) * mcus_x];
+            for (int mx = 0; mx < mcus_x; mx++) {
+                if (!changed[mx])
+                    continue;
+                for (int b = 0; b < h_blocks; b++) {
+                    const auto col = static_cast<JDIMENSION>(mx * h_blocks + b);
+                    if (col < src_comp->width_in_blocks)
+                        memcpy(dst_blocks[0][col], new_blocks[0][col], sizeof(JBLOCK));
+                }
+            }
+        }
+    }
+}
+
+/* Carry over the source's APPn and COM markers, apart from the JFIF and Adobe
+ * headers libjpeg writes itself */
+static void copy_markers(SelectiveJpeg& s)
+{
+    for (jpeg_saved_marker_ptr marker = s.src.marker_list; marker != nullptr; marker = marker->next) {
+        if (s.dst.write_JFIF_header && marker->marker == JPEG_APP0 && marker->data_length >= 5
+            && memcmp(marker->data, "JFIF", 5) == 0)
+            continue;
+        if (s.dst.write_Adobe_marker && marker->marker == JPEG_APP0 + 14 && marker->data_length >= 5
+            && memcmp(marker->data, "Adobe", 5) == 0)
+            continue;
+        jpeg_write_marker(&s.dst, marker->marker, marker->data, marker->data_length);
+    }
+}
+#endif
+
+static bool write_bytes(const std::string& path, const std::vector<uchar>& data)
+{
+    std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+    out.close();
+    return !out.fail();
+}
+
+bool equirect_blur_jpeg_selective_available()
+{
+#ifdef HAVE_LIBJPEG
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool equirect_blur_write_jpeg_selective(
+    const std::vector<uchar>& source,
+    const cv::Mat& original,
+    const cv::Mat& processed,
+    const std::string& output_file,
+    JpegSelectiveStats* stats)
+{
+#ifdef HAVE_LIBJPEG
+    if (original.size() != processed.size() || original.type() != CV_8UC3 || processed.type() != CV_8UC3)
+        return false;
+
+    /* Set up before the setjmp() so nothing needs to be volatile */
+    SelectiveJpeg s;
+    s.src.err = s.band.err = s.band_coefs.err = s.dst.err = jpeg_std_error(&s.err.pub);
+    s.err.pub.error_exit = jpeg_error_exit;
+
+    if (setjmp(s.err.setjmp_buffer)) {
+        const bool partial = s.out != nullptr;
+        release_selective(s);
+        if (partial)
+            std::remove(output_file.c_str());
+        return false;
+    }
+
+    jpeg_create_decompress(&s.src);
+    s.src_created = true;
+    /* Older libjpeg releases take a non-const buffer, though they only read it */
+    jpeg_mem_src(&s.src, const_cast<uchar*>(source.data()), static_cast<unsigned long>(source.size()));
+    jpeg_save_markers(&s.src, JPEG_COM, 0xFFFF);
+    for (int m = 0; m < 16; m++)
+        jpeg_save_markers(&s.src, JPEG_APP0 + m, 0xFFFF);
+    jpeg_read_header(&s.src, TRUE);
+
+    if (s.src.jpeg_color_space != JCS_YCbCr || s.src.num_components != 3
+        || s.src.image_width != static_cast<JDIMENSION>(processed.cols)
+        || s.src.image_height != static_cast<JDIMENSION>(processed.rows)) {
+        release_selective(s);
+        return false;
+    }
+
+    const cv::Size mcu(s.src.max_h_samp_factor * DCTSIZE, s.src.max_v_samp_factor * DCTSIZE);
+    const int mcus_x = (processed.cols + mcu.width - 1) / mcu.width;
+    const int mcus_y = (processed.rows + mcu.height - 1) / mcu.height;
+    find_changed_mcus(s, original, processed, mcu, mcus_x, mcus_y);
+
+    const int reencoded = static_cast<int>(std::count(s.changed.begin(), s.changed.end(), 1));
+    if (stats != nullptr) {
+        stats->mcus = mcus_x * mcus_y;
+        stats->reencoded = reencoded;
+    }
+
+    if (reencoded == 0) {
+        release_selective(s);
+        if (!write_bytes(output_file, source)) {
+            std::cerr << "Can't write image file " << output_file << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    jvirt_barray_ptr* src_coefs = jpeg_read_coefficients(&s.src);
+
+    jpeg_create_compress(&s.band);
+    s.band_created = true;
+    jpeg_create_decompress(&s.band_coefs);
+    s.band_coefs_created = true;
+
+    /* Re-encode each run of MCU rows with changes in it */
+    for (int row = 0; row < mcus_y;) {
+        if (!row_changed(s, row, mcus_x)) {
+            row++;
+            continue;
+        }
+        int end = row + 1;
+        while (end < mcus_y && row_changed(s, end, mcus_x))
+            end++;
+
+        const cv::Range rows(row * mcu.height, std::min(end * mcu.height, processed.rows));
+#ifdef JCS_EXTENSIONS
+        s.band_pixels = processed.rowRange(rows);
+#else
+        cv::cvtColor(processed.rowRange(rows), s.band_pixels, cv::COLOR_BGR2RGB);
+#endif
+        encode_band(s);
+
+        jpeg_mem_src(&s.band_coefs, s.band_buffer, s.band_size);
+        jpeg_read_header(&s.band_coefs, TRUE);
+        jvirt_barray_ptr* band_coefs = jpeg_read_coefficients(&s.band_coefs);
+        copy_changed_blocks(s, src_coefs, band_coefs, mcus_x, row, end - row);
+        jpeg_finish_decompress(&s.band_coefs);
+
+        row = end;
+    }
+
+    s.out = fopen(output_file.c_str(), "wb");
+    if (s.out == nullptr) {
+        std::cerr << "Can't write image file " << output_file << std::endl;
+        release_selective(s);
+        return false;
+    }
+
+    jpeg_create_compress(&s.dst);
+    s.dst_created = true;
+    jpeg_stdio_dest(&s.dst, s.out);
+    jpeg_copy_critical_parameters(&s.src, &s.dst);
+    if (s.src.progressive_mode)
+        jpeg_simple_progression(&s.dst);
+    jpeg_write_coefficients(&s.dst, src_coefs);
+    copy_markers(s);
+    jpeg_finish_compress(&s.dst);
+    jpeg_finish_decompress(&s.src);
+
+    const bool write_failed = fflush(s.out) != 0 || ferror(s.out) != 0;
+    release_selective(s);
+    if (write_failed) {
+        std::cerr << "Can't write image file " << output_file << std::endl;
+        std::remove(output_file.c_str());
+        return false;
+    }
+
+    return true;
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <opencv2/core.hpp>
+#include <string>
+#include <vector>
+
+/* Counts from equirect_blur_write_jpeg_selective(), for reporting */
+struct JpegSelectiveStats {
+    int mcus = 0; /* MCUs in the image */
+    int reencoded = 0; /* MCUs taken from the processed image */
+};
+
+/* True if built with libjpeg, so equirect_blur_write_jpeg_selective() can work */
+bool equirect_blur_jpeg_selective_available();
+
+/* Write processed (original with some faces obscured) to output_file as a JPEG
+ * that keeps source's entropy-coded coefficients wherever the two images are
+ * identical. Only the MCUs containing a changed pixel are re-encoded, using the
+ * source's quantisation tables and sampling, so the rest of the image suffers no
+ * further generation loss and EXIF/XMP markers are carried over unchanged.
+ *
+ * original must be source decoded without applying EXIF orientation, so that its
+ * pixels line up with the coefficients. If nothing changed, source is written as
+ * is. Returns false without writing anything if source can't be handled this way
+ * (e.g. it isn't a YCbCr JPEG of the same size), in which case the caller should
+ * encode processed normally. */
+bool equirect_blur_write_jpeg_selective(
+    const std::vector<uchar>& source,
+    const cv::Mat& original,
+    const cv::Mat& processed,
+    const std::string& output_file,
+    JpegSelectiveStats* stats = nullptr);
@@ -0,0 +1,162 @@
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <iterator>
+#include <tuple>
+
+#include "equirect-blur-manifest.h"
+#include "equirect-blur-sidecar.h"
+
+static std::string format_rects(const std::vector<cv::Rect>& rects)
+{
+    char buf[64];
+    std::string ret = "[";
+
+    for (size_t r = 0; r < rects.size(); r++) {
+        const cv::Rect& rect = rects[r];
+        snprintf(buf, sizeof(buf), "%s[%d,%d,%d,%d]", r > 0 ? "," : "", rect.x, rect.y, rect.width, rect.height);
+        ret += buf;
+    }
+    return ret + "]";
+}
+
+static std::string format_regions(const DirtyRegions& regions)
+{
+    char buf[128];
+    std::string line;
+
+    line += "{\"file\":\"" + json_escape(regions.file) + "\"";
+    snprintf(buf,
+             sizeof(buf),
+             ",\"width\":%d,\"height\":%d,\"obscure\":\"%s\"",
+             regions.size.width,
+             regions.size.height,
+             regions.obscure.c_str());
+    line += buf;
+
+    line += ",\"rects\":" + format_rects(regions.rects);
+    if (regions.compared)
+        line += ",\"changed\":" + format_rects(regions.changed);
+    line += "}";
+
+    return line;
+}
+
+static void parse_rects(const cv::FileNode& node, std::vector<cv::Rect>& rects)
+{
+    for (const cv::FileNode& rect : node) {
+        rects.emplace_back(
+            static_cast<int>(rect[0]), static_cast<int>(rect[1]), static_cast<int>(rect[2]), static_cast<int>(rect[3]));
+    }
+}
+
+static bool parse_regions(const std::string& line, DirtyRegions& regions)
+{
+    try {
+        const cv::FileStorage fs(line, cv::FileStorage::READ | cv::FileStorage::MEMORY | cv::FileStorage::FORMAT_JSON);
+        if (!fs.isOpened())
+            return false;
+
+        regions.file = static_cast<std::string>(fs["file"]);
+        regions.size = cv::Size(static_cast<int>(fs["width"]), static_cast<int>(fs["height"]));
+        regions.obscure = static_cast<std::string>(fs["obscure"]);
+        parse_rects(fs["rects"], regions.rects);
+        if (!fs["changed"].empty()) {
+            regions.compared = true;
+            parse_rects(fs["changed"], regions.changed);
+        }
+    }
+    catch (const cv::Exception& e) {
+        std::cerr << "Failed to parse manifest: " << e.what() << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool ManifestWriter::open(const std::string& path)
+{
+    out_.open(path, std::ios::out | std::ios::trunc);
+    return out_.is_open();
+}
+
+bool ManifestWriter::is_open() const
+{
+    return out_.is_open();
+}
+
+void ManifestWriter::write(const DirtyRegions& regions)
+{
+    const std::string line = format_regions(regions);
+
+    std::lock_guard lock(lock_);
+    out_ << line << '\n';
+    out_.flush();
+}
+
+bool ManifestReader::load(const std::string& path)
+{
+    std::ifstream in(path);
+    if (!in.is_open()) {
+        std::cerr << "Can't open manifest file " << path << std::endl;
+        return false;
+    }
+
+    std::string line;
+    int line_no = 0;
+    while (std::getline(in, line)) {
+        line_no++;
+        if (line.empty())
+            continue;
+
+        DirtyRegions regions;
+        if (!parse_regions(line, regions)) {
+            std::cerr << "Invalid manifest entry at " << path << ":" << line_no << std::endl;
+            return false;
+        }
+
+        by_file_[regions.file] = images_.size();
+        images_.push_back(std::move(regions));
+    }
+
+    return true;
+}
+
+const DirtyRegions* ManifestReader::find_file(const std::string& file) const
+{
+    const auto it = by_file_.find(file);
+    return it != by_file_.end() ? &images_[it->second] : nullptr;
+}
+
+static bool rect_less(const cv::Rect& a, const cv::Rect& b)
+{
+    return std::tie(a.y, a.x, a.height, a.width) < std::tie(b.y, b.x, b.height, b.width);
+}
+
+static std::vector<cv::Rect> sorted_rects(std::vector<cv::Rect> rects)
+{
+    std::sort(rects.begin(), rects.end(), rect_less);
+    rects.erase(std::unique(rects.begin(), rects.end()), rects.end());
+    return rects;
+}
+
+void equirect_blur_compare_regions(const DirtyRegions* previous, DirtyRegions& current)
+{
+    current.compared = true;
+    current.changed.clear();
+
+    if (previous == nullptr || previous->size != current.size) {
+        current.changed.emplace_back(0, 0, current.size.width, current.size.height);
+        return;
+    }
+
+    const std::vector<cv::Rect> before = sorted_rects(previous->rects);
+    const std::vector<cv::Rect> after = sorted_rects(current.rects);
+    if (before == after && previous->obscure == current.obscure)
+        return;
+
+    /* Both the old obscured areas (now back to the input, or obscured differently)
+     * and the new ones need redoing */
+    std::set_union(
+        before.begin(), before.end(), after.begin(), after.end(), std::back_inserter(current.changed), rect_less);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <opencv2/core.hpp>
+#include <string>
+#include <vector>
+
+/* The parts of one image that processing overwrote. Manifest files store one
+ * image per line as a JSON object:
+ *
+ * {"file":"IMG_0012.jpg","width":5760,"height":2880,"obscure":"blur","rects":[[3641,1242,52,55]],
+ *   "changed":[[3641,1242,52,55],[120,1400,40,41]]}
+ *
+ * rects are the equirect rects written when obscuring faces, which can overlap.
+ * Everything outside them is exactly the input image. "changed" is only present
+ * when the run was compared against a previous manifest, and lists the rects
+ * where the output may differ from the previous run's: empty if nothing
+ * changed, and the whole frame if the image wasn't in the previous manifest */
+struct DirtyRegions {
+    std::string file;
+    cv::Size size;
+    std::string obscure = "blur"; /* How faces were obscured, see equirect_blur_obscure_name() */
+    std::vector<cv::Rect> rects;
+
+    bool compared = false;
+    std::vector<cv::Rect> changed;
+};
+
+class ManifestWriter {
+public:
+    bool open(const std::string& path);
+    [[nodiscard]] bool is_open() const;
+    void write(const DirtyRegions& regions);
+
+private:
+    std::ofstream out_;
+    std::mutex lock_;
+};
+
+class ManifestReader {
+public:
+    bool load(const std::string& path);
+
+    [[nodiscard]] const DirtyRegions* find_file(const std::string& file) const;
+
+private:
+    std::vector<DirtyRegions> images_;
+    std::map<std::string, size_t> by_file_;
+};
+
+/* Fill in current.changed from the previous run's regions for the same image
+ * (or nullptr if it had none). Pixels outside both runs' rects are the input
+ * in both outputs, so only those rects can differ, and none of them do if the
+ * same rects were obscured the same way */
+void equirect_blur_compare_regions(const DirtyRegions* previous, DirtyRegions& current);
@@ -0,0 +1,189 @@
+#include <mutex>
+
+#include <opencv2/core.hpp>
+
+#include "equirect-blur-memory.h"
+
+static constexpr size_t memory_uses = static_cast<size_t>(MemoryUse::COUNT);
+
+struct MemoryState {
+    std::mutex lock;
+    MemoryUsage usage[memory_uses + 1]; /* By subsystem, with the total last */
+};
+
+/* Never destroyed, as static charges (like the projection cache's) are
+ * released while the process exits, in no particular order */
+static MemoryState& memory_state()
+{
+    static auto* state = new MemoryState();
+    return *state;
+}
+
+/* Add (or with a negative change, remove) bytes charged to use */
+static void charge(const MemoryUse use, const int64_t change)
+{
+    if (change == 0)
+        return;
+
+    MemoryState& state = memory_state();
+    std::lock_guard lock(state.lock);
+    for (MemoryUsage* usage : { &state.usage[static_cast<size_t>(use)], &state.usage[memory_uses] }) {
+        usage->bytes = static_cast<uint64_t>(static_cast<int64_t>(usage->bytes) + change);
+        usage->peak_bytes = MAX(usage->peak_bytes, usage->bytes);
+    }
+}
+
+const char* equirect_blur_memory_name(const MemoryUse use)
+{
+    switch (use) {
+    case MemoryUse::MAPS:
+        return "maps";
+    case MemoryUse::MODELS:
+        return "models";
+    case MemoryUse::SCRATCH:
+        return "scratch";
+    case MemoryUse::FRAMES:
+        return "frames";
+    default:
+        return "total";
+    }
+}
+
+MemoryUsage equirect_blur_memory_usage(const MemoryUse use)
+{
+    MemoryState& state = memory_state();
+    std::lock_guard lock(state.lock);
+    return state.usage[MIN(static_cast<size_t>(use), memory_uses)];
+}
+
+std::string equirect_blur_memory_report()
+{
+    std::string report = cv::format(
+        "Peak memory: %.0f MB (",
+        static_cast<double>(equirect_blur_memory_usage(MemoryUse::COUNT).peak_bytes) / (1 << 20));
+    for (size_t i = 0; i < memory_uses; i++) {
+        const auto use = static_cast<MemoryUse>(i);
+        report += cv::format(
+            "%s%s %.0f MB",
+            i > 0 ? ", " : "",
+            equirect_blur_memory_name(use),
+            static_cast<double>(equirect_blur_memory_usage(use).peak_bytes) / (1 << 20));
+    }
+    return report + ")";
+}
+
+MemoryCharge::MemoryCharge(const MemoryUse use, const size_t bytes)
+    : use_(use)
+{
+    set(bytes);
+}
+
+MemoryCharge::~MemoryCharge()
+{
+    set(0);
+}
+
+MemoryCharge::MemoryCharge(MemoryCharge&& other) noexcept
+    : use_(other.use_)
+    , bytes_(other.bytes_)
+{
+    other.bytes_ = 0;
+}
+
+MemoryCharge& MemoryCharge::operator=(MemoryCharge&& other) noexcept
+{
+    if (this != &other) {
+        set(0);
+        use_ = other.use_;
+        bytes_ = other.bytes_;
+        other.bytes_ = 0;
+    }
+    return *this;
+}
+
+void MemoryCharge::set(const size_t bytes)
+{
+    charge(use_, static_cast<int64_t>(bytes) - static_cast<int64_t>(bytes_));
+    bytes_ = bytes;
+}
+
+size_t MemoryCharge::bytes() const
+{
+    return bytes_;
+}
+
+MemoryGate::MemoryGate(const size_t budget, const int workers)
+    : budget_(budget)
+    , workers_(workers)
+{
+}
+
+bool MemoryGate::enter(const size_t bytes)
+{
+    if (budget_ == 0)
+        return true;
+
+    std::unique_lock lock(lock_);
+    changed_.wait(lock, [&] {
+        return stopped_ || (waiting_ >= workers_ && pending_ == 0)
+            || equirect_blur_memory_usage(MemoryUse::COUNT).bytes + bytes <= budget_;
+    });
+    return !stopped_;
+}
+
+void MemoryGate::released()
+{
+    if (budget_ == 0)
+        return;
+
+    /* Taking the lock orders this with a waiting thread's check */
+    {
+        std::lock_guard lock(lock_);
+    }
+    changed_.notify_all();
+}
+
+void MemoryGate::releasing(const bool pending)
+{
+    if (budget_ == 0)
+        return;
+
+    {
+        std::lock_guard lock(lock_);
+        pending_ += pending ? 1 : -1;
+    }
+    changed_.notify_all();
+}
+
+void MemoryGate::worker_waiting(const bool waiting)
+{
+    if (budget_ == 0)
+        return;
+
+    {
+        std::lock_guard lock(lock_);
+        waiting_ += waiting ? 1 : -1;
+    }
+    changed_.notify_all();
+}
+
+void MemoryGate::add_workers(const int count)
+{
+    if (budget_ == 0)
+        return;
+
+    {
+        std::lock_guard lock(lock_);
+        workers_ += count;
+    }
+    changed_.notify_all();
+}
+
+void MemoryGate::stop()
+{
+    {
+        std::lock_guard lock(lock_);
+        stopped_ = true;
+    }
+    changed_.notify_all();
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+/* Accounting of the large allocations made while processing frames, by the
+ * subsystem that holds them, for the whole process. The figures are the sizes
+ * of the buffers as they are charged (and, for the detectors, the networks'
+ * own estimates), not what the allocator has mapped, but they cover what
+ * grows with the frame size, projection count and worker count */
+enum class MemoryUse {
+    MAPS, /* Projection remap tables and cube face maps */
+    MODELS, /* Detector network weights */
+    SCRATCH, /* Per-worker buffers and each detector's padded image, pyramid and activations */
+    FRAMES, /* Decoded frames in flight between the pipeline stages */
+    COUNT
+};
+
+/* maps, models, scratch or frames */
+const char* equirect_blur_memory_name(MemoryUse use);
+
+/* Bytes charged to one subsystem now, and the most there have been at once */
+struct MemoryUsage {
+    uint64_t bytes = 0;
+    uint64_t peak_bytes = 0;
+};
+
+/* Usage of one subsystem, or with MemoryUse::COUNT of all of them together.
+ * The total's peak is the most charged at once, which can be less than the sum
+ * of the subsystems' peaks */
+MemoryUsage equirect_blur_memory_usage(MemoryUse use);
+
+/* One line summing up the peaks, e.g. for printing at exit */
+std::string equirect_blur_memory_report();
+
+/* Bytes charged to a subsystem for as long as this lives. set() follows a
+ * buffer as it grows or shrinks. Moving a charge moves the bytes with it, so a
+ * frame's charge can travel with it through the pipeline's queues */
+class MemoryCharge {
+public:
+    explicit MemoryCharge(MemoryUse use, size_t bytes = 0);
+    ~MemoryCharge();
+
+    MemoryCharge(MemoryCharge&& other) noexcept;
+    MemoryCharge& operator=(MemoryCharge&& other) noexcept;
+    MemoryCharge(const MemoryCharge&) = delete;
+    MemoryCharge& operator=(const MemoryCharge&) = delete;
+
+    void set(size_t bytes);
+    [[nodiscard]] size_t bytes() const;
+
+private:
+    MemoryUse use_;
+    size_t bytes_ = 0;
+};
+
+/* Holds work back while taking on bytes more would take the memory charged to
+ * the process over a budget. Workers (the threads or streams that go on to
+ * free memory, such as equirect-blur-image's detection threads) tell the gate
+ * while they wait for work, and work that has been handed on to free its
+ * memory later (such as an image queued to be written) is counted while it is
+ * pending. When every worker is waiting and nothing is pending, nothing else
+ * would free any memory, so work is let through over the budget rather than
+ * stall the run; it is the only way the budget is exceeded. A budget of 0 lets
+ * everything through */
+class MemoryGate {
+public:
+    MemoryGate(size_t budget, int workers);
+
+    /* Wait until bytes more fit. Returns false once stopped */
+    bool enter(size_t bytes);
+
+    /* Memory has been freed */
+    void released();
+
+    /* Work that will free its memory has been handed on (pending = true), or
+     * it has freed it (false) */
+    void releasing(bool pending);
+
+    /* A worker starts or stops waiting for work */
+    void worker_waiting(bool waiting);
+
+    /* Workers join (a positive count) or leave (negative) */
+    void add_workers(int count);
+
+    void stop();
+
+private:
+    size_t budget_;
+    int workers_;
+    int waiting_ = 0;
+    int pending_ = 0;
+    bool stopped_ = false;
+
+    std::mutex lock_;
+    std::condition_variable changed_;
+};
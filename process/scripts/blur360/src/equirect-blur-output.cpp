@@ -0,0 +1,42 @@
+#include <iostream>
+#include <opencv2/imgcodecs.hpp>
+
+#include "equirect-blur-output.h"
+
+bool equirect_blur_output_format(
+    const std::string& name, const int quality, const int png_compression, OutputFormat& format)
+{
+    format.name = name;
+    format.params.clear();
+
+    if (name == "png") {
+        format.extension = ".png";
+        if (png_compression >= 0)
+            format.params = { cv::IMWRITE_PNG_COMPRESSION, png_compression };
+    }
+    else if (name == "fast-png") {
+        /* The strategy has to follow the level, as setting the level resets it */
+        format.extension = ".png";
+        format.params = {
+            cv::IMWRITE_PNG_COMPRESSION,
+            1,
+            cv::IMWRITE_PNG_STRATEGY,
+            cv::IMWRITE_PNG_STRATEGY_HUFFMAN_ONLY,
+        };
+    }
+    else if (name == "jpeg" || name == "jpg" || name == "jpeg-selective") {
+        format.extension = ".jpg";
+        format.params = { cv::IMWRITE_JPEG_QUALITY, quality };
+    }
+    else if (name == "webp") {
+        /* Quality above 100 selects lossless compression */
+        format.extension = ".webp";
+        format.params = { cv::IMWRITE_WEBP_QUALITY, 101 };
+    }
+    else {
+        std::cerr << "Unknown output format " << name << " (expected one of " OUTPUT_FORMAT_NAMES ")" << std::endl;
+        return false;
+    }
+
+    return true;
+}
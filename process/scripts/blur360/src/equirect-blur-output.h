@@ -0,0 +1,26 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+/* How processed images are written */
+struct OutputFormat {
+    std::string name;
+    std::string extension; /* Including the leading '.' */
+    std::vector<int> params; /* cv::imwrite parameters */
+};
+
+/* Formats accepted by equirect_blur_output_format(), for help text */
+#define OUTPUT_FORMAT_NAMES "png, fast-png, jpeg, jpeg-selective, webp"
+
+/* Look up an output format by name:
+ *   png      - PNG, at png_compression (0-9) or OpenCV's default level if < 0
+ *   fast-png - PNG using zlib's Huffman-only mode, which skips the LZ77
+ *              match search. Much quicker than the higher levels, but not
+ *              than OpenCV 4.11's own default (level 1, run-length)
+ *   jpeg     - JPEG at quality (0-100)
+ *   jpeg-selective - JPEG that only re-encodes the parts of a JPEG input that
+ *              changed (see equirect_blur_write_jpeg_selective()). params are
+ *              for inputs that can't be handled that way
+ *   webp     - lossless WebP */
+bool equirect_blur_output_format(const std::string& name, int quality, int png_compression, OutputFormat& format);
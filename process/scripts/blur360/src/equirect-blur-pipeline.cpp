@@ -0,0 +1,1065 @@
+#include "equirect-blur-pipeline.h"
+#include "equirect-blur-common.h"
+#include "equirect-blur-jpeg.h"
+#include "equirect-blur-manifest.h"
+#include "equirect-blur-queue.h"
+#include "equirect-blur-shared.h"
+#include "equirect-blur-sidecar.h"
+#include "equirect-blur-stats.h"
+#include "equirect-blur-trace.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <thread>
+
+inline bool ends_with(std::string const& value, std::string const& ending)
+{
+    if (ending.size() > value.size())
+        return false;
+    return std::equal(ending.rbegin(), ending.rend(), value.rbegin());
+}
+
+/* An image on its way through the decode -> detect -> write stages */
+struct ImageJob {
+    std::string input_file;
+    std::vector<uchar> source; /* The input file's contents, for jpeg-selective output */
+    cv::Mat image;
+    cv::Mat proxy; /* Reduced resolution copy of image for detection, if decoded that way */
+    SidecarFrame detections;
+    DirtyRegions regions; /* Where image was written to */
+    MemoryCharge memory { MemoryUse::FRAMES }; /* The decoded images and source, from decoding until written */
+};
+
+/* Memory held by a job's images and source */
+static size_t job_bytes(const ImageJob& job)
+{
+    return job.source.size() + job.image.total() * job.image.elemSize() + job.proxy.total() * job.proxy.elemSize();
+}
+
+/* The faces found in the latest image of a sequence run, to seed the next one's search */
+struct RunSeeds {
+    cv::Size size;
+    std::vector<FaceDetection> faces;
+};
+
+/* Time spent working by one stage thread, for the utilisation report */
+struct WorkerStats {
+    std::string name;
+    int images = 0;
+    std::chrono::steady_clock::duration busy {};
+};
+
+cv::CommandLineParser equirect_blur_image_parser(const int argc, const char* const* argv)
+{
+    cv::CommandLineParser parser(
+        argc,
+        argv,
+        "{help h||}"
+        "{blur b|true|If supplied, faces are blurred rather than hidden with rectangles}"
+        "{direct-obscure||Obscure a spherical region of the equirect image around each face, in one pass}"
+        "{obscure-filter|gaussian|Filter for blurring faces: gaussian, box, stack or pixelate}"
+        "{obscure-radius|0|Blur radius (pixelate block size) in face widths (0 = 0.25, or a fixed kernel for gaussian)}"
+        "{thresh t||Detection threshold for all three detector stages (default 0.9175, or from --config)}"
+        "{config||Detector settings and projection layout from this file (e.g. written by equirect-blur-tune)}"
+        "{detect-scale|1|Detect faces in a copy of each image scaled by this (e.g. 0.5), then obscure at full size}"
+        "{scaled-decode||Decode the detection copy straight from the JPEG (--detect-scale of 0.5, 0.25 or 0.125)}"
+        "{models-dir m||Path to PCN models}"
+        "{full-sweep-interval|0|Treat the images as a sequence, and only sweep every this many in full (0 = all)}"
+        "{seed-sweep-scale|0.5|Between full sweeps, also sweep for new faces in a copy scaled by this (0 = don't)}"
+        "{seed-search|4|Between full sweeps, size of the area searched around each face, in face widths}"
+        "{save-detections||Write the detected faces for each image to this file (JSON lines)}"
+        "{load-detections||Obscure the faces listed in this file (from --save-detections) instead of detecting}"
+        "{dirty-manifest||Write the rects changed in each image to this file (JSON lines)}"
+        "{previous-manifest||Compare with this --dirty-manifest from an earlier run, and reprocess every image}"
+        "{projection-cache|0|Memory in MB for cached projection maps of different image sizes (0 = default)}"
+        "{decode-threads|2|Number of threads reading input images}"
+        "{detect-threads|0|Number of threads detecting faces, each with its own detectors (0 = from --memory-budget)}"
+        "{memory-budget|0|Memory in MB to fit the run into, cutting back threads, queues and map precision, and "
+        "holding back decoding while over it unless nothing else would free memory (0 = none)}"
+        "{map-precision|auto|Projection maps in float, or fixed point (25% smaller), or auto (fixed if over budget)}"
+        "{write-threads|2|Number of threads writing output images}"
+        "{queue-depth|4|Number of images waiting between each stage}"
+        "{format f|png|Output image format: " OUTPUT_FORMAT_NAMES "}"
+        "{quality q|95|JPEG quality (0-100)}"
+        "{png-compression|-1|PNG compression level (0-9, -1 for OpenCV's default)}"
+        "{output-dir o||Output directory for the processed images}"
+        "{tiles-dir||Write a Pannellum multires tile set for each image into a directory named after it in here, as "
+        "generate.py would (but OpenCV's Lanczos, unlike PIL's, isn't widened to smooth the smaller levels)}"
+        "{tile-size|512|Tile size in pixels}"
+        "{cube-size|0|Cube face size in pixels for the tiles (0 = keep all the detail)}"
+        "{tile-quality|75|JPEG quality of the tiles (0-100)}"
+        "{fallback-size|1024|Size of the fallback cube faces written with the tiles (0 = none)}"
+        "{serve||Run as a server, taking jobs on this Unix domain socket instead of processing a directory}"
+        "{max-jobs|1|Number of jobs the server runs at once}"
+        "{max-queued|64|Number of jobs the server holds waiting before it turns new ones away}"
+        "{detect-limit|0|Number of detection threads the server runs at once across all jobs (0 = no limit)}"
+        "{warm-size||Frame size (e.g. 5760x2880) to build projection maps and load detectors for at server start}"
+        "{stats||Write stage timings and counters to this file (- for stdout) every --stats-interval seconds}"
+        "{stats-format|json|Format of the --stats file: json or prometheus}"
+        "{stats-interval|10|Seconds between --stats dumps}"
+        "{trace||Write a timeline of every stage to this file (Chrome trace-event JSON, e.g. for ui.perfetto.dev)}"
+        "{@input-dir||Input directory, or a single image}");
+    parser.about("\nA utility that extracts strips of images from an equirectangular source\n"
+                 "image into the relatively undistorted equatorial band, and then uses the OpenCV\n"
+                 "cv::CascadeClassifier class to detect faces and apply blur to them\n");
+
+    return parser;
+}
+
+/* imread() flag for decoding JPEGs straight to scale, or 0 if libjpeg can't */
+static int reduced_decode_flag(const double scale)
+{
+    if (scale == 0.5)
+        return cv::IMREAD_REDUCED_COLOR_2;
+    if (scale == 0.25)
+        return cv::IMREAD_REDUCED_COLOR_4;
+    if (scale == 0.125)
+        return cv::IMREAD_REDUCED_COLOR_8;
+    return 0;
+}
+
+bool equirect_blur_image_config(const cv::CommandLineParser& parser, BlurConfig& config, std::string& error)
+{
+    config = equirect_blur_image_defaults();
+    if (parser.has("config") && !equirect_blur_load_config(parser.get<cv::String>("config"), config, error))
+        return false;
+
+    if (parser.has("thresh")) {
+        const float thresh = parser.get<float>("thresh");
+        if (thresh < 0) {
+            error = "--thresh can't be negative";
+            return false;
+        }
+        config.detector.thresh[0] = config.detector.thresh[1] = config.detector.thresh[2] = thresh;
+    }
+    return true;
+}
+
+bool equirect_blur_image_options(const cv::CommandLineParser& parser, ImageRunOptions& options, std::string& error)
+{
+    options.input = parser.get<cv::String>("@input-dir");
+    options.models_dir = parser.get<cv::String>("models-dir");
+    if (!equirect_blur_image_config(parser, options.config, error))
+        return false;
+    options.obscure.draw_over_faces = !parser.has("blur");
+    options.obscure.direct = parser.has("direct-obscure");
+    options.obscure.radius = parser.get<double>("obscure-radius");
+    if (!equirect_blur_parse_filter(parser.get<cv::String>("obscure-filter"), options.obscure.filter)) {
+        error = "--obscure-filter must be gaussian, box, stack or pixelate";
+        return false;
+    }
+    if (options.obscure.radius < 0) {
+        error = "--obscure-radius can't be negative";
+        return false;
+    }
+
+    options.detect_scale = parser.get<double>("detect-scale");
+    if (options.detect_scale <= 0 || options.detect_scale > 1) {
+        error = "--detect-scale must be more than 0 and at most 1";
+        return false;
+    }
+    options.scaled_decode_flag = parser.has("scaled-decode") ? reduced_decode_flag(options.detect_scale) : 0;
+    if (parser.has("scaled-decode") && options.scaled_decode_flag == 0) {
+        error = "--scaled-decode needs a --detect-scale of 0.5, 0.25 or 0.125";
+        return false;
+    }
+
+    options.full_sweep_interval = parser.get<int>("full-sweep-interval");
+    options.seed_sweep_scale = parser.get<double>("seed-sweep-scale");
+    options.seed_search = parser.get<double>("seed-search");
+    if (options.full_sweep_interval < 0 || options.seed_sweep_scale < 0 || options.seed_sweep_scale > 1
+        || options.seed_search < 1) {
+        error = "Invalid sequence settings";
+        return false;
+    }
+
+    options.output_dir = parser.get<cv::String>("output-dir");
+    options.tiles_dir = parser.get<cv::String>("tiles-dir");
+    if (options.output_dir.empty() && options.tiles_dir.empty()) {
+        error = "Either --output-dir or --tiles-dir is needed";
+        return false;
+    }
+
+    options.tile_options.tile_size = parser.get<int>("tile-size");
+    options.tile_options.cube_size = parser.get<int>("cube-size");
+    options.tile_options.quality = parser.get<int>("tile-quality");
+    options.tile_options.fallback_size = parser.get<int>("fallback-size");
+    if (options.tile_options.tile_size < 1 || options.tile_options.cube_size < 0
+        || options.tile_options.fallback_size < 0) {
+        error = "Invalid tile or cube size";
+        return false;
+    }
+
+    options.decode_threads = parser.get<int>("decode-threads");
+    options.detect_threads = parser.get<int>("detect-threads");
+    options.write_threads = parser.get<int>("write-threads");
+    options.queue_depth = parser.get<int>("queue-depth");
+    options.memory_budget_mb = parser.get<double>("memory-budget");
+    if (options.decode_threads < 1 || options.detect_threads < 0 || options.write_threads < 1
+        || options.queue_depth < 1) {
+        error = "Thread counts and queue depth must be at least 1";
+        return false;
+    }
+
+    const std::string map_precision = parser.get<cv::String>("map-precision");
+    options.auto_map_precision = map_precision == "auto";
+    options.map_precision = map_precision == "fixed" ? MapPrecision::FIXED : MapPrecision::FLOAT;
+    if (map_precision != "auto" && map_precision != "float" && map_precision != "fixed") {
+        error = "--map-precision must be float, fixed or auto";
+        return false;
+    }
+
+    if (!equirect_blur_output_format(
+            parser.get<cv::String>("format"),
+            parser.get<int>("quality"),
+            parser.get<int>("png-compression"),
+            options.format)) {
+        error = "Unknown output format " + parser.get<cv::String>("format");
+        return false;
+    }
+    if (options.format.name == "jpeg-selective" && !equirect_blur_jpeg_selective_available()) {
+        error = "jpeg-selective output needs blur360 to be built with libjpeg";
+        return false;
+    }
+
+    if (parser.has("save-detections"))
+        options.save_detections = parser.get<cv::String>("save-detections");
+    if (parser.has("load-detections"))
+        options.load_detections = parser.get<cv::String>("load-detections");
+    if (parser.has("dirty-manifest"))
+        options.dirty_manifest = parser.get<cv::String>("dirty-manifest");
+    if (parser.has("previous-manifest"))
+        options.previous_manifest = parser.get<cv::String>("previous-manifest");
+
+    return true;
+}
+
+WorkerDetectors::WorkerDetectors(const size_t max_in_use)
+    : max_in_use_(max_in_use)
+{
+}
+
+WorkerDetectors::~WorkerDetectors()
+{
+    for (const auto& [models_dir, detectors] : idle_) {
+        for (const PCN* detector : detectors)
+            delete detector;
+    }
+}
+
+PCN* WorkerDetectors::acquire(const std::string& models_dir, const DetectorSettings& settings)
+{
+    PCN* detector = nullptr;
+    {
+        std::unique_lock lock(lock_);
+        idle_cond_.wait(lock, [this] { return max_in_use_ == 0 || in_use_ < max_in_use_; });
+        in_use_++;
+
+        std::vector<PCN*>& idle = idle_[models_dir];
+        if (!idle.empty()) {
+            detector = idle.back();
+            idle.pop_back();
+        }
+    }
+
+    /* The detection settings are all that differ between runs. A new detector
+     * loads its models without holding the lock */
+    if (detector != nullptr)
+        equirect_blur_apply_detector_settings(*detector, settings);
+    else
+        detector = equirect_blur_create_detector(models_dir, settings, false);
+
+    return detector;
+}
+
+void WorkerDetectors::release(const std::string& models_dir, PCN* detector)
+{
+    {
+        std::lock_guard lock(lock_);
+        idle_[models_dir].push_back(detector);
+        in_use_--;
+    }
+    idle_cond_.notify_one();
+}
+
+const TileWriter* TileWriters::get(const cv::Size& size, const TileOptions& options)
+{
+    std::lock_guard lock(lock_);
+
+    const auto key = std::make_tuple(
+        size.width,
+        size.height,
+        options.tile_size,
+        options.cube_size,
+        options.fallback_size,
+        options.quality,
+        options.hfov);
+    std::unique_ptr<TileWriter>& tiles = writers_[key];
+    if (!tiles) {
+        std::cout << "Preparing cube face maps for " << size.width << " x " << size.height << std::endl;
+        tiles = std::make_unique<TileWriter>(size, options);
+        std::cout << "Tiles: " << tiles->levels() << " levels, cube size " << tiles->cube_size() << std::endl;
+    }
+    return tiles.get();
+}
+
+/* The thread counts, queue depth and map precision a run uses */
+struct RunPlan {
+    int decode_threads;
+    int detect_threads;
+    int write_threads;
+    int queue_depth;
+    MapPrecision map_precision;
+};
+
+/* Estimated memory for a run: shared by all the detection workers, and for each
+ * of them */
+struct MemoryEstimate {
+    size_t shared;
+    size_t worker;
+};
+
+/* Estimate a run's memory under plan. The projection maps (for each size the
+ * workers detect at), the tile maps and the images waiting in queues are shared.
+ * Each detection worker adds the image it is working on, its cropped scratch
+ * image and its detector, which it runs on each projection in turn. A detector
+ * takes about its model files' size, and while it runs its padded image with
+ * the three rotations of it, and the float activations of the image pyramid for
+ * the cropped image (roughly 3x the input blob) */
+static MemoryEstimate estimate_run_memory(
+    const ImageRunOptions& options,
+    const RunPlan& plan,
+    const cv::Size& image_size,
+    const bool sequence,
+    const bool render_only)
+{
+    const ProjectionLayout& layout = options.config.layout;
+    const auto scaled = [&image_size](const double scale) {
+        return cv::Size(
+            static_cast<int>(std::lround(image_size.width * scale)),
+            static_cast<int>(std::lround(image_size.height * scale)));
+    };
+
+    size_t frame_bytes = static_cast<size_t>(image_size.area()) * 3;
+    size_t maps_bytes = equirect_blur_projection_map_bytes(image_size, layout, plan.map_precision);
+    if (!render_only && options.detect_scale < 1) {
+        frame_bytes += static_cast<size_t>(scaled(options.detect_scale).area()) * 3;
+        maps_bytes += equirect_blur_projection_map_bytes(scaled(options.detect_scale), layout, plan.map_precision);
+    }
+    if (sequence && options.seed_sweep_scale > 0)
+        maps_bytes += equirect_blur_projection_map_bytes(scaled(options.seed_sweep_scale), layout, plan.map_precision);
+    if (!options.tiles_dir.empty()) {
+        const int cube_size = options.tile_options.cube_size > 0 ? options.tile_options.cube_size
+                                                                 : 8 * static_cast<int>(image_size.width / M_PI / 8);
+        maps_bytes += 6 * static_cast<size_t>(cube_size) * static_cast<size_t>(cube_size) * sizeof(cv::Vec2f);
+    }
+
+    const size_t model_bytes = equirect_blur_model_bytes(options.models_dir);
+    const cv::Size cropped = Projection::view_size_for(image_size, layout.aperture);
+    const size_t cropped_bytes = static_cast<size_t>(cropped.area()) * 3;
+
+    /* The detector pads the cropped image by a fifth on each side (at most 100
+     * pixels) and keeps it with its three rotations, as PCN's ScratchBytes() */
+    const cv::Size padded(
+        cropped.width + 2 * MIN(cropped.width / 5, 100), cropped.height + 2 * MIN(cropped.height / 5, 100));
+    const size_t padded_bytes = 4 * static_cast<size_t>(padded.area()) * 3;
+    const size_t detector_bytes = render_only ? 0 : model_bytes + padded_bytes + cropped_bytes * sizeof(float) * 3;
+
+    /* Sequence mode has a queue for each run being detected, and for one run
+     * being decoded ahead by each decode thread, in place of the detect queue */
+    const size_t decoded_images = sequence ? static_cast<size_t>(plan.decode_threads) * plan.queue_depth
+                                           : static_cast<size_t>(plan.queue_depth);
+    const size_t images_in_flight = decoded_images + plan.queue_depth + plan.decode_threads + plan.write_threads;
+    const size_t worker_images = 1 + (sequence ? plan.queue_depth : 0);
+
+    return {
+        maps_bytes + images_in_flight * frame_bytes,
+        worker_images * frame_bytes + cropped_bytes + detector_bytes,
+    };
+}
+
+/* Fit a run into options.memory_budget_mb, if it is set: give up the map
+ * precision, then queue depth, then decode and write threads until one
+ * detection worker (or detect_threads, if set) fits, then fill the rest of the
+ * budget with detection workers. Returns false with a message in error if even
+ * the smallest run doesn't fit */
+static bool plan_run(
+    const ImageRunOptions& options,
+    const cv::Size& image_size,
+    const bool sequence,
+    const bool render_only,
+    RunPlan& plan,
+    std::string& error)
+{
+    plan = { options.decode_threads,
+             options.detect_threads,
+             options.write_threads,
+             options.queue_depth,
+             options.map_precision };
+    if (options.memory_budget_mb <= 0) {
+        plan.detect_threads = MAX(plan.detect_threads, 1);
+        return true;
+    }
+
+    const auto budget = static_cast<size_t>(options.memory_budget_mb * 1024 * 1024);
+    MemoryEstimate estimate {};
+    for (;;) {
+        estimate = estimate_run_memory(options, plan, image_size, sequence, render_only);
+        if (estimate.shared + static_cast<size_t>(MAX(plan.detect_threads, 1)) * estimate.worker <= budget)
+            break;
+
+        if (options.auto_map_precision && plan.map_precision == MapPrecision::FLOAT) {
+            plan.map_precision = MapPrecision::FIXED;
+        }
+        else if (plan.queue_depth > 1) {
+            plan.queue_depth /= 2;
+        }
+        else if (plan.decode_threads > 1 || plan.write_threads > 1) {
+            plan.decode_threads = MAX(plan.decode_threads - 1, 1);
+            plan.write_threads = MAX(plan.write_threads - 1, 1);
+        }
+        else {
+            error = cv::format(
+                "Memory budget of %.0f MB is too small for %d x %d images, which need about %zu MB",
+                options.memory_budget_mb,
+                image_size.width,
+                image_size.height,
+                (estimate.shared + static_cast<size_t>(MAX(plan.detect_threads, 1)) * estimate.worker) >> 20);
+            return false;
+        }
+    }
+
+    if (plan.detect_threads == 0) {
+        const size_t workers = (budget - estimate.shared) / estimate.worker;
+        plan.detect_threads
+            = static_cast<int>(std::clamp<size_t>(workers, 1, MAX(std::thread::hardware_concurrency(), 1u)));
+    }
+
+    std::cout << "Memory estimate: " << (estimate.shared >> 20) << " MB shared, " << (estimate.worker >> 20)
+              << " MB per detection worker" << std::endl;
+    std::cout << "Fitting " << options.memory_budget_mb << " MB with "
+              << (plan.map_precision == MapPrecision::FIXED ? "fixed point" : "float") << " maps, "
+              << plan.decode_threads << " decode threads, " << plan.write_threads << " write threads and queue depth "
+              << plan.queue_depth << std::endl;
+    return true;
+}
+
+/* Read a whole file into data */
+static bool read_file(const std::string& path, std::vector<uchar>& data)
+{
+    std::ifstream in(path, std::ios::in | std::ios::binary);
+    if (!in.is_open())
+        return false;
+
+    data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    return !in.bad();
+}
+
+/* Switch projections to the (cached) set for frames of size, with the worker's
+ * detector attached to each, unless they are already for that size */
+static void use_projections(
+    std::vector<Projection>& projections,
+    cv::Size& projections_size,
+    const cv::Size& size,
+    const ProjectionLayout& layout,
+    const MapPrecision precision,
+    PCN* detector)
+{
+    if (size == projections_size)
+        return;
+
+    projections_size = size;
+    projections = equirect_blur_shared_projections(size, layout, precision);
+    for (Projection& p : projections)
+        p.detector = detector;
+}
+
+/* The .jpg files to process, leaving out those whose outputs all exist unless
+ * every image is being compared with a previous run */
+static std::vector<std::string> input_files(const ImageRunOptions& options)
+{
+    std::vector<std::filesystem::path> candidates;
+    if (!options.files.empty()) {
+        candidates.assign(options.files.begin(), options.files.end());
+    }
+    else if (std::filesystem::is_directory(options.input)) {
+        for (const auto& file : std::filesystem::directory_iterator(options.input)) {
+            std::cout << "File: " << file.path().u8string() << std::endl;
+            candidates.push_back(file.path());
+        }
+    }
+    else {
+        candidates.emplace_back(options.input);
+    }
+
+    std::vector<std::string> files;
+    for (const std::filesystem::path& file : candidates) {
+        std::string file_str_lowered = file.u8string();
+        std::transform(
+            file_str_lowered.begin(), file_str_lowered.end(), file_str_lowered.begin(), [](const unsigned char c) {
+                return std::tolower(c);
+            });
+        if (ends_with(file_str_lowered, ".jpg") == true) {
+            std::filesystem::path output_dir_path(options.output_dir);
+            std::filesystem::path output_file = output_dir_path / file.filename();
+            output_file.replace_extension(options.format.extension);
+            const std::filesystem::path tiles_config
+                = std::filesystem::path(options.tiles_dir) / file.stem() / "config.json";
+            if (!options.previous_manifest.empty() || (!options.output_dir.empty() && !exists(output_file))
+                || (!options.tiles_dir.empty() && !exists(tiles_config))) {
+                std::cout << "Input File: " << file.u8string() << std::endl;
+                files.push_back(file.u8string());
+            }
+        }
+    }
+    std::sort(files.begin(), files.end());
+
+    return files;
+}
+
+bool equirect_blur_run_images(
+    const ImageRunOptions& options,
+    ImageResources& resources,
+    ImageRunResult& result,
+    const std::function<void(const ImageRunProgress&)>& progress,
+    const std::atomic<bool>* cancel)
+{
+    const std::vector<std::string> files = input_files(options);
+    result.total = files.size();
+    result.processed = 0;
+
+    int first_width, first_height;
+    if (!files.empty()) {
+        cv::Mat im = cv::imread(files[0]);
+        first_width = im.cols;
+        first_height = im.rows;
+    }
+    else {
+        return true;
+    }
+    if (first_width == 0) {
+        result.error = "Can't open image file " + files[0];
+        std::cerr << result.error << std::endl;
+        return false;
+    }
+
+    const ObscureOptions obscure = options.obscure;
+    BlurStats* const run_stats = resources.stats;
+    const bool selective_jpeg = options.format.name == "jpeg-selective";
+    const int scaled_decode_flag = options.scaled_decode_flag;
+    const double detect_scale = options.detect_scale;
+
+    SidecarWriter detections_out;
+    if (!options.save_detections.empty() && !detections_out.open(options.save_detections)) {
+        result.error = "Can't open detections file " + options.save_detections;
+        std::cerr << result.error << std::endl;
+        return false;
+    }
+
+    SidecarReader detections_in;
+    const bool render_only = !options.load_detections.empty();
+    if (render_only && !detections_in.load(options.load_detections)) {
+        result.error = "Can't load detections file " + options.load_detections;
+        return false;
+    }
+
+    ManifestWriter manifest_out;
+    if (!options.dirty_manifest.empty() && !manifest_out.open(options.dirty_manifest)) {
+        result.error = "Can't open manifest file " + options.dirty_manifest;
+        std::cerr << result.error << std::endl;
+        return false;
+    }
+
+    ManifestReader previous_manifest;
+    const bool compare_manifest = !options.previous_manifest.empty();
+    if (compare_manifest && !previous_manifest.load(options.previous_manifest)) {
+        result.error = "Can't load manifest file " + options.previous_manifest;
+        return false;
+    }
+
+    /* In sequence mode, images are detected in runs of full_sweep_interval. The
+     * first of each run gets a full sweep, and the rest are seeded from the image
+     * before, so each run is detected in order by one detection thread. Decode
+     * threads fill whichever runs have room (see RunQueues), so every detection
+     * thread can have a run in progress however many decode threads there are */
+    const bool sequence = options.full_sweep_interval > 1 && !render_only;
+    const size_t run_length = sequence ? options.full_sweep_interval : 1;
+
+    cv::Size image_size(first_width, first_height);
+    RunPlan plan {};
+    if (!plan_run(options, image_size, sequence, render_only, plan, result.error)) {
+        std::cerr << result.error << std::endl;
+        return false;
+    }
+    const int decode_threads = plan.decode_threads;
+    const int detect_threads = plan.detect_threads;
+    const int write_threads = plan.write_threads;
+    const int queue_depth = plan.queue_depth;
+    const MapPrecision map_precision = plan.map_precision;
+    std::cout << "Using " << detect_threads << " detection threads" << std::endl;
+
+    /* Prepare cropped projection maps for processing. Images of other sizes get
+     * theirs from the cache as they turn up */
+    std::cout << "Compiling detectors" << std::endl;
+    const std::vector<Projection> projections
+        = equirect_blur_shared_projections(image_size, options.config.layout, map_precision);
+
+    /* One entry per thread, in the order the threads are started */
+    std::vector<WorkerStats> stats;
+    for (int i = 0; i < decode_threads; i++)
+        stats.push_back({ "decode-" + std::to_string(i) });
+    for (int i = 0; i < detect_threads; i++)
+        stats.push_back({ "detect-" + std::to_string(i) });
+    for (int i = 0; i < write_threads; i++)
+        stats.push_back({ "write-" + std::to_string(i) });
+
+    /* Images are streamed through three stages, each with its own threads:
+     * decode -> detect_queue -> detect and obscure -> write_queue -> encode and write.
+     * The bounded queues keep memory use independent of the number of images */
+    WorkQueue<ImageJob> detect_queue(queue_depth);
+    WorkQueue<ImageJob> write_queue(queue_depth);
+
+    /* Each decode thread can be filling a run ahead of the detection threads */
+    RunQueues<ImageJob> run_queues(files.size(), run_length, queue_depth, detect_threads + decode_threads);
+    std::atomic<int> full_sweeps { 0 };
+    std::atomic<int> seeded_searches { 0 };
+
+    /* The memory budget is kept to as images are decoded, expecting each to
+     * be as big as the biggest so far. plan_run() fits the run to the first
+     * image's size, and the gate keeps to the budget when later images are
+     * bigger, or the estimate is short. The detection threads are its workers,
+     * and images queued to be written are pending until they are */
+    MemoryGate memory_gate(
+        options.memory_budget_mb > 0 ? static_cast<size_t>(options.memory_budget_mb * 1024 * 1024) : 0,
+        detect_threads);
+    std::atomic<size_t> largest_job { static_cast<size_t>(image_size.area()) * 3 };
+
+    std::atomic<size_t> next_image { 0 };
+    std::atomic<size_t> done { 0 };
+    std::atomic<bool> stopping { false }; /* No more images are read once set */
+    std::atomic<bool> failed { false }; /* Queued images are discarded once set */
+
+    /* Stop the run, keeping the first reason for the result */
+    std::mutex error_lock;
+    auto fail = [&](const std::string& message) {
+        std::cerr << message << std::endl;
+        std::lock_guard lock(error_lock);
+        if (result.error.empty())
+            result.error = message;
+        failed = stopping = true;
+        run_queues.stop();
+        memory_gate.stop();
+    };
+
+    /* Read and decode image i into job. Returns false if the run has to stop */
+    auto decode_image = [&](WorkerStats& worker, const size_t i, ImageJob& job) {
+        if (cancel != nullptr && *cancel) {
+            fail("Cancelled");
+            return false;
+        }
+        if (!memory_gate.enter(largest_job))
+            return false;
+
+        const auto start = std::chrono::steady_clock::now();
+        BlurTraceFrame trace_frame(static_cast<int64_t>(i));
+        BlurStatsTimer decode_timer(run_stats, "decode");
+
+        job.input_file = files[i];
+        job.detections.frame = static_cast<int64_t>(i);
+        job.detections.file = std::filesystem::path(job.input_file).filename().u8string();
+        job.regions.file = job.detections.file;
+        job.regions.obscure = equirect_blur_obscure_name(obscure);
+
+        std::cout << "Starting to Process: " << job.input_file << std::endl;
+
+        if (selective_jpeg) {
+            /* Keep the file for its coefficients, and leave the pixels in the
+             * same orientation as them. The EXIF orientation is copied over */
+            if (read_file(job.input_file, job.source))
+                job.image = cv::imdecode(job.source, cv::IMREAD_COLOR | cv::IMREAD_IGNORE_ORIENTATION);
+        }
+        else {
+            job.image = cv::imread(job.input_file);
+        }
+        if (job.image.data == nullptr) {
+            fail("Can't open image file " + job.input_file);
+            return false;
+        }
+        job.regions.size = job.image.size();
+        if (run_stats != nullptr) {
+            std::error_code ec;
+            const uintmax_t size = job.source.empty() ? std::filesystem::file_size(job.input_file, ec)
+                                                      : job.source.size();
+            run_stats->add_count("bytes_read", ec ? 0 : static_cast<uint64_t>(size));
+        }
+
+        /* libjpeg can decode at 1/2, 1/4 or 1/8 scale for much less than a full decode */
+        if (scaled_decode_flag != 0 && !render_only) {
+            job.proxy = selective_jpeg
+                ? cv::imdecode(job.source, scaled_decode_flag | cv::IMREAD_IGNORE_ORIENTATION)
+                : cv::imread(job.input_file, scaled_decode_flag);
+        }
+
+        job.memory.set(job_bytes(job));
+        for (size_t largest = largest_job; job.memory.bytes() > largest;) {
+            if (largest_job.compare_exchange_weak(largest, job.memory.bytes()))
+                break;
+        }
+        decode_timer.stop();
+        worker.images++;
+        worker.busy += std::chrono::steady_clock::now() - start;
+        return true;
+    };
+
+    auto decode_worker = [&](WorkerStats& worker) {
+        equirect_blur_trace_thread_name(worker.name);
+        if (sequence) {
+            size_t run, i;
+            while (!stopping && run_queues.next(run, i)) {
+                ImageJob job;
+                if (!decode_image(worker, i, job))
+                    break;
+                run_queues.push(run, std::move(job));
+            }
+            return;
+        }
+
+        for (size_t i = next_image++; i < files.size() && !stopping; i = next_image++) {
+            ImageJob job;
+            if (!decode_image(worker, i, job))
+                break;
+            detect_queue.push(std::move(job));
+        }
+    };
+
+    auto detect_worker = [&](WorkerStats& worker) {
+        equirect_blur_trace_thread_name(worker.name);
+        PCN* detector
+            = render_only ? nullptr : resources.detectors.acquire(options.models_dir, options.config.detector);
+        cv::Size projections_size, proxy_projections_size, sweep_projections_size;
+        std::vector<Projection> worker_projections, proxy_projections, sweep_projections;
+        FrameScratch scratch;
+        cv::Mat sweep;
+
+        /* Detect and obscure one image, seeded from the faces in the image before
+         * it in its run if seeds is set */
+        auto detect_image = [&](ImageJob& job, RunSeeds* seeds) {
+            if (failed)
+                return;
+
+            const auto start = std::chrono::steady_clock::now();
+            BlurTraceFrame trace_frame(job.detections.frame);
+
+            if (job.image.size() != projections_size && projections_size.area() > 0) {
+                std::cout << "Switching to " << job.image.cols << " x " << job.image.rows << " projections at "
+                          << job.input_file << std::endl;
+            }
+            use_projections(
+                worker_projections,
+                projections_size,
+                job.image.size(),
+                options.config.layout,
+                map_precision,
+                detector);
+
+            const bool seeded = seeds != nullptr && seeds->size == job.image.size();
+
+            bool ok;
+            if (render_only) {
+                if (const SidecarFrame* saved = detections_in.find_file(job.detections.file))
+                    job.detections.faces = saved->faces;
+
+                ok = equirect_blur_render_frame(
+                    job.image,
+                    worker_projections,
+                    job.detections.faces,
+                    obscure,
+                    &scratch,
+                    &job.regions.rects,
+                    run_stats);
+            }
+            else if (seeded) {
+                /* Search at full resolution around the previous image's faces,
+                 * and sweep everywhere else quickly at reduced resolution */
+                std::vector<FaceDetection> faces;
+                ok = equirect_blur_detect_near(
+                    job.image,
+                    worker_projections,
+                    seeds->faces,
+                    options.seed_search,
+                    faces,
+                    &scratch,
+                    run_stats);
+                job.proxy.release();
+
+                if (ok && options.seed_sweep_scale > 0) {
+                    const double scale = options.seed_sweep_scale;
+                    cv::resize(job.image, sweep, cv::Size(), scale, scale, cv::INTER_AREA);
+                    use_projections(
+                        sweep_projections,
+                        sweep_projections_size,
+                        sweep.size(),
+                        options.config.layout,
+                        map_precision,
+                        detector);
+
+                    ok = equirect_blur_detect_frame(
+                        sweep, sweep_projections, job.detections.faces, &scratch, run_stats);
+                    equirect_blur_scale_detections(
+                        job.detections.faces, static_cast<double>(job.image.cols) / sweep_projections_size.width);
+                }
+
+                if (ok) {
+                    equirect_blur_merge_detections(faces, job.detections.faces);
+                    job.detections.faces = std::move(faces);
+                    ok = equirect_blur_render_frame(
+                        job.image,
+                        worker_projections,
+                        job.detections.faces,
+                        obscure,
+                        &scratch,
+                        &job.regions.rects,
+                        run_stats);
+                }
+                seeded_searches++;
+            }
+            else if (detect_scale < 1) {
+                /* Find faces in the proxy with projections of its size, and
+                 * obscure them in the full size image */
+                if (job.proxy.empty())
+                    cv::resize(job.image, job.proxy, cv::Size(), detect_scale, detect_scale, cv::INTER_AREA);
+                use_projections(
+                    proxy_projections,
+                    proxy_projections_size,
+                    job.proxy.size(),
+                    options.config.layout,
+                    map_precision,
+                    detector);
+
+                ok = equirect_blur_detect_frame(
+                    job.proxy, proxy_projections, job.detections.faces, &scratch, run_stats);
+                job.proxy.release();
+
+                if (ok) {
+                    const double scale = static_cast<double>(job.image.cols) / proxy_projections_size.width;
+                    equirect_blur_scale_detections(job.detections.faces, scale);
+                    ok = equirect_blur_render_frame(
+                        job.image,
+                        worker_projections,
+                        job.detections.faces,
+                        obscure,
+                        &scratch,
+                        &job.regions.rects,
+                        run_stats);
+                }
+            }
+            else {
+                ok = equirect_blur_process_frame(
+                    job.image,
+                    worker_projections,
+                    obscure,
+                    &job.detections.faces,
+                    &scratch,
+                    &job.regions.rects,
+                    run_stats);
+            }
+
+            if (!ok) {
+                fail("Processing frame failed at " + job.input_file);
+                return;
+            }
+
+            if (run_stats != nullptr)
+                run_stats->add_count("frames");
+
+            if (seeds != nullptr) {
+                if (!seeded)
+                    full_sweeps++;
+                *seeds = { job.image.size(), job.detections.faces };
+            }
+
+            job.memory.set(job_bytes(job));
+            worker.images++;
+            worker.busy += std::chrono::steady_clock::now() - start;
+            memory_gate.releasing(true);
+            write_queue.push(std::move(job));
+        };
+
+        /* Wait for the next image, letting the memory gate know while waiting */
+        auto next_run = [&](size_t& run) {
+            memory_gate.worker_waiting(true);
+            const bool taken = run_queues.take_run(run);
+            memory_gate.worker_waiting(false);
+            return taken;
+        };
+        auto next_job = [&](const size_t run, ImageJob& job) {
+            memory_gate.worker_waiting(true);
+            const bool popped = sequence ? run_queues.pop(run, job) : detect_queue.pop(job);
+            memory_gate.worker_waiting(false);
+            return popped;
+        };
+
+        ImageJob job;
+        if (sequence) {
+            size_t run;
+            while (next_run(run)) {
+                RunSeeds seeds;
+                while (next_job(run, job))
+                    detect_image(job, &seeds);
+            }
+        }
+        else {
+            while (next_job(0, job))
+                detect_image(job, nullptr);
+        }
+
+        /* Projections hold pointers to the detector, so drop them first */
+        worker_projections.clear();
+        proxy_projections.clear();
+        sweep_projections.clear();
+        if (!render_only)
+            resources.detectors.release(options.models_dir, detector);
+    };
+
+    auto write_worker = [&](WorkerStats& worker) {
+        equirect_blur_trace_thread_name(worker.name);
+        const std::filesystem::path output_dir_path(options.output_dir);
+
+        /* Write one image out, unless the run has failed */
+        auto write_image = [&](ImageJob& job) {
+            if (failed)
+                return;
+
+            const auto start = std::chrono::steady_clock::now();
+            BlurTraceFrame trace_frame(job.detections.frame);
+            BlurStatsTimer write_timer(run_stats, "write");
+
+            if (detections_out.is_open())
+                detections_out.write(job.detections);
+            if (compare_manifest)
+                equirect_blur_compare_regions(previous_manifest.find_file(job.regions.file), job.regions);
+            if (manifest_out.is_open())
+                manifest_out.write(job.regions);
+
+            std::filesystem::path input_file_path(job.input_file);
+
+            if (!options.output_dir.empty()) {
+                std::filesystem::path output_file
+                    = output_dir_path / input_file_path.filename().replace_extension(options.format.extension);
+
+                bool written = false;
+                JpegSelectiveStats jpeg_stats;
+                if (selective_jpeg) {
+                    /* Only decode the input again if something may have changed */
+                    const cv::Mat original = job.detections.faces.empty()
+                        ? job.image
+                        : cv::imdecode(job.source, cv::IMREAD_COLOR | cv::IMREAD_IGNORE_ORIENTATION);
+                    written = equirect_blur_write_jpeg_selective(
+                        job.source, original, job.image, output_file.u8string(), &jpeg_stats);
+                    if (!written)
+                        std::cout << "Re-encoding all of " << job.input_file << std::endl;
+                }
+
+                if (!written && !imwrite(output_file.u8string(), job.image, options.format.params)) {
+                    fail("Can't write image file " + output_file.u8string());
+                    return;
+                }
+
+                if (run_stats != nullptr) {
+                    std::error_code ec;
+                    const uintmax_t size = std::filesystem::file_size(output_file, ec);
+                    run_stats->add_count("bytes_written", ec ? 0 : static_cast<uint64_t>(size));
+                }
+
+                if (written) {
+                    std::cout << "Processed: " << output_file.u8string() << " (re-encoded " << jpeg_stats.reencoded
+                              << " of " << jpeg_stats.mcus << " MCUs)" << std::endl;
+                }
+                else {
+                    std::cout << "Processed: " << output_file.u8string() << std::endl;
+                }
+            }
+
+            if (!options.tiles_dir.empty()) {
+                /* Tiles are cut straight from the processed frame, without a full size file in between */
+                const std::filesystem::path tiles_output
+                    = std::filesystem::path(options.tiles_dir) / input_file_path.stem();
+                const std::vector<cv::Rect>* changed = compare_manifest ? &job.regions.changed : nullptr;
+                const TileWriter* tiles = resources.tiles.get(job.image.size(), options.tile_options);
+                if (!tiles->write(job.image, tiles_output.u8string(), changed)) {
+                    fail("Can't write tiles for " + job.input_file);
+                    return;
+                }
+                std::cout << "Tiled: " << tiles_output.u8string() << std::endl;
+            }
+
+            write_timer.stop();
+            worker.images++;
+            worker.busy += std::chrono::steady_clock::now() - start;
+
+            if (progress) {
+                ImageRunProgress image;
+                image.file = job.detections.file;
+                image.faces = job.detections.faces.size();
+                image.done = ++done;
+                image.total = files.size();
+                progress(image);
+            }
+            else {
+                done++;
+            }
+        };
+
+        ImageJob job;
+        while (write_queue.pop(job)) {
+            write_image(job);
+
+            /* Free the image now rather than when the next one arrives, for the memory gate */
+            job = ImageJob();
+            memory_gate.releasing(false);
+        }
+    };
+
+    const auto run_start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> decoders, detectors, writers;
+    size_t worker_index = 0;
+    for (int i = 0; i < decode_threads; i++)
+        decoders.emplace_back(decode_worker, std::ref(stats[worker_index++]));
+    for (int i = 0; i < detect_threads; i++)
+        detectors.emplace_back(detect_worker, std::ref(stats[worker_index++]));
+    for (int i = 0; i < write_threads; i++)
+        writers.emplace_back(write_worker, std::ref(stats[worker_index++]));
+
+    /* Shut the stages down in order, letting each drain its queue */
+    for (std::thread& t : decoders)
+        t.join();
+    detect_queue.close();
+    for (std::thread& t : detectors)
+        t.join();
+    write_queue.close();
+    for (std::thread& t : writers)
+        t.join();
+
+    const std::chrono::duration<double> wall = std::chrono::steady_clock::now() - run_start;
+    std::cout << "Worker utilisation over " << cv::format("%.1f", wall.count()) << " s:" << std::endl;
+    for (const WorkerStats& worker : stats) {
+        const std::chrono::duration<double> busy = worker.busy;
+        const double utilisation = wall.count() > 0 ? 100.0 * busy.count() / wall.count() : 0.0;
+        std::cout << cv::format(
+            "  %-10s %6d images, busy %5.1f%% (%.1f s)", worker.name.c_str(), worker.images, utilisation, busy.count())
+                  << std::endl;
+    }
+
+    if (sequence) {
+        std::cout << "Sequence: " << full_sweeps << " full sweeps, " << seeded_searches << " seeded searches"
+                  << std::endl;
+    }
+
+    result.processed = done;
+    return !failed;
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include "equirect-blur-common.h"
+#include "equirect-blur-config.h"
+#include "equirect-blur-output.h"
+#include "equirect-blur-tiles.h"
+#include "PCN.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <opencv2/core.hpp>
+#include <string>
+#include <tuple>
+#include <vector>
+
+/* Settings for one run of equirect-blur-image over a set of images */
+struct ImageRunOptions {
+    std::string input; /* Directory of .jpg images, or a single image */
+    std::vector<std::string> files; /* Images to process instead of input's, if set */
+
+    std::string models_dir;
+    BlurConfig config; /* Detector settings and projection layout */
+    ObscureOptions obscure;
+    double detect_scale = 1.0;
+    int scaled_decode_flag = 0; /* imread() flag for decoding the detection copy, 0 to resize */
+
+    /* Sequence mode, when more than 1: only every full_sweep_interval'th image
+     * gets a full sweep. The images in between are searched around the previous
+     * image's faces, and swept at seed_sweep_scale (if more than 0) for new ones */
+    int full_sweep_interval = 0;
+    double seed_sweep_scale = 0.5;
+    double seed_search = 4.0; /* Side of the area searched around a face, in face widths */
+
+    std::string save_detections;
+    std::string load_detections;
+    std::string dirty_manifest;
+    std::string previous_manifest;
+
+    int decode_threads = 2;
+    int detect_threads = 0; /* 0 to size from memory_budget_mb */
+    int write_threads = 2;
+    int queue_depth = 4;
+    /* Memory in MB to fit the run into, if more than 0. The map precision (if
+     * automatic), then the queue depth, then the decode and write threads are
+     * cut from the settings here until the estimate fits, and the run fails if
+     * it can't */
+    double memory_budget_mb = 0;
+    MapPrecision map_precision = MapPrecision::FLOAT;
+    bool auto_map_precision = true; /* FIXED if memory_budget_mb needs it, or else FLOAT */
+
+    OutputFormat format;
+    std::string output_dir;
+    std::string tiles_dir;
+    TileOptions tile_options;
+};
+
+/* A parser for equirect-blur-image's command line options */
+cv::CommandLineParser equirect_blur_image_parser(int argc, const char* const* argv);
+
+/* The detector settings and projection layout from a parser's --config and
+ * --thresh, over equirect-blur-image's defaults. Returns false with a message
+ * in error if the config file can't be loaded */
+bool equirect_blur_image_config(const cv::CommandLineParser& parser, BlurConfig& config, std::string& error);
+
+/* Fill in options from a parser made by equirect_blur_image_parser(). Returns
+ * false with a message in error if they aren't valid */
+bool equirect_blur_image_options(const cv::CommandLineParser& parser, ImageRunOptions& options, std::string& error);
+
+/* Detectors kept loaded between runs, so a long running process only reads
+ * the models once per directory. Each detection thread takes one, which it runs
+ * on every projection in turn (PCN::Detect keeps no state between images).
+ * max_in_use limits how many are in use at once across all runs, 0 for no limit */
+class WorkerDetectors {
+public:
+    explicit WorkerDetectors(size_t max_in_use = 0);
+    ~WorkerDetectors();
+
+    WorkerDetectors(const WorkerDetectors&) = delete;
+    WorkerDetectors& operator=(const WorkerDetectors&) = delete;
+
+    /* Wait for an idle detector for models_dir, loading one if there isn't one */
+    PCN* acquire(const std::string& models_dir, const DetectorSettings& settings);
+    void release(const std::string& models_dir, PCN* detector);
+
+private:
+    size_t max_in_use_;
+    size_t in_use_ = 0;
+    std::map<std::string, std::vector<PCN*>> idle_; /* Keyed by models directory */
+
+    std::mutex lock_;
+    std::condition_variable idle_cond_;
+};
+
+/* Tile writers (and their cube face maps) by image size and tile options */
+class TileWriters {
+public:
+    const TileWriter* get(const cv::Size& size, const TileOptions& options);
+
+private:
+    std::map<std::tuple<int, int, int, int, int, int, double>, std::unique_ptr<TileWriter>> writers_;
+    std::mutex lock_;
+};
+
+/* State that outlives a run: equirect-blur-image has one for its single run,
+ * and the job server one for all the jobs it runs. The projection maps live in
+ * the shared cache (equirect_blur_shared_projections()) */
+struct ImageResources {
+    WorkerDetectors detectors;
+    TileWriters tiles;
+    BlurStats* stats = nullptr; /* Stage timings and counters are added here if set */
+
+    explicit ImageResources(const size_t max_detectors = 0)
+        : detectors(max_detectors)
+    {
+    }
+};
+
+/* Reported as each image is finished */
+struct ImageRunProgress {
+    std::string file; /* Input file name */
+    size_t faces = 0;
+    size_t done = 0;
+    size_t total = 0;
+};
+
+struct ImageRunResult {
+    size_t total = 0; /* Images that needed processing */
+    size_t processed = 0;
+    std::string error; /* Why the run failed, if it did */
+};
+
+/* Process the images selected by options, streaming them through the decode,
+ * detect and write stages. progress (if set) is called from the write threads.
+ * Setting *cancel stops the run between images */
+bool equirect_blur_run_images(
+    const ImageRunOptions& options,
+    ImageResources& resources,
+    ImageRunResult& result,
+    const std::function<void(const ImageRunProgress&)>& progress = nullptr,
+    const std::atomic<bool>* cancel = nullptr);
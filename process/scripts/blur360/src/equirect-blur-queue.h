@@ -0,0 +1,218 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+
+/* A bounded FIFO for handing work from one pipeline stage to the next. push()
+ * blocks while the queue is full, which bounds how much decoded data can be in
+ * flight. pop() blocks while the queue is empty, and returns false once the
+ * queue has been closed and drained */
+template <typename T> class WorkQueue {
+public:
+    explicit WorkQueue(const size_t capacity)
+        : capacity_(capacity > 0 ? capacity : 1)
+    {
+    }
+
+    void push(T item)
+    {
+        std::unique_lock lock(lock_);
+        not_full_.wait(lock, [this] { return items_.size() < capacity_; });
+        items_.push_back(std::move(item));
+        lock.unlock();
+        not_empty_.notify_one();
+    }
+
+    /* Push without waiting. Returns false, leaving item alone, if the queue is full */
+    bool try_push(T& item)
+    {
+        std::unique_lock lock(lock_);
+        if (items_.size() >= capacity_)
+            return false;
+        items_.push_back(std::move(item));
+        lock.unlock();
+        not_empty_.notify_one();
+        return true;
+    }
+
+    bool pop(T& item)
+    {
+        std::unique_lock lock(lock_);
+        not_empty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+        if (items_.empty())
+            return false;
+
+        item = std::move(items_.front());
+        items_.pop_front();
+        lock.unlock();
+        not_full_.notify_one();
+        return true;
+    }
+
+    /* No more items will be pushed. Wakes up consumers once the queue is empty */
+    void close()
+    {
+        {
+            std::lock_guard lock(lock_);
+            closed_ = true;
+        }
+        not_empty_.notify_all();
+    }
+
+private:
+    size_t capacity_;
+    std::deque<T> items_;
+    bool closed_ = false;
+
+    std::mutex lock_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+};
+
+/* Items 0 to n_items - 1 in runs of run_length, each taken in order by one
+ * consumer (a detection thread in sequence mode) while any number of producers
+ * (decode threads) make them.
+ *
+ * A producer takes the next item of whichever open run has room in its queue
+ * and isn't being made by another producer, so no producer is tied to one run
+ * and every consumer can have a run in progress whatever the number of
+ * producers. Up to max_open runs are open at once, each holding up to depth
+ * made items: the runs consumers are working on, plus ones being made ahead for
+ * the next consumers to take */
+template <typename T> class RunQueues {
+public:
+    RunQueues(const size_t n_items, const size_t run_length, const size_t depth, const size_t max_open)
+        : n_items_(n_items)
+        , run_length_(run_length > 0 ? run_length : 1)
+        , depth_(depth > 0 ? depth : 1)
+        , max_open_(max_open > 0 ? max_open : 1)
+    {
+    }
+
+    /* Take the earliest open run no consumer has. Returns false once every run
+     * has been taken, or stop() has been called */
+    bool take_run(size_t& run)
+    {
+        std::unique_lock lock(lock_);
+        open_runs();
+        for (auto& [index, r] : runs_) {
+            if (!r.taken && !stopped_) {
+                r.taken = true;
+                run = index;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /* The next item of a taken run. Returns false at the end of the run, or once stop() has been called */
+    bool pop(const size_t run, T& item)
+    {
+        std::unique_lock lock(lock_);
+        Run& r = runs_.at(run);
+        changed_.wait(lock, [this, &r] { return stopped_ || !r.items.empty() || (r.next == r.end && !r.making); });
+        if (stopped_)
+            return false;
+
+        const bool popped = !r.items.empty();
+        if (popped) {
+            item = std::move(r.items.front());
+            r.items.pop_front();
+        }
+        else {
+            /* Make room for the next run to be opened */
+            runs_.erase(run);
+            open_runs();
+        }
+        lock.unlock();
+        changed_.notify_all();
+        return popped;
+    }
+
+    /* Wait for an item to make, which belongs to run until push(). Returns
+     * false once every item has been made, or stop() has been called */
+    bool next(size_t& run, size_t& index)
+    {
+        std::unique_lock lock(lock_);
+        Run* r = nullptr;
+        changed_.wait(lock, [this, &r, &run] {
+            open_runs();
+            for (auto& [i, candidate] : runs_) {
+                if (!candidate.making && candidate.next < candidate.end && candidate.items.size() < depth_) {
+                    r = &candidate;
+                    run = i;
+                    return true;
+                }
+            }
+            return stopped_ || all_made();
+        });
+        if (r == nullptr || stopped_)
+            return false;
+
+        r->making = true;
+        index = r->next++;
+        return true;
+    }
+
+    /* Hand over the item taken with next() */
+    void push(const size_t run, T item)
+    {
+        {
+            std::lock_guard lock(lock_);
+            Run& r = runs_.at(run);
+            r.items.push_back(std::move(item));
+            r.making = false;
+        }
+        changed_.notify_all();
+    }
+
+    /* Wake everyone up and end the run early. Items not yet taken are dropped */
+    void stop()
+    {
+        {
+            std::lock_guard lock(lock_);
+            stopped_ = true;
+        }
+        changed_.notify_all();
+    }
+
+private:
+    struct Run {
+        std::deque<T> items;
+        size_t next; /* Next item to make */
+        size_t end;
+        bool taken = false;
+        bool making = false;
+    };
+
+    /* Open runs up to max_open. lock_ is held */
+    void open_runs()
+    {
+        while (runs_.size() < max_open_ && next_run_ * run_length_ < n_items_) {
+            const size_t first = next_run_ * run_length_;
+            runs_[next_run_++] = Run { {}, first, std::min(n_items_, first + run_length_) };
+        }
+    }
+
+    /* True once no more items will be made. lock_ is held */
+    bool all_made() const
+    {
+        if (next_run_ * run_length_ < n_items_)
+            return false;
+        return std::all_of(runs_.begin(), runs_.end(), [](const auto& r) { return r.second.next == r.second.end; });
+    }
+
+    size_t n_items_;
+    size_t run_length_;
+    size_t depth_;
+    size_t max_open_;
+    size_t next_run_ = 0;
+    std::map<size_t, Run> runs_;
+    bool stopped_ = false;
+
+    std::mutex lock_;
+    std::condition_variable changed_;
+};
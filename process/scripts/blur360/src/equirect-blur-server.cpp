@@ -0,0 +1,252 @@
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <mutex>
+#include <opencv2/core.hpp>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+
+#include "equirect-blur-queue.h"
+#include "equirect-blur-server.h"
+#include "equirect-blur-sidecar.h"
+
+/* Longest request line accepted, to stop a bad client using up memory */
+#define MAX_REQUEST_BYTES (1 << 20)
+
+/* One client. Events for its jobs are written from the runner threads, so
+ * writes are serialised. The socket is closed once the reader and all of the
+ * client's jobs are done with it */
+class ServerConnection {
+public:
+    explicit ServerConnection(const int fd)
+        : fd_(fd)
+    {
+    }
+
+    ~ServerConnection()
+    {
+        close(fd_);
+    }
+
+    ServerConnection(const ServerConnection&) = delete;
+    ServerConnection& operator=(const ServerConnection&) = delete;
+
+    [[nodiscard]] int fd() const
+    {
+        return fd_;
+    }
+
+    /* Write one line. A failed write means the client has gone, which cancels its jobs */
+    void send_line(const std::string& line)
+    {
+        std::lock_guard lock(lock_);
+        if (closed)
+            return;
+
+        const std::string data = line + "\n";
+        size_t sent = 0;
+        while (sent < data.size()) {
+            const ssize_t n = send(fd_, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                closed = true;
+                return;
+            }
+            sent += static_cast<size_t>(n);
+        }
+    }
+
+    std::atomic<bool> closed { false };
+
+private:
+    int fd_;
+    std::mutex lock_;
+};
+
+JobReporter::JobReporter(std::shared_ptr<ServerConnection> connection, std::string id)
+    : connection_(std::move(connection))
+    , id_(std::move(id))
+{
+}
+
+void JobReporter::event(const std::string& name, const std::string& fields) const
+{
+    connection_->send_line("{\"id\":\"" + json_escape(id_) + "\",\"event\":\"" + name + "\"" + fields + "}");
+}
+
+const std::atomic<bool>* JobReporter::cancelled() const
+{
+    return &connection_->closed;
+}
+
+struct QueuedJob {
+    ServerJob job;
+    std::shared_ptr<ServerConnection> connection;
+};
+
+static bool parse_job(const std::string& line, ServerJob& job, std::string& error)
+{
+    try {
+        const cv::FileStorage fs(line, cv::FileStorage::READ | cv::FileStorage::MEMORY | cv::FileStorage::FORMAT_JSON);
+        if (!fs.isOpened()) {
+            error = "Invalid request";
+            return false;
+        }
+
+        if (fs["id"].isString())
+            job.id = static_cast<std::string>(fs["id"]);
+        if (!fs["args"].isSeq()) {
+            error = "args must be a list of command line options";
+            return false;
+        }
+        for (const cv::FileNode& arg : fs["args"])
+            job.args.push_back(static_cast<std::string>(arg));
+        for (const cv::FileNode& file : fs["files"])
+            job.files.push_back(static_cast<std::string>(file));
+    }
+    catch (const cv::Exception& e) {
+        error = std::string("Invalid request: ") + e.what();
+        return false;
+    }
+
+    return true;
+}
+
+/* Read the client's requests, one per line, and queue their jobs */
+static void read_requests(const std::shared_ptr<ServerConnection>& connection, WorkQueue<QueuedJob>& jobs)
+{
+    std::string buffer;
+    char data[4096];
+
+    for (;;) {
+        const ssize_t n = recv(connection->fd(), data, sizeof(data), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        buffer.append(data, static_cast<size_t>(n));
+
+        size_t end;
+        while ((end = buffer.find('\n')) != std::string::npos) {
+            const std::string line = buffer.substr(0, end);
+            buffer.erase(0, end + 1);
+            if (line.find_first_not_of(" \t\r") == std::string::npos)
+                continue;
+
+            QueuedJob queued { {}, connection };
+            std::string error;
+            if (!parse_job(line, queued.job, error)) {
+                JobReporter(connection, queued.job.id).event("rejected", ",\"error\":\"" + json_escape(error) + "\"");
+                continue;
+            }
+
+            const JobReporter reporter(connection, queued.job.id);
+            std::cout << "Job " << queued.job.id << " received" << std::endl;
+            if (!jobs.try_push(queued)) {
+                reporter.event("rejected", ",\"error\":\"Too many jobs queued\"");
+                continue;
+            }
+            reporter.event("queued");
+        }
+
+        if (buffer.size() > MAX_REQUEST_BYTES) {
+            std::cerr << "Dropping client with an over-long request" << std::endl;
+            break;
+        }
+    }
+
+    /* The client has gone (or is being dropped), which cancels its jobs */
+    connection->closed = true;
+}
+
+/* Remove a socket left behind by an earlier server, but nothing else */
+static bool remove_stale_socket(const std::string& path)
+{
+    std::error_code ec;
+    const std::filesystem::file_status status = std::filesystem::symlink_status(path, ec);
+    if (ec || !std::filesystem::exists(status))
+        return true;
+
+    if (status.type() != std::filesystem::file_type::socket) {
+        std::cerr << path << " exists and isn't a socket" << std::endl;
+        return false;
+    }
+    return std::filesystem::remove(path, ec);
+}
+
+bool equirect_blur_serve(
+    const ServerOptions& options, const std::function<void(const ServerJob&, const JobReporter&)>& handler)
+{
+    sockaddr_un addr {};
+    addr.sun_family = AF_UNIX;
+    if (options.socket_path.empty() || options.socket_path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "Invalid socket path " << options.socket_path << std::endl;
+        return false;
+    }
+    strncpy(addr.sun_path, options.socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+    if (!remove_stale_socket(options.socket_path))
+        return false;
+
+    const int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        std::cerr << "Can't create socket: " << strerror(errno) << std::endl;
+        return false;
+    }
+    /* Only the server's user and group may connect. The socket is made with
+     * these permissions rather than changed after, so there's no window where
+     * others can. No other threads are running yet to see the umask change */
+    const mode_t old_umask = umask(S_IRWXO | S_IXUSR | S_IXGRP);
+    const int bound = bind(listen_fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr));
+    umask(old_umask);
+    if (bound < 0 || listen(listen_fd, SOMAXCONN) < 0) {
+        std::cerr << "Can't listen on " << options.socket_path << ": " << strerror(errno) << std::endl;
+        close(listen_fd);
+        return false;
+    }
+    std::cout << "Listening on " << options.socket_path << std::endl;
+
+    WorkQueue<QueuedJob> jobs(options.max_queued);
+
+    std::vector<std::thread> runners;
+    for (int i = 0; i < std::max(options.max_jobs, 1); i++) {
+        runners.emplace_back([&jobs, &handler] {
+            QueuedJob queued;
+            while (jobs.pop(queued)) {
+                const JobReporter reporter(queued.connection, queued.job.id);
+                if (*reporter.cancelled()) {
+                    std::cout << "Job " << queued.job.id << " dropped, its client has gone" << std::endl;
+                }
+                else {
+                    handler(queued.job, reporter);
+                }
+                queued = {};
+            }
+        });
+    }
+
+    for (;;) {
+        const int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            std::cerr << "Can't accept connections: " << strerror(errno) << std::endl;
+            break;
+        }
+
+        auto connection = std::make_shared<ServerConnection>(fd);
+        std::thread([connection, &jobs] { read_requests(connection, jobs); }).detach();
+    }
+
+    close(listen_fd);
+    jobs.close();
+    for (std::thread& t : runners)
+        t.join();
+
+    return false;
+}
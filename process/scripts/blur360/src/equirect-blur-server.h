@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+/* A job submitted to the server. Clients write one JSON object per line:
+ *
+ * {"id":"seq-12","args":["--blur=true","-m=models","-o=/trails/seq-12/img_blur","/trails/seq-12/img_original"],
+ *   "files":["/trails/seq-12/img_original/0001.jpg"]}
+ *
+ * args are equirect-blur-image's command line options, without the program name,
+ * with relative paths taken from the server's working directory. files is
+ * optional, and replaces the images from the input directory. The server answers
+ * with events for the job, one JSON object per line, each with the job's id and
+ * an "event" of queued, started, image, finished or rejected */
+struct ServerJob {
+    std::string id;
+    std::vector<std::string> args;
+    std::vector<std::string> files;
+};
+
+class ServerConnection;
+
+/* Sends a job's events back to the client that submitted it */
+class JobReporter {
+public:
+    JobReporter(std::shared_ptr<ServerConnection> connection, std::string id);
+
+    /* Send an event. fields are extra members for the JSON object, each starting
+     * with a comma, e.g. ",\"done\":3" */
+    void event(const std::string& name, const std::string& fields = "") const;
+
+    /* Set once the client has disconnected, which cancels its jobs */
+    [[nodiscard]] const std::atomic<bool>* cancelled() const;
+
+private:
+    std::shared_ptr<ServerConnection> connection_;
+    std::string id_;
+};
+
+struct ServerOptions {
+    std::string socket_path;
+    int max_jobs = 1; /* Jobs run at once */
+    int max_queued = 64; /* Jobs waiting to run before new ones are rejected */
+};
+
+/* Listen on a Unix domain socket and run each job with handler, on one of
+ * max_jobs runner threads. Only returns if the socket can't be set up */
+bool equirect_blur_serve(
+    const ServerOptions& options, const std::function<void(const ServerJob&, const JobReporter&)>& handler);
@@ -0,0 +1,218 @@
+#include <algorithm>
+#include <iostream>
+#include <list>
+#include <map>
+#include <set>
+
+#include "equirect-blur-memory.h"
+#include "equirect-blur-shared.h"
+
+DetectorPool::DetectorPool(std::function<PCN*()> create_detector, const size_t max_detectors)
+    : create_detector_(std::move(create_detector))
+    , max_detectors_(max_detectors > 0 ? max_detectors : 1)
+{
+}
+
+DetectorPool::~DetectorPool()
+{
+    for (const PCN* detector : detectors_)
+        delete detector;
+}
+
+PCN* DetectorPool::acquire()
+{
+    std::unique_lock lock(lock_);
+
+    while (idle_.empty()) {
+        if (detectors_.size() < max_detectors_) {
+            /* Reserve the slot, and load the models without holding the lock */
+            detectors_.push_back(nullptr);
+            const size_t slot = detectors_.size() - 1;
+
+            lock.unlock();
+            PCN* detector = create_detector_();
+            lock.lock();
+
+            detectors_[slot] = detector;
+            return detector;
+        }
+        idle_cond_.wait(lock);
+    }
+
+    PCN* detector = idle_.back();
+    idle_.pop_back();
+    return detector;
+}
+
+void DetectorPool::release(PCN* detector)
+{
+    {
+        std::lock_guard lock(lock_);
+        idle_.push_back(detector);
+    }
+    idle_cond_.notify_one();
+}
+
+size_t DetectorPool::max_detectors() const
+{
+    return max_detectors_;
+}
+
+/* Cached projections are keyed by frame size, layout and map precision */
+struct ProjectionsKey {
+    cv::Size size;
+    ProjectionLayout layout;
+    MapPrecision precision;
+
+    bool operator<(const ProjectionsKey& other) const
+    {
+        if (size.width != other.size.width)
+            return size.width < other.size.width;
+        if (size.height != other.size.height)
+            return size.height < other.size.height;
+        if (precision != other.precision)
+            return precision < other.precision;
+        return layout < other.layout;
+    }
+};
+
+/* One cached set of projections, most recently used first */
+struct CachedProjections {
+    ProjectionsKey key;
+    std::vector<Projection> projections;
+    size_t bytes;
+};
+
+static std::mutex shared_projections_lock;
+static std::list<CachedProjections> shared_projections;
+static std::map<ProjectionsKey, std::list<CachedProjections>::iterator> shared_projections_by_key;
+static size_t shared_projections_bytes = 0;
+static size_t shared_projections_limit = DEFAULT_PROJECTION_CACHE_BYTES;
+static MemoryCharge shared_projections_charge(MemoryUse::MAPS);
+/* Keys whose tables are being built, without the lock held */
+static std::set<ProjectionsKey> shared_projections_building;
+static std::condition_variable shared_projections_built;
+
+/* Drop least recently used sizes until the cache fits its limit. Called with the lock held */
+static void trim_shared_projections()
+{
+    while (shared_projections.size() > 1 && shared_projections_bytes > shared_projections_limit) {
+        const CachedProjections& oldest = shared_projections.back();
+        std::cout << "Dropping cached projections for " << oldest.key.size.width << " x "
+                  << oldest.key.size.height << std::endl;
+
+        shared_projections_bytes -= oldest.bytes;
+        shared_projections_by_key.erase(oldest.key);
+        shared_projections.pop_back();
+    }
+    shared_projections_charge.set(shared_projections_bytes);
+}
+
+void equirect_blur_set_projection_cache_limit(const size_t bytes)
+{
+    std::lock_guard lock(shared_projections_lock);
+
+    shared_projections_limit = bytes;
+    trim_shared_projections();
+}
+
+size_t equirect_blur_projection_count(const ProjectionLayout& layout)
+{
+    /* The same steps around the sphere as equirect_blur_shared_projections() */
+    size_t count = 0;
+    for (int phi_step = 0; phi_step < static_cast<int>((M_PI / layout.step[1])); phi_step++) {
+        for (float lambda = 0; lambda < 2 * M_PI; lambda += layout.step[0]) // NOLINT(*-flp30-c)
+            count++;
+    }
+    return count;
+}
+
+size_t equirect_blur_projection_map_bytes(
+    const cv::Size& size, const ProjectionLayout& layout, const MapPrecision precision)
+{
+    /* CV_32FC2, or CV_16SC2 and CV_16UC1 */
+    const size_t pixel_bytes = precision == MapPrecision::FIXED ? 6 : 8;
+    const auto view_pixels = static_cast<size_t>(Projection::view_size_for(size, layout.aperture).area());
+    return equirect_blur_projection_count(layout) * view_pixels * pixel_bytes;
+}
+
+/* Build the projections for key, without the cache */
+static std::vector<Projection> build_projections(const ProjectionsKey& key)
+{
+    const cv::Size& size = key.size;
+    const ProjectionLayout& layout = key.layout;
+    const MapPrecision precision = key.precision;
+
+    std::vector<Projection> projections;
+    const float* apertures = layout.aperture;
+    const float x_step = layout.step[0], y_step = layout.step[1];
+
+#pragma omp parallel for // NOLINT(*-use-default-none)
+    for (int phi_step = 0; phi_step < static_cast<int>((M_PI / y_step)); phi_step++) {
+        const float phi_full = static_cast<float>(phi_step) * y_step;
+        /* Calculate a phi (vertical tilt) from -M_PI/2 to M_PI/2 */
+        const float phi = phi_full <= M_PI / 2 ? phi_full : phi_full - static_cast<float>(M_PI);
+
+        for (float lambda = 0; lambda < 2 * M_PI; lambda += x_step) { // NOLINT(*-flp30-c)
+            Projection projection(size, apertures, phi, lambda, nullptr, precision);
+
+#pragma omp critical
+            projections.push_back(projection);
+        }
+    }
+
+    /* The loop above adds them in any order. Sort them so runs are repeatable */
+    std::sort(projections.begin(), projections.end(), [](const Projection& a, const Projection& b) {
+        return a.phi != b.phi ? a.phi < b.phi : a.lambda < b.lambda;
+    });
+
+    return projections;
+}
+
+std::vector<Projection> equirect_blur_shared_projections(
+    const cv::Size& size, const ProjectionLayout& layout, const MapPrecision precision)
+{
+    std::unique_lock lock(shared_projections_lock);
+
+    /* Wait while another thread builds the same tables */
+    const ProjectionsKey key { size, layout, precision };
+    for (;;) {
+        if (const auto it = shared_projections_by_key.find(key); it != shared_projections_by_key.end()) {
+            shared_projections.splice(shared_projections.begin(), shared_projections, it->second);
+            return it->second->projections;
+        }
+        if (shared_projections_building.count(key) == 0)
+            break;
+        shared_projections_built.wait(lock);
+    }
+
+    /* Build them without holding the lock, leaving the key reserved */
+    shared_projections_building.insert(key);
+    lock.unlock();
+    std::vector<Projection> projections;
+    try {
+        projections = build_projections(key);
+    }
+    catch (...) {
+        lock.lock();
+        shared_projections_building.erase(key);
+        lock.unlock();
+        shared_projections_built.notify_all();
+        throw;
+    }
+    lock.lock();
+    shared_projections_building.erase(key);
+
+    size_t bytes = 0;
+    for (const Projection& p : projections)
+        bytes += p.map_bytes();
+
+    shared_projections.push_front({ key, projections, bytes });
+    shared_projections_by_key[key] = shared_projections.begin();
+    shared_projections_bytes += bytes;
+    trim_shared_projections();
+    lock.unlock();
+    shared_projections_built.notify_all();
+
+    return projections;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "equirect-blur-common.h"
+#include "equirect-blur-config.h"
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+/* A set of PCN detectors shared by several streams. PCN::Detect keeps no state
+ * between calls, so any idle detector can serve any projection of any stream.
+ * At most max_detectors are created, which also limits how many inferences run
+ * at once across all the streams using the pool */
+class DetectorPool {
+public:
+    DetectorPool(std::function<PCN*()> create_detector, size_t max_detectors);
+    ~DetectorPool();
+
+    DetectorPool(const DetectorPool&) = delete;
+    DetectorPool& operator=(const DetectorPool&) = delete;
+
+    /* Wait for an idle detector, creating one if the pool isn't full yet */
+    PCN* acquire();
+    void release(PCN* detector);
+
+    [[nodiscard]] size_t max_detectors() const;
+
+private:
+    std::function<PCN*()> create_detector_;
+    size_t max_detectors_;
+
+    std::vector<PCN*> detectors_;
+    std::vector<PCN*> idle_;
+    std::mutex lock_;
+    std::condition_variable idle_cond_;
+};
+
+/* The projections for equirect frames of the given size laid out around the
+ * sphere by layout, with no detectors attached. The remap tables are built the
+ * first time a size, layout and precision are requested, and every returned
+ * copy shares them. They are kept in a least recently used cache, so a sequence
+ * mixing a few frame sizes only builds each one once. The cache isn't locked
+ * while tables are built, so other sizes can be looked up meanwhile; callers
+ * wanting the same ones wait for them. The cached tables are charged to
+ * MemoryUse::MAPS */
+std::vector<Projection> equirect_blur_shared_projections(
+    const cv::Size& size,
+    const ProjectionLayout& layout = ProjectionLayout(),
+    MapPrecision precision = MapPrecision::FLOAT);
+
+/* How many projections equirect_blur_shared_projections() makes for layout, and
+ * the memory their remap tables would take, without building them */
+size_t equirect_blur_projection_count(const ProjectionLayout& layout);
+size_t equirect_blur_projection_map_bytes(const cv::Size& size, const ProjectionLayout& layout, MapPrecision precision);
+
+/* Default limit on the memory used by the cached remap tables. With the default
+ * layout a 5.7K frame's set is four 5760 x 1920 float maps, about 340 MB (250 MB
+ * in fixed point) */
+#define DEFAULT_PROJECTION_CACHE_BYTES (static_cast<size_t>(2048) << 20)
+
+/* Set the limit on the memory used by the cached remap tables. Least recently
+ * used sizes are dropped beyond it, though the most recent one is always kept.
+ * Projections already handed out keep their tables until they are destroyed */
+void equirect_blur_set_projection_cache_limit(size_t bytes);
@@ -0,0 +1,242 @@
+#include <cerrno>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#include "equirect-blur-sidecar.h"
+
+static int64_t pts_to_ns(const double pts)
+{
+    return std::llround(pts * 1e9);
+}
+
+std::string json_escape(const std::string& str)
+{
+    std::string ret;
+
+    for (const char c : str) {
+        switch (c) {
+        case '"':
+            ret += "\\\"";
+            break;
+        case '\\':
+            ret += "\\\\";
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                char buf[8];
+                snprintf(buf, sizeof(buf), "\\u%04x", c);
+                ret += buf;
+            }
+            else {
+                ret += c;
+            }
+            break;
+        }
+    }
+    return ret;
+}
+
+static std::string format_frame(const SidecarFrame& frame)
+{
+    char buf[256];
+    std::string line;
+
+    snprintf(buf, sizeof(buf), "{\"frame\":%" PRId64, frame.frame);
+    line += buf;
+    if (frame.pts >= 0) {
+        snprintf(buf, sizeof(buf), ",\"pts\":%.9f", frame.pts);
+        line += buf;
+    }
+    if (!frame.file.empty())
+        line += ",\"file\":\"" + json_escape(frame.file) + "\"";
+
+    line += ",\"faces\":[";
+    for (size_t f = 0; f < frame.faces.size(); f++) {
+        const FaceDetection& face = frame.faces[f];
+
+        snprintf(
+            buf,
+            sizeof(buf),
+            "%s{\"phi\":%.9g,\"lambda\":%.9g,\"x\":%d,\"y\":%d,\"width\":%d,\"angle\":%d,\"score\":%.6g,\"rects\":[",
+            f > 0 ? "," : "",
+            face.phi,
+            face.lambda,
+            face.window.x,
+            face.window.y,
+            face.window.width,
+            face.window.angle,
+            face.window.score);
+        line += buf;
+
+        for (size_t r = 0; r < face.equ_rects.size(); r++) {
+            const cv::Rect& rect = face.equ_rects[r];
+            snprintf(buf, sizeof(buf), "%s[%d,%d,%d,%d]", r > 0 ? "," : "", rect.x, rect.y, rect.width, rect.height);
+            line += buf;
+        }
+        line += "]}";
+    }
+    line += "]}";
+
+    return line;
+}
+
+/* The top level "frame" of a detections line, left as it is if there isn't one.
+ * FileNode reads integers through an int, which would truncate frame numbers
+ * past 2^31, so the number is read from the line itself */
+static bool parse_frame_number(const std::string& line, int64_t& frame)
+{
+    int depth = 0;
+    for (size_t i = 0; i < line.size(); i++) {
+        if (line[i] == '{' || line[i] == '[') {
+            depth++;
+        }
+        else if (line[i] == '}' || line[i] == ']') {
+            depth--;
+        }
+        else if (line[i] == '"') {
+            const size_t start = i + 1;
+            for (i++; i < line.size() && line[i] != '"'; i++) {
+                if (line[i] == '\\')
+                    i++;
+            }
+            const size_t colon = line.find_first_not_of(" \t", i + 1);
+            if (depth != 1 || line.compare(start, i - start, "frame") != 0 || colon == std::string::npos
+                || line[colon] != ':')
+                continue;
+
+            const char* value = line.c_str() + colon + 1;
+            char* end;
+            errno = 0;
+            const long long number = strtoll(value, &end, 10);
+            if (end == value || errno == ERANGE)
+                return false;
+            frame = number;
+            return true;
+        }
+    }
+    return true;
+}
+
+static bool parse_frame(const std::string& line, SidecarFrame& frame)
+{
+    if (!parse_frame_number(line, frame.frame))
+        return false;
+
+    try {
+        const cv::FileStorage fs(line, cv::FileStorage::READ | cv::FileStorage::MEMORY | cv::FileStorage::FORMAT_JSON);
+        if (!fs.isOpened())
+            return false;
+
+        if (!fs["pts"].empty())
+            frame.pts = static_cast<double>(fs["pts"]);
+        if (!fs["file"].empty())
+            frame.file = static_cast<std::string>(fs["file"]);
+
+        for (const cv::FileNode& node : fs["faces"]) {
+            FaceDetection face {
+                static_cast<float>(node["phi"]),
+                static_cast<float>(node["lambda"]),
+                Window(
+                    static_cast<int>(node["x"]),
+                    static_cast<int>(node["y"]),
+                    static_cast<int>(node["width"]),
+                    static_cast<int>(node["angle"]),
+                    static_cast<float>(node["score"]),
+                    {}),
+                {},
+            };
+            for (const cv::FileNode& rect : node["rects"]) {
+                face.equ_rects.emplace_back(
+                    static_cast<int>(rect[0]),
+                    static_cast<int>(rect[1]),
+                    static_cast<int>(rect[2]),
+                    static_cast<int>(rect[3]));
+            }
+            frame.faces.push_back(face);
+        }
+    }
+    catch (const cv::Exception& e) {
+        std::cerr << "Failed to parse detections: " << e.what() << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool SidecarWriter::open(const std::string& path)
+{
+    out_.open(path, std::ios::out | std::ios::trunc);
+    return out_.is_open();
+}
+
+bool SidecarWriter::is_open() const
+{
+    return out_.is_open();
+}
+
+void SidecarWriter::write(const SidecarFrame& frame)
+{
+    const std::string line = format_frame(frame);
+
+    std::lock_guard lock(lock_);
+    out_ << line << '\n';
+}
+
+bool SidecarReader::load(const std::string& path)
+{
+    std::ifstream in(path);
+    if (!in.is_open()) {
+        std::cerr << "Can't open detections file " << path << std::endl;
+        return false;
+    }
+
+    std::string line;
+    int line_no = 0;
+    while (std::getline(in, line)) {
+        line_no++;
+        if (line.empty())
+            continue;
+
+        SidecarFrame frame;
+        if (!parse_frame(line, frame)) {
+            std::cerr << "Invalid detections at " << path << ":" << line_no << std::endl;
+            return false;
+        }
+
+        const size_t index = frames_.size();
+        if (!frame.file.empty())
+            by_file_[frame.file] = index;
+        if (frame.pts >= 0)
+            by_pts_[pts_to_ns(frame.pts)] = index;
+        by_frame_[frame.frame] = index;
+
+        frames_.push_back(std::move(frame));
+    }
+
+    return true;
+}
+
+const std::vector<SidecarFrame>& SidecarReader::frames() const
+{
+    return frames_;
+}
+
+const SidecarFrame* SidecarReader::find_file(const std::string& file) const
+{
+    const auto it = by_file_.find(file);
+    return it != by_file_.end() ? &frames_[it->second] : nullptr;
+}
+
+const SidecarFrame* SidecarReader::find_pts(const double pts) const
+{
+    const auto it = by_pts_.find(pts_to_ns(pts));
+    return it != by_pts_.end() ? &frames_[it->second] : nullptr;
+}
+
+const SidecarFrame* SidecarReader::find_frame(const int64_t frame) const
+{
+    const auto it = by_frame_.find(frame);
+    return it != by_frame_.end() ? &frames_[it->second] : nullptr;
+}
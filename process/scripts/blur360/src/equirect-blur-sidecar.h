@@ -0,0 +1,57 @@
+#pragma once
+
+#include "equirect-blur-common.h"
+
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/* Face detections for one image or video frame. Sidecar files store one frame
+ * per line as a JSON object:
+ *
+ * {"frame":12,"pts":0.400400400,"faces":[{"phi":0,"lambda":3.14159274,"x":812,"y":301,
+ *   "width":46,"angle":-4,"score":0.97,"rects":[[3641,1242,52,55]]}]}
+ *
+ * pts (in seconds) is only present for video frames, and "file" (the input file
+ * name) only for images. x/y/width/angle are the face window in the cropped
+ * projection identified by phi/lambda, and rects its bounding box(es) in the
+ * equirect frame */
+struct SidecarFrame {
+    int64_t frame = -1;
+    double pts = -1.0;
+    std::string file;
+    std::vector<FaceDetection> faces;
+};
+
+/* Escape a string for use in a JSON string literal */
+std::string json_escape(const std::string& str);
+
+class SidecarWriter {
+public:
+    bool open(const std::string& path);
+    [[nodiscard]] bool is_open() const;
+    void write(const SidecarFrame& frame);
+
+private:
+    std::ofstream out_;
+    std::mutex lock_;
+};
+
+class SidecarReader {
+public:
+    bool load(const std::string& path);
+
+    [[nodiscard]] const std::vector<SidecarFrame>& frames() const;
+    [[nodiscard]] const SidecarFrame* find_file(const std::string& file) const;
+    [[nodiscard]] const SidecarFrame* find_pts(double pts) const;
+    [[nodiscard]] const SidecarFrame* find_frame(int64_t frame) const;
+
+private:
+    std::vector<SidecarFrame> frames_;
+    std::map<std::string, size_t> by_file_;
+    std::map<int64_t, size_t> by_pts_; /* Keyed by pts in nanoseconds */
+    std::map<int64_t, size_t> by_frame_;
+};
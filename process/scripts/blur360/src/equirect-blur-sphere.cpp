@@ -0,0 +1,264 @@
+#include <algorithm>
+#include <cmath>
+
+#include "equirect-blur-sphere.h"
+
+/* Pixels of one row of the frame inside a cap. x can be off either side of the
+ * frame, and wraps around */
+struct CapSpan {
+    int y;
+    int x;
+    int width;
+};
+
+static cv::Vec3d unit_vector(const double longitude, const double colatitude)
+{
+    return { sin(colatitude) * cos(longitude), sin(colatitude) * sin(longitude), cos(colatitude) };
+}
+
+/* Longitude/colatitude of a point in a projection's cropped view */
+static void cropped_to_sphere(const Projection& p, const cv::Point2f& point, double& longitude, double& colatitude)
+{
+    const cv::Size view = p.view_size();
+    const int x = CLAMP(cvRound(point.x), 0, view.width - 1);
+    const int y = CLAMP(cvRound(point.y), 0, view.height - 1);
+    const cv::Vec2f equ = p.source_point(x, y);
+
+    longitude = 2 * M_PI * equ[0] / p.equ_size.width;
+    colatitude = M_PI * equ[1] / p.equ_size.height;
+}
+
+SphericalCap equirect_face_cap(const Projection& p, const Window& face)
+{
+    /* blur_face() pads the face by a quarter of its width each side */
+    const float radius = 0.75f * static_cast<float>(face.width);
+    const cv::Point2f centre(
+        static_cast<float>(face.x) + static_cast<float>(face.width) / 2,
+        static_cast<float>(face.y) + static_cast<float>(face.width) / 2);
+
+    SphericalCap cap {};
+    cropped_to_sphere(p, centre, cap.longitude, cap.colatitude);
+
+    /* Measure the radius on the sphere towards whichever side stays in the view */
+    const bool right_in_view = centre.x + radius < static_cast<float>(p.view_size().width);
+    const cv::Point2f edge = centre + cv::Point2f(right_in_view ? radius : -radius, 0);
+    double edge_longitude, edge_colatitude;
+    cropped_to_sphere(p, edge, edge_longitude, edge_colatitude);
+
+    const double cos_radius
+        = unit_vector(cap.longitude, cap.colatitude).dot(unit_vector(edge_longitude, edge_colatitude));
+    cap.radius = acos(CLAMP(cos_radius, -1.0, 1.0));
+
+    return cap;
+}
+
+/* Copy columns x .. x + width - 1 of rows y .. y + height - 1, wrapping around the
+ * frame's left/right edge. width can be more than the frame's */
+static void copy_wrapped(const cv::Mat& image, int x, const int y, const int width, const int height, cv::Mat& out)
+{
+    out.create(height, width, image.type());
+
+    x = ((x % image.cols) + image.cols) % image.cols;
+    for (int done = 0; done < width;) {
+        const int n = MIN(width - done, image.cols - x);
+        image(cv::Rect(x, y, n, height)).copyTo(out(cv::Rect(done, 0, n, height)));
+        done += n;
+        x = 0;
+    }
+}
+
+/* Write a span from row, whose first pixel is at frame column row_x */
+static void write_span(cv::Mat& image, const CapSpan& span, const cv::Mat& row, const int row_x)
+{
+    int x = ((span.x % image.cols) + image.cols) % image.cols;
+    for (int done = 0; done < span.width;) {
+        const int n = MIN(span.width - done, image.cols - x);
+        row.colRange(span.x - row_x + done, span.x - row_x + done + n).copyTo(image(cv::Rect(x, span.y, n, 1)));
+        done += n;
+        x = 0;
+    }
+}
+
+static void fill_span(cv::Mat& image, const CapSpan& span, const cv::Scalar& colour)
+{
+    int x = ((span.x % image.cols) + image.cols) % image.cols;
+    for (int done = 0; done < span.width;) {
+        const int n = MIN(span.width - done, image.cols - x);
+        image(cv::Rect(x, span.y, n, 1)).setTo(colour);
+        done += n;
+        x = 0;
+    }
+}
+
+/* The spans of each row inside the cap */
+static std::vector<CapSpan> cap_spans(const cv::Size& size, const SphericalCap& cap)
+{
+    const double pixels_per_radian_x = size.width / (2 * M_PI);
+    const double pixels_per_radian_y = size.height / M_PI;
+
+    const int y0 = MAX(static_cast<int>(floor((cap.colatitude - cap.radius) * pixels_per_radian_y)), 0);
+    const int y1 = MIN(static_cast<int>(ceil((cap.colatitude + cap.radius) * pixels_per_radian_y)), size.height - 1);
+
+    std::vector<CapSpan> spans;
+    for (int y = y0; y <= y1; y++) {
+        /* A point at this colatitude is inside the cap if the angle to its centre,
+         * cos(d) = cos(c)cos(c0) + sin(c)sin(c0)cos(dlon), is at most the radius */
+        const double colatitude = (y + 0.5) / pixels_per_radian_y;
+        const double num = cos(cap.radius) - cos(colatitude) * cos(cap.colatitude);
+        const double denom = sin(colatitude) * sin(cap.colatitude);
+
+        double half_width;
+        if (denom < 1e-12) {
+            if (num > 0)
+                continue;
+            half_width = M_PI;
+        }
+        else if (num / denom > 1) {
+            continue;
+        }
+        else {
+            half_width = num / denom <= -1 ? M_PI : acos(num / denom);
+        }
+
+        if (half_width >= M_PI) {
+            spans.push_back({ y, 0, size.width });
+            continue;
+        }
+        const int x0 = static_cast<int>(floor((cap.longitude - half_width) * pixels_per_radian_x));
+        const int x1 = static_cast<int>(ceil((cap.longitude + half_width) * pixels_per_radian_x));
+        spans.push_back({ y, x0, MIN(x1 - x0 + 1, size.width) });
+    }
+
+    return spans;
+}
+
+/* The rects covering spans, split at the frame's left/right edge */
+static void spans_to_rects(const cv::Size& size, const std::vector<CapSpan>& spans, std::vector<cv::Rect>& rects)
+{
+    int min_x = spans.front().x, max_x = spans.front().x + spans.front().width;
+    for (const CapSpan& span : spans) {
+        min_x = MIN(min_x, span.x);
+        max_x = MAX(max_x, span.x + span.width);
+    }
+
+    const int y = spans.front().y;
+    const int height = spans.back().y - y + 1;
+    if (max_x - min_x >= size.width) {
+        rects.emplace_back(0, y, size.width, height);
+        return;
+    }
+
+    const int x = ((min_x % size.width) + size.width) % size.width;
+    const int width = max_x - min_x;
+    if (x + width <= size.width) {
+        rects.emplace_back(x, y, width, height);
+    }
+    else {
+        rects.emplace_back(x, y, size.width - x, height);
+        rects.emplace_back(0, y, x + width - size.width, height);
+    }
+}
+
+/* Pixelate in blocks of block_y rows, from the top of the patch, each split
+ * into blocks the same angle across at its latitude */
+template <typename BlockWidth>
+static void pixelate_patch(cv::Mat& patch, const int patch_y, const int block_y, const BlockWidth& block_x_at)
+{
+    for (int y = 0; y < patch.rows; y += block_y) {
+        const int height = MIN(block_y, patch.rows - y);
+        const int block_x = block_x_at(patch_y + y + height / 2);
+        for (int x = 0; x < patch.cols; x += block_x) {
+            cv::Mat cell = patch(cv::Rect(x, y, MIN(block_x, patch.cols - x), height));
+            cell.setTo(cv::mean(cell));
+        }
+    }
+}
+
+void equirect_obscure_cap(
+    cv::Mat& image, const SphericalCap& cap, const ObscureOptions& obscure, std::vector<cv::Rect>* written_rects)
+{
+    const std::vector<CapSpan> spans = cap_spans(image.size(), cap);
+    if (spans.empty())
+        return;
+
+    if (written_rects != nullptr)
+        spans_to_rects(image.size(), spans, *written_rects);
+
+    if (obscure.draw_over_faces) {
+        for (const CapSpan& span : spans)
+            fill_span(image, span, cv::Scalar(64, 64, 64));
+        return;
+    }
+
+    /* The filter covers the same angle everywhere on the sphere: a fixed number
+     * of rows, and more columns the further a row is from the equator. The cap
+     * is 1.5 face widths across */
+    const double radius = (obscure.radius > 0 ? obscure.radius : DEFAULT_FILTER_RADIUS) * cap.radius / 0.75;
+    const double pixels_per_radian_x = image.cols / (2 * M_PI);
+    const double pixels_per_radian_y = image.rows / M_PI;
+    const int radius_y = MAX(cvRound(radius * pixels_per_radian_y), 1);
+
+    auto radius_x_at = [&](const int y) {
+        const double sin_colatitude = MAX(sin((y + 0.5) / pixels_per_radian_y), 1e-3);
+        return CLAMP(cvRound(radius * pixels_per_radian_x / sin_colatitude), 1, image.cols / 4);
+    };
+
+    int min_x = spans.front().x, max_x = spans.front().x + spans.front().width;
+    int reach_x = 0;
+    for (const CapSpan& span : spans) {
+        min_x = MIN(min_x, span.x);
+        max_x = MAX(max_x, span.x + span.width);
+        reach_x = MAX(reach_x, equirect_blur_filter_reach(obscure.filter, radius_x_at(span.y)));
+    }
+    const int reach_y = equirect_blur_filter_reach(obscure.filter, radius_y);
+
+    /* Patch around the cap with room for the filter, wrapping around the frame */
+    const int patch_y = MAX(spans.front().y - reach_y, 0);
+    const int patch_height = MIN(spans.back().y + reach_y + 1, image.rows) - patch_y;
+    const int patch_x = min_x - reach_x;
+    cv::Mat patch;
+    copy_wrapped(image, patch_x, patch_y, max_x - min_x + 2 * reach_x, patch_height, patch);
+
+    if (obscure.filter == ObscureFilter::PIXELATE) {
+        pixelate_patch(patch, patch_y, radius_y, radius_x_at);
+        for (const CapSpan& span : spans)
+            write_span(image, span, patch.row(span.y - patch_y), patch_x);
+        return;
+    }
+
+    switch (obscure.filter) {
+    case ObscureFilter::BOX:
+        equirect_box_blur_columns(patch, radius_y);
+        break;
+    case ObscureFilter::STACK:
+        equirect_stack_blur_columns(patch, radius_y);
+        break;
+    default:
+        GaussianBlur(patch, patch, cv::Size(1, 2 * reach_y + 1), 0, radius_y / 2.0);
+        break;
+    }
+
+    cv::Mat blurred;
+    std::vector<int> buf;
+    for (const CapSpan& span : spans) {
+        const int radius_x = radius_x_at(span.y);
+        cv::Mat row = patch.row(span.y - patch_y);
+
+        switch (obscure.filter) {
+        case ObscureFilter::BOX:
+            equirect_box_blur_row(row.ptr<uchar>(), row.cols, row.channels(), radius_x, buf);
+            break;
+        case ObscureFilter::STACK:
+            equirect_stack_blur_row(row.ptr<uchar>(), row.cols, row.channels(), radius_x, buf);
+            break;
+        default: {
+            const int reach = equirect_blur_filter_reach(obscure.filter, radius_x);
+            const int kernel = MIN(2 * reach + 1, (patch.cols - 1) | 1);
+            GaussianBlur(row, blurred, cv::Size(kernel, 1), radius_x / 2.0, 0);
+            row = blurred;
+            break;
+        }
+        }
+        write_span(image, span, row, patch_x);
+    }
+}
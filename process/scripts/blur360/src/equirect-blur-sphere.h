@@ -0,0 +1,27 @@
+#pragma once
+
+#include "equirect-blur-common.h"
+
+#include <vector>
+
+/* A circle on the sphere */
+struct SphericalCap {
+    double longitude; /* Radians, 0 to 2pi across the equirect frame */
+    double colatitude; /* Radians, 0 at the top of the frame to pi at the bottom */
+    double radius; /* Angular radius in radians */
+};
+
+/* The cap covering a face found in projection p, as much as blur_face()'s
+ * padded square around it would */
+SphericalCap equirect_face_cap(const Projection& p, const Window& face);
+
+/* Obscure the pixels of the equirect frame inside cap, without going through
+ * a projection. Filtering is done in a patch around the cap, with the filter's
+ * horizontal size growing towards the poles so it covers the same angle on the
+ * sphere at every latitude. The rects written are appended to written_rects if
+ * it is set, split where they cross the frame's left/right edge */
+void equirect_obscure_cap(
+    cv::Mat& image,
+    const SphericalCap& cap,
+    const ObscureOptions& obscure,
+    std::vector<cv::Rect>* written_rects = nullptr);
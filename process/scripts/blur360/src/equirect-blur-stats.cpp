@@ -0,0 +1,318 @@
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+
+#include "equirect-blur-stats.h"
+#include "equirect-blur-trace.h"
+
+BlurStats::BlurStats(BlurStats* parent)
+    : parent_(parent)
+    , created_(std::chrono::steady_clock::now())
+{
+}
+
+void BlurStats::add_time(const std::string& stage, const double seconds)
+{
+    {
+        std::lock_guard lock(lock_);
+        BlurStatsData::Stage& s = data_.stages[stage];
+        s.count++;
+        s.seconds += seconds;
+    }
+    if (parent_ != nullptr)
+        parent_->add_time(stage, seconds);
+}
+
+void BlurStats::add_count(const std::string& counter, const uint64_t n)
+{
+    {
+        std::lock_guard lock(lock_);
+        data_.counters[counter] += n;
+    }
+    if (parent_ != nullptr)
+        parent_->add_count(counter, n);
+}
+
+void BlurStats::add_faces(const float phi, const float lambda, const uint64_t faces)
+{
+    const std::pair<int, int> projection(
+        static_cast<int>(lround(phi * 180 / M_PI)), static_cast<int>(lround(lambda * 180 / M_PI)));
+    {
+        std::lock_guard lock(lock_);
+        data_.counters["faces"] += faces;
+        data_.projection_faces[projection] += faces;
+    }
+    if (parent_ != nullptr)
+        parent_->add_faces(phi, lambda, faces);
+}
+
+void BlurStats::add_detection(const PCNStats& detection)
+{
+    {
+        std::lock_guard lock(lock_);
+        for (const PCNStageTiming& stage : detection.stages) {
+            BlurStatsData::Stage& s = data_.stages[stage.name];
+            s.count++;
+            s.seconds += stage.seconds;
+            if (stage.name != "prepare")
+                data_.counters["candidates_" + stage.name] += stage.windows;
+        }
+        data_.counters["pyramid_levels"] += detection.pyramid_levels;
+    }
+    if (parent_ != nullptr)
+        parent_->add_detection(detection);
+}
+
+BlurStatsData BlurStats::snapshot() const
+{
+    std::lock_guard lock(lock_);
+    BlurStatsData data = data_;
+    const std::chrono::duration<double> uptime = std::chrono::steady_clock::now() - created_;
+    data.uptime = uptime.count();
+    for (size_t i = 0; i <= static_cast<size_t>(MemoryUse::COUNT); i++) {
+        const auto use = static_cast<MemoryUse>(i);
+        data.memory[equirect_blur_memory_name(use)] = equirect_blur_memory_usage(use);
+    }
+    return data;
+}
+
+BlurStatsTimer::BlurStatsTimer(BlurStats* stats, const char* stage)
+    : stats_(stats)
+    , stage_(stage)
+    , running_(stats != nullptr || equirect_blur_trace_enabled())
+{
+    if (running_)
+        start_ = std::chrono::steady_clock::now();
+}
+
+BlurStatsTimer::~BlurStatsTimer()
+{
+    stop();
+}
+
+void BlurStatsTimer::stop()
+{
+    if (!running_)
+        return;
+    running_ = false;
+
+    const auto end = std::chrono::steady_clock::now();
+    equirect_blur_trace_span("stage", stage_, start_, end);
+    if (stats_ != nullptr) {
+        const std::chrono::duration<double> elapsed = end - start_;
+        stats_->add_time(stage_, elapsed.count());
+    }
+}
+
+BlurStats& equirect_blur_process_stats()
+{
+    static BlurStats stats;
+    return stats;
+}
+
+std::string equirect_blur_stats_json(const BlurStatsData& data)
+{
+    char buf[256];
+    snprintf(buf, sizeof(buf), "{\"uptime_seconds\":%.3f,\"stages\":{", data.uptime);
+    std::string json = buf;
+
+    const char* sep = "";
+    for (const auto& [name, stage] : data.stages) {
+        snprintf(
+            buf,
+            sizeof(buf),
+            "%s\"%s\":{\"count\":%llu,\"seconds\":%.6f}",
+            sep,
+            name.c_str(),
+            static_cast<unsigned long long>(stage.count),
+            stage.seconds);
+        json += buf;
+        sep = ",";
+    }
+
+    json += "},\"counters\":{";
+    sep = "";
+    for (const auto& [name, value] : data.counters) {
+        snprintf(buf, sizeof(buf), "%s\"%s\":%llu", sep, name.c_str(), static_cast<unsigned long long>(value));
+        json += buf;
+        sep = ",";
+    }
+
+    json += "},\"projection_faces\":[";
+    sep = "";
+    for (const auto& [projection, faces] : data.projection_faces) {
+        snprintf(
+            buf,
+            sizeof(buf),
+            "%s{\"phi\":%d,\"lambda\":%d,\"faces\":%llu}",
+            sep,
+            projection.first,
+            projection.second,
+            static_cast<unsigned long long>(faces));
+        json += buf;
+        sep = ",";
+    }
+
+    json += "],\"memory\":{";
+    sep = "";
+    for (const auto& [name, usage] : data.memory) {
+        snprintf(
+            buf,
+            sizeof(buf),
+            "%s\"%s\":{\"bytes\":%llu,\"peak_bytes\":%llu}",
+            sep,
+            name.c_str(),
+            static_cast<unsigned long long>(usage.bytes),
+            static_cast<unsigned long long>(usage.peak_bytes));
+        json += buf;
+        sep = ",";
+    }
+
+    return json + "}}";
+}
+
+std::string equirect_blur_stats_prometheus(const BlurStatsData& data)
+{
+    char buf[256];
+    std::string text;
+
+    text += "# HELP blur360_uptime_seconds Seconds since the stats were started\n";
+    text += "# TYPE blur360_uptime_seconds gauge\n";
+    snprintf(buf, sizeof(buf), "blur360_uptime_seconds %.3f\n", data.uptime);
+    text += buf;
+
+    text += "# HELP blur360_stage_seconds_total Wall time spent in each stage of processing\n";
+    text += "# TYPE blur360_stage_seconds_total counter\n";
+    for (const auto& [name, stage] : data.stages) {
+        snprintf(buf, sizeof(buf), "blur360_stage_seconds_total{stage=\"%s\"} %.6f\n", name.c_str(), stage.seconds);
+        text += buf;
+    }
+    text += "# HELP blur360_stage_runs_total Number of times each stage of processing ran\n";
+    text += "# TYPE blur360_stage_runs_total counter\n";
+    for (const auto& [name, stage] : data.stages) {
+        snprintf(
+            buf,
+            sizeof(buf),
+            "blur360_stage_runs_total{stage=\"%s\"} %llu\n",
+            name.c_str(),
+            static_cast<unsigned long long>(stage.count));
+        text += buf;
+    }
+
+    for (const auto& [name, value] : data.counters) {
+        snprintf(
+            buf,
+            sizeof(buf),
+            "# TYPE blur360_%s_total counter\nblur360_%s_total %llu\n",
+            name.c_str(),
+            name.c_str(),
+            static_cast<unsigned long long>(value));
+        text += buf;
+    }
+
+    text += "# HELP blur360_projection_faces_total Faces found in each projection\n";
+    text += "# TYPE blur360_projection_faces_total counter\n";
+    for (const auto& [projection, faces] : data.projection_faces) {
+        snprintf(
+            buf,
+            sizeof(buf),
+            "blur360_projection_faces_total{phi=\"%d\",lambda=\"%d\"} %llu\n",
+            projection.first,
+            projection.second,
+            static_cast<unsigned long long>(faces));
+        text += buf;
+    }
+
+    text += "# HELP blur360_memory_bytes Memory charged to each subsystem, and in total\n";
+    text += "# TYPE blur360_memory_bytes gauge\n";
+    for (const auto& [name, usage] : data.memory) {
+        snprintf(
+            buf,
+            sizeof(buf),
+            "blur360_memory_bytes{subsystem=\"%s\"} %llu\n",
+            name.c_str(),
+            static_cast<unsigned long long>(usage.bytes));
+        text += buf;
+    }
+    text += "# HELP blur360_memory_peak_bytes Most memory charged to each subsystem, and in total, at once\n";
+    text += "# TYPE blur360_memory_peak_bytes gauge\n";
+    for (const auto& [name, usage] : data.memory) {
+        snprintf(
+            buf,
+            sizeof(buf),
+            "blur360_memory_peak_bytes{subsystem=\"%s\"} %llu\n",
+            name.c_str(),
+            static_cast<unsigned long long>(usage.peak_bytes));
+        text += buf;
+    }
+
+    return text;
+}
+
+BlurStatsDumper::~BlurStatsDumper()
+{
+    stop();
+}
+
+bool BlurStatsDumper::start(
+    const BlurStats& stats, const std::string& path, const std::string& format, const double interval)
+{
+    if (format != "json" && format != "prometheus")
+        return false;
+
+    stats_ = &stats;
+    path_ = path;
+    prometheus_ = format == "prometheus";
+    stopping_ = false;
+
+    const auto period = std::chrono::duration<double>(interval > 0 ? interval : 10.0);
+    thread_ = std::thread([this, period] {
+        std::unique_lock lock(lock_);
+        while (!stop_cond_.wait_for(lock, period, [this] { return stopping_; })) {
+            lock.unlock();
+            dump();
+            lock.lock();
+        }
+    });
+    return true;
+}
+
+void BlurStatsDumper::stop()
+{
+    if (!thread_.joinable())
+        return;
+
+    {
+        std::lock_guard lock(lock_);
+        stopping_ = true;
+    }
+    stop_cond_.notify_one();
+    thread_.join();
+
+    dump();
+}
+
+void BlurStatsDumper::dump() const
+{
+    const BlurStatsData data = stats_->snapshot();
+    const std::string text
+        = prometheus_ ? equirect_blur_stats_prometheus(data) : equirect_blur_stats_json(data) + "\n";
+
+    if (path_ == "-") {
+        std::cout << text << std::flush;
+        return;
+    }
+
+    const std::string tmp_path = path_ + ".tmp";
+    {
+        std::ofstream out(tmp_path, std::ios::out | std::ios::trunc);
+        out << text;
+        if (!out) {
+            std::cerr << "Can't write stats file " << tmp_path << std::endl;
+            return;
+        }
+    }
+    if (std::rename(tmp_path.c_str(), path_.c_str()) != 0)
+        std::cerr << "Can't replace stats file " << path_ << std::endl;
+}
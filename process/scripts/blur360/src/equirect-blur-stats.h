@@ -0,0 +1,118 @@
+#pragma once
+
+#include "PCN.h"
+#include "equirect-blur-memory.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+/* Totals recorded by BlurStats since it was created */
+struct BlurStatsData {
+    struct Stage {
+        uint64_t count = 0;
+        double seconds = 0;
+    };
+
+    double uptime = 0; /* Seconds since the stats were created */
+    /* Wall time by stage: remap, detect (all of the detector's stages),
+     * prepare, stage1, nms1, stage2, nms2, stage3, nms3 and obscure, and the
+     * image tool's decode and write. Stages run on several threads at once add
+     * up past the uptime */
+    std::map<std::string, Stage> stages;
+    /* frames, projections (projection views searched), pyramid_levels,
+     * candidates_<stage> (windows left after each detector stage), faces,
+     * bytes_read and bytes_written */
+    std::map<std::string, uint64_t> counters;
+    std::map<std::pair<int, int>, uint64_t> projection_faces; /* By projection phi and lambda in degrees */
+    /* Memory charged to maps, models, scratch, frames and in total, for the
+     * whole process however many BlurStats there are. Taken at snapshot() */
+    std::map<std::string, MemoryUsage> memory;
+};
+
+/* Counters and per-stage timings for processing frames, shared by every thread
+ * of a process. Updates take a lock, so they are made once per stage of each
+ * projection rather than per pixel. Updates are also passed on to parent, if
+ * set, so an element's stats can add up into the process's */
+class BlurStats {
+public:
+    explicit BlurStats(BlurStats* parent = nullptr);
+
+    BlurStats(const BlurStats&) = delete;
+    BlurStats& operator=(const BlurStats&) = delete;
+
+    void add_time(const std::string& stage, double seconds);
+    void add_count(const std::string& counter, uint64_t n = 1);
+    void add_faces(float phi, float lambda, uint64_t faces);
+    /* Add the stages, candidate counts and pyramid levels from one PCN::Detect() */
+    void add_detection(const PCNStats& detection);
+
+    [[nodiscard]] BlurStatsData snapshot() const;
+
+private:
+    BlurStats* parent_;
+    std::chrono::steady_clock::time_point created_;
+    BlurStatsData data_;
+    mutable std::mutex lock_;
+};
+
+/* Adds the wall time from construction to destruction (or stop()) to a stage
+ * of stats, if it is set, and to the trace as a span if tracing is on */
+class BlurStatsTimer {
+public:
+    BlurStatsTimer(BlurStats* stats, const char* stage);
+    ~BlurStatsTimer();
+
+    BlurStatsTimer(const BlurStatsTimer&) = delete;
+    BlurStatsTimer& operator=(const BlurStatsTimer&) = delete;
+
+    void stop();
+
+private:
+    BlurStats* stats_;
+    const char* stage_;
+    bool running_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+/* The process-wide stats the command line tools dump */
+BlurStats& equirect_blur_process_stats();
+
+/* Stats as a JSON object on one line, or in the Prometheus text exposition
+ * format with blur360_ metric names */
+std::string equirect_blur_stats_json(const BlurStatsData& data);
+std::string equirect_blur_stats_prometheus(const BlurStatsData& data);
+
+/* Writes stats to a file every interval seconds from its own thread, and once
+ * more when stopped. Each dump replaces the file whole (written alongside it and
+ * renamed), so it can be read or scraped at any time. A path of "-" prints the
+ * dumps to stdout instead */
+class BlurStatsDumper {
+public:
+    BlurStatsDumper() = default;
+    ~BlurStatsDumper();
+
+    BlurStatsDumper(const BlurStatsDumper&) = delete;
+    BlurStatsDumper& operator=(const BlurStatsDumper&) = delete;
+
+    /* format is json or prometheus. Returns false if it isn't one of those */
+    bool start(const BlurStats& stats, const std::string& path, const std::string& format, double interval);
+    void stop();
+
+private:
+    void dump() const;
+
+    const BlurStats* stats_ = nullptr;
+    std::string path_;
+    bool prometheus_ = false;
+
+    std::thread thread_;
+    bool stopping_ = false;
+    std::mutex lock_;
+    std::condition_variable stop_cond_;
+};
@@ -0,0 +1,179 @@
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+#include "equirect-blur-common.h"
+#include "equirect-blur-tiles.h"
+
+/* File name letters, indexed by CubeFace */
+static const char face_letters[] = { 'f', 'b', 'u', 'd', 'l', 'r' };
+
+TileWriter::TileWriter(const cv::Size& equ_size, const TileOptions& options)
+    : equ_size_(equ_size)
+    , options_(options)
+{
+    /* Sizes and levels are worked out as generate.py does for a full panorama */
+    cube_size_ = options.cube_size > 0 ? options.cube_size : 8 * static_cast<int>(equ_size.width / M_PI / 8);
+    tile_size_ = std::min(options.tile_size, cube_size_);
+    levels_ = static_cast<int>(std::ceil(std::log2(static_cast<double>(cube_size_) / tile_size_))) + 1;
+    if (static_cast<int>(cube_size_ / std::pow(2.0, levels_ - 2)) == tile_size_)
+        levels_--;
+
+    face_maps_.resize(std::size(face_letters));
+    for (size_t f = 0; f < face_maps_.size(); f++)
+        face_maps_[f] = equirect_cube_face_map(equ_size, static_cast<CubeFace>(f), cube_size_);
+    face_maps_charge_.set(face_maps_.size() * face_maps_[0].total() * face_maps_[0].elemSize());
+}
+
+int TileWriter::cube_size() const
+{
+    return cube_size_;
+}
+
+int TileWriter::levels() const
+{
+    return levels_;
+}
+
+/* Mask of the full size face's pixels that sample from the changed equirect rects.
+ * The rects are grown by two pixels for the bicubic interpolation */
+cv::Mat TileWriter::changed_mask(const size_t face, const std::vector<cv::Rect>& changed) const
+{
+    cv::Mat mask = cv::Mat::zeros(cube_size_, cube_size_, CV_8U);
+    cv::Mat in_rect;
+
+    for (const cv::Rect& rect : changed) {
+        const cv::Scalar low(rect.x - 2, rect.y - 2);
+        const cv::Scalar high(rect.x + rect.width + 2, rect.y + rect.height + 2);
+        cv::inRange(face_maps_[face], low, high, in_rect);
+        cv::bitwise_or(mask, in_rect, mask);
+    }
+
+    return mask;
+}
+
+bool TileWriter::write(const cv::Mat& image, const std::string& output_dir, const std::vector<cv::Rect>* changed) const
+{
+    if (image.size() != equ_size_) {
+        std::cerr << "Tile input size mismatch (expected " << equ_size_.height << " x " << equ_size_.width << " got "
+                  << image.rows << " x " << image.cols << ")" << std::endl;
+        return false;
+    }
+
+    const std::filesystem::path dir(output_dir);
+
+    /* Without a complete previous set, every tile has to be written */
+    if (changed != nullptr && !std::filesystem::exists(dir / "config.json"))
+        changed = nullptr;
+    std::vector<std::filesystem::path> subdirs;
+    for (int level = 1; level <= levels_; level++)
+        subdirs.push_back(dir / std::to_string(level));
+    if (options_.fallback_size > 0)
+        subdirs.push_back(dir / "fallback");
+    for (const std::filesystem::path& subdir : subdirs) {
+        std::error_code ec;
+        std::filesystem::create_directories(subdir, ec);
+        if (ec) {
+            std::cerr << "Can't create tile directory " << subdir.u8string() << ": " << ec.message() << std::endl;
+            return false;
+        }
+    }
+
+    const std::vector<int> params = { cv::IMWRITE_JPEG_QUALITY, options_.quality };
+    cv::Mat face;
+
+    for (size_t f = 0; f < face_maps_.size(); f++) {
+        cv::Mat mask;
+        if (changed != nullptr) {
+            mask = changed_mask(f, *changed);
+            if (cv::countNonZero(mask) == 0)
+                continue;
+        }
+
+        /* Resampled as generate.py does: bicubic like nona's default poly3,
+         * then Lanczos for the smaller sizes like PIL's resize(). OpenCV's
+         * Lanczos doesn't widen its kernel when shrinking as PIL's does */
+        remap(image, face, face_maps_[f], cv::noArray(), cv::INTER_CUBIC, cv::BORDER_WRAP);
+
+        if (options_.fallback_size > 0) {
+            cv::Mat fallback;
+            cv::resize(
+                face, fallback, cv::Size(options_.fallback_size, options_.fallback_size), 0, 0, cv::INTER_LANCZOS4);
+            const std::filesystem::path file = dir / "fallback" / (std::string(1, face_letters[f]) + ".jpg");
+            if (!cv::imwrite(file.u8string(), fallback, params)) {
+                std::cerr << "Can't write tile " << file.u8string() << std::endl;
+                return false;
+            }
+        }
+
+        /* Each level halves the one above it, from the full cube size down */
+        int size = cube_size_;
+        for (int level = levels_; level > 0; level--) {
+            if (level < levels_)
+                cv::resize(face, face, cv::Size(size, size), 0, 0, cv::INTER_LANCZOS4);
+
+            /* Size of a pixel at this level in full size face pixels, for
+             * finding the tiles a changed pixel contributes to. Each halving's
+             * Lanczos reaches 4 pixels of the level above, which adds up to
+             * less than 4 pixels of this level however many levels down */
+            const double scale = static_cast<double>(cube_size_) / size;
+            const cv::Rect full_face(0, 0, cube_size_, cube_size_);
+
+            const int tiles = (size + tile_size_ - 1) / tile_size_;
+            for (int i = 0; i < tiles; i++) {
+                for (int j = 0; j < tiles; j++) {
+                    const cv::Rect tile(j * tile_size_, i * tile_size_, tile_size_, tile_size_);
+                    if (!mask.empty()) {
+                        const cv::Rect area(
+                            static_cast<int>(std::floor((tile.x - 4) * scale)),
+                            static_cast<int>(std::floor((tile.y - 4) * scale)),
+                            static_cast<int>(std::ceil((tile.width + 8) * scale)),
+                            static_cast<int>(std::ceil((tile.height + 8) * scale)));
+                        if (cv::countNonZero(mask(area & full_face)) == 0)
+                            continue;
+                    }
+
+                    const std::string name = face_letters[f] + std::to_string(i) + "_" + std::to_string(j) + ".jpg";
+                    const std::filesystem::path file = dir / std::to_string(level) / name;
+
+                    if (!cv::imwrite(file.u8string(), face(tile & cv::Rect(0, 0, size, size)), params)) {
+                        std::cerr << "Can't write tile " << file.u8string() << std::endl;
+                        return false;
+                    }
+                }
+            }
+            size /= 2;
+        }
+    }
+
+    return write_config(output_dir);
+}
+
+bool TileWriter::write_config(const std::string& output_dir) const
+{
+    const std::filesystem::path file = std::filesystem::path(output_dir) / "config.json";
+    std::ofstream out(file, std::ios::out | std::ios::trunc);
+
+    out << "{\n";
+    out << "    \"hfov\": " << cv::format("%.1f", options_.hfov) << ",\n";
+    out << "    \"type\": \"multires\",\n";
+    out << "    \"multiRes\": {\n";
+    out << "        \"path\": \"/%l/%s%y_%x\",\n";
+    if (options_.fallback_size > 0)
+        out << "        \"fallbackPath\": \"/fallback/%s\",\n";
+    out << "        \"extension\": \"jpg\",\n";
+    out << "        \"tileResolution\": " << tile_size_ << ",\n";
+    out << "        \"maxLevel\": " << levels_ << ",\n";
+    out << "        \"cubeResolution\": " << cube_size_ << "\n";
+    out << "    }\n";
+    out << "}";
+    out.close();
+
+    if (out.fail()) {
+        std::cerr << "Can't write tile config " << file.u8string() << std::endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "equirect-blur-memory.h"
+
+#include <opencv2/core.hpp>
+#include <string>
+#include <vector>
+
+/* Settings for a Pannellum multires tile set, matching generate.py's options
+ * and defaults */
+struct TileOptions {
+    int tile_size = 512;
+    int cube_size = 0; /* 0 to keep all the detail of the equirect */
+    int fallback_size = 1024; /* Size of the fallback cube faces, 0 for none */
+    int quality = 75; /* JPEG quality of the tiles */
+    double hfov = 100.0; /* Starting horizontal field of view in the config */
+};
+
+/* Writes a full equirect frame as a Pannellum multires tile set, laid out like
+ * generate.py's output:
+ *
+ *   config.json          - the multiRes viewer config
+ *   <level>/<face><row>_<col>.jpg
+ *   fallback/<face>.jpg  - if fallback_size is set
+ *
+ * Level 1 is the lowest resolution, with each level doubling the cube size up to
+ * the full cube size at maxLevel. The cube face maps are built once, and write()
+ * only remaps and encodes, so one TileWriter can be used from several threads */
+class TileWriter {
+public:
+    TileWriter(const cv::Size& equ_size, const TileOptions& options);
+
+    [[nodiscard]] int cube_size() const;
+    [[nodiscard]] int levels() const;
+
+    /* Write the tiles for image into output_dir, creating it if needed.
+     * config.json is written last, so its presence marks a complete set.
+     *
+     * If changed is set (equirect rects, e.g. DirtyRegions::changed) and
+     * output_dir already has a complete set, only the tiles and fallback faces
+     * that sample from those rects are rewritten */
+    bool write(
+        const cv::Mat& image, const std::string& output_dir, const std::vector<cv::Rect>* changed = nullptr) const;
+
+private:
+    bool write_config(const std::string& output_dir) const;
+    [[nodiscard]] cv::Mat changed_mask(size_t face, const std::vector<cv::Rect>& changed) const;
+
+    cv::Size equ_size_;
+    TileOptions options_;
+    int cube_size_;
+    int tile_size_;
+    int levels_;
+    std::vector<cv::Mat2f> face_maps_; /* Indexed by CubeFace */
+    MemoryCharge face_maps_charge_ { MemoryUse::MAPS };
+};
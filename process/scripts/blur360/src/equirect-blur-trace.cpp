@@ -0,0 +1,184 @@
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+
+#include "equirect-blur-trace.h"
+
+std::atomic<bool> equirect_blur_trace_on { false };
+
+static std::mutex trace_lock;
+static FILE* trace_file = nullptr;
+static std::chrono::steady_clock::time_point trace_start;
+static std::atomic<int> next_thread_id { 1 };
+
+static thread_local int thread_id = 0;
+static thread_local int64_t thread_frame = -1;
+
+static int current_thread_id()
+{
+    if (thread_id == 0)
+        thread_id = next_thread_id++;
+    return thread_id;
+}
+
+static std::string escape(const std::string& str)
+{
+    std::string out;
+    for (const char c : str) {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        if (static_cast<unsigned char>(c) >= 0x20)
+            out += c;
+    }
+    return out;
+}
+
+/* Microseconds since the trace started */
+static double trace_us(const std::chrono::steady_clock::time_point t)
+{
+    const std::chrono::duration<double, std::micro> us = t - trace_start;
+    return us.count();
+}
+
+/* The args object for a span on this thread */
+static std::string frame_args(const std::string& args)
+{
+    std::string out = "{";
+    if (thread_frame >= 0)
+        out += "\"frame\":" + std::to_string(thread_frame) + (args.empty() ? "" : ",");
+    return out + args + "}";
+}
+
+/* Write one event (everything but its closing brace) under the lock */
+static void write_event(const std::string& event)
+{
+    std::lock_guard lock(trace_lock);
+    if (trace_file != nullptr)
+        fprintf(trace_file, ",\n%s}", event.c_str());
+}
+
+bool equirect_blur_trace_open(const std::string& path)
+{
+    equirect_blur_trace_close();
+
+    std::lock_guard lock(trace_lock);
+    trace_file = fopen(path.c_str(), "w");
+    if (trace_file == nullptr) {
+        std::cerr << "Can't open trace file " << path << std::endl;
+        return false;
+    }
+
+    trace_start = std::chrono::steady_clock::now();
+    fprintf(trace_file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(trace_file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"blur360\"}}");
+    equirect_blur_trace_on = true;
+    return true;
+}
+
+void equirect_blur_trace_close()
+{
+    std::lock_guard lock(trace_lock);
+    equirect_blur_trace_on = false;
+    if (trace_file == nullptr)
+        return;
+
+    fprintf(trace_file, "\n]}\n");
+    fclose(trace_file);
+    trace_file = nullptr;
+}
+
+void equirect_blur_trace_thread_name(const std::string& name)
+{
+    if (!equirect_blur_trace_enabled())
+        return;
+
+    char buf[64];
+    snprintf(buf, sizeof(buf), "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d", current_thread_id());
+    write_event(buf + std::string(",\"args\":{\"name\":\"") + escape(name) + "\"}");
+}
+
+void equirect_blur_trace_span(
+    const char* cat,
+    const std::string& name,
+    const std::chrono::steady_clock::time_point start,
+    const std::chrono::steady_clock::time_point end,
+    const std::string& args)
+{
+    if (!equirect_blur_trace_enabled())
+        return;
+
+    char buf[128];
+    snprintf(
+        buf,
+        sizeof(buf),
+        "\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d",
+        trace_us(start),
+        trace_us(end) - trace_us(start),
+        current_thread_id());
+    write_event(
+        "{\"name\":\"" + escape(name) + "\",\"cat\":\"" + cat + "\"," + buf + ",\"args\":" + frame_args(args));
+}
+
+/* Write a B or E event at the current time */
+static void trace_edge(const char phase, const char* cat, const std::string& name)
+{
+    if (!equirect_blur_trace_enabled())
+        return;
+
+    char buf[128];
+    snprintf(
+        buf,
+        sizeof(buf),
+        "\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%d",
+        phase,
+        trace_us(std::chrono::steady_clock::now()),
+        current_thread_id());
+    write_event(
+        "{\"name\":\"" + escape(name) + "\",\"cat\":\"" + cat + "\"," + buf + ",\"args\":" + frame_args(""));
+}
+
+void equirect_blur_trace_begin(const char* cat, const std::string& name)
+{
+    trace_edge('B', cat, name);
+}
+
+void equirect_blur_trace_end(const char* cat, const std::string& name)
+{
+    trace_edge('E', cat, name);
+}
+
+BlurTraceSpan::BlurTraceSpan(const char* cat, const char* name)
+    : cat_(cat)
+    , name_(name)
+    , enabled_(equirect_blur_trace_enabled())
+{
+    if (enabled_)
+        start_ = std::chrono::steady_clock::now();
+}
+
+BlurTraceSpan::~BlurTraceSpan()
+{
+    if (enabled_)
+        equirect_blur_trace_span(cat_, name_, start_, std::chrono::steady_clock::now(), args_);
+}
+
+void BlurTraceSpan::arg(const char* key, const double value)
+{
+    if (!enabled_)
+        return;
+
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%s\"%s\":%g", args_.empty() ? "" : ",", key, value);
+    args_ += buf;
+}
+
+BlurTraceFrame::BlurTraceFrame(const int64_t frame)
+    : previous_(thread_frame)
+{
+    thread_frame = frame;
+}
+
+BlurTraceFrame::~BlurTraceFrame()
+{
+    thread_frame = previous_;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+/* Optional timeline tracing in Chrome's trace-event JSON format, which can be
+ * opened in Perfetto (ui.perfetto.dev) or chrome://tracing. Spans are written
+ * to one file for the whole process as they finish, tagged with the thread
+ * they ran on and the frame being processed. With no trace open each span
+ * costs one relaxed atomic load */
+
+/* Start writing a trace to path, replacing any trace already open */
+bool equirect_blur_trace_open(const std::string& path);
+/* Finish the trace file. Spans still open when it closes are dropped */
+void equirect_blur_trace_close();
+
+extern std::atomic<bool> equirect_blur_trace_on;
+
+inline bool equirect_blur_trace_enabled()
+{
+    return equirect_blur_trace_on.load(std::memory_order_relaxed);
+}
+
+/* Name the calling thread in the trace (e.g. decode-0) */
+void equirect_blur_trace_thread_name(const std::string& name);
+
+/* Add a span of category cat that ran from start to end on this thread. args
+ * is empty or a list of JSON members (e.g. "\"level\":2") added to the span's
+ * frame number */
+void equirect_blur_trace_span(
+    const char* cat,
+    const std::string& name,
+    std::chrono::steady_clock::time_point start,
+    std::chrono::steady_clock::time_point end,
+    const std::string& args = std::string());
+
+/* Begin and end a span on this thread separately, for hooks that see the two
+ * halves in different calls. Spans begun on a thread must end in reverse order */
+void equirect_blur_trace_begin(const char* cat, const std::string& name);
+void equirect_blur_trace_end(const char* cat, const std::string& name);
+
+/* Traces the span from construction to destruction, if tracing is on */
+class BlurTraceSpan {
+public:
+    BlurTraceSpan(const char* cat, const char* name);
+    ~BlurTraceSpan();
+
+    BlurTraceSpan(const BlurTraceSpan&) = delete;
+    BlurTraceSpan& operator=(const BlurTraceSpan&) = delete;
+
+    /* Add a number to the span's arguments */
+    void arg(const char* key, double value);
+
+private:
+    const char* cat_;
+    const char* name_;
+    bool enabled_;
+    std::chrono::steady_clock::time_point start_;
+    std::string args_;
+};
+
+/* Tags the spans on this thread with a frame number while it is in scope */
+class BlurTraceFrame {
+public:
+    explicit BlurTraceFrame(int64_t frame);
+    ~BlurTraceFrame();
+
+    BlurTraceFrame(const BlurTraceFrame&) = delete;
+    BlurTraceFrame& operator=(const BlurTraceFrame&) = delete;
+
+private:
+    int64_t previous_;
+};
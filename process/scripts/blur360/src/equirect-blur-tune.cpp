@@ -0,0 +1,325 @@
+#include "config.h"
+#include "equirect-blur-annotations.h"
+#include "equirect-blur-config.h"
+#include "equirect-blur-shared.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+/* Search the detector's cost knobs (minimum face size, pyramid scale, the three
+ * stage thresholds and the projection layout) on a sample of frames for the
+ * fastest configuration that still finds a given share of the faces, and write
+ * it as a config file for equirect-blur-image, equirect-blur-video and the
+ * equirect_blur element.
+ *
+ * The faces to find are the sample's annotations if it has them, or else the
+ * faces the starting configuration finds, so an unannotated sample of our own
+ * footage tunes for speed without losing what we blur today */
+
+struct SampleFrame {
+    std::string file;
+    cv::Mat image;
+    std::vector<AnnotatedFace> faces; /* The faces to find */
+};
+
+/* One configuration's run over the sample */
+struct Trial {
+    BlurConfig config;
+    double seconds = 0; /* Spent detecting, leaving out building the projection maps */
+    size_t faces = 0;
+    size_t detections = 0;
+    size_t matched = 0;
+
+    [[nodiscard]] double recall() const
+    {
+        return faces > 0 ? static_cast<double>(matched) / static_cast<double>(faces) : 1.0;
+    }
+
+    [[nodiscard]] double precision() const
+    {
+        return detections > 0 ? static_cast<double>(matched) / static_cast<double>(detections) : 1.0;
+    }
+};
+
+/* Up to count .jpg frames spread evenly through dir */
+static std::vector<std::filesystem::path> sample_files(const std::string& dir, const size_t count)
+{
+    std::vector<std::filesystem::path> files;
+    for (const auto& entry : std::filesystem::directory_iterator(dir)) {
+        std::string extension = entry.path().extension().u8string();
+        std::transform(extension.begin(), extension.end(), extension.begin(), [](const unsigned char c) {
+            return std::tolower(c);
+        });
+        if (extension == ".jpg")
+            files.push_back(entry.path());
+    }
+    std::sort(files.begin(), files.end());
+
+    if (files.size() <= count)
+        return files;
+
+    std::vector<std::filesystem::path> sample;
+    for (size_t i = 0; i < count; i++)
+        sample.push_back(files[i * files.size() / count]);
+    return sample;
+}
+
+/* Detect the faces in every frame under config with one detector. found (if
+ * set) gets each frame's detections */
+static bool run_trial(
+    const BlurConfig& config,
+    PCN& detector,
+    const std::vector<SampleFrame>& frames,
+    Trial& trial,
+    std::vector<std::vector<FaceDetection>>* found = nullptr)
+{
+    trial = Trial();
+    trial.config = config;
+    equirect_blur_apply_detector_settings(detector, config.detector);
+
+    FrameScratch scratch;
+    for (const SampleFrame& frame : frames) {
+        std::vector<Projection> projections = equirect_blur_shared_projections(frame.image.size(), config.layout);
+        for (Projection& p : projections)
+            p.detector = &detector;
+
+        std::vector<FaceDetection> detections;
+        const auto start = std::chrono::steady_clock::now();
+        if (!equirect_blur_detect_frame(frame.image, projections, detections, &scratch))
+            return false;
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        trial.seconds += elapsed.count();
+        trial.faces += frame.faces.size();
+        trial.detections += detections.size();
+        trial.matched += equirect_blur_match_faces(frame.faces, detections, frame.image.size());
+        if (found != nullptr)
+            found->push_back(std::move(detections));
+    }
+    return true;
+}
+
+static float radians(const double degrees)
+{
+    return static_cast<float>(degrees * M_PI / 180);
+}
+
+/* Configurations one step away from config in each direction of each knob */
+static std::vector<BlurConfig> neighbours(const BlurConfig& config)
+{
+    std::vector<BlurConfig> out;
+    BlurConfig c;
+
+    /* PCN searches for 20 pixel faces when asked for anything under 15 */
+    c = config;
+    c.detector.min_face_size = static_cast<int>(lround(config.detector.min_face_size * 1.25));
+    out.push_back(c);
+    c.detector.min_face_size = static_cast<int>(lround(config.detector.min_face_size / 1.25));
+    if (c.detector.min_face_size >= 15)
+        out.push_back(c);
+
+    c = config;
+    c.detector.pyramid_scale = config.detector.pyramid_scale + 0.1f;
+    out.push_back(c);
+    c.detector.pyramid_scale = config.detector.pyramid_scale - 0.1f;
+    if (c.detector.pyramid_scale > 1.05f)
+        out.push_back(c);
+
+    for (int stage = 0; stage < 3; stage++) {
+        c = config;
+        c.detector.thresh[stage] = config.detector.thresh[stage] * 1.05f;
+        out.push_back(c);
+        c.detector.thresh[stage] = config.detector.thresh[stage] / 1.05f;
+        out.push_back(c);
+    }
+
+    /* Taller or shorter bands of projections, overlapping by half */
+    for (const double change : { 15.0, -15.0 }) {
+        c = config;
+        c.layout.aperture[1] = config.layout.aperture[1] + radians(change);
+        c.layout.step[1] = c.layout.aperture[1] / 2;
+        if (c.layout.aperture[1] >= radians(60) && c.layout.aperture[1] <= static_cast<float>(M_PI))
+            out.push_back(c);
+    }
+
+    /* One column of projections, with a seam at the back, or two overlapping by half */
+    c = config;
+    c.layout.step[0] = config.layout.step[0] < config.layout.aperture[0] ? config.layout.aperture[0]
+                                                                         : config.layout.aperture[0] / 2;
+    out.push_back(c);
+
+    return out;
+}
+
+/* Whether a beats b: meeting the recall target comes first, then speed.
+ * Timings within 2% of each other are taken as noise */
+static bool better(const Trial& a, const Trial& b, const double target)
+{
+    const bool a_meets = a.recall() >= target, b_meets = b.recall() >= target;
+    if (a_meets != b_meets)
+        return a_meets;
+    if (!a_meets)
+        return a.recall() > b.recall();
+    return a.seconds < b.seconds * 0.98;
+}
+
+static void print_trial(const size_t n, const Trial& trial, const size_t frames)
+{
+    std::cout << cv::format(
+                     "{\"trial\":%zu,\"seconds\":%.3f,\"fps\":%.3f,\"recall\":%.4f,\"precision\":%.4f,\"faces\":%zu,"
+                     "\"detections\":%zu,\"config\":",
+                     n,
+                     trial.seconds,
+                     trial.seconds > 0 ? static_cast<double>(frames) / trial.seconds : 0.0,
+                     trial.recall(),
+                     trial.precision(),
+                     trial.faces,
+                     trial.detections)
+              << equirect_blur_config_json(trial.config) << "}" << std::endl;
+}
+
+int main(int argc, const char** argv)
+{
+    cv::CommandLineParser parser(
+        argc,
+        argv,
+        "{help h||}"
+        "{models-dir m|" MODELS_DATADIR "|Path to PCN models}"
+        "{defaults|image|Start from the defaults of equirect-blur-image (image) or the equirect_blur element (video)}"
+        "{config||Start from this config file instead, over the --defaults}"
+        "{annotations||Faces annotated in the sample (JSON lines, as for bench-accuracy). Without them, recall is "
+        "measured against the faces the starting configuration finds}"
+        "{recall|0.98|Share of the faces the tuned configuration must find}"
+        "{frames|12|Frames to tune on, spread evenly through the sample}"
+        "{max-trials|60|Number of configurations to try}"
+        "{output o|blur360-config.json|Config file to write}"
+        "{@sample||Directory of .jpg frames from the footage to tune for}");
+    parser.about("\nSearches the detector settings and projection layout for the fastest configuration\n"
+                 "that still finds --recall of the faces in a sample of frames, and writes it as a config\n"
+                 "file for equirect-blur-image, equirect-blur-video and the equirect_blur element\n");
+
+    if (parser.get<bool>("help") || !parser.has("@sample")) {
+        parser.printMessage();
+        return parser.get<bool>("help") ? 0 : 1;
+    }
+
+    const std::string defaults = parser.get<cv::String>("defaults");
+    if (defaults != "image" && defaults != "video") {
+        std::cerr << "--defaults must be image or video" << std::endl;
+        return 1;
+    }
+    BlurConfig start = defaults == "video" ? equirect_blur_video_defaults() : equirect_blur_image_defaults();
+    std::string error;
+    if (parser.has("config") && !equirect_blur_load_config(parser.get<cv::String>("config"), start, error)) {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+
+    const double target = parser.get<double>("recall");
+    const int max_trials = parser.get<int>("max-trials");
+    if (target < 0 || target > 1 || max_trials < 1 || parser.get<int>("frames") < 1) {
+        std::cerr << "--recall must be between 0 and 1, and --frames and --max-trials at least 1" << std::endl;
+        return 1;
+    }
+
+    AnnotationReader annotations;
+    const bool annotated = parser.has("annotations");
+    if (annotated && !annotations.load(parser.get<cv::String>("annotations")))
+        return 1;
+
+    std::vector<SampleFrame> frames;
+    for (const std::filesystem::path& file :
+         sample_files(parser.get<cv::String>("@sample"), static_cast<size_t>(parser.get<int>("frames")))) {
+        SampleFrame frame;
+        frame.file = file.filename().u8string();
+        if (annotated) {
+            const AnnotatedImage* image = annotations.find_file(frame.file);
+            if (image == nullptr) {
+                std::cout << "Skipping " << frame.file << ", which has no annotations" << std::endl;
+                continue;
+            }
+            frame.faces = image->faces;
+        }
+
+        frame.image = cv::imread(file.u8string());
+        if (frame.image.empty()) {
+            std::cerr << "Can't open image file " << file.u8string() << std::endl;
+            return 1;
+        }
+        frames.push_back(std::move(frame));
+    }
+    if (frames.empty()) {
+        std::cerr << "No frames to tune on" << std::endl;
+        return 1;
+    }
+
+    PCN* detector = equirect_blur_create_detector(parser.get<cv::String>("models-dir"), DetectorSettings(), false);
+
+    /* The first run also warms up the detector, so the starting configuration
+     * is timed again as the first trial */
+    std::vector<std::vector<FaceDetection>> found;
+    Trial best;
+    if (!run_trial(start, *detector, frames, best, &found))
+        return 1;
+    if (!annotated) {
+        for (size_t i = 0; i < frames.size(); i++) {
+            for (const FaceDetection& face : found[i])
+                frames[i].faces.push_back(equirect_blur_annotate_detection(face, frames[i].image.size()));
+        }
+    }
+
+    std::cout << "Tuning on " << frames.size() << " frames" << std::endl;
+    std::set<std::string> tried { equirect_blur_config_json(start) };
+    size_t trials = 0;
+    if (!run_trial(start, *detector, frames, best))
+        return 1;
+    print_trial(trials++, best, frames.size());
+    const Trial first = best;
+
+    /* Move to the best of the neighbouring configurations until none beats the
+     * current one, or the trials run out */
+    bool improved = true;
+    while (improved && trials < static_cast<size_t>(max_trials)) {
+        improved = false;
+        Trial round_best = best;
+        for (const BlurConfig& candidate : neighbours(best.config)) {
+            if (trials >= static_cast<size_t>(max_trials))
+                break;
+            if (!tried.insert(equirect_blur_config_json(candidate)).second)
+                continue;
+
+            Trial trial;
+            if (!run_trial(candidate, *detector, frames, trial))
+                return 1;
+            print_trial(trials++, trial, frames.size());
+            if (better(trial, round_best, target)) {
+                round_best = trial;
+                improved = true;
+            }
+        }
+        best = round_best;
+    }
+    delete detector;
+
+    if (best.recall() < target) {
+        std::cerr << "No configuration found with a recall of " << target << " (best " << best.recall() << ")"
+                  << std::endl;
+        return 1;
+    }
+
+    std::cout << cv::format(
+                     "Best of %zu trials: recall %.4f, %.2fx the speed of the starting configuration",
+                     trials,
+                     best.recall(),
+                     best.seconds > 0 ? first.seconds / best.seconds : 1.0)
+              << std::endl;
+    std::cout << equirect_blur_config_json(best.config) << std::endl;
+
+    return equirect_blur_save_config(parser.get<cv::String>("output"), best.config) ? 0 : 1;
+}
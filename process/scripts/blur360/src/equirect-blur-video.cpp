@@ -1,4 +1,7 @@
 #include "config.h"
+#include "equirect-blur-memory.h"
+#include "equirect-blur-trace.h"
+#include "gst-equirect-blur-tracer.h"
 #include "gst-equirect-blur.h"
 
 #ifdef G_OS_UNIX
@@ -9,6 +12,12 @@
 #include <windows.h>
 #endif
 
+#include <glib/gstdio.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+
 using namespace cv;
 using namespace std;
 
@@ -16,23 +25,113 @@ struct BlurData {
     GstBin* pipeline;
     GstElement* src;
     GstElement* mux;
+
+    /* Portion of the input this pipeline outputs, in stream time. stop is
+     * GST_CLOCK_TIME_NONE for the final (or only) segment */
+    GstClockTime start;
+    GstClockTime stop;
+
+    /* Keyframes the compressed video is decoded from and up to. Decoding a GOP
+     * either side of the output range lets the leading B-frames of an open GOP,
+     * which come after their keyframe in decode order but before it in
+     * presentation order, be decoded from complete references and kept by the
+     * segment their PTS falls in. decode_stop is GST_CLOCK_TIME_NONE to decode
+     * to the end */
+    GstClockTime decode_start;
+    GstClockTime decode_stop;
+
+    /* For reporting which file failed in batch mode */
+    String output_file;
+
+    /* Detections file written by this pipeline's blur filter, if any */
+    String save_detections;
+
+    /* Set for segments of a checkpointed run, which are recorded in the
+     * checkpoint file as they complete */
+    gboolean checkpointed;
+    guint segment_index;
+
+    guint bus_watch_id;
+    gboolean done;
+};
+
+/* Options for processing one input file */
+struct ProcessOptions {
+    guint n_segments;
+    String save_detections;
+
+    /* Split the input into segments of about this length, recording each as it
+     * completes so the run can be resumed. 0 to disable */
+    GstClockTime checkpoint_interval;
+    gboolean resume;
+};
+
+#define DEFAULT_CHECKPOINT_INTERVAL (60 * GST_SECOND)
+
+/* Encoder settings for the blurred video. Empty / 0 settings are left at the
+ * encoder's defaults */
+struct EncoderOptions {
+    String element;
+    String parser; /* Parser for the encoder's output format */
+    String preset;
+    int threads;
+    int keyframe_interval;
+    int face_qp_delta; /* Quantiser offset for face regions, for encoders that take ROI hints */
+};
+
+/* Per-stream state for trimming a segment's input to its keyframe range */
+struct SegmentStream {
+    const BlurData* bd;
+    gboolean is_video;
+    gboolean started;
+    gboolean eos_sent;
 };
 
 static bool draw_over_faces;
+static bool direct_obscure;
+static String obscure_filter;
+static double obscure_radius;
 static String models_dir;
-BlurData blur_data;
+static String config_file; /* Detector settings and projection layout, if set */
+static String config_json; /* config_file's settings, to record in checkpoints */
+static String load_detections;
+static gboolean shared_detectors;
+static EncoderOptions encoder;
+static guint max_inferences;
+static double memory_budget; /* In MB, 0 for none */
+static vector<BlurData*> blur_pipelines;
+static guint active_pipelines;
+static guint running_pipelines;
+static guint max_running_pipelines;
+static size_t next_pipeline;
+static gboolean processing_failed;
+static gboolean keep_going; /* Carry on with the other pipelines when one fails */
+static String checkpoint_file;
+static gboolean count_io_bytes; /* Add the bytes read and written to the process stats */
 
 GMainLoop* loop = nullptr;
 
+static gboolean blur_data_is_segment(const BlurData* bd)
+{
+    return bd->start > 0 || GST_CLOCK_TIME_IS_VALID(bd->stop);
+}
+
 #if defined(G_OS_UNIX) || defined(G_OS_WIN32)
 [[maybe_unused]] static guint signal_watch_intr_id;
 
 // ReSharper disable once CppDFAConstantParameter
 static gboolean intr_handler([[maybe_unused]] gpointer user_data)
 {
-    if (blur_data.src) {
+    if (blur_pipelines.size() > 1 || !checkpoint_file.empty()) {
+        /* Partial segments can't be joined into a usable output, so don't wait for them to drain.
+         * Completed segments of a checkpointed run are kept to resume from */
+        g_print("Stopping\n");
+        processing_failed = TRUE;
+        g_main_loop_quit(loop);
+    }
+    else if (!blur_pipelines.empty() && blur_pipelines[0]->src) {
         g_print("Stopping. Sending EOS (This can take a long time while it drains queued frames)\n");
-        gst_element_send_event(blur_data.src, gst_event_new_eos());
+        gst_element_send_event(blur_pipelines[0]->src, gst_event_new_eos());
     }
     else {
         g_print("Stopping\n");
@@ -51,12 +150,59 @@ static BOOL WINAPI w32_intr_handler([[maybe_unused]] DWORD dwCtrlType)
 #endif
 #endif
 
-static gboolean msg_handler([[maybe_unused]] GstBus* bus, GstMessage* message, [[maybe_unused]] gpointer data)
+/* Record a completed segment of a checkpointed run */
+static void checkpoint_segment_done(const guint segment_index)
+{
+    std::ofstream out(checkpoint_file, std::ios::out | std::ios::app);
+    out << "done " << segment_index << endl;
+    if (!out)
+        cerr << "Failed to update checkpoint file " << checkpoint_file << endl;
+}
+
+static void start_pending_pipelines();
+
+/* Shut down a pipeline that has finished (to release its decoder and detectors
+ * and finish writing its output), and start the next queued pipeline if any */
+static void finish_pipeline(BlurData* bd)
+{
+    bd->done = TRUE;
+    running_pipelines--;
+    gst_element_set_state(GST_ELEMENT(bd->pipeline), GST_STATE_NULL);
+
+    if (--active_pipelines == 0) {
+        g_print("Finished\n");
+        g_main_loop_quit(loop);
+    }
+    else {
+        g_print("%u pipelines still to finish\n", active_pipelines);
+        start_pending_pipelines();
+    }
+}
+
+/* Start queued pipelines, keeping at most max_running_pipelines (if set) running */
+static void start_pending_pipelines()
+{
+    while (next_pipeline < blur_pipelines.size()
+           && (max_running_pipelines == 0 || running_pipelines < max_running_pipelines)) {
+        gst_element_set_state(GST_ELEMENT(blur_pipelines[next_pipeline++]->pipeline), GST_STATE_PLAYING);
+        running_pipelines++;
+    }
+}
+
+static gboolean msg_handler([[maybe_unused]] GstBus* bus, GstMessage* message, gpointer data)
 {
+    auto* bd = static_cast<BlurData*>(data);
+
     switch (GST_MESSAGE_TYPE(message)) {
     case GST_MESSAGE_EOS:
-        g_print("End Of Stream. Finished\n");
-        g_main_loop_quit(loop);
+        if (!bd->done) {
+            g_print("End Of Stream\n");
+            finish_pipeline(bd);
+
+            /* The segment file is complete once its pipeline has shut down */
+            if (bd->checkpointed)
+                checkpoint_segment_done(bd->segment_index);
+        }
         break;
     case GST_MESSAGE_ERROR: {
         GError* err = nullptr;
@@ -73,7 +219,16 @@ static gboolean msg_handler([[maybe_unused]] GstBus* bus, GstMessage* message, [
         g_free(debug);
         g_free(name);
 
-        g_main_loop_quit(loop);
+        processing_failed = TRUE;
+        if (keep_going) {
+            if (!bd->done) {
+                g_print("Failed to process %s\n", bd->output_file.c_str());
+                finish_pipeline(bd);
+            }
+        }
+        else {
+            g_main_loop_quit(loop);
+        }
         break;
     }
 
@@ -111,6 +266,155 @@ static gboolean msg_handler([[maybe_unused]] GstBus* bus, GstMessage* message, [
     return TRUE;
 }
 
+/* Trim compressed input to the GOPs a segment decodes. Video is cut at keyframes
+ * in decode order so the decoder always starts cleanly, and its decoded frames
+ * are then trimmed to the output range by segment_output_probe. Audio is passed
+ * through, so it is cut to the output range directly */
+static GstPadProbeReturn segment_input_probe(GstPad* pad, GstPadProbeInfo* info, gpointer user_data)
+{
+    auto* stream = static_cast<SegmentStream*>(user_data);
+    const GstBuffer* buf = GST_PAD_PROBE_INFO_BUFFER(info);
+    const GstClockTime pts = GST_BUFFER_PTS(buf);
+    const gboolean keyframe = !GST_BUFFER_FLAG_IS_SET(buf, GST_BUFFER_FLAG_DELTA_UNIT);
+
+    if (stream->eos_sent)
+        return GST_PAD_PROBE_DROP;
+
+    if (!stream->started) {
+        const GstClockTime first = stream->is_video ? stream->bd->decode_start : stream->bd->start;
+        if (!GST_CLOCK_TIME_IS_VALID(pts) || pts < first || (stream->is_video && !keyframe))
+            return GST_PAD_PROBE_DROP;
+        stream->started = TRUE;
+    }
+
+    const GstClockTime last = stream->is_video ? stream->bd->decode_stop : stream->bd->stop;
+    if (GST_CLOCK_TIME_IS_VALID(last) && GST_CLOCK_TIME_IS_VALID(pts) && pts >= last
+        && (keyframe || !stream->is_video)) {
+        /* Past the end of what this segment needs. Finish this stream */
+        stream->eos_sent = TRUE;
+        gst_pad_push_event(pad, gst_event_new_eos());
+        return GST_PAD_PROBE_DROP;
+    }
+
+    return GST_PAD_PROBE_OK;
+}
+
+/* Drop decoded frames outside the segment's output range, before they reach the blur filter */
+static GstPadProbeReturn segment_output_probe([[maybe_unused]] GstPad* pad, GstPadProbeInfo* info, gpointer user_data)
+{
+    const auto* bd = static_cast<const BlurData*>(user_data);
+    const GstClockTime pts = GST_BUFFER_PTS(GST_PAD_PROBE_INFO_BUFFER(info));
+
+    if (GST_CLOCK_TIME_IS_VALID(pts) && (pts < bd->start || (GST_CLOCK_TIME_IS_VALID(bd->stop) && pts >= bd->stop)))
+        return GST_PAD_PROBE_DROP;
+
+    return GST_PAD_PROBE_OK;
+}
+
+/* Add the size of each buffer (or list of them) passing to the process stats
+ * counter named by user_data */
+static GstPadProbeReturn count_bytes_probe([[maybe_unused]] GstPad* pad, GstPadProbeInfo* info, gpointer user_data)
+{
+    const auto* counter = static_cast<const char*>(user_data);
+    gsize size = 0;
+    if ((GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER_LIST) != 0)
+        size = gst_buffer_list_calculate_size(GST_PAD_PROBE_INFO_BUFFER_LIST(info));
+    else
+        size = gst_buffer_get_size(GST_PAD_PROBE_INFO_BUFFER(info));
+
+    equirect_blur_process_stats().add_count(counter, size);
+    return GST_PAD_PROBE_OK;
+}
+
+static void add_count_bytes_probe(GstElement* element, const gchar* pad_name, const gchar* counter)
+{
+    GstPad* pad = gst_element_get_static_pad(element, pad_name);
+    gst_pad_add_probe(
+        pad,
+        static_cast<GstPadProbeType>(GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST),
+        count_bytes_probe,
+        const_cast<gchar*>(counter),
+        nullptr);
+    gst_object_unref(pad);
+}
+
+static void add_segment_input_probe(GstPad* pad, const BlurData* bd, const gboolean is_video)
+{
+    auto* stream = g_new0(SegmentStream, 1);
+    stream->bd = bd;
+    stream->is_video = is_video;
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, segment_input_probe, stream, g_free);
+}
+
+/* Set the first of the named properties that the encoder has */
+static void set_encoder_property(
+    GstElement* enc, const std::initializer_list<const gchar*> names, const String& value, const gchar* option)
+{
+    for (const gchar* name : names) {
+        if (g_object_class_find_property(G_OBJECT_GET_CLASS(enc), name) != nullptr) {
+            gst_util_set_object_arg(G_OBJECT(enc), name, value.c_str());
+            return;
+        }
+    }
+    g_print("Encoder %s doesn't support %s. Ignoring\n", encoder.element.c_str(), option);
+}
+
+static void configure_encoder(GstElement* enc)
+{
+    if (!encoder.preset.empty())
+        set_encoder_property(enc, { "speed-preset", "preset" }, encoder.preset, "--preset");
+    if (encoder.threads > 0)
+        set_encoder_property(enc, { "threads" }, format("%d", encoder.threads), "--threads");
+    if (encoder.keyframe_interval > 0) {
+        set_encoder_property(
+            enc,
+            { "key-int-max", "keyframe-period", "gop-size" },
+            format("%d", encoder.keyframe_interval),
+            "--keyframe-interval");
+    }
+}
+
+/* Whether an encoder reads the quantiser offsets in the face region of interest
+ * metas, which only the VA-API and MSDK encoders do */
+static gboolean encoder_takes_roi(const String& element)
+{
+    return g_str_has_prefix(element.c_str(), "vaapi") || g_str_has_prefix(element.c_str(), "msdk");
+}
+
+/* Find the parser for the format an encoder produces (H.264 or H.265) */
+static gboolean find_encoder_parser(const String& element, String& parser)
+{
+    GstElementFactory* factory = gst_element_factory_find(element.c_str());
+    if (factory == nullptr) {
+        cerr << "No encoder element named " << element << endl;
+        return FALSE;
+    }
+
+    parser.clear();
+    for (const GList* l = gst_element_factory_get_static_pad_templates(factory); l != nullptr; l = l->next) {
+        auto* templ = static_cast<GstStaticPadTemplate*>(l->data);
+        if (templ->direction != GST_PAD_SRC)
+            continue;
+
+        GstCaps* caps = gst_static_caps_get(&templ->static_caps);
+        for (guint i = 0; i < gst_caps_get_size(caps) && parser.empty(); i++) {
+            const GstStructure* s = gst_caps_get_structure(caps, i);
+            if (gst_structure_has_name(s, "video/x-h264"))
+                parser = "h264parse";
+            else if (gst_structure_has_name(s, "video/x-h265"))
+                parser = "h265parse";
+        }
+        gst_caps_unref(caps);
+    }
+    gst_object_unref(factory);
+
+    if (parser.empty()) {
+        cerr << "Encoder " << element << " doesn't produce H.264 or H.265" << endl;
+        return FALSE;
+    }
+    return TRUE;
+}
+
 static void new_stream([[maybe_unused]] GstElement* parse, GstPad* pad, const BlurData* bd)
 {
     if (GstCaps* caps = gst_pad_get_current_caps(pad)) {
@@ -138,11 +442,13 @@ static void new_stream([[maybe_unused]] GstElement* parse, GstPad* pad, const Bl
         }
 
         if (g_str_equal(stream_type, "video/x-h264")) {
-            GstElement* blur_bin = gst_parse_bin_from_description(
-                "avdec_h264 ! progressreport ! videoconvert name=video-in ! queue max-size-buffers=1 ! equirect_blur ! "
-                "videoconvert ! x264enc tune=zerolatency name=enc ! h264parse",
-                TRUE,
-                &error);
+            gchar* description = g_strdup_printf(
+                "avdec_h264 name=dec ! progressreport ! videoconvert name=video-in ! queue max-size-buffers=1 ! "
+                "equirect_blur name=blur ! videoconvert ! %s name=enc ! %s",
+                encoder.element.c_str(),
+                encoder.parser.c_str());
+            GstElement* blur_bin = gst_parse_bin_from_description(description, TRUE, &error);
+            g_free(description);
 
             if (error != nullptr) {
                 cerr << "Error creating GStreamer pipeline: " << error->message << endl;
@@ -151,6 +457,37 @@ static void new_stream([[maybe_unused]] GstElement* parse, GstPad* pad, const Bl
                 goto done;
             }
 
+            GstElement* blur = gst_bin_get_by_name(GST_BIN(blur_bin), "blur");
+            g_object_set(blur, "models-dir", models_dir.c_str(), "draw-over-faces", draw_over_faces, nullptr);
+            g_object_set(blur, "direct-obscure", direct_obscure, "obscure-radius", obscure_radius, nullptr);
+            gst_util_set_object_arg(G_OBJECT(blur), "obscure-filter", obscure_filter.c_str());
+            if (!config_file.empty())
+                g_object_set(blur, "config", config_file.c_str(), nullptr);
+            if (!bd->save_detections.empty())
+                g_object_set(blur, "save-detections", bd->save_detections.c_str(), nullptr);
+            if (!load_detections.empty())
+                g_object_set(blur, "load-detections", load_detections.c_str(), nullptr);
+            if (shared_detectors)
+                g_object_set(blur, "shared-detectors", TRUE, "max-inferences", max_inferences, nullptr);
+            g_object_set(blur, "roi-qp-delta", encoder.face_qp_delta, nullptr);
+            g_object_set(blur, "memory-budget", memory_budget, nullptr);
+
+            GstElement* enc = gst_bin_get_by_name(GST_BIN(blur_bin), "enc");
+            configure_encoder(enc);
+            gst_object_unref(enc);
+
+            if (blur_data_is_segment(bd)) {
+                add_segment_input_probe(pad, bd, TRUE);
+
+                GstElement* dec = gst_bin_get_by_name(GST_BIN(blur_bin), "dec");
+                GstPad* dec_src = gst_element_get_static_pad(dec, "src");
+                gst_pad_add_probe(
+                    dec_src, GST_PAD_PROBE_TYPE_BUFFER, segment_output_probe, const_cast<BlurData*>(bd), nullptr);
+                gst_object_unref(dec_src);
+                gst_object_unref(dec);
+            }
+            gst_object_unref(blur);
+
             gst_element_set_state(blur_bin, GST_STATE_PLAYING);
             gst_bin_add(bd->pipeline, blur_bin);
 
@@ -179,6 +516,9 @@ static void new_stream([[maybe_unused]] GstElement* parse, GstPad* pad, const Bl
                 goto done;
             }
 
+            if (blur_data_is_segment(bd))
+                add_segment_input_probe(pad, bd, FALSE);
+
             gst_element_set_state(pass_bin, GST_STATE_PLAYING);
             gst_bin_add(bd->pipeline, pass_bin);
 
@@ -204,6 +544,683 @@ static void new_stream([[maybe_unused]] GstElement* parse, GstPad* pad, const Bl
     }
 }
 
+static gboolean create_blur_pipeline(const String& input_file, const String& output_file, BlurData* bd)
+{
+    GError* error = nullptr;
+    GstElement* pipeline = gst_parse_launch(
+        "filesrc name=src ! parsebin name=parse multiqueue use-interleave=true name=mq mp4mux name=mux ! filesink "
+        "name=sink",
+        &error);
+
+    if (error != nullptr) {
+        cerr << "Error creating GStreamer pipeline: " << error->message << endl;
+        g_error_free(error);
+        return FALSE;
+    }
+
+    GstElement* src = gst_bin_get_by_name(GST_BIN(pipeline), "src");
+    GstElement* parse = gst_bin_get_by_name(GST_BIN(pipeline), "parse");
+    GstElement* mux = gst_bin_get_by_name(GST_BIN(pipeline), "mux");
+    GstElement* sink = gst_bin_get_by_name(GST_BIN(pipeline), "sink");
+
+    if (src == nullptr || parse == nullptr || mux == nullptr || sink == nullptr) {
+        cerr << "Error creating GStreamer pipeline: Failed to create elements" << endl;
+        for (GstElement* element : { src, parse, mux, sink }) {
+            if (element != nullptr)
+                gst_object_unref(element);
+        }
+        gst_object_unref(pipeline);
+        return FALSE;
+    }
+
+    g_object_set(src, "location", input_file.c_str(), nullptr);
+    g_object_set(sink, "location", output_file.c_str(), nullptr);
+    if (count_io_bytes) {
+        add_count_bytes_probe(src, "src", "bytes_read");
+        add_count_bytes_probe(sink, "sink", "bytes_written");
+    }
+    gst_object_unref(sink);
+
+    bd->output_file = output_file;
+    bd->pipeline = GST_BIN(pipeline);
+    bd->src = src;
+    bd->mux = mux;
+
+    g_signal_connect(parse, "pad-added", G_CALLBACK(new_stream), (gpointer)bd);
+    gst_object_unref(parse);
+
+    GstBus* bus = gst_element_get_bus(pipeline);
+    bd->bus_watch_id = gst_bus_add_watch(bus, msg_handler, bd);
+    gst_object_unref(bus);
+
+    return TRUE;
+}
+
+static void free_blur_pipeline(BlurData* bd)
+{
+    /* bd may not have had its pipeline created, if an earlier one failed */
+    if (bd->pipeline != nullptr) {
+        gst_element_set_state(GST_ELEMENT(bd->pipeline), GST_STATE_NULL);
+        gst_object_unref(bd->pipeline);
+        gst_object_unref(bd->src);
+        gst_object_unref(bd->mux);
+        g_source_remove(bd->bus_watch_id);
+    }
+    delete bd;
+}
+
+static void free_blur_pipelines()
+{
+    for (BlurData* bd : blur_pipelines)
+        free_blur_pipeline(bd);
+    blur_pipelines.clear();
+}
+
+/* Run all pipelines in blur_pipelines to completion, at most max_running at
+ * a time (0 for no limit) */
+static gboolean run_pipelines(const guint max_running = 0)
+{
+    active_pipelines = static_cast<guint>(blur_pipelines.size());
+    running_pipelines = 0;
+    max_running_pipelines = max_running;
+    next_pipeline = 0;
+    processing_failed = FALSE;
+
+    if (blur_pipelines.empty())
+        return TRUE;
+
+    start_pending_pipelines();
+
+    g_main_loop_run(loop);
+
+    free_blur_pipelines();
+
+    return !processing_failed;
+}
+
+struct KeyframeScan {
+    GstElement* pipeline;
+    GstPad* video_pad;
+    vector<GstClockTime> keyframes;
+    GstClockTime end;
+};
+
+static GstPadProbeReturn keyframe_scan_probe([[maybe_unused]] GstPad* pad, GstPadProbeInfo* info, gpointer user_data)
+{
+    auto* scan = static_cast<KeyframeScan*>(user_data);
+    const GstBuffer* buf = GST_PAD_PROBE_INFO_BUFFER(info);
+    const GstClockTime pts = GST_BUFFER_PTS(buf);
+
+    if (GST_CLOCK_TIME_IS_VALID(pts)) {
+        if (!GST_BUFFER_FLAG_IS_SET(buf, GST_BUFFER_FLAG_DELTA_UNIT))
+            scan->keyframes.push_back(pts);
+        if (!GST_CLOCK_TIME_IS_VALID(scan->end) || pts > scan->end)
+            scan->end = pts;
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+static void keyframe_scan_new_stream([[maybe_unused]] GstElement* parse, GstPad* pad, KeyframeScan* scan)
+{
+    GstElement* sink = gst_element_factory_make("fakesink", nullptr);
+    g_object_set(sink, "sync", FALSE, "async", FALSE, nullptr);
+    gst_bin_add(GST_BIN(scan->pipeline), sink);
+    gst_element_sync_state_with_parent(sink);
+
+    GstPad* sinkpad = gst_element_get_static_pad(sink, "sink");
+    gst_pad_link(pad, sinkpad);
+    gst_object_unref(sinkpad);
+
+    if (GstCaps* caps = gst_pad_get_current_caps(pad)) {
+        const gchar* stream_type = gst_structure_get_name(gst_caps_get_structure(caps, 0));
+        if (scan->video_pad == nullptr && g_str_has_prefix(stream_type, "video/")) {
+            scan->video_pad = pad;
+            gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, keyframe_scan_probe, scan, nullptr);
+        }
+        gst_caps_unref(caps);
+    }
+}
+
+/* Demux (without decoding) the input file to find the timestamps of all video keyframes */
+static gboolean scan_keyframes(const String& input_file, vector<GstClockTime>& keyframes, GstClockTime& end)
+{
+    GError* error = nullptr;
+    KeyframeScan scan {};
+    scan.end = GST_CLOCK_TIME_NONE;
+
+    scan.pipeline = gst_parse_launch("filesrc name=src ! parsebin name=parse", &error);
+    if (error != nullptr) {
+        cerr << "Error creating GStreamer pipeline: " << error->message << endl;
+        g_error_free(error);
+        return FALSE;
+    }
+
+    GstElement* src = gst_bin_get_by_name(GST_BIN(scan.pipeline), "src");
+    GstElement* parse = gst_bin_get_by_name(GST_BIN(scan.pipeline), "parse");
+    g_object_set(src, "location", input_file.c_str(), nullptr);
+    g_signal_connect(parse, "pad-added", G_CALLBACK(keyframe_scan_new_stream), &scan);
+    gst_object_unref(src);
+    gst_object_unref(parse);
+
+    gst_element_set_state(scan.pipeline, GST_STATE_PLAYING);
+
+    GstBus* bus = gst_element_get_bus(scan.pipeline);
+    GstMessage* msg = gst_bus_timed_pop_filtered(
+        bus, GST_CLOCK_TIME_NONE, static_cast<GstMessageType>(GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+    const gboolean ok = GST_MESSAGE_TYPE(msg) == GST_MESSAGE_EOS;
+    if (!ok) {
+        GError* err = nullptr;
+        gst_message_parse_error(msg, &err, nullptr);
+        cerr << "Error scanning input for keyframes: " << err->message << endl;
+        g_clear_error(&err);
+    }
+    gst_message_unref(msg);
+    gst_object_unref(bus);
+
+    gst_element_set_state(scan.pipeline, GST_STATE_NULL);
+    gst_object_unref(scan.pipeline);
+
+    std::sort(scan.keyframes.begin(), scan.keyframes.end());
+    scan.keyframes.erase(std::unique(scan.keyframes.begin(), scan.keyframes.end()), scan.keyframes.end());
+
+    keyframes = scan.keyframes;
+    end = scan.end;
+    return ok && !keyframes.empty();
+}
+
+/* Create the segments beginning at each of starts (which are keyframes) */
+static vector<BlurData*> segments_from_starts(const vector<GstClockTime>& keyframes, const vector<GstClockTime>& starts)
+{
+    vector<BlurData*> segments;
+    for (size_t i = 0; i < starts.size(); i++) {
+        auto* bd = new BlurData {};
+        bd->start = starts[i];
+        bd->stop = i + 1 < starts.size() ? starts[i + 1] : GST_CLOCK_TIME_NONE;
+
+        /* Decode from the keyframe before start, to the one after stop */
+        auto k = std::lower_bound(keyframes.begin(), keyframes.end(), bd->start);
+        bd->decode_start = k != keyframes.begin() ? *(k - 1) : 0;
+        bd->decode_stop = GST_CLOCK_TIME_NONE;
+        if (GST_CLOCK_TIME_IS_VALID(bd->stop)) {
+            if (k = std::upper_bound(keyframes.begin(), keyframes.end(), bd->stop); k != keyframes.end())
+                bd->decode_stop = *k;
+        }
+        segments.push_back(bd);
+    }
+
+    return segments;
+}
+
+/* Split the input at keyframes into (up to) n_segments roughly equal length segments */
+static vector<BlurData*> plan_segments(
+    const vector<GstClockTime>& keyframes, const GstClockTime end, const guint n_segments)
+{
+    vector<GstClockTime> starts = { 0 };
+
+    for (guint i = 1; i < n_segments; i++) {
+        const GstClockTime target = gst_util_uint64_scale(end, i, n_segments);
+        auto k = std::lower_bound(keyframes.begin(), keyframes.end(), target);
+        if (k != keyframes.end() && *k > starts.back())
+            starts.push_back(*k);
+    }
+
+    return segments_from_starts(keyframes, starts);
+}
+
+/* Split the input at the first keyframe after every interval */
+static vector<BlurData*> plan_checkpoints(
+    const vector<GstClockTime>& keyframes, const GstClockTime end, const GstClockTime interval)
+{
+    vector<GstClockTime> starts = { 0 };
+
+    for (GstClockTime target = interval; target < end; target += interval) {
+        auto k = std::lower_bound(keyframes.begin(), keyframes.end(), target);
+        if (k != keyframes.end() && *k > starts.back())
+            starts.push_back(*k);
+    }
+
+    return segments_from_starts(keyframes, starts);
+}
+
+static GStrv concat_format_location([[maybe_unused]] GstElement* splitmuxsrc, gpointer user_data)
+{
+    const auto* files = static_cast<const vector<String>*>(user_data);
+    auto locations = g_new0(gchar*, files->size() + 1);
+
+    for (size_t i = 0; i < files->size(); i++)
+        locations[i] = g_strdup((*files)[i].c_str());
+
+    return locations;
+}
+
+static void concat_new_stream([[maybe_unused]] GstElement* splitmuxsrc, GstPad* pad, const BlurData* bd)
+{
+    GstCaps* caps = gst_pad_get_current_caps(pad);
+    if (caps == nullptr)
+        caps = gst_pad_query_caps(pad, nullptr);
+
+    const gchar* stream_type = gst_structure_get_name(gst_caps_get_structure(caps, 0));
+    const gchar* mux_pad_name = g_str_has_prefix(stream_type, "audio/") ? "audio_%u" : "video_%u";
+
+    GstElement* queue = gst_element_factory_make("queue", nullptr);
+    gst_bin_add(bd->pipeline, queue);
+    gst_element_sync_state_with_parent(queue);
+
+    GstPad* sinkpad = gst_element_get_static_pad(queue, "sink");
+    GstPad* srcpad = gst_element_get_static_pad(queue, "src");
+    GstPad* mux_pad = gst_element_request_pad_simple(bd->mux, mux_pad_name);
+
+    if (gst_pad_link(pad, sinkpad) != GST_PAD_LINK_OK || gst_pad_link(srcpad, mux_pad) != GST_PAD_LINK_OK) {
+        cerr << "Error linking " << stream_type << " segment stream to muxer" << endl;
+        GST_ELEMENT_ERROR(bd->pipeline, LIBRARY, INIT, ("Failed to construct concatenation pipeline"), (nullptr));
+    }
+
+    gst_object_unref(sinkpad);
+    gst_object_unref(srcpad);
+    gst_object_unref(mux_pad);
+    gst_caps_unref(caps);
+}
+
+/* Remux the encoded segments into one output file, without re-encoding */
+static gboolean concat_segments(
+    const vector<String>& segment_files, const String& output_file, const String& input_file)
+{
+    GError* error = nullptr;
+    GstElement* pipeline = gst_parse_launch("splitmuxsrc name=src mp4mux name=mux ! filesink name=sink", &error);
+
+    if (error != nullptr) {
+        cerr << "Error creating GStreamer pipeline: " << error->message << endl;
+        g_error_free(error);
+        return FALSE;
+    }
+
+    auto* bd = new BlurData {};
+    bd->pipeline = GST_BIN(pipeline);
+    bd->src = gst_bin_get_by_name(bd->pipeline, "src");
+    bd->mux = gst_bin_get_by_name(bd->pipeline, "mux");
+
+    GstElement* sink = gst_bin_get_by_name(bd->pipeline, "sink");
+    g_object_set(sink, "location", output_file.c_str(), nullptr);
+    gst_object_unref(sink);
+
+    /* Stamp the output with the input's modification time rather than the current
+     * time, so joining the same segments always gives the same file */
+    if (GStatBuf st; g_stat(input_file.c_str(), &st) == 0) {
+        GstDateTime* datetime = gst_date_time_new_from_unix_epoch_utc(st.st_mtime);
+        gst_tag_setter_add_tags(GST_TAG_SETTER(bd->mux), GST_TAG_MERGE_REPLACE, GST_TAG_DATE_TIME, datetime, nullptr);
+        gst_date_time_unref(datetime);
+    }
+
+    g_signal_connect(bd->src, "format-location", G_CALLBACK(concat_format_location), (gpointer)&segment_files);
+    g_signal_connect(bd->src, "pad-added", G_CALLBACK(concat_new_stream), (gpointer)bd);
+
+    GstBus* bus = gst_element_get_bus(pipeline);
+    bd->bus_watch_id = gst_bus_add_watch(bus, msg_handler, bd);
+    gst_object_unref(bus);
+
+    g_print("Joining %u segments into %s\n", static_cast<guint>(segment_files.size()), output_file.c_str());
+    blur_pipelines.push_back(bd);
+    return run_pipelines();
+}
+
+/* Detections file written by one segment, and the part of it that segment outputs */
+struct SegmentDetections {
+    String file;
+    GstClockTime start;
+    GstClockTime stop;
+};
+
+/* Join the per-segment detection files, keeping only the frames each segment
+ * outputs and renumbering them from the start of the output */
+static gboolean merge_segment_detections(const vector<SegmentDetections>& segments, const String& save_detections)
+{
+    SidecarWriter out;
+    if (!out.open(save_detections)) {
+        cerr << "Can't open detections file " << save_detections << endl;
+        return FALSE;
+    }
+
+    int64_t frame_index = 0;
+    for (const SegmentDetections& seg : segments) {
+        SidecarReader in;
+        if (!in.load(seg.file))
+            return FALSE;
+
+        const double start = static_cast<double>(seg.start) / GST_SECOND;
+        const double stop = GST_CLOCK_TIME_IS_VALID(seg.stop) ? static_cast<double>(seg.stop) / GST_SECOND : -1.0;
+
+        for (SidecarFrame frame : in.frames()) {
+            if (frame.pts < start || (stop >= 0 && frame.pts >= stop))
+                continue;
+            frame.frame = frame_index++;
+            out.write(frame);
+        }
+    }
+
+    return TRUE;
+}
+
+/* State of a checkpointed run, kept next to the output file so an interrupted
+ * run can be resumed. The file holds the settings the run was planned with,
+ * one "key value" per line, followed by a "done <index>" line for each segment
+ * as it is completed */
+struct Checkpoint {
+    String input_file;
+    goffset input_size;
+    gint64 input_mtime;
+    GstClockTime interval;
+    String models_dir;
+    String config;
+    String load_detections;
+    gboolean draw_over_faces;
+    gboolean direct_obscure;
+    String obscure_filter;
+    String obscure_radius;
+    String save_detections;
+    String encoder;
+    String preset;
+    gint threads;
+    gint keyframe_interval;
+    gint face_qp_delta;
+    guint n_segments;
+    vector<gboolean> done;
+};
+
+static gboolean checkpoint_matches(const Checkpoint& a, const Checkpoint& b)
+{
+    return a.input_file == b.input_file && a.input_size == b.input_size && a.input_mtime == b.input_mtime
+        && a.interval == b.interval && a.models_dir == b.models_dir && a.config == b.config
+        && a.load_detections == b.load_detections && a.draw_over_faces == b.draw_over_faces
+        && a.direct_obscure == b.direct_obscure && a.obscure_filter == b.obscure_filter
+        && a.obscure_radius == b.obscure_radius && a.save_detections == b.save_detections && a.encoder == b.encoder
+        && a.preset == b.preset && a.threads == b.threads && a.keyframe_interval == b.keyframe_interval
+        && a.face_qp_delta == b.face_qp_delta;
+}
+
+static gboolean load_checkpoint(const String& path, Checkpoint& checkpoint)
+{
+    std::ifstream in(path);
+    if (!in.is_open())
+        return FALSE;
+
+    checkpoint = Checkpoint {};
+    string line;
+    while (std::getline(in, line)) {
+        const size_t sep = line.find(' ');
+        const string key = line.substr(0, sep);
+        const string value = sep != string::npos ? line.substr(sep + 1) : string();
+
+        if (key == "input")
+            checkpoint.input_file = value;
+        else if (key == "input-size")
+            checkpoint.input_size = g_ascii_strtoll(value.c_str(), nullptr, 10);
+        else if (key == "input-mtime")
+            checkpoint.input_mtime = g_ascii_strtoll(value.c_str(), nullptr, 10);
+        else if (key == "interval")
+            checkpoint.interval = g_ascii_strtoull(value.c_str(), nullptr, 10);
+        else if (key == "models-dir")
+            checkpoint.models_dir = value;
+        else if (key == "config")
+            checkpoint.config = value;
+        else if (key == "load-detections")
+            checkpoint.load_detections = value;
+        else if (key == "draw-over-faces")
+            checkpoint.draw_over_faces = value == "1";
+        else if (key == "direct-obscure")
+            checkpoint.direct_obscure = value == "1";
+        else if (key == "obscure-filter")
+            checkpoint.obscure_filter = value;
+        else if (key == "obscure-radius")
+            checkpoint.obscure_radius = value;
+        else if (key == "save-detections")
+            checkpoint.save_detections = value;
+        else if (key == "encoder")
+            checkpoint.encoder = value;
+        else if (key == "preset")
+            checkpoint.preset = value;
+        else if (key == "threads")
+            checkpoint.threads = static_cast<gint>(g_ascii_strtoll(value.c_str(), nullptr, 10));
+        else if (key == "keyframe-interval")
+            checkpoint.keyframe_interval = static_cast<gint>(g_ascii_strtoll(value.c_str(), nullptr, 10));
+        else if (key == "face-qp-delta")
+            checkpoint.face_qp_delta = static_cast<gint>(g_ascii_strtoll(value.c_str(), nullptr, 10));
+        else if (key == "segments") {
+            checkpoint.n_segments = static_cast<guint>(g_ascii_strtoull(value.c_str(), nullptr, 10));
+            checkpoint.done.assign(checkpoint.n_segments, FALSE);
+        }
+        else if (key == "done") {
+            /* A partially written last line is ignored */
+            if (const guint64 index = g_ascii_strtoull(value.c_str(), nullptr, 10); index < checkpoint.done.size())
+                checkpoint.done[index] = TRUE;
+        }
+    }
+
+    return checkpoint.interval > 0 && checkpoint.n_segments > 0;
+}
+
+static gboolean save_checkpoint(const String& path, const Checkpoint& checkpoint)
+{
+    std::ofstream out(path, std::ios::out | std::ios::trunc);
+
+    out << "input " << checkpoint.input_file << endl;
+    out << "input-size " << checkpoint.input_size << endl;
+    out << "input-mtime " << checkpoint.input_mtime << endl;
+    out << "interval " << checkpoint.interval << endl;
+    out << "models-dir " << checkpoint.models_dir << endl;
+    out << "config " << checkpoint.config << endl;
+    out << "load-detections " << checkpoint.load_detections << endl;
+    out << "draw-over-faces " << (checkpoint.draw_over_faces ? 1 : 0) << endl;
+    out << "direct-obscure " << (checkpoint.direct_obscure ? 1 : 0) << endl;
+    out << "obscure-filter " << checkpoint.obscure_filter << endl;
+    out << "obscure-radius " << checkpoint.obscure_radius << endl;
+    out << "save-detections " << checkpoint.save_detections << endl;
+    out << "encoder " << checkpoint.encoder << endl;
+    out << "preset " << checkpoint.preset << endl;
+    out << "threads " << checkpoint.threads << endl;
+    out << "keyframe-interval " << checkpoint.keyframe_interval << endl;
+    out << "face-qp-delta " << checkpoint.face_qp_delta << endl;
+    out << "segments " << checkpoint.n_segments << endl;
+
+    if (!out) {
+        cerr << "Failed to write checkpoint file " << path << endl;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static gboolean process_segmented(const String& input_file, const String& output_file, const ProcessOptions& opts)
+{
+    vector<GstClockTime> keyframes;
+    GstClockTime end;
+
+    /* Describe this run, to compare against any checkpoint left by an earlier one */
+    const gboolean checkpointing = opts.checkpoint_interval > 0 || opts.resume;
+    Checkpoint checkpoint {};
+    if (checkpointing) {
+        GStatBuf st;
+        if (g_stat(input_file.c_str(), &st) != 0) {
+            cerr << "Can't read input file " << input_file << endl;
+            return FALSE;
+        }
+
+        checkpoint_file = output_file + ".checkpoint";
+        checkpoint.input_file = input_file;
+        checkpoint.input_size = st.st_size;
+        checkpoint.input_mtime = st.st_mtime;
+        checkpoint.interval = opts.checkpoint_interval > 0 ? opts.checkpoint_interval : DEFAULT_CHECKPOINT_INTERVAL;
+        checkpoint.models_dir = models_dir;
+        checkpoint.config = config_json;
+        checkpoint.load_detections = load_detections;
+        checkpoint.draw_over_faces = draw_over_faces;
+        checkpoint.direct_obscure = direct_obscure;
+        checkpoint.obscure_filter = obscure_filter;
+        checkpoint.obscure_radius = format("%g", obscure_radius);
+        checkpoint.save_detections = opts.save_detections;
+        checkpoint.encoder = encoder.element;
+        checkpoint.preset = encoder.preset;
+        checkpoint.threads = encoder.threads;
+        checkpoint.keyframe_interval = encoder.keyframe_interval;
+        checkpoint.face_qp_delta = encoder.face_qp_delta;
+
+        Checkpoint previous;
+        if (opts.resume && load_checkpoint(checkpoint_file, previous)) {
+            /* Resume with the interval the segments were planned with */
+            if (opts.checkpoint_interval == 0)
+                checkpoint.interval = previous.interval;
+
+            if (!checkpoint_matches(previous, checkpoint)) {
+                cerr << "Checkpoint " << checkpoint_file << " was made with a different input file or options. "
+                     << "Remove it, or run without --resume to start again" << endl;
+                return FALSE;
+            }
+            checkpoint = previous;
+        }
+        else if (opts.resume) {
+            g_print("No checkpoint found at %s. Starting from the beginning\n", checkpoint_file.c_str());
+        }
+    }
+
+    g_print("Scanning %s for keyframes\n", input_file.c_str());
+    if (!scan_keyframes(input_file, keyframes, end)) {
+        cerr << "Failed to find keyframes in " << input_file << endl;
+        return FALSE;
+    }
+
+    vector<BlurData*> segments = checkpointing ? plan_checkpoints(keyframes, end, checkpoint.interval)
+                                               : plan_segments(keyframes, end, opts.n_segments);
+
+    if (checkpointing) {
+        if (checkpoint.n_segments != 0 && checkpoint.n_segments != segments.size()) {
+            cerr << "Checkpoint " << checkpoint_file << " doesn't match the input's keyframes" << endl;
+            for (const BlurData* bd : segments)
+                delete bd;
+            return FALSE;
+        }
+        if (checkpoint.n_segments == 0) {
+            checkpoint.n_segments = static_cast<guint>(segments.size());
+            checkpoint.done.assign(checkpoint.n_segments, FALSE);
+            if (!save_checkpoint(checkpoint_file, checkpoint)) {
+                for (const BlurData* bd : segments)
+                    delete bd;
+                return FALSE;
+            }
+        }
+    }
+
+    vector<String> segment_files;
+    vector<SegmentDetections> segment_detections;
+    guint n_resumed = 0;
+    for (size_t i = 0; i < segments.size(); i++) {
+        BlurData* bd = segments[i];
+        segment_files.push_back(format("%s.seg-%03u.mp4", output_file.c_str(), static_cast<unsigned>(i)));
+
+        if (!opts.save_detections.empty()) {
+            bd->save_detections = format("%s.seg-%03u", opts.save_detections.c_str(), static_cast<unsigned>(i));
+            segment_detections.push_back({ bd->save_detections, bd->start, bd->stop });
+        }
+
+        /* Segments completed by an earlier run are reused as long as their files survived */
+        if (checkpointing && checkpoint.done[i] && g_file_test(segment_files.back().c_str(), G_FILE_TEST_EXISTS)
+            && (bd->save_detections.empty() || g_file_test(bd->save_detections.c_str(), G_FILE_TEST_EXISTS))) {
+            n_resumed++;
+            delete bd;
+            continue;
+        }
+
+        g_print(
+            "Segment %u: %" GST_TIME_FORMAT " - %" GST_TIME_FORMAT " (decoding from %" GST_TIME_FORMAT ")\n",
+            static_cast<guint>(i),
+            GST_TIME_ARGS(bd->start),
+            GST_TIME_ARGS(bd->stop),
+            GST_TIME_ARGS(bd->decode_start));
+
+        bd->checkpointed = checkpointing;
+        bd->segment_index = static_cast<guint>(i);
+        blur_pipelines.push_back(bd);
+
+        if (!create_blur_pipeline(input_file, segment_files.back(), bd)) {
+            for (size_t j = i + 1; j < segments.size(); j++)
+                delete segments[j];
+            free_blur_pipelines();
+            return FALSE;
+        }
+    }
+
+    if (n_resumed > 0)
+        g_print("Resuming: %u of %u segments already complete\n", n_resumed, static_cast<guint>(segments.size()));
+
+    /* A checkpointed run keeps to the requested number of concurrent segments, but
+     * may have many more segments than that in total */
+    gboolean ok = run_pipelines(checkpointing ? opts.n_segments : 0);
+    if (ok)
+        ok = concat_segments(segment_files, output_file, input_file);
+    if (ok && !opts.save_detections.empty())
+        ok = merge_segment_detections(segment_detections, opts.save_detections);
+
+    /* Keep completed segments after a failure if they can be resumed from */
+    if (ok || !checkpointing) {
+        for (const String& f : segment_files)
+            std::remove(f.c_str());
+        for (const SegmentDetections& seg : segment_detections)
+            std::remove(seg.file.c_str());
+        if (checkpointing)
+            std::remove(checkpoint_file.c_str());
+    }
+    else {
+        g_print("Stopped. Completed segments are kept - run again with --resume to continue\n");
+    }
+
+    return ok;
+}
+
+/* Process each "input<TAB>output" pair (or "input output" if the names have no
+ * spaces) listed in list_file, running up to jobs pipelines at once. All the
+ * pipelines share one set of projection maps and a pool of detectors */
+static gboolean process_batch(const String& list_file, const guint jobs)
+{
+    std::ifstream in(list_file);
+    if (!in.is_open()) {
+        cerr << "Can't open batch file " << list_file << endl;
+        return FALSE;
+    }
+
+    string line;
+    int line_no = 0;
+    while (std::getline(in, line)) {
+        line_no++;
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        size_t sep = line.find('\t');
+        if (sep == string::npos)
+            sep = line.find(' ');
+        const size_t output_pos = sep != string::npos ? line.find_first_not_of(" \t", sep) : string::npos;
+        if (output_pos == string::npos) {
+            cerr << "Expected an input and output file at " << list_file << ":" << line_no << endl;
+            return FALSE;
+        }
+
+        const String input_file = line.substr(0, sep);
+        const String output_file = line.substr(output_pos);
+
+        auto* bd = new BlurData {};
+        bd->stop = GST_CLOCK_TIME_NONE;
+        blur_pipelines.push_back(bd);
+        if (!create_blur_pipeline(input_file, output_file, bd)) {
+            free_blur_pipelines();
+            return FALSE;
+        }
+    }
+
+    g_print("Processing %u files, %u at a time\n", static_cast<guint>(blur_pipelines.size()), jobs);
+
+    shared_detectors = TRUE;
+    keep_going = TRUE;
+    return run_pipelines(jobs);
+}
+
 int main(int argc, char** argv)
 {
     CommandLineParser parser(
@@ -211,7 +1228,31 @@ int main(int argc, char** argv)
         argv,
         "{help h||}"
         "{blur b||If supplied, faces are blurred rather than hidden with rectangles}"
+        "{direct-obscure||Obscure a spherical region of the frame around each face, in one pass}"
+        "{obscure-filter|gaussian|Filter for blurring faces: gaussian, box, stack or pixelate}"
+        "{obscure-radius|0|Blur radius (pixelate block size) in face widths (0 = 0.25, or a fixed kernel for gaussian)}"
         "{models-dir m|" MODELS_DATADIR "|Path to PCN models}"
+        "{config||Detector settings and projection layout from this file (e.g. written by equirect-blur-tune)}"
+        "{segments s|1|Split the input at keyframes into this many segments and process them concurrently}"
+        "{checkpoint-interval|0|Process in segments of about this many seconds, keeping each as it completes}"
+        "{resume||Continue an interrupted --checkpoint-interval run from its completed segments}"
+        "{batch||Process the input/output file pairs listed in this file (one per line) in a single process}"
+        "{jobs j|4|Number of files processed at once in batch mode}"
+        "{max-inferences|0|Number of face detections run at once across all batch jobs (0 = number of CPUs)}"
+        "{memory-budget|0|Memory in MB to keep to across all segments and batch jobs: frames wait to be processed "
+        "while they would exceed it, though one goes ahead over it when every stream is waiting (0 = no limit)}"
+        "{encoder|x264enc|Encoder element for the blurred video (H.264 or H.265)}"
+        "{preset||Encoder speed preset (e.g. ultrafast ... veryslow for x264enc)}"
+        "{threads|0|Encoder threads (0 = encoder default)}"
+        "{keyframe-interval|0|Maximum frames between keyframes (0 = encoder default)}"
+        "{face-qp-delta||Quantiser offset for obscured faces, for encoders that take ROI hints (VA-API and MSDK; "
+        "default 10 with them, and 0 = none)}"
+        "{save-detections||Write the detected faces for each frame to this file (JSON lines)}"
+        "{load-detections||Obscure the faces listed in this file (from --save-detections) instead of detecting}"
+        "{stats||Write stage timings and counters to this file (- for stdout) every --stats-interval seconds}"
+        "{stats-format|json|Format of the --stats file: json or prometheus}"
+        "{stats-interval|10|Seconds between --stats dumps}"
+        "{trace||Write a timeline of the detection stages and GStreamer elements to this file (Chrome trace JSON)}"
         "{output-file o|output.mp4|Output file}"
         "{@input-file|test.mp4|Input file}");
     parser.about("\nA utility that extracts strips of images from an equirectangular source\n"
@@ -232,49 +1273,107 @@ int main(int argc, char** argv)
 
     const auto input_file = parser.get<String>("@input-file");
     const auto output_file = parser.get<String>("output-file");
+    const int n_segments = parser.get<int>("segments");
+    const double checkpoint_interval = parser.get<double>("checkpoint-interval");
 
-    models_dir = parser.get<String>("models-dir");
-    draw_over_faces = !parser.has("blur");
+    if (n_segments < 1) {
+        cerr << "Number of segments must be at least 1" << endl;
+        return 1;
+    }
+    if (checkpoint_interval < 0) {
+        cerr << "Checkpoint interval can't be negative" << endl;
+        return 1;
+    }
 
-    loop = g_main_loop_new(nullptr, FALSE);
+    ProcessOptions opts {};
+    opts.n_segments = static_cast<guint>(n_segments);
+    if (parser.has("save-detections"))
+        opts.save_detections = parser.get<String>("save-detections");
+    opts.checkpoint_interval = static_cast<GstClockTime>(checkpoint_interval * GST_SECOND);
+    opts.resume = parser.has("resume");
 
-    GError* error = nullptr;
-    GstElement* pipeline = gst_parse_launch(
-        "filesrc name=src ! parsebin name=parse multiqueue use-interleave=true name=mq mp4mux name=mux ! filesink "
-        "name=sink",
-        &error);
-
-    if (error != nullptr) {
-        cerr << "Error creating GStreamer pipeline: " << error->message << endl;
-        g_error_free(error);
+    models_dir = parser.get<String>("models-dir");
+    draw_over_faces = !parser.has("blur");
+    direct_obscure = parser.has("direct-obscure");
+    obscure_filter = parser.get<String>("obscure-filter");
+    obscure_radius = parser.get<double>("obscure-radius");
+    ObscureFilter filter;
+    if (!equirect_blur_parse_filter(obscure_filter, filter)) {
+        cerr << "--obscure-filter must be gaussian, box, stack or pixelate" << endl;
+        return 1;
+    }
+    if (obscure_radius < 0 || obscure_radius > 10) {
+        cerr << "--obscure-radius must be between 0 and 10" << endl;
         return 1;
     }
+    if (parser.has("config")) {
+        /* Check it here, rather than when each element starts */
+        config_file = parser.get<String>("config");
+        BlurConfig config;
+        std::string error;
+        if (!equirect_blur_load_config(config_file, config, error)) {
+            cerr << error << endl;
+            return 1;
+        }
+        config_json = equirect_blur_config_json(config);
+    }
+    if (parser.has("load-detections"))
+        load_detections = parser.get<String>("load-detections");
 
-    GstElement* src = gst_bin_get_by_name(GST_BIN(pipeline), "src");
-    GstElement* parse = gst_bin_get_by_name(GST_BIN(pipeline), "parse");
-    GstElement* mux = gst_bin_get_by_name(GST_BIN(pipeline), "mux");
-    GstElement* sink = gst_bin_get_by_name(GST_BIN(pipeline), "sink");
+    const bool batch = parser.has("batch");
+    const int jobs = parser.get<int>("jobs");
+    max_inferences = static_cast<guint>(MAX(parser.get<int>("max-inferences"), 0));
+    memory_budget = MAX(parser.get<double>("memory-budget"), 0.0);
 
-    if (src == nullptr || parse == nullptr || mux == nullptr || sink == nullptr) {
-        cerr << "Error creating GStreamer pipeline: Failed to create elements" << endl;
+    if (batch
+        && (opts.n_segments > 1 || opts.checkpoint_interval > 0 || opts.resume || !opts.save_detections.empty()
+            || !load_detections.empty())) {
+        cerr << "--batch can't be combined with segmented, checkpointed or detection file options" << endl;
+        return 1;
+    }
+    if (jobs < 1) {
+        cerr << "Number of jobs must be at least 1" << endl;
         return 1;
     }
 
-    g_object_set(src, "location", input_file.c_str(), nullptr);
-    g_object_set(sink, "location", output_file.c_str(), nullptr);
-    gst_object_unref(sink);
-
-    blur_data.pipeline = GST_BIN(pipeline);
-    blur_data.src = src;
-    blur_data.mux = mux;
+    encoder.element = parser.get<String>("encoder");
+    if (parser.has("preset"))
+        encoder.preset = parser.get<String>("preset");
+    encoder.threads = parser.get<int>("threads");
+    encoder.keyframe_interval = parser.get<int>("keyframe-interval");
+    if (!parser.has("face-qp-delta")) {
+        encoder.face_qp_delta = encoder_takes_roi(encoder.element) ? 10 : 0;
+    }
+    else {
+        encoder.face_qp_delta = parser.get<int>("face-qp-delta");
+        if (encoder.face_qp_delta != 0 && !encoder_takes_roi(encoder.element))
+            cerr << "Warning: " << encoder.element << " ignores region of interest hints, so --face-qp-delta has no "
+                 << "effect" << endl;
+    }
+    if (!find_encoder_parser(encoder.element, encoder.parser))
+        return 1;
 
-    g_signal_connect(parse, "pad-added", G_CALLBACK(new_stream), (gpointer)&blur_data);
-    gst_object_unref(parse);
+    /* Every blur element's stats add up into the process stats */
+    BlurStatsDumper stats_dumper;
+    if (parser.has("stats")) {
+        if (!stats_dumper.start(
+                equirect_blur_process_stats(),
+                parser.get<String>("stats"),
+                parser.get<String>("stats-format"),
+                parser.get<double>("stats-interval"))) {
+            cerr << "--stats-format must be json or prometheus" << endl;
+            return 1;
+        }
+        count_io_bytes = TRUE;
+    }
 
-    GstBus* bus = gst_element_get_bus(pipeline);
-    const guint bus_watch_id = gst_bus_add_watch(bus, msg_handler, nullptr);
+    if (parser.has("trace")) {
+        if (!equirect_blur_trace_open(parser.get<String>("trace")))
+            return 1;
+        gst_equirect_blur_tracer_start();
+    }
 
-    gst_object_unref(bus);
+    loop = g_main_loop_new(nullptr, FALSE);
 
 #ifdef G_OS_UNIX
     signal_watch_intr_id = g_unix_signal_add(SIGINT, (GSourceFunc)intr_handler, nullptr);
@@ -282,16 +1381,42 @@ int main(int argc, char** argv)
     SetConsoleCtrlHandler(w32_intr_handler, TRUE);
 #endif
 
-    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+    const gint64 start_time = g_get_monotonic_time();
 
-    g_main_loop_run(loop);
+    gboolean ok;
+    if (batch) {
+        ok = process_batch(parser.get<String>("batch"), static_cast<guint>(jobs));
+    }
+    else if (opts.n_segments > 1 || opts.checkpoint_interval > 0 || opts.resume) {
+        ok = process_segmented(input_file, output_file, opts);
+    }
+    else {
+        auto* bd = new BlurData {};
+        bd->stop = GST_CLOCK_TIME_NONE;
+        bd->save_detections = opts.save_detections;
+        blur_pipelines.push_back(bd);
+        ok = create_blur_pipeline(input_file, output_file, bd) && run_pipelines();
+    }
 
-    gst_element_set_state(pipeline, GST_STATE_NULL);
-    gst_object_unref(blur_data.pipeline);
-    gst_object_unref(blur_data.src);
-    gst_object_unref(blur_data.mux);
-    g_source_remove(bus_watch_id);
     g_main_loop_unref(loop);
+    equirect_blur_trace_close();
+    g_print("%s\n", equirect_blur_memory_report().c_str());
+
+    if (ok) {
+        const double elapsed = static_cast<double>(g_get_monotonic_time() - start_time) / G_USEC_PER_SEC;
+        GStatBuf st;
+        if (!batch && g_stat(output_file.c_str(), &st) == 0) {
+            g_print(
+                "Wrote %s (%.1f MB) with %s in %.1f s\n",
+                output_file.c_str(),
+                static_cast<double>(st.st_size) / (1024 * 1024),
+                encoder.element.c_str(),
+                elapsed);
+        }
+        else {
+            g_print("Finished in %.1f s\n", elapsed);
+        }
+    }
 
-    return 0;
+    return ok ? 0 : 1;
 }
@@ -1,145 +1,167 @@
-#include "equirect-blur-common.h"
-#include <cctype>
-#include <filesystem>
+#include "equirect-blur-memory.h"
+#include "equirect-blur-pipeline.h"
+#include "equirect-blur-server.h"
+#include "equirect-blur-shared.h"
+#include "equirect-blur-sidecar.h"
+#include "equirect-blur-stats.h"
+#include "equirect-blur-trace.h"
+#include <chrono>
+#include <cstdio>
 #include <iostream>
 #include <string>
 #include <vector>
 
-inline bool ends_with(std::string const& value, std::string const& ending)
+/* Run one job from the server with the resident detectors and tile writers */
+static void run_job(const ServerJob& job, const JobReporter& reporter, ImageResources& resources)
 {
-    if (ending.size() > value.size())
+    std::vector<const char*> argv = { "equirect-blur-image" };
+    for (const std::string& arg : job.args)
+        argv.push_back(arg.c_str());
+
+    const cv::CommandLineParser parser = equirect_blur_image_parser(static_cast<int>(argv.size()), argv.data());
+    ImageRunOptions options;
+    std::string error;
+    if (parser.has("serve") || parser.has("warm-size") || parser.has("stats") || parser.has("trace"))
+        error = "Server options can't be used in a job";
+    else if (equirect_blur_image_options(parser, options, error))
+        options.files = job.files;
+
+    if (!error.empty()) {
+        std::cerr << "Job " << job.id << ": " << error << std::endl;
+        reporter.event("rejected", ",\"error\":\"" + json_escape(error) + "\"");
+        return;
+    }
+
+    std::cout << "Job " << job.id << " started" << std::endl;
+    reporter.event("started");
+    const auto start = std::chrono::steady_clock::now();
+
+    ImageRunResult result;
+    const bool ok = equirect_blur_run_images(
+        options,
+        resources,
+        result,
+        [&reporter](const ImageRunProgress& image) {
+            char buf[128];
+            snprintf(
+                buf, sizeof(buf), ",\"faces\":%zu,\"done\":%zu,\"total\":%zu", image.faces, image.done, image.total);
+            reporter.event("image", ",\"file\":\"" + json_escape(image.file) + "\"" + buf);
+        },
+        reporter.cancelled());
+
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    char buf[128];
+    snprintf(
+        buf,
+        sizeof(buf),
+        ",\"ok\":%s,\"images\":%zu,\"processed\":%zu,\"seconds\":%.3f",
+        ok ? "true" : "false",
+        result.total,
+        result.processed,
+        elapsed.count());
+    std::string fields = buf;
+    if (!ok)
+        fields += ",\"error\":\"" + json_escape(result.error) + "\"";
+    reporter.event("finished", fields);
+
+    std::cout << "Job " << job.id << (ok ? " finished" : " failed") << " in " << cv::format("%.1f", elapsed.count())
+              << " s" << std::endl;
+}
+
+/* Build the projection maps for a frame size and load one set of detectors, so
+ * the first job doesn't wait for them */
+static bool warm_up(const cv::CommandLineParser& parser, ImageResources& resources)
+{
+    int width, height;
+    if (sscanf(parser.get<cv::String>("warm-size").c_str(), "%dx%d", &width, &height) != 2 || width < 1
+        || height < 1) {
+        std::cerr << "--warm-size must be WIDTHxHEIGHT" << std::endl;
         return false;
-    return std::equal(ending.rbegin(), ending.rend(), value.rbegin());
+    }
+
+    BlurConfig config;
+    std::string error;
+    if (!equirect_blur_image_config(parser, config, error)) {
+        std::cerr << error << std::endl;
+        return false;
+    }
+
+    std::cout << "Compiling detectors for " << width << " x " << height << std::endl;
+    equirect_blur_shared_projections(cv::Size(width, height), config.layout);
+    const auto models_dir = parser.get<cv::String>("models-dir");
+    resources.detectors.release(models_dir, resources.detectors.acquire(models_dir, config.detector));
+    return true;
 }
 
 int main(int argc, const char** argv)
 {
-    cv::CommandLineParser parser(
-        argc,
-        argv,
-        "{help h||}"
-        "{blur b|true|If supplied, faces are blurred rather than hidden with rectangles}"
-        "{thresh t|0.9175|Threshold value}"
-        "{models-dir m||Path to PCN models}"
-        "{output-dir o||Output file}"
-        "{@input-dir||Input directory}");
-    parser.about("\nA utility that extracts strips of images from an equirectangular source\n"
-                 "image into the relatively undistorted equatorial band, and then uses the OpenCV\n"
-                 "cv::CascadeClassifier class to detect faces and apply blur to them\n");
+    const cv::CommandLineParser parser = equirect_blur_image_parser(argc, argv);
 
     if (parser.get<bool>("help")) {
         parser.printMessage();
         return 0;
     }
 
-    auto thresh_arg = parser.get<float>("thresh");
-
-    auto input_dir = parser.get<cv::String>("@input-dir");
-
-    auto output_dir = parser.get<cv::String>("output-dir");
-
-    std::vector<cv::String> files;
-    for (const auto& file : std::filesystem::directory_iterator(input_dir)) {
-        std::cout << "File: " << file.path().u8string() << std::endl;
-        std::string file_str_lowered = file.path().u8string();
-        std::transform(
-            file_str_lowered.begin(), file_str_lowered.end(), file_str_lowered.begin(), [](const unsigned char c) {
-                return std::tolower(c);
-            });
-        if (ends_with(file_str_lowered, ".jpg") == true) {
-            std::filesystem::path output_dir_path(output_dir);
-            std::filesystem::path output_file = output_dir_path / file.path().filename();
-            output_file.replace_extension(".png");
-            if (files.size() < 100 && !exists(output_file)) {
-                std::cout << "Input File: " << file.path().u8string() << std::endl;
-                files.push_back(file.path().u8string());
-            }
-        }
-    }
-
-    int first_width, first_height;
-    if (!files.empty()) {
-        cv::Mat im = cv::imread(files[0]);
-        first_width = im.cols;
-        first_height = im.rows;
-    }
-    else {
-        return EXIT_SUCCESS;
-    }
-
-    auto models_dir = parser.get<cv::String>("models-dir");
-
-    bool draw_over_faces = !parser.has("blur");
-
-    /* Prepare cropped projection maps for processing */
-    cv::Size image_size(first_width, first_height);
-    float apertures[2] = { X_APERTURE, Y_APERTURE };
-    std::vector<Projection> projections;
-    std::cout << "Compiling detectors" << std::endl;
-
-#pragma omp parallel for // NOLINT(*-use-default-none)
-    for (int phi_step = 0; phi_step < static_cast<int>((M_PI / Y_STEP)); phi_step++) {
-        float phi_full = static_cast<float>(phi_step) * Y_STEP;
-        /* Calculate a phi (vertical tilt) from -M_PI/2 to M_PI/2 */
-        float phi = phi_full <= M_PI / 2 ? phi_full : phi_full - static_cast<float>(M_PI);
-        for (float lambda = 0; lambda < 2 * M_PI; lambda += X_STEP) { // NOLINT(*-flp30-c)
-
-            auto detector = new PCN(
-                models_dir + "/PCN.caffemodel",
-                models_dir + "/PCN-1.prototxt",
-                models_dir + "/PCN-2.prototxt",
-                models_dir + "/PCN-3.prototxt",
-                models_dir + "/PCN-Tracking.caffemodel",
-                models_dir + "/PCN-Tracking.prototxt");
-
-            /// detection
-            detector->SetMinFaceSize(20);
-            detector->SetImagePyramidScaleFactor(1.25f);
-            // detector->SetDetectionThresh(0.37f, 0.43f, 0.85f);
-            // detector->SetDetectionThresh(0.46f, 0.54f, 1.06f);
-            // detector->SetDetectionThresh(0.9175f, 0.9175f, 0.9175f);
-            detector->SetDetectionThresh(thresh_arg, thresh_arg, thresh_arg);
-            /// tracking
-            detector->SetTrackingPeriod(0);
-            detector->SetTrackingThresh(9999.9f);
-            detector->SetVideoSmooth(false);
-
-            Projection projection(image_size, apertures, phi, lambda, detector);
-
-#pragma omp critical
-            projections.push_back(projection);
+    /* Stats cover everything the process runs, including all of a server's jobs */
+    BlurStatsDumper stats_dumper;
+    if (parser.has("stats")) {
+        if (!stats_dumper.start(
+                equirect_blur_process_stats(),
+                parser.get<cv::String>("stats"),
+                parser.get<cv::String>("stats-format"),
+                parser.get<double>("stats-interval"))) {
+            std::cerr << "--stats-format must be json or prometheus" << std::endl;
+            return 1;
         }
     }
-
-    for (auto& input_file : files) {
-
-        std::cout << "Starting to Process: " << input_file << std::endl;
-
-        cv::Mat im = cv::imread(input_file);
-        if (im.rows != first_height || im.cols != first_width) {
-            std::cout << "Exiting due to dimension change" << std::endl;
-            return EXIT_SUCCESS;
-        }
-        if (im.data == nullptr) {
-            parser.printMessage();
-            std::cout << "Can't open image file " << input_file << std::endl;
+    BlurStats* const stats = parser.has("stats") ? &equirect_blur_process_stats() : nullptr;
+
+    if (parser.has("trace") && !equirect_blur_trace_open(parser.get<cv::String>("trace")))
+        return 1;
+
+    const double projection_cache_mb = parser.get<double>("projection-cache");
+    if (projection_cache_mb > 0)
+        equirect_blur_set_projection_cache_limit(static_cast<size_t>(projection_cache_mb * 1024 * 1024));
+
+    if (parser.has("serve")) {
+        ServerOptions server;
+        server.socket_path = parser.get<cv::String>("serve");
+        server.max_jobs = parser.get<int>("max-jobs");
+        server.max_queued = parser.get<int>("max-queued");
+        const int detect_limit = parser.get<int>("detect-limit");
+        if (server.max_jobs < 1 || server.max_queued < 1) {
+            std::cerr << "--max-jobs and --max-queued must be at least 1" << std::endl;
             return 1;
         }
-
-        if (!equirect_blur_process_frame(im, projections, draw_over_faces)) {
-            std::cerr << "Processing frame failed" << std::endl;
+        if (detect_limit < 0) {
+            std::cerr << "--detect-limit must be 0 (no limit) or more" << std::endl;
             return 1;
         }
 
-        std::filesystem::path output_dir_path(output_dir);
-        std::filesystem::path input_file_path(input_file);
-
-        std::filesystem::path output_file = output_dir_path / input_file_path.filename().replace_extension("png");
+        ImageResources resources(detect_limit);
+        resources.stats = stats;
+        if (parser.has("warm-size") && !warm_up(parser, resources))
+            return 1;
 
-        std::cout << "Processed: " << output_file.u8string() << std::endl;
+        equirect_blur_serve(server, [&resources](const ServerJob& job, const JobReporter& reporter) {
+            run_job(job, reporter, resources);
+        });
+        equirect_blur_trace_close();
+        return 1;
+    }
 
-        imwrite(output_file.u8string(), im);
+    ImageRunOptions options;
+    std::string error;
+    if (!equirect_blur_image_options(parser, options, error)) {
+        std::cerr << error << std::endl;
+        return 1;
     }
 
-    return 0;
+    ImageResources resources;
+    resources.stats = stats;
+    ImageRunResult result;
+    const bool ok = equirect_blur_run_images(options, resources, result);
+    equirect_blur_trace_close();
+    std::cout << equirect_blur_memory_report() << std::endl;
+    return ok ? 0 : 1;
 }
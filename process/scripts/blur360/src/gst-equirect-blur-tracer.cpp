@@ -0,0 +1,76 @@
+#include "gst-equirect-blur-tracer.h"
+#include "equirect-blur-trace.h"
+
+#include <string>
+
+#define gst_equirect_blur_tracer_parent_class parent_class
+G_DEFINE_TYPE(GstEquirectBlurTracer, gst_equirect_blur_tracer, GST_TYPE_TRACER);
+
+static thread_local bool thread_named = false;
+
+/* element:pad, for the span pushing out of pad */
+static std::string pad_span_name(GstPad* pad)
+{
+    gchar* name = g_strdup_printf("%s:%s", GST_DEBUG_PAD_NAME(pad));
+    std::string span = name;
+    g_free(name);
+    return span;
+}
+
+/* Name GStreamer's streaming threads after the first element seen pushing on them */
+static void name_thread(GstPad* pad)
+{
+    if (thread_named)
+        return;
+    thread_named = true;
+
+    const GstObject* parent = GST_OBJECT_PARENT(pad);
+    equirect_blur_trace_thread_name(std::string("gst ") + (parent != nullptr ? GST_OBJECT_NAME(parent) : "?"));
+}
+
+static void do_push_buffer_pre(
+    [[maybe_unused]] GObject* self, [[maybe_unused]] GstClockTime ts, GstPad* pad, [[maybe_unused]] GstBuffer* buffer)
+{
+    if (!equirect_blur_trace_enabled())
+        return;
+    name_thread(pad);
+    equirect_blur_trace_begin("gst", pad_span_name(pad));
+}
+
+static void do_push_buffer_post(
+    [[maybe_unused]] GObject* self, [[maybe_unused]] GstClockTime ts, GstPad* pad, [[maybe_unused]] GstFlowReturn res)
+{
+    if (!equirect_blur_trace_enabled())
+        return;
+    equirect_blur_trace_end("gst", pad_span_name(pad));
+}
+
+static void do_push_list_pre(
+    [[maybe_unused]] GObject* self, [[maybe_unused]] GstClockTime ts, GstPad* pad, [[maybe_unused]] GstBufferList* list)
+{
+    if (!equirect_blur_trace_enabled())
+        return;
+    name_thread(pad);
+    equirect_blur_trace_begin("gst", pad_span_name(pad));
+}
+
+static void gst_equirect_blur_tracer_class_init([[maybe_unused]] GstEquirectBlurTracerClass* klass)
+{
+}
+
+static void gst_equirect_blur_tracer_init(GstEquirectBlurTracer* self)
+{
+    GstTracer* tracer = GST_TRACER(self);
+    gst_tracing_register_hook(tracer, "pad-push-pre", G_CALLBACK(do_push_buffer_pre));
+    gst_tracing_register_hook(tracer, "pad-push-post", G_CALLBACK(do_push_buffer_post));
+    gst_tracing_register_hook(tracer, "pad-push-list-pre", G_CALLBACK(do_push_list_pre));
+    gst_tracing_register_hook(tracer, "pad-push-list-post", G_CALLBACK(do_push_buffer_post));
+}
+
+void gst_equirect_blur_tracer_start(void)
+{
+    /* Tracers hook in when they are created, and stay for the life of the process */
+    static GstEquirectBlurTracer* tracer = nullptr;
+    if (tracer == nullptr)
+        tracer = GST_EQUIRECT_BLUR_TRACER(gst_object_ref_sink(g_object_new(GST_TYPE_EQUIRECT_BLUR_TRACER, nullptr)));
+}
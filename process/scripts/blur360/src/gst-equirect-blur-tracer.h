@@ -0,0 +1,25 @@
+#pragma once
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+#define GST_TYPE_EQUIRECT_BLUR_TRACER (gst_equirect_blur_tracer_get_type())
+G_DECLARE_FINAL_TYPE(GstEquirectBlurTracer, gst_equirect_blur_tracer, GST, EQUIRECT_BLUR_TRACER, GstTracer);
+
+/* A GStreamer tracer that adds a span to the blur360 trace (see
+ * equirect-blur-trace.h) for every buffer pushed between elements, so element
+ * and queue timings appear on the same timeline as the detection stages. Each
+ * span covers the downstream chain functions running on the pushing thread */
+struct _GstEquirectBlurTracer {
+    GstTracer parent;
+};
+
+struct _GstEquirectBlurTracerClass { // NOLINT(*-reserved-identifier)
+    GstTracerClass parent;
+};
+
+/* Start tracing every pipeline in the process, after gst_init() */
+void gst_equirect_blur_tracer_start(void);
+
+G_END_DECLS
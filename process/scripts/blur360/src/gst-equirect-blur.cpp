@@ -1,12 +1,51 @@
 #include "gst-equirect-blur.h"
+#include "equirect-blur-trace.h"
+
+#include <gst/video/gstvideometa.h>
+
+#include <algorithm>
+#include <map>
+#include <mutex>
 
 GST_DEBUG_CATEGORY_STATIC(gst_equirect_blur_debug);
 #define GST_CAT_DEFAULT gst_equirect_blur_debug
 
-enum { PROP_0, PROP_DRAW_OVER_FACES, PROP_MODELS_DIR };
+enum {
+    PROP_0,
+    PROP_DRAW_OVER_FACES,
+    PROP_DIRECT_OBSCURE,
+    PROP_OBSCURE_FILTER,
+    PROP_OBSCURE_RADIUS,
+    PROP_MODELS_DIR,
+    PROP_CONFIG,
+    PROP_SAVE_DETECTIONS,
+    PROP_LOAD_DETECTIONS,
+    PROP_SHARED_DETECTORS,
+    PROP_MAX_INFERENCES,
+    PROP_ROI_QP_DELTA,
+    PROP_MEMORY_BUDGET,
+    PROP_STATS
+};
 
 #define DEFAULT_DRAW_OVER_FACES TRUE
+#define DEFAULT_DIRECT_OBSCURE FALSE
+#define DEFAULT_OBSCURE_FILTER ObscureFilter::GAUSSIAN
+#define DEFAULT_OBSCURE_RADIUS 0.0
 #define DEFAULT_MODELS_DIR "models"
+#define DEFAULT_SHARED_DETECTORS FALSE
+#define DEFAULT_MAX_INFERENCES 0
+#define DEFAULT_ROI_QP_DELTA 0
+#define DEFAULT_MEMORY_BUDGET 0.0
+
+/* Detector pools shared by all elements with shared-detectors set, one per models directory and
+ * detector settings */
+static std::mutex shared_pools_lock;
+static std::map<std::string, DetectorPool*> shared_pools;
+
+/* The memory gate shared by all elements with a memory-budget. Its workers are
+ * the elements processing a frame, or waiting to */
+static std::mutex memory_gate_lock;
+static MemoryGate* memory_gate;
 
 static GstStaticPadTemplate sink_template
     = GST_STATIC_PAD_TEMPLATE("sink", GST_PAD_SINK, GST_PAD_ALWAYS, GST_STATIC_CAPS("video/x-raw,format=(string)BGR"));
@@ -14,6 +53,23 @@ static GstStaticPadTemplate sink_template
 static GstStaticPadTemplate src_template
     = GST_STATIC_PAD_TEMPLATE("src", GST_PAD_SRC, GST_PAD_ALWAYS, GST_STATIC_CAPS("video/x-raw,format=(string)BGR"));
 
+#define GST_TYPE_EQUIRECT_BLUR_FILTER (gst_equirect_blur_filter_get_type())
+static GType gst_equirect_blur_filter_get_type()
+{
+    static GType type = 0;
+    static const GEnumValue values[] = {
+        { static_cast<gint>(ObscureFilter::GAUSSIAN), "Gaussian blur", "gaussian" },
+        { static_cast<gint>(ObscureFilter::BOX), "Box blur", "box" },
+        { static_cast<gint>(ObscureFilter::STACK), "Stack blur", "stack" },
+        { static_cast<gint>(ObscureFilter::PIXELATE), "Pixelate", "pixelate" },
+        { 0, nullptr, nullptr },
+    };
+
+    if (g_once_init_enter(&type))
+        g_once_init_leave(&type, g_enum_register_static("GstEquirectBlurFilter", values));
+    return type;
+}
+
 #define gst_equirect_blur_parent_class parent_class
 G_DEFINE_TYPE(GstEquirectBlur, gst_equirect_blur, GST_TYPE_VIDEO_FILTER);
 
@@ -25,6 +81,9 @@ static void gst_equirect_blur_set_property(GObject* object, guint prop_id, const
 static void gst_equirect_blur_get_property(GObject* object, guint prop_id, GValue* value, GParamSpec* pspec);
 static void gst_equirect_blur_finalize(GObject* object);
 
+static gboolean gst_equirect_blur_start(GstBaseTransform* trans);
+static gboolean gst_equirect_blur_stop(GstBaseTransform* trans);
+
 static GstFlowReturn gst_equirect_blur_transform_frame_ip(GstVideoFilter* base, GstVideoFrame* frame);
 
 static void gst_equirect_blur_class_init(GstEquirectBlurClass* klass)
@@ -46,6 +105,41 @@ static void gst_equirect_blur_class_init(GstEquirectBlurClass* klass)
             DEFAULT_DRAW_OVER_FACES,
             static_cast<GParamFlags>(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
 
+    g_object_class_install_property(
+        gobject_class,
+        PROP_DIRECT_OBSCURE,
+        g_param_spec_boolean(
+            "direct-obscure",
+            "Direct obscure",
+            "Obscure a spherical region of the frame around each face in one pass, instead of obscuring it in its "
+            "projection and remapping that back",
+            DEFAULT_DIRECT_OBSCURE,
+            static_cast<GParamFlags>(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+    g_object_class_install_property(
+        gobject_class,
+        PROP_OBSCURE_FILTER,
+        g_param_spec_enum(
+            "obscure-filter",
+            "Obscure filter",
+            "Filter for blurring faces when draw-over-faces is FALSE",
+            GST_TYPE_EQUIRECT_BLUR_FILTER,
+            static_cast<gint>(DEFAULT_OBSCURE_FILTER),
+            static_cast<GParamFlags>(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+    g_object_class_install_property(
+        gobject_class,
+        PROP_OBSCURE_RADIUS,
+        g_param_spec_double(
+            "obscure-radius",
+            "Obscure radius",
+            "Blur radius (pixelate block size) in face widths "
+            "(0 = 0.25, or a fixed kernel for the gaussian filter when not obscuring directly)",
+            0.0,
+            10.0,
+            DEFAULT_OBSCURE_RADIUS,
+            static_cast<GParamFlags>(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
     g_object_class_install_property(
         gobject_class,
         PROP_MODELS_DIR,
@@ -56,6 +150,98 @@ static void gst_equirect_blur_class_init(GstEquirectBlurClass* klass)
             DEFAULT_MODELS_DIR,
             static_cast<GParamFlags>(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
 
+    g_object_class_install_property(
+        gobject_class,
+        PROP_CONFIG,
+        g_param_spec_string(
+            "config",
+            "Config",
+            "Detector settings and projection layout to use instead of the defaults (a JSON file, e.g. written by "
+            "equirect-blur-tune). Read when the element starts",
+            nullptr,
+            static_cast<GParamFlags>(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+    g_object_class_install_property(
+        gobject_class,
+        PROP_SAVE_DETECTIONS,
+        g_param_spec_string(
+            "save-detections",
+            "Save detections",
+            "Write the faces detected in each frame to this file (JSON lines)",
+            nullptr,
+            static_cast<GParamFlags>(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+    g_object_class_install_property(
+        gobject_class,
+        PROP_LOAD_DETECTIONS,
+        g_param_spec_string(
+            "load-detections",
+            "Load detections",
+            "Obscure the faces listed in this file (from save-detections) instead of running the detectors",
+            nullptr,
+            static_cast<GParamFlags>(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+    g_object_class_install_property(
+        gobject_class,
+        PROP_SHARED_DETECTORS,
+        g_param_spec_boolean(
+            "shared-detectors",
+            "Shared detectors",
+            "Share projection maps and a pool of detectors with the other equirect_blur elements in the process",
+            DEFAULT_SHARED_DETECTORS,
+            static_cast<GParamFlags>(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+    g_object_class_install_property(
+        gobject_class,
+        PROP_MAX_INFERENCES,
+        g_param_spec_uint(
+            "max-inferences",
+            "Max inferences",
+            "Size of the shared detector pool, which limits how many detections run at once across all streams "
+            "(0 = number of CPUs). Set by the first element to use the pool",
+            0,
+            G_MAXUINT,
+            DEFAULT_MAX_INFERENCES,
+            static_cast<GParamFlags>(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+    g_object_class_install_property(
+        gobject_class,
+        PROP_ROI_QP_DELTA,
+        g_param_spec_int(
+            "roi-qp-delta",
+            "ROI QP delta",
+            "Quantiser offset added to the face region of interest metas for encoders that support them "
+            "(positive values spend fewer bits on the obscured faces, 0 = no hint)",
+            -51,
+            51,
+            DEFAULT_ROI_QP_DELTA,
+            static_cast<GParamFlags>(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+    g_object_class_install_property(
+        gobject_class,
+        PROP_MEMORY_BUDGET,
+        g_param_spec_double(
+            "memory-budget",
+            "Memory budget",
+            "Memory in MB for all equirect_blur elements in the process together. A frame waits to be processed "
+            "while it would take the memory charged to the process over this, unless every element with a frame "
+            "is waiting, when one goes ahead over it (0 = no limit). Set by the first element to start with one",
+            0.0,
+            G_MAXDOUBLE,
+            DEFAULT_MEMORY_BUDGET,
+            static_cast<GParamFlags>(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+    g_object_class_install_property(
+        gobject_class,
+        PROP_STATS,
+        g_param_spec_boxed(
+            "stats",
+            "Statistics",
+            "Time spent in each stage of processing (remap, detect and the detector's stages, obscure), the "
+            "detector's pyramid levels and candidate windows, and the faces found in each projection",
+            GST_TYPE_STRUCTURE,
+            static_cast<GParamFlags>(G_PARAM_READABLE | G_PARAM_STATIC_STRINGS)));
+
     gst_element_class_set_details_simple(
         gstelement_class,
         "Equirectangular Face Blur Filter",
@@ -66,6 +252,8 @@ static void gst_equirect_blur_class_init(GstEquirectBlurClass* klass)
     gst_element_class_add_pad_template(gstelement_class, gst_static_pad_template_get(&src_template));
     gst_element_class_add_pad_template(gstelement_class, gst_static_pad_template_get(&sink_template));
 
+    GST_BASE_TRANSFORM_CLASS(klass)->start = gst_equirect_blur_start;
+    GST_BASE_TRANSFORM_CLASS(klass)->stop = gst_equirect_blur_stop;
     GST_VIDEO_FILTER_CLASS(klass)->set_info = gst_equirect_blur_set_info;
     GST_VIDEO_FILTER_CLASS(klass)->transform_frame_ip = gst_equirect_blur_transform_frame_ip;
 
@@ -75,7 +263,17 @@ static void gst_equirect_blur_class_init(GstEquirectBlurClass* klass)
 static void gst_equirect_blur_init(GstEquirectBlur* self)
 {
     self->models_dir = g_strdup(DEFAULT_MODELS_DIR);
+    self->config = equirect_blur_video_defaults();
     self->draw_over_faces = DEFAULT_DRAW_OVER_FACES;
+    self->direct_obscure = DEFAULT_DIRECT_OBSCURE;
+    self->obscure_filter = static_cast<gint>(DEFAULT_OBSCURE_FILTER);
+    self->obscure_radius = DEFAULT_OBSCURE_RADIUS;
+    self->shared_detectors = DEFAULT_SHARED_DETECTORS;
+    self->max_inferences = DEFAULT_MAX_INFERENCES;
+    self->roi_qp_delta = DEFAULT_ROI_QP_DELTA;
+    self->memory_budget = DEFAULT_MEMORY_BUDGET;
+    self->stats = new BlurStats(&equirect_blur_process_stats());
+    self->scratch = new FrameScratch();
 }
 
 static void gst_equirect_blur_finalize(GObject* object)
@@ -83,7 +281,17 @@ static void gst_equirect_blur_finalize(GObject* object)
     GstEquirectBlur* filter = GST_EQUIRECT_BLUR(object);
     filter->cvMat.release();
 
+    for (const PCN* detector : filter->detectors)
+        delete detector;
+    std::vector<PCN*>().swap(filter->detectors);
+    std::vector<Projection>().swap(filter->projections);
+
     g_free(filter->models_dir);
+    g_free(filter->config_file);
+    g_free(filter->save_detections);
+    g_free(filter->load_detections);
+    delete filter->stats;
+    delete filter->scratch;
 
     G_OBJECT_CLASS(parent_class)->finalize(object);
 }
@@ -96,18 +304,121 @@ static void gst_equirect_blur_set_property(GObject* object, const guint prop_id,
     case PROP_DRAW_OVER_FACES:
         filter->draw_over_faces = g_value_get_boolean(value);
         break;
+    case PROP_DIRECT_OBSCURE:
+        filter->direct_obscure = g_value_get_boolean(value);
+        break;
+    case PROP_OBSCURE_FILTER:
+        filter->obscure_filter = g_value_get_enum(value);
+        break;
+    case PROP_OBSCURE_RADIUS:
+        filter->obscure_radius = g_value_get_double(value);
+        break;
     case PROP_MODELS_DIR:
         GST_OBJECT_LOCK(object);
         g_free(filter->models_dir);
         filter->models_dir = g_value_dup_string(value);
         GST_OBJECT_UNLOCK(object);
         break;
+    case PROP_CONFIG:
+        GST_OBJECT_LOCK(object);
+        g_free(filter->config_file);
+        filter->config_file = g_value_dup_string(value);
+        GST_OBJECT_UNLOCK(object);
+        break;
+    case PROP_SHARED_DETECTORS:
+        filter->shared_detectors = g_value_get_boolean(value);
+        break;
+    case PROP_MAX_INFERENCES:
+        filter->max_inferences = g_value_get_uint(value);
+        break;
+    case PROP_ROI_QP_DELTA:
+        filter->roi_qp_delta = g_value_get_int(value);
+        break;
+    case PROP_MEMORY_BUDGET:
+        filter->memory_budget = g_value_get_double(value);
+        break;
+    case PROP_SAVE_DETECTIONS:
+        GST_OBJECT_LOCK(object);
+        g_free(filter->save_detections);
+        filter->save_detections = g_value_dup_string(value);
+        GST_OBJECT_UNLOCK(object);
+        break;
+    case PROP_LOAD_DETECTIONS:
+        GST_OBJECT_LOCK(object);
+        g_free(filter->load_detections);
+        filter->load_detections = g_value_dup_string(value);
+        GST_OBJECT_UNLOCK(object);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
         break;
     }
 }
 
+/* The stats property: seconds and runs for each stage, the counters, the
+ * process's memory use (memory-<subsystem>-bytes and -peak-bytes), and an array
+ * of per projection face counts */
+static GstStructure* gst_equirect_blur_stats_structure(const BlurStatsData& data)
+{
+    GstStructure* s
+        = gst_structure_new("application/x-equirect-blur-stats", "uptime", G_TYPE_DOUBLE, data.uptime, nullptr);
+
+    for (const auto& [name, stage] : data.stages) {
+        gst_structure_set(
+            s,
+            (name + "-seconds").c_str(),
+            G_TYPE_DOUBLE,
+            stage.seconds,
+            (name + "-runs").c_str(),
+            G_TYPE_UINT64,
+            static_cast<guint64>(stage.count),
+            nullptr);
+    }
+
+    for (const auto& [name, value] : data.counters) {
+        std::string field = name;
+        std::replace(field.begin(), field.end(), '_', '-');
+        gst_structure_set(s, field.c_str(), G_TYPE_UINT64, static_cast<guint64>(value), nullptr);
+    }
+
+    for (const auto& [name, usage] : data.memory) {
+        gst_structure_set(
+            s,
+            ("memory-" + name + "-bytes").c_str(),
+            G_TYPE_UINT64,
+            static_cast<guint64>(usage.bytes),
+            ("memory-" + name + "-peak-bytes").c_str(),
+            G_TYPE_UINT64,
+            static_cast<guint64>(usage.peak_bytes),
+            nullptr);
+    }
+
+    GValue projections = G_VALUE_INIT;
+    g_value_init(&projections, GST_TYPE_ARRAY);
+    for (const auto& [projection, faces] : data.projection_faces) {
+        GValue entry = G_VALUE_INIT;
+        g_value_init(&entry, GST_TYPE_STRUCTURE);
+        g_value_take_boxed(
+            &entry,
+            gst_structure_new(
+                "projection",
+                "phi",
+                G_TYPE_INT,
+                projection.first,
+                "lambda",
+                G_TYPE_INT,
+                projection.second,
+                "faces",
+                G_TYPE_UINT64,
+                static_cast<guint64>(faces),
+                nullptr));
+        gst_value_array_append_and_take_value(&projections, &entry);
+    }
+    gst_structure_take_value(s, "projection-faces", &projections);
+
+    return s;
+}
+
 static void gst_equirect_blur_get_property(GObject* object, const guint prop_id, GValue* value, GParamSpec* pspec)
 {
     const GstEquirectBlur* filter = GST_EQUIRECT_BLUR(object);
@@ -116,16 +427,132 @@ static void gst_equirect_blur_get_property(GObject* object, const guint prop_id,
     case PROP_DRAW_OVER_FACES:
         g_value_set_boolean(value, filter->draw_over_faces);
         break;
+    case PROP_DIRECT_OBSCURE:
+        g_value_set_boolean(value, filter->direct_obscure);
+        break;
+    case PROP_OBSCURE_FILTER:
+        g_value_set_enum(value, filter->obscure_filter);
+        break;
+    case PROP_OBSCURE_RADIUS:
+        g_value_set_double(value, filter->obscure_radius);
+        break;
     case PROP_MODELS_DIR:
         GST_OBJECT_LOCK(object);
         g_value_set_string(value, filter->models_dir);
         GST_OBJECT_UNLOCK(object);
         break;
+    case PROP_CONFIG:
+        GST_OBJECT_LOCK(object);
+        g_value_set_string(value, filter->config_file);
+        GST_OBJECT_UNLOCK(object);
+        break;
+    case PROP_SHARED_DETECTORS:
+        g_value_set_boolean(value, filter->shared_detectors);
+        break;
+    case PROP_MAX_INFERENCES:
+        g_value_set_uint(value, filter->max_inferences);
+        break;
+    case PROP_ROI_QP_DELTA:
+        g_value_set_int(value, filter->roi_qp_delta);
+        break;
+    case PROP_MEMORY_BUDGET:
+        g_value_set_double(value, filter->memory_budget);
+        break;
+    case PROP_SAVE_DETECTIONS:
+        GST_OBJECT_LOCK(object);
+        g_value_set_string(value, filter->save_detections);
+        GST_OBJECT_UNLOCK(object);
+        break;
+    case PROP_LOAD_DETECTIONS:
+        GST_OBJECT_LOCK(object);
+        g_value_set_string(value, filter->load_detections);
+        GST_OBJECT_UNLOCK(object);
+        break;
+    case PROP_STATS:
+        g_value_take_boxed(value, gst_equirect_blur_stats_structure(filter->stats->snapshot()));
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
         break;
     }
 }
+
+static gboolean gst_equirect_blur_start(GstBaseTransform* trans)
+{
+    GstEquirectBlur* filter = GST_EQUIRECT_BLUR(trans);
+
+    GST_OBJECT_LOCK(filter);
+    const std::string save_detections = filter->save_detections ? filter->save_detections : "";
+    const std::string load_detections = filter->load_detections ? filter->load_detections : "";
+    const std::string config_file = filter->config_file ? filter->config_file : "";
+    GST_OBJECT_UNLOCK(filter);
+
+    filter->frame_count = 0;
+
+    /* The projections and detectors pick up the config when they are next prepared */
+    BlurConfig config = equirect_blur_video_defaults();
+    std::string error;
+    if (!config_file.empty() && !equirect_blur_load_config(config_file, config, error)) {
+        GST_ELEMENT_ERROR(filter, RESOURCE, READ, ("%s", error.c_str()), (nullptr));
+        return FALSE;
+    }
+    filter->config = config;
+    filter->update_projections = TRUE;
+
+    if (!save_detections.empty()) {
+        filter->sidecar_out = new SidecarWriter();
+        if (!filter->sidecar_out->open(save_detections)) {
+            GST_ELEMENT_ERROR(
+                filter,
+                RESOURCE,
+                OPEN_WRITE,
+                ("Could not open detections file %s", save_detections.c_str()),
+                (nullptr));
+            delete filter->sidecar_out;
+            filter->sidecar_out = nullptr;
+            return FALSE;
+        }
+    }
+
+    if (!load_detections.empty()) {
+        filter->sidecar_in = new SidecarReader();
+        if (!filter->sidecar_in->load(load_detections)) {
+            GST_ELEMENT_ERROR(
+                filter, RESOURCE, READ, ("Could not read detections file %s", load_detections.c_str()), (nullptr));
+            /* stop() isn't called when start() fails */
+            delete filter->sidecar_in;
+            filter->sidecar_in = nullptr;
+            delete filter->sidecar_out;
+            filter->sidecar_out = nullptr;
+            return FALSE;
+        }
+    }
+
+    filter->memory_gate = nullptr;
+    if (filter->memory_budget > 0) {
+        std::lock_guard lock(memory_gate_lock);
+        if (memory_gate == nullptr) {
+            g_print("Keeping to a memory budget of %.0f MB\n", filter->memory_budget);
+            memory_gate = new MemoryGate(static_cast<size_t>(filter->memory_budget * 1024 * 1024), 0);
+        }
+        filter->memory_gate = memory_gate;
+    }
+
+    return TRUE;
+}
+
+static gboolean gst_equirect_blur_stop(GstBaseTransform* trans)
+{
+    GstEquirectBlur* filter = GST_EQUIRECT_BLUR(trans);
+
+    delete filter->sidecar_out;
+    filter->sidecar_out = nullptr;
+    delete filter->sidecar_in;
+    filter->sidecar_in = nullptr;
+
+    return TRUE;
+}
+
 static gboolean gst_equirect_blur_set_info(
     GstVideoFilter* vfilter,
     GstCaps* incaps,
@@ -146,6 +573,29 @@ static gboolean gst_equirect_blur_set_info(
     return TRUE;
 }
 
+static DetectorPool* gst_equirect_blur_get_shared_pool(
+    const cv::String& models_dir, const DetectorSettings& settings, guint max_inferences)
+{
+    std::lock_guard lock(shared_pools_lock);
+
+    /* Streams with different detector settings can't share detectors. The
+     * layout doesn't matter, as any detector can serve any projection */
+    BlurConfig key;
+    key.detector = settings;
+    DetectorPool*& pool = shared_pools[models_dir + " " + equirect_blur_config_json(key)];
+    if (pool == nullptr) {
+        if (max_inferences == 0)
+            max_inferences = g_get_num_processors();
+
+        g_print("Sharing up to %u detectors from %s\n", max_inferences, models_dir.c_str());
+        pool = new DetectorPool(
+            [models_dir, settings] { return equirect_blur_create_detector(models_dir, settings, true); },
+            max_inferences);
+    }
+
+    return pool;
+}
+
 static void gst_equirect_blur_prepare_projections(GstEquirectBlur* filter)
 {
     /* Prepare cropped projection maps for processing */
@@ -153,51 +603,72 @@ static void gst_equirect_blur_prepare_projections(GstEquirectBlur* filter)
 
     const cv::Size image_size(filter->width, filter->height);
 
-    float apertures[2] = { X_APERTURE, Y_APERTURE };
-
     GST_OBJECT_LOCK(GST_OBJECT(filter));
     const auto models_dir = cv::String(filter->models_dir);
     GST_OBJECT_UNLOCK(GST_OBJECT(filter));
 
+    /* The maps come from the process-wide cache, so going back to a size seen
+     * before (in this stream or another) doesn't rebuild them */
+    filter->projections = equirect_blur_shared_projections(image_size, filter->config.layout);
+
+    /* Rendering from a detections file doesn't need the detectors */
+    if (filter->sidecar_in != nullptr)
+        return;
+
+    if (filter->shared_detectors) {
+        DetectorPool* pool
+            = gst_equirect_blur_get_shared_pool(models_dir, filter->config.detector, filter->max_inferences);
+        for (Projection& p : filter->projections)
+            p.pool = pool;
+        return;
+    }
+
+    /* Our own detectors are kept across caps changes, one per projection. The
+     * settings may have changed since they were made, if the element restarted */
+    for (PCN* detector : filter->detectors)
+        equirect_blur_apply_detector_settings(*detector, filter->config.detector);
+    if (filter->detectors.size() < filter->projections.size()) {
+        const size_t first = filter->detectors.size();
+        filter->detectors.resize(filter->projections.size());
+
 #pragma omp parallel for // NOLINT(*-use-default-none)
-    for (int phi_step = 0; phi_step < static_cast<int>((M_PI / Y_STEP)); phi_step++) {
-        const float phi_full = static_cast<float>(phi_step) * Y_STEP;
-        /* Calculate a phi (vertical tilt) from -M_PI/2 to M_PI/2 */
-        const float phi = phi_full <= M_PI / 2 ? phi_full : phi_full - static_cast<float>(M_PI);
-
-        for (float lambda = 0; lambda < 2 * M_PI; lambda += X_STEP) { // NOLINT(*-flp30-c)
-            const auto detector = new PCN(
-                models_dir + "/PCN.caffemodel",
-                models_dir + "/PCN-1.prototxt",
-                models_dir + "/PCN-2.prototxt",
-                models_dir + "/PCN-3.prototxt",
-                models_dir + "/PCN-Tracking.caffemodel",
-                models_dir + "/PCN-Tracking.prototxt");
-
-            /// detection
-            detector->SetMinFaceSize(32);
-            detector->SetImagePyramidScaleFactor(1.5f);
-            // detector->SetDetectionThresh(0.37f, 0.43f, 0.85f); // default
-            // detector->SetDetectionThresh(0.28f, 0.32f, 0.64f); // More blur
-            detector->SetDetectionThresh(0.56f, 0.65f, 1.274f);
-            /// tracking
-            detector->SetTrackingPeriod(30);
-            detector->SetTrackingThresh(0.9f);
-            detector->SetVideoSmooth(true);
-
-            Projection projection(image_size, apertures, phi, lambda, detector);
-
-#pragma omp critical
-            filter->projections.push_back(projection);
-        }
+        for (int i = static_cast<int>(first); i < static_cast<int>(filter->detectors.size()); i++)
+            filter->detectors[i] = equirect_blur_create_detector(models_dir, filter->config.detector, true);
     }
+    for (size_t i = 0; i < filter->projections.size(); i++)
+        filter->projections[i].detector = filter->detectors[i];
 
-    g_print(
-        "Created %u projections of %u x %u\n",
-        static_cast<int>(filter->projections.size()),
-        static_cast<int>((M_PI / Y_STEP)),
-        static_cast<int>(2 * M_PI / X_STEP + 1));
-    g_assert(filter->projections.size() == static_cast<int>(M_PI / Y_STEP) * static_cast<int>(2 * M_PI / X_STEP + 1));
+    g_print("Using %u projections of %d x %d\n",
+            static_cast<guint>(filter->projections.size()),
+            filter->width,
+            filter->height);
+}
+
+/* Attach a "face" region of interest to the buffer for each equirect rect of each
+ * face, so downstream elements (encoders, analytics) can find them. With a
+ * qp_delta, the metas also carry the quality hints read by the VA-API and
+ * MSDK encoders */
+static void gst_equirect_blur_attach_roi_meta(
+    GstBuffer* buffer, const std::vector<FaceDetection>& faces, const gint qp_delta)
+{
+    for (const FaceDetection& face : faces) {
+        for (const cv::Rect& rect : face.equ_rects) {
+            GstVideoRegionOfInterestMeta* meta = gst_buffer_add_video_region_of_interest_meta(
+                buffer, "face", rect.x, rect.y, rect.width, rect.height);
+
+            gst_video_region_of_interest_meta_add_param(
+                meta,
+                gst_structure_new(
+                    "detection", "confidence", G_TYPE_DOUBLE, static_cast<gdouble>(face.window.score), nullptr));
+
+            if (qp_delta != 0) {
+                gst_video_region_of_interest_meta_add_param(
+                    meta, gst_structure_new("roi/vaapi", "delta-qp", G_TYPE_INT, qp_delta, nullptr));
+                gst_video_region_of_interest_meta_add_param(
+                    meta, gst_structure_new("roi/msdk", "delta-qp", G_TYPE_INT, qp_delta, nullptr));
+            }
+        }
+    }
 }
 
 // ReSharper disable once CppParameterMayBeConstPtrOrRef
@@ -211,13 +682,62 @@ static GstFlowReturn gst_equirect_blur_transform_frame_ip(GstVideoFilter* base,
     }
 
     GST_DEBUG_OBJECT(filter, "Processing frame");
+    BlurTraceFrame trace_frame(static_cast<int64_t>(filter->frame_count));
     filter->cvMat.data = static_cast<unsigned char*>(frame->data[0]);
     filter->cvMat.datastart = static_cast<unsigned char*>(frame->data[0]);
 
-    if (!equirect_blur_process_frame(filter->cvMat, filter->projections, filter->draw_over_faces)) {
+    SidecarFrame detections;
+    detections.frame = static_cast<int64_t>(filter->frame_count++);
+    if (GST_BUFFER_PTS_IS_VALID(frame->buffer))
+        detections.pts = static_cast<double>(GST_BUFFER_PTS(frame->buffer)) / GST_SECOND;
+
+    ObscureOptions obscure;
+    obscure.draw_over_faces = filter->draw_over_faces;
+    obscure.direct = filter->direct_obscure;
+    obscure.filter = static_cast<ObscureFilter>(filter->obscure_filter);
+    obscure.radius = filter->obscure_radius;
+
+    /* The frame is charged while it is processed. With a memory budget, it
+     * waits for that to fit first */
+    const size_t frame_bytes = filter->cvMat.total() * filter->cvMat.elemSize();
+    if (filter->memory_gate != nullptr) {
+        filter->memory_gate->add_workers(1);
+        filter->memory_gate->worker_waiting(true);
+        filter->memory_gate->enter(frame_bytes);
+        filter->memory_gate->worker_waiting(false);
+    }
+    MemoryCharge frame_memory(MemoryUse::FRAMES, frame_bytes);
+
+    bool processed;
+    if (filter->sidecar_in != nullptr) {
+        const SidecarFrame* saved = detections.pts >= 0 ? filter->sidecar_in->find_pts(detections.pts)
+                                                        : filter->sidecar_in->find_frame(detections.frame);
+        if (saved != nullptr)
+            detections.faces = saved->faces;
+
+        processed = equirect_blur_render_frame(
+            filter->cvMat, filter->projections, detections.faces, obscure, filter->scratch, nullptr, filter->stats);
+    }
+    else {
+        processed = equirect_blur_process_frame(
+            filter->cvMat, filter->projections, obscure, &detections.faces, filter->scratch, nullptr, filter->stats);
+    }
+
+    frame_memory.set(0);
+    if (filter->memory_gate != nullptr) {
+        filter->memory_gate->add_workers(-1);
+        filter->memory_gate->released();
+    }
+    if (!processed) {
         GST_ERROR_OBJECT(filter, "Processing frame failed");
         return GST_FLOW_ERROR;
     }
+    filter->stats->add_count("frames");
+
+    gst_equirect_blur_attach_roi_meta(frame->buffer, detections.faces, filter->roi_qp_delta);
+
+    if (filter->sidecar_out != nullptr)
+        filter->sidecar_out->write(detections);
 
     return GST_FLOW_OK;
 }
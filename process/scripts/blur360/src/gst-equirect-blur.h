@@ -5,6 +5,11 @@
 #include <gst/video/gstvideofilter.h>
 
 #include "equirect-blur-common.h"
+#include "equirect-blur-config.h"
+#include "equirect-blur-memory.h"
+#include "equirect-blur-shared.h"
+#include "equirect-blur-sidecar.h"
+#include "equirect-blur-stats.h"
 
 G_BEGIN_DECLS
 
@@ -17,11 +22,45 @@ struct _GstEquirectBlur {
     gint width, height;
 
     gboolean update_projections;
-    std::vector<Projection> projections;
+    std::vector<Projection> projections; /* For the current frame size */
+    std::vector<PCN*> detectors; /* Our own detectors, when not using a shared pool */
     cv::Mat cvMat;
 
     gboolean draw_over_faces;
+    gboolean direct_obscure; /* Obscure faces directly in the equirect frame */
+    gint obscure_filter; /* An ObscureFilter */
+    gdouble obscure_radius; /* In face widths */
     gchar* models_dir;
+    gchar* config_file; /* Read into config when the element starts */
+    BlurConfig config;
+
+    /* Use the process-wide projection maps and detector pool instead of
+     * building our own, so several streams can share them */
+    gboolean shared_detectors;
+    guint max_inferences;
+
+    /* Quantiser offset suggested to encoders for face regions (0 = no hint) */
+    gint roi_qp_delta;
+
+    /* Memory in MB for all the elements in the process, and the gate they
+     * share while it is set (see equirect-blur-memory.h) */
+    gdouble memory_budget;
+    MemoryGate* memory_gate;
+
+    /* Detection sidecar files. When load_detections is set, faces are taken
+     * from the file instead of running the detectors */
+    gchar* save_detections;
+    gchar* load_detections;
+    SidecarWriter* sidecar_out;
+    SidecarReader* sidecar_in;
+    guint64 frame_count;
+
+    /* Stage timings and counters for this element, which also add up into
+     * the process-wide stats */
+    BlurStats* stats;
+
+    /* Working buffers, kept between frames */
+    FrameScratch* scratch;
 };
 
 struct _GstEquirectBlurClass { // NOLINT(*-reserved-identifier)
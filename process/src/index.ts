@@ -22,6 +22,9 @@ if (process.env.TV_WEB_PROCESS_SECRET === undefined) {
 export const imagesPath = process.env.TV_IMAGES_PATH ?? '/trails';
 export const webUrl = process.env.TV_WEB_URL;
 export const apiKey = process.env.TV_WEB_PROCESS_SECRET;
+// Socket of an `equirect-blur-image --serve` server to send blur jobs to,
+// instead of starting equirect-blur-image for every sequence
+export const blurSocket = process.env.TV_BLUR_SOCKET;
 
 async function loop() {
     const sequences = await fetchSequenceStatuses();
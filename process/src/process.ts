@@ -1,7 +1,8 @@
-import { join } from 'path';
+import { join, resolve as resolvePath } from 'path';
 import fs from 'fs-extra';
 import { spawn } from 'child_process';
-import { imagesPath } from './index.js';
+import { createConnection } from 'net';
+import { blurSocket, imagesPath } from './index.js';
 import z from 'zod';
 import {
     jpgsInDir,
@@ -148,6 +149,67 @@ export async function processTile(sequence: Sequence) {
     await checkToSequence();
 }
 
+// Run a blur job on an `equirect-blur-image --serve` server, which keeps its
+// projection maps and detectors loaded between sequences. Rejects if the server
+// turns the job down, the job fails, or the connection ends before it finishes
+async function blurWithServer(socketPath: string, id: string, args: string[]) {
+    await new Promise<void>((resolve, reject) => {
+        const socket = createConnection(socketPath);
+        let buffer = '';
+        let failure: Error | undefined;
+        let finished = false;
+        socket.on('connect', () => {
+            socket.write(JSON.stringify({ id, args }) + '\n');
+        });
+        socket.on('data', (data) => {
+            buffer += data.toString();
+            let end;
+            while ((end = buffer.indexOf('\n')) !== -1) {
+                const line = buffer.slice(0, end);
+                buffer = buffer.slice(end + 1);
+                let event;
+                try {
+                    event = JSON.parse(line);
+                } catch {
+                    console.error(
+                        `Ignoring malformed blur server reply: ${line}`
+                    );
+                    continue;
+                }
+                if (event.event === 'image') {
+                    console.log(
+                        `Blurred ${event.file} (${event.done}/${event.total}, ${event.faces} faces)`
+                    );
+                } else if (event.event === 'rejected') {
+                    failure = new Error(`Blur job rejected: ${event.error}`);
+                    socket.end();
+                } else if (event.event === 'finished') {
+                    finished = true;
+                    if (event.ok !== true) {
+                        failure = new Error(`Blur job failed: ${event.error}`);
+                    }
+                    socket.end();
+                }
+            }
+        });
+        socket.on('error', (err) => {
+            failure ??= new Error(`Blur server error: ${err}`);
+        });
+        socket.on('close', () => {
+            if (!failure && !finished) {
+                failure = new Error(
+                    'Blur server closed the connection before the job finished'
+                );
+            }
+            if (failure) {
+                reject(failure);
+            } else {
+                resolve();
+            }
+        });
+    });
+}
+
 export async function processBlur(sequence: Sequence) {
     const sequencePath = join(imagesPath, sequence.name);
 
@@ -173,26 +235,31 @@ export async function processBlur(sequence: Sequence) {
             return;
         }
     }
-    await new Promise<void>((resolve) => {
-        const blurProcess = spawn(
-            'scripts/blur360/build/src/equirect-blur-image',
-            [
-                '--blur=true',
-                '-m=scripts/blur360/models',
-                `-o=${join(sequencePath, 'img_blur')}`,
-                join(sequencePath, 'img_original'),
-            ]
-        );
-        blurProcess.stdout.on('data', (data) => {
-            console.log(`${data}`);
-        });
-        blurProcess.stderr.on('data', (data) => {
-            console.error(`${data}`);
-        });
-        blurProcess.on('close', () => {
-            resolve();
+    const blurArgs = [
+        '--blur=true',
+        `-m=${resolvePath('scripts/blur360/models')}`,
+        `-o=${join(sequencePath, 'img_blur')}`,
+        join(sequencePath, 'img_original'),
+    ];
+    if (blurSocket) {
+        await blurWithServer(blurSocket, sequence.name, blurArgs);
+    } else {
+        await new Promise<void>((resolve) => {
+            const blurProcess = spawn(
+                'scripts/blur360/build/src/equirect-blur-image',
+                blurArgs
+            );
+            blurProcess.stdout.on('data', (data) => {
+                console.log(`${data}`);
+            });
+            blurProcess.stderr.on('data', (data) => {
+                console.error(`${data}`);
+            });
+            blurProcess.on('close', () => {
+                resolve();
+            });
         });
-    });
+    }
     await checkToTile();
 }
 